@@ -273,6 +273,10 @@ int main(int argc, char **argv)
    _log(GENERAL, zs);
    strcat(report, zs); strcat(report, "\n");
 
+   sprintf(zs, "%48s: %s", "Database round trips", commas_q(db_round_trips));
+   _log(GENERAL, zs);
+   strcat(report, zs); strcat(report, "\n");
+
    for(i=0; i<MAXstats; i++)
    {
       char zs1[128];
@@ -426,6 +430,7 @@ int main(int argc, char **argv)
 
    }
    email_alert(NAME, BUILD, "Database Archive Report", report);
+   db_report_profile(true);
 
    exit(0);
 }
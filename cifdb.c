@@ -28,12 +28,17 @@
 #include <curl/curl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <zlib.h>
+#include <pthread.h>
 
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME "cifdb"
@@ -44,7 +49,7 @@
 #define BUILD RELEASE_BUILD
 #endif
 
-static word debug, opt_fetch_all, run, opt_test, opt_print, opt_insecure, used_insecure;
+static word debug, opt_fetch_all, run, opt_test, opt_print, opt_insecure, used_insecure, opt_workers;
 static char * opt_filename;
 static char * opt_url;
 static dword update_id;
@@ -55,6 +60,25 @@ static time_t start_time, last_reported_time;
 
 #define TEMP_DIRECTORY "/var/tmp"
 
+// Cards are passed to the process_ functions as slices of the input, which need not be terminated, so fields are read
+// at fixed offsets within the first CIF_CARD characters.  Shorter cards are padded.
+#define CIF_CARD 80
+
+// Batched inserts
+// Schedules are only batched in bulk load mode, otherwise they are inserted singly to get their id.
+enum batch_tables {ScheduleBatch, LocationBatch, CRBatch, AssociationBatch, TIPLOCBatch, MAXBatch};
+static const char * const batch_table[MAXBatch] = {"cif_schedules", "cif_schedule_locations", "cif_changes_en_route", "cif_associations", "cif_tiplocs"};
+static struct db_batch batch[MAXBatch];
+
+// Bulk load
+// For a full timetable the rows are written to tab separated staging files instead, with schedule ids assigned here,
+// and loaded with LOAD DATA LOCAL INFILE.  Secondary indexes are dropped during the load and rebuilt afterwards.
+static word bulk_load;
+static FILE * bulk_fp[MAXBatch];
+static char bulk_indexes[MAXBatch][DB_INDEXES_SIZE];
+static dword bulk_schedule_id;
+static char bulk_schedule_card[128];
+
 // Stats
 enum stats_categories {Fetches,  
                        CIFRecords,
@@ -86,18 +110,93 @@ static size_t fetch_total_bytes;
 static time_t fetch_extract_time;
 static char fetch_filepath[512];
 
+// fetch_file() results
+enum fetch_results {FetchOK, FetchFailed, FetchUnwanted, FetchProcessFailed};
+// Checks made on the extract time in the header card before the file is processed
+enum fetch_checks {CheckNone, CheckYesterday, CheckFull};
+
+// Streaming.  A download is decompressed as it arrives and each card is processed as soon as it is complete, so the
+// download, decompression and database work overlap.  Only the compressed file is kept on disc.
+enum stream_states {StreamHeader, StreamProcess, StreamFailed, StreamIgnore};
+static z_stream stream;
+static char stream_buffer[65536];
+static size_t stream_length;
+static word stream_state, stream_check, stream_unwanted, stream_ended;
+static qword cards;
+
+// Pipelined processing, selected by -j.  The cards are read in blocks, each of which normally ends just before a BS
+// card so that a schedule isn't split.  Worker threads prepare the rows for the cards in each block, and a single writer
+// thread, which has the database connection to itself, applies the blocks in the order they were read.  Anything which
+// needs the database, such as deletes, BX updates, TIPLOCs and schedule ids, is left to the writer.
+// The pipeline starts after the HD card, so the header checks are made, and update_id set, before any worker runs.
+#define PIPE_BLOCK 256
+#define PIPE_SLOTS 32
+#define PIPE_MAX_WORKERS 16
+enum pipe_states {PipeFree, PipeRead, PipeParsing, PipeParsed};
+enum prepared_states {PreparedNone, PreparedRow, PreparedMerged};
+struct pipe_card
+{
+   char card[CIF_CARD + 1];
+   char row[512];      // Row prepared by a worker.  See the process_ functions for which part of the row.
+   word prepared;      // PreparedNone, PreparedRow or PreparedMerged (BX card included in the BS row.)
+   word sort_time;     // Of a prepared location.
+};
+struct pipe_block
+{
+   word state;
+   word cards;
+   struct pipe_card card[PIPE_BLOCK];
+};
+static struct pipe_block pipe_blocks[PIPE_SLOTS];
+static qword pipe_read, pipe_parse, pipe_write;
+static word pipe_running, pipe_ending;
+static volatile word pipe_failed;
+static pthread_mutex_t pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipe_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pipe_writer_thread, pipe_worker_threads[PIPE_MAX_WORKERS];
+static word pipe_workers;
+
 #define REPORT_SIZE 16384
 static char report[REPORT_SIZE];
 
-static word fetch_file(const word day);
+static word fetch_file(const word day, const word check);
 static size_t cif_write_data(void *buffer, size_t size, size_t nmemb, void *userp);
+static word stream_start(const word check);
+static word stream_inflate(const void * const data, const size_t length);
+static word stream_card(const char * const card, const size_t length);
+static word stream_finish(void);
+static word parse_header(const char * const card);
+static word extract_wanted(const word check);
 static word process_file(void);
+static word process_start(void);
+static word process_card(const char * card, const size_t length);
+static word process_end(word fail);
+static word process_record(const char * const card, const struct pipe_card * const p);
+static void comfort_report(void);
+static word pipe_start(void);
+static word pipe_card(const char * const card);
+static word pipe_submit(void);
+static word pipe_finish(word fail);
+static void * pipe_worker(void * arg);
+static void * pipe_writer(void * arg);
+static void pipe_prepare(struct pipe_block * const b);
 static int file_is_cif_download(const struct dirent *d);
 static void final_report(void);
 static word process_HD(const char * const c);
-static word process_association(const char * const c);
-static word process_schedule(const char * const c);
+static word process_association(const char * const c, const struct pipe_card * const p);
+static void association_row(const char * const c, char * const query);
+static word process_schedule(const char * const c, const struct pipe_card * const p);
+static word location_row(const char * const c, const word origin_sort_time, char * const query);
+static void cr_row(const char * const c, char * const query);
 static word process_schedule_delete(const char * const c);
+static word batch_insert(const word table, const char * const row);
+static word batch_flush(void);
+static void schedule_row(const char * const c, const char * const bx, char * const query);
+static word bulk_start(void);
+static word bulk_write(const word table, const char * const row);
+static word bulk_write_schedule(const char * const bx);
+static word bulk_finish(const word abandon);
+static void bulk_path(char * const path, const word table);
 static word process_tiploc(const char * const c);
 static word create_tiploc(const char * const c);
 static word get_sort_time(const char const * buffer);
@@ -106,6 +205,7 @@ static char * tiploc_name(const char * const tiploc);
 static void extract_field(const char * const c, size_t s, size_t l, char * d);
 static char * extract_field_s(const char * const c, size_t s, size_t l);
 static time_t parse_CIF_datestamp(const char * const s);
+static time_t extract_CIF_datestamp(const char * const c, const size_t s);
 
 int main(int argc, char **argv)
 {
@@ -117,11 +217,12 @@ int main(int argc, char **argv)
    opt_print = false;
    opt_insecure = false;
    used_insecure = false;
+   opt_workers = 0;
 
    strcpy(config_file_path, "/etc/openrail.conf");
    word usage = false;
    int c;
-   while ((c = getopt (argc, argv, ":c:u:f:atpih")) != -1)
+   while ((c = getopt (argc, argv, ":c:u:f:j:atpih")) != -1)
       switch (c)
       {
       case 'c':
@@ -136,6 +237,10 @@ int main(int argc, char **argv)
       case 'a':
          opt_fetch_all = true;
          break;
+      case 'j':
+         opt_workers = atoi(optarg);
+         if(opt_workers > PIPE_MAX_WORKERS) opt_workers = PIPE_MAX_WORKERS;
+         break;
       case 't':
          opt_test = true;
          break;
@@ -167,13 +272,13 @@ int main(int argc, char **argv)
 
    if(usage) 
    {
-      printf("%s %s  Usage: %s [-c /path/to/config/file.conf] [-u <url> | -f <path> | -a] [-t | -r] [-p][-i]\n", NAME, BUILD, argv[0]);
+      printf("%s %s  Usage: %s [-c /path/to/config/file.conf] [-u <url> | -f <path> | -a] [-t | -r] [-p][-i][-j <n>]\n", NAME, BUILD, argv[0]);
       printf(
              "-c <file>  Path to config file.\n"
              "Data source:\n"
              "default    Fetch latest update.\n"
              "-u <url>   Fetch from specified URL.\n"
-             "-f <file>  Use specified file.  (Must already be decompressed.)\n"
+             "-f <file>  Use specified file.  (Compressed or not.)\n"
              "-a         Fetch latest full timetable.\n"
              "Actions:\n"
              "default    Apply data to database.\n"
@@ -181,6 +286,7 @@ int main(int argc, char **argv)
              "Options:\n"
              "-i         Insecure.  Circumvent certificate checks if necessary.\n"
              "-p         Print activity as well as logging.\n"
+             "-j <n>     Pipelined processing, with <n> threads preparing the rows.\n"
              );
       exit(1);
    }
@@ -255,7 +361,9 @@ int main(int argc, char **argv)
             while(run && delay--) sleep(1);
          }
 
-         if(fetch_file(0xffff))
+         // Fetch and process the file, if it has the correct date.
+         word result = fetch_file(0xffff, CheckYesterday);
+         if(result == FetchFailed)
          {
             _log(MAJOR, "Failed to fetch file.");
             if(opt_test || opt_filename || opt_url) run = false;
@@ -263,28 +371,10 @@ int main(int argc, char **argv)
          
          else if(run)
          {
-            // Is it correct date?
-            struct tm * broken = gmtime(&fetch_extract_time);
-            time_t when = start_time - 24L*60L*60L;
-            struct tm * wanted = gmtime(&when);
-            
-            if(broken->tm_year == wanted->tm_year &&
-               broken->tm_mon  == wanted->tm_mon  &&
-               broken->tm_mday == wanted->tm_mday)
-            {
-               // Got the file we want
-               if(!process_file())
-               {
-                  // All done!
-                  run = false;
-               }
-               else
-               {
-               }
-            }
-            else
+            if(result == FetchOK)
             {
-               _log(MAJOR, "Downloaded file has incorrect timestamp %s.", time_text(fetch_extract_time, true));
+               // All done!
+               run = false;
             }
             if(run && stats[Fetches] > 31)
             {
@@ -308,38 +398,51 @@ int main(int argc, char **argv)
    }
    else if(opt_url || opt_filename)
    {
-      if(fetch_file(0xffff)) exit(1);
-      if(process_file()) exit(1);
+      if(fetch_file(0xffff, CheckNone)) exit(1);
    }
    else
    {
       // Special processing for opt_fetch_all.
-      if(fetch_file(0xffff))
+      db_mode(DB_MODE_LOCAL_INFILE);
+      bulk_load = true;
+      word fail = fetch_file(0xffff, CheckFull);
+      bulk_load = false;
+      db_mode(DB_MODE_NORMAL);
+      if(fail == FetchFailed || fail == FetchUnwanted)
       {
          exit(1);
       }
-      struct tm * broken = localtime(&fetch_extract_time);
-      if(broken->tm_wday != 5)
+      if(fail && run)
       {
-         _log(ABEND, "Unexpected extract day %d (%s) on full download.", broken->tm_wday, time_text(fetch_extract_time, true));
-         exit(1);
+         _log(MAJOR, "Bulk load failed.  Loading full timetable card by card.");
+         reset_database();
+         if(database_upgrade(cifdb))
+         {
+            _log(CRITICAL, "Error in upgrade_database().  Aborting.");
+            exit(1);
+         }
+         word i;
+         for(i = 0; i < MAXStats; i++) if(i != Fetches) stats[i] = 0;
+         home_report_index = 0;
+         fail = process_file();
       }
-      if(!process_file())
+      if(!fail)
       {
          // Successfully loaded full file, apply any required updates
-         broken = localtime(&start_time);
+         struct tm * broken = localtime(&start_time);
          word last_day = broken->tm_wday;
          word day = 0; // Day after fetch-day of full update
-         word fail = false;
          // Fetch updates from day after full up to today. ASSUMES full extract fetched on Saturday.
          while(last_day != 6 && day <= last_day && !fail)
          {
-            fail = fetch_file(day++);
-            if(!fail) fail = process_file();
+            fail = fetch_file(day++, CheckNone);
          }
       }
    }
 
+   // liverail's day plans were worked out from the old timetable.
+   if(!opt_test) day_plans_invalidate(NULL);
+
    // All done.  Send Report
    final_report();
    db_disconnect();
@@ -424,6 +527,9 @@ static void final_report(void)
    sprintf(zs, "             Elapsed time: %ld minutes", (time(NULL) - start_time + 30) / 60);
    _log(GENERAL, zs);
    strcat(report, zs); strcat(report, "\n");
+   sprintf(zs, "     Database round trips: %s", commas_q(db_round_trips));
+   _log(GENERAL, zs);
+   strcat(report, zs); strcat(report, "\n");
    if(opt_test)
    {
       sprintf(zs, "Test mode.  No database changes made.");
@@ -578,10 +684,11 @@ static void reset_database(void)
    db_disconnect();
 }
 
-static word fetch_file(const word day)
+static word fetch_file(const word day, const word check)
 {
-   // Returns 0=Success or error code.
-   // In success case ONLY, returns following info in globals:
+   // Fetches the file and processes it, if the extract time in its header passes check.
+   // Returns a fetch_results value.
+   // Also returns following info in globals:
    // fetch_total_bytes
    // fetch_extract_time
    // fetch_filepath 
@@ -589,7 +696,7 @@ static word fetch_file(const word day)
    // In choosing where to fetch from, day parameter takes priority.  If day > 7, obey opt_ settings
    // day is day of fetch, not day of extract!  So day = 2 (Tuesday) will fetch from mon url.
 
-   char zs[256], filepathz[256], filepath[256], url[256];
+   char zs[256], filepathz[256], url[256];
    time_t now, when;
    struct tm * broken;
    static char * weekdays[] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat", "sun" };
@@ -601,306 +708,551 @@ static word fetch_file(const word day)
 
    fp = NULL;
 
-   if(!opt_filename)
+   if(opt_filename)
    {
-      // Build URL
-      now = time(NULL);
-      when = now - 24*60*60;
-      broken = localtime(&when); // Note broken contains "yesterday"
-      if(day < 8)
-      {
-         sprintf(url, "https://datafeeds.networkrail.co.uk/ntrod/CifFileAuthenticate?type=CIF_ALL_UPDATE_DAILY&day=toc-update-%s.CIF.gz", weekdays[(day + 6) % 7]);
-      }
-      else if(opt_url)
-      {
-         strcpy(url, opt_url);
-      }
-      else if(opt_fetch_all)
+      // Read enough of the file to find the datestamp
+      char card[128];
+      gzFile gz;
+
+      strcpy(fetch_filepath, opt_filename);
+      if(!(gz = gzopen(fetch_filepath, "r")))
       {
-         sprintf(url, "https://datafeeds.networkrail.co.uk/ntrod/CifFileAuthenticate?type=CIF_ALL_FULL_DAILY&day=toc-full.CIF.gz");
-         full_file = true;
+         _log(MAJOR, "Failed to open \"%s\" for reading.", fetch_filepath);
+         return FetchFailed;
       }
-      else
+      if(!gzgets(gz, card, sizeof(card)))
       {
-         sprintf(url, "https://datafeeds.networkrail.co.uk/ntrod/CifFileAuthenticate?type=CIF_ALL_UPDATE_DAILY&day=toc-update-%s.CIF.gz", weekdays[broken->tm_wday]);
+         gzclose(gz);
+         _log(MAJOR, "Failed to read file header.");
+         return FetchFailed;
       }
+      gzclose(gz);
+      card[strlen(card) - 1] = '\0'; // Lose the newline
+      if(parse_header(card)) return FetchFailed;
+      if(!extract_wanted(check)) return FetchUnwanted;
+
+      return process_file() ? FetchProcessFailed : FetchOK;
+   }
+
+   // Build URL
+   now = time(NULL);
+   when = now - 24*60*60;
+   broken = localtime(&when); // Note broken contains "yesterday"
+   if(day < 8)
+   {
+      sprintf(url, "https://datafeeds.networkrail.co.uk/ntrod/CifFileAuthenticate?type=CIF_ALL_UPDATE_DAILY&day=toc-update-%s.CIF.gz", weekdays[(day + 6) % 7]);
+   }
+   else if(opt_url)
+   {
+      strcpy(url, opt_url);
+   }
+   else if(opt_fetch_all)
+   {
+      sprintf(url, "https://datafeeds.networkrail.co.uk/ntrod/CifFileAuthenticate?type=CIF_ALL_FULL_DAILY&day=toc-full.CIF.gz");
+      full_file = true;
+   }
+   else
+   {
+      sprintf(url, "https://datafeeds.networkrail.co.uk/ntrod/CifFileAuthenticate?type=CIF_ALL_UPDATE_DAILY&day=toc-update-%s.CIF.gz", weekdays[broken->tm_wday]);
+   }
       
-      // Fetch to temporary file name 
-      {
-         static CURL * curlh;
-         struct curl_slist * slist;
+   // Fetch to temporary file name, processing as it arrives
+   static CURL * curlh;
+   struct curl_slist * slist;
+   CURLcode result;
          
-         if(!(curlh = curl_easy_init())) 
-         {
-            _log(CRITICAL, "fetch_file():  Failed to obtain libcurl easy handle.");
-            return 1;
-         }
-         curl_easy_setopt(curlh, CURLOPT_WRITEFUNCTION, cif_write_data);
+   if(!(curlh = curl_easy_init())) 
+   {
+      _log(CRITICAL, "fetch_file():  Failed to obtain libcurl easy handle.");
+      return FetchFailed;
+   }
+   curl_easy_setopt(curlh, CURLOPT_WRITEFUNCTION, cif_write_data);
          
-         slist = NULL;
-         slist = curl_slist_append(slist, "Cache-Control: no-cache");
-         if(!slist)
-         {
-            _log(MAJOR,"fetch_file():  Failed to create slist.");
-            return 1;
-         }
+   slist = NULL;
+   slist = curl_slist_append(slist, "Cache-Control: no-cache");
+   if(!slist)
+   {
+      _log(MAJOR,"fetch_file():  Failed to create slist.");
+      return FetchFailed;
+   }
          
-         _log(GENERAL, "Fetching \"%s\".", url);
+   _log(GENERAL, "Fetching \"%s\".", url);
          
-         sprintf(filepathz, "%s/cifdb-cif-fetch-%ld.gz", TEMP_DIRECTORY, now);
-         sprintf(filepath,  "%s/cifdb-cif-fetch-%ld",    TEMP_DIRECTORY, now);
+   sprintf(filepathz, "%s/cifdb-cif-fetch-%ld.gz", TEMP_DIRECTORY, now);
          
-         if(!(fp = fopen(filepathz, "w")))
-         {
-            _log(MAJOR, "Failed to open \"%s\" for writing.", filepathz);
-            return 1;
-         }
+   if(!(fp = fopen(filepathz, "w")))
+   {
+      _log(MAJOR, "Failed to open \"%s\" for writing.", filepathz);
+      return FetchFailed;
+   }
+   if(stream_start(check))
+   {
+      fclose(fp);
+      fp = NULL;
+      return FetchFailed;
+   }
          
-         curl_easy_setopt(curlh, CURLOPT_HTTPHEADER, slist);
+   curl_easy_setopt(curlh, CURLOPT_HTTPHEADER, slist);
          
-         // Set timeouts
-         curl_easy_setopt(curlh, CURLOPT_NOSIGNAL,              1L);
-         curl_easy_setopt(curlh, CURLOPT_FTP_RESPONSE_TIMEOUT, 128L);
-         curl_easy_setopt(curlh, CURLOPT_TIMEOUT,              128L);
-         curl_easy_setopt(curlh, CURLOPT_CONNECTTIMEOUT,       128L);
+   // Set timeouts
+   // As the data is processed while it is downloaded the transfer can take a long time, so it is only abandoned if it stalls.
+   curl_easy_setopt(curlh, CURLOPT_NOSIGNAL,              1L);
+   curl_easy_setopt(curlh, CURLOPT_FTP_RESPONSE_TIMEOUT, 128L);
+   curl_easy_setopt(curlh, CURLOPT_LOW_SPEED_LIMIT,        1L);
+   curl_easy_setopt(curlh, CURLOPT_LOW_SPEED_TIME,       128L);
+   curl_easy_setopt(curlh, CURLOPT_CONNECTTIMEOUT,       128L);
          
-         // Debugging prints.
-         if(debug) curl_easy_setopt(curlh, CURLOPT_VERBOSE,               1L);
+   // Debugging prints.
+   if(debug) curl_easy_setopt(curlh, CURLOPT_VERBOSE,               1L);
          
-         // URL and login
-         curl_easy_setopt(curlh, CURLOPT_URL,     url);
-         sprintf(zs, "%s:%s", conf[conf_nr_user], conf[conf_nr_password]);
-         curl_easy_setopt(curlh, CURLOPT_USERPWD, zs);
-         curl_easy_setopt(curlh, CURLOPT_FOLLOWLOCATION,        1L);  // On receiving a 3xx response, follow the redirect.
-         fetch_total_bytes = 0;
+   // URL and login
+   curl_easy_setopt(curlh, CURLOPT_URL,     url);
+   sprintf(zs, "%s:%s", conf[conf_nr_user], conf[conf_nr_password]);
+   curl_easy_setopt(curlh, CURLOPT_USERPWD, zs);
+   curl_easy_setopt(curlh, CURLOPT_FOLLOWLOCATION,        1L);  // On receiving a 3xx response, follow the redirect.
+   fetch_total_bytes = 0;
          
-         CURLcode result;
+   if((result = curl_easy_perform(curlh)))
+   {
+      _log(stream_unwanted?DEBUG:MAJOR, "fetch_file(): curl_easy_perform() returned error %d: %s.", result, curl_easy_strerror(result));
+      if(opt_insecure && (result == 51 || result == 60))
+      {
+         _log(MAJOR, "Retrying download in insecure mode.");
+         // SSH failure, retry without
+         curl_easy_setopt(curlh, CURLOPT_SSL_VERIFYPEER, 0L);
+         curl_easy_setopt(curlh, CURLOPT_SSL_VERIFYHOST, 0L);
+         used_insecure = true;
          if((result = curl_easy_perform(curlh)))
          {
-            _log(MAJOR, "fetch_file(): curl_easy_perform() returned error %d: %s.", result, curl_easy_strerror(result));
-            if(opt_insecure && (result == 51 || result == 60))
-            {
-               _log(MAJOR, "Retrying download in insecure mode.");
-               // SSH failure, retry without
-               curl_easy_setopt(curlh, CURLOPT_SSL_VERIFYPEER, 0L);
-               curl_easy_setopt(curlh, CURLOPT_SSL_VERIFYHOST, 0L);
-               used_insecure = true;
-               if((result = curl_easy_perform(curlh)))
-               {
-                  _log(MAJOR, "fetch_file(): In insecure mode curl_easy_perform() returned error %d: %s.", result, curl_easy_strerror(result));
-                  if(fp) fclose(fp);
-                  fp = NULL;
-                  return 1;
-               }
-            }
-            else
-            {
-               if(fp) fclose(fp);
-               fp = NULL;
-               return 1;
-            }
-         }
-         char * actual_url;
-         if(!curl_easy_getinfo(curlh, CURLINFO_EFFECTIVE_URL, &actual_url) && actual_url)
-         {
-            _log(GENERAL, "Download was redirected to \"%s\".", actual_url);
-         }
-         
-         if(fp) fclose(fp);
-         fp = NULL;
-         if(curlh) curl_easy_cleanup(curlh);
-         curlh = NULL;
-         if(slist) curl_slist_free_all(slist);
-         slist = NULL;
-         
-         _log(GENERAL, "Received %s bytes of compressed CIF updates.",  commas(fetch_total_bytes));
-         
-         if(fetch_total_bytes == 0) return 1;
-         
-         _log(GENERAL, "Decompressing data...");
-         sprintf(zs, "/bin/gunzip -f %s", filepathz);
-         char * rc;
-         if((rc = system_call(zs)))
-         {
-            _log(MAJOR, "Failed to uncompress file:  %s", rc);
-            if((fp = fopen(filepathz, "r")))
-            {
-               char error_message[2048];
-               size_t length;
-               if((length = fread(error_message, 1, 2047, fp)) && error_message[0] == '<')
-               {
-                  error_message[length] = '\0';
-                  _log(MAJOR, "Received message:\n%s", error_message);   
-               }
-               fclose(fp);
-            }
-            return 1;
+            _log(stream_unwanted?DEBUG:MAJOR, "fetch_file(): In insecure mode curl_easy_perform() returned error %d: %s.", result, curl_easy_strerror(result));
          }
-         _log(GENERAL, "Decompressed.");
       }
    }
-   else
+   if(!result)
    {
-      strcpy(filepath, opt_filename);
+      char * actual_url;
+      if(!curl_easy_getinfo(curlh, CURLINFO_EFFECTIVE_URL, &actual_url) && actual_url)
+      {
+         _log(GENERAL, "Download was redirected to \"%s\".", actual_url);
+      }
    }
-      
-   if(!(fp = fopen(filepath, "r")))
+         
+   if(fp) fclose(fp);
+   fp = NULL;
+   if(curlh) curl_easy_cleanup(curlh);
+   curlh = NULL;
+   if(slist) curl_slist_free_all(slist);
+   slist = NULL;
+
+   _log(GENERAL, "Received %s bytes of compressed CIF updates.",  commas(fetch_total_bytes));
+
+   // Process any unterminated last card, and finish processing.
+   word incomplete = stream_finish() || result;
+   word fail = FetchOK;
+   if(stream_state == StreamIgnore) fail = FetchProcessFailed;
+   else if(stream_state == StreamProcess || stream_state == StreamFailed)
    {
-      _log(MAJOR, "Failed to open \"%s\" for reading.", filepath);
-      return 1;
+      if(process_end(incomplete || stream_state == StreamFailed)) fail = incomplete ? FetchFailed : FetchProcessFailed;
    }
+   if(stream_unwanted)             return FetchUnwanted;
+   if(incomplete)                  return FetchFailed;
+   if(stream_state == StreamHeader) return FetchFailed;
 
-   // Read enough of the file to find the datestamp
-   char card[128];
+   // Keep the compressed file
+   broken = localtime(&fetch_extract_time);
+   sprintf(fetch_filepath, "%s/cifdb-cif-%s-extracted-%04d-%02d-%02d.gz", TEMP_DIRECTORY, full_file?"-full-":"update", broken->tm_year + 1900, broken->tm_mon + 1, broken->tm_mday);
 
-   if(!fgets(card, sizeof(card), fp))
+   struct stat z;
+   word duplicates = 0;
+   while(!stat(fetch_filepath, &z))
    {
-      fclose(fp);
-      _log(MAJOR, "Failed to read file header.");
+      _log(DEBUG, "stat(\"%s\") found a file.", fetch_filepath);
+      sprintf(fetch_filepath, "%s/cifdb-cif-%s-extracted-%04d-%02d-%02d-%05d.gz", TEMP_DIRECTORY, full_file?"-full-":"update", broken->tm_year + 1900, broken->tm_mon + 1, broken->tm_mday, ++duplicates);
+   }
+
+   if(rename(filepathz, fetch_filepath))
+   {
+      //TODO Handle this properly
+      _log(ABEND, "Failed to rename(\"%s\", \"%s\").", filepathz, fetch_filepath);
+      exit(1);
+   }
+   _log(GENERAL, "Downloaded to file \"%s\".", fetch_filepath);
+
+   return fail;
+}
+
+static size_t cif_write_data(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+   _log(PROC, "cif_write_data()");
+
+   size_t bytes = size * nmemb;
+
+   _log(DEBUG, "Bytes received = %zd", bytes);
+   
+   fwrite(buffer, size, nmemb, fp);
+
+   if(!fetch_total_bytes && ((char *) buffer)[0] == '<')
+   {
+      // Not compressed data, probably an error page.
+      char error_message[2048];
+      size_t length = (bytes > 2047) ? 2047 : bytes;
+      memcpy(error_message, buffer, length);
+      error_message[length] = '\0';
+      _log(MAJOR, "Received message:\n%s", error_message);   
+      return 0;
+   }
+
+   fetch_total_bytes += bytes;
+
+   // Returning short makes curl abandon the transfer.
+   if(stream_inflate(buffer, bytes)) return 0;
+
+   return bytes;
+}
+
+static word stream_start(const word check)
+{
+   memset(&stream, 0, sizeof(stream));
+   // 16 selects gzip format.
+   if(inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+   {
+      _log(CRITICAL, "stream_start():  Failed to initialise decompression.");
       return 1;
    }
-   else
+   stream_length = 0;
+   stream_state = StreamHeader;
+   stream_check = check;
+   stream_unwanted = stream_ended = false;
+   return 0;
+}
+
+static word stream_inflate(const void * const data, const size_t length)
+{
+   // Decompress a block of the download and pass on the complete cards.  Returns non-zero to abandon the download.
+   char * start, * end;
+
+   stream.next_in = (Bytef *) data;
+   stream.avail_in = length;
+   while(stream.avail_in)
    {
-      fclose(fp);   
-      card[strlen(card) - 1] = '\0'; // Lose the newline
-      char record_identity[4];
-      extract_field(card, 0, 2, record_identity);
-      _log(DEBUG, "First card \"%s\".", card);
-      if(strcmp("HD", record_identity))
+      if(stream_ended)
       {
-         //TODO Handle this properly
-         _log(MAJOR, "File does not begin with a header record.");
+         // Another gzip member follows.
+         inflateReset(&stream);
+         stream_ended = false;
+      }
+      stream.next_out = (Bytef *) stream_buffer + stream_length;
+      stream.avail_out = sizeof(stream_buffer) - stream_length - 1;
+      int r = inflate(&stream, Z_NO_FLUSH);
+      if(r == Z_STREAM_END) stream_ended = true;
+      else if(r != Z_OK)
+      {
+         _log(MAJOR, "Failed to uncompress data:  Error %d %s", r, stream.msg?stream.msg:"");
          return 1;
       }
-      
-      struct tm broken;
-      broken.tm_year = atoi(extract_field_s(card, 26, 2)) + 100;
-      broken.tm_mon  = atoi(extract_field_s(card, 24, 2)) - 1;
-      broken.tm_mday = atoi(extract_field_s(card, 22, 2));
-      broken.tm_hour = atoi(extract_field_s(card, 28, 2));
-      broken.tm_min  = atoi(extract_field_s(card, 30, 2));
-      broken.tm_sec = 0;
-      broken.tm_isdst = -1;
-      fetch_extract_time = mktime(&broken); // Assumes local!
-
-      _log(GENERAL, "Time of extract = %s", time_text(fetch_extract_time, true));
-
-      if(!opt_filename)
-      {
-         // Build Filename
-         sprintf(fetch_filepath, "%s/cifdb-cif-%s-extracted-%04d-%02d-%02d", TEMP_DIRECTORY, full_file?"-full-":"update", broken.tm_year + 1900, broken.tm_mon + 1, broken.tm_mday);
-
-         struct stat z;
-         word duplicates = 0;
-         while(!stat(fetch_filepath, &z))
-         {
-            _log(DEBUG, "stat(\"%s\") found a file.", fetch_filepath);
-            sprintf(fetch_filepath, "%s/cifdb-cif-%s-extracted-%04d-%02d-%02d-%05d", TEMP_DIRECTORY, full_file?"-full-":"update", broken.tm_year + 1900, broken.tm_mon + 1, broken.tm_mday, ++duplicates);
-         }
+      stream_length = sizeof(stream_buffer) - 1 - stream.avail_out;
 
-         if(rename(filepath, fetch_filepath))
-         {
-            //TODO Handle this properly
-            _log(ABEND, "Failed to rename(\"%s\", \"%s\").", filepath, fetch_filepath);
-            exit(1);
-         }
-         _log(GENERAL, "Downloaded to file \"%s\".", fetch_filepath);
+      start = stream_buffer;
+      while((end = memchr(start, '\n', stream_buffer + stream_length - start)))
+      {
+         *end = '\0';
+         if(stream_card(start, end - start)) return 1;
+         start = end + 1;
       }
-      else
+      stream_length -= start - stream_buffer;
+      memmove(stream_buffer, start, stream_length);
+      if(stream_length > 1024)
       {
-         strcpy(fetch_filepath, opt_filename);
+         _log(MAJOR, "Overlong line in uncompressed data.");
+         return 1;
       }
    }
    return 0;
 }
 
-static size_t cif_write_data(void *buffer, size_t size, size_t nmemb, void *userp)
+static word stream_card(const char * const card, const size_t length)
 {
-   _log(PROC, "cif_write_data()");
+   // Handle a card from the download.  Returns non-zero to abandon the download.
+   if(!run) return 1;
 
-   size_t bytes = size * nmemb;
+   switch(stream_state)
+   {
+   case StreamHeader:
+      if(parse_header(card)) return 1;
+      if(!extract_wanted(stream_check))
+      {
+         stream_unwanted = true;
+         return 1;
+      }
+      if(process_start())
+      {
+         stream_state = StreamIgnore;
+         return 0;
+      }
+      stream_state = StreamProcess;
+      // Fall through
+   case StreamProcess:
+      // After a failure carry on with the download, so the file is complete for another attempt.
+      if(process_card(card, length)) stream_state = StreamFailed;
+      break;
+   }
+   return 0;
+}
 
-   _log(DEBUG, "Bytes received = %zd", bytes);
-   
-   fwrite(buffer, size, nmemb, fp);
+static word stream_finish(void)
+{
+   // Pass on any unterminated last card and tidy up.  Returns non-zero if the download was incomplete.
+   word incomplete = !stream_ended;
 
-   fetch_total_bytes += bytes;
+   if(stream_length && !incomplete)
+   {
+      stream_buffer[stream_length] = '\0';
+      if(stream_card(stream_buffer, stream_length)) incomplete = true;
+   }
+   stream_length = 0;
+   inflateEnd(&stream);
+   if(incomplete && fetch_total_bytes && !stream_unwanted) _log(MAJOR, "Download incomplete.");
+   return incomplete;
+}
 
-   return bytes;
+static word parse_header(const char * const card)
+{
+   // Sets fetch_extract_time from the header card.  Returns non-zero if it isn't one.
+   char record_identity[4];
+   extract_field(card, 0, 2, record_identity);
+   _log(DEBUG, "First card \"%s\".", card);
+   if(strcmp("HD", record_identity))
+   {
+      //TODO Handle this properly
+      _log(MAJOR, "File does not begin with a header record.");
+      return 1;
+   }
+      
+   struct tm broken;
+   broken.tm_year = atoi(extract_field_s(card, 26, 2)) + 100;
+   broken.tm_mon  = atoi(extract_field_s(card, 24, 2)) - 1;
+   broken.tm_mday = atoi(extract_field_s(card, 22, 2));
+   broken.tm_hour = atoi(extract_field_s(card, 28, 2));
+   broken.tm_min  = atoi(extract_field_s(card, 30, 2));
+   broken.tm_sec = 0;
+   broken.tm_isdst = -1;
+   fetch_extract_time = mktime(&broken); // Assumes local!
+
+   _log(GENERAL, "Time of extract = %s", time_text(fetch_extract_time, true));
+   return 0;
+}
+
+static word extract_wanted(const word check)
+{
+   // Returns true if the extract time is right for this run.
+   struct tm * broken;
+   switch(check)
+   {
+   case CheckYesterday:
+      {
+         // Is it correct date?
+         broken = gmtime(&fetch_extract_time);
+         word year = broken->tm_year, mon = broken->tm_mon, mday = broken->tm_mday;
+         time_t when = start_time - 24L*60L*60L;
+         struct tm * wanted = gmtime(&when);
+            
+         if(year == wanted->tm_year && mon == wanted->tm_mon && mday == wanted->tm_mday) return true;
+         _log(MAJOR, "Downloaded file has incorrect timestamp %s.", time_text(fetch_extract_time, true));
+         return false;
+      }
+
+   case CheckFull:
+      broken = localtime(&fetch_extract_time);
+      if(broken->tm_wday == 5) return true;
+      _log(ABEND, "Unexpected extract day %d (%s) on full download.", broken->tm_wday, time_text(fetch_extract_time, true));
+      return false;
+   }
+   return true;
 }
 
 static word process_file(void)
 {
-   qword cards;
+   // Process the file at fetch_filepath, which may be compressed.  The file is mapped into memory.  The cards of a plain
+   // file are processed where they lie, and a compressed one is decompressed as a download is.
    word fail;
-   char card[128];
-   if(!(fp = fopen(fetch_filepath, "r")))
+   int fd;
+   struct stat st;
+   const char * map = NULL, * card, * end;
+
+   if((fd = open(fetch_filepath, O_RDONLY)) < 0 || fstat(fd, &st))
+   {
+      _log(MAJOR, "process_file():  Failed to open \"%s\" for reading.  Error %d %s", fetch_filepath, errno, strerror(errno));
+      if(fd >= 0) close(fd);
+      return 1;
+   }
+   if(st.st_size && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
    {
-      _log(MAJOR, "process_file():  Failed to open \"%s\" for reading.", fetch_filepath);
+      _log(MAJOR, "process_file():  Failed to map \"%s\".  Error %d %s", fetch_filepath, errno, strerror(errno));
+      close(fd);
       return 1;
    }
+   close(fd);
+   if(map) madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
 
-   fail = false;
-   cards = 0;
-   while(fgets(card, sizeof(card), fp) && !fail)
+   if(st.st_size >= 2 && (byte) map[0] == 0x1f && (byte) map[1] == 0x8b)
    {
-      cards++;
+      // gzip.  The header has already been dealt with, so go straight to processing.
+      if(stream_start(CheckNone) || process_start())
+      {
+         munmap((void *) map, st.st_size);
+         return 1;
+      }
+      stream_state = StreamProcess;
+      fail = stream_inflate(map, st.st_size);
+      fail = stream_finish() || fail;
+      munmap((void *) map, st.st_size);
+      return process_end(fail || stream_state == StreamFailed) || fail;
    }
-   fseeko(fp, 0, SEEK_SET);
 
-   _log(GENERAL, "%s CIF cards received.", commas_q(cards));
+   if(process_start())
+   {
+      if(map) munmap((void *) map, st.st_size);
+      return 1;
+   }
 
-   if(opt_test)
+   fail = false;
+   card = map;
+   end = map + st.st_size;
+   while(!fail && card < end)
    {
-      _log(GENERAL, "Ignoring data from file in test mode.");
-      fclose(fp);
-      return 0;
+      const char * newline = memchr(card, '\n', end - card);
+      size_t length = (newline ? newline : end) - card;
+      fail = process_card(card, length);
+      card += length + 1;
    }
 
+   if(map) munmap((void *) map, st.st_size);
+
+   return process_end(fail);
+}
+
+static word process_start(void)
+{
+   // Prepare to process a file of cards.
+   cards = 0;
    last_reported_time = time(NULL);
 
+   if(opt_test) return 0;
+
    update_id = 0;
+   {
+      word b;
+      char head[128];
+      for(b = 0; b < MAXBatch; b++)
+      {
+         sprintf(head, "INSERT INTO %s VALUES", batch_table[b]);
+         db_batch_init(&batch[b], head, NULL);
+      }
+   }
 
-   if(db_start_transaction()) return 1;
+   if(bulk_load) return bulk_start();
 
-   while(fgets(card, sizeof(card), fp) && !fail)
+   return db_start_transaction();
+}
+
+static word process_card(const char * card, const size_t length)
+{
+   // Process one card of length characters, without its newline.  Returns non-zero on failure.
+   char padded[CIF_CARD + 1];
+
+   cards++;
+   if(opt_test) return 0;
+
+   if(length < CIF_CARD)
    {
-      // Comfort report
-#define COMFORT_REPORT_PERIOD ((opt_print?1:10) * 60)
-      time_t now = time(NULL);
-      if(now - last_reported_time > COMFORT_REPORT_PERIOD)
-      {
-         char zs[128], zs1[128];
-         sprintf(zs, "Progress:  Processed %s of ", commas_q(stats[CIFRecords]));
-         sprintf(zs1, "%s CIF cards.  ", commas_q(cards));
-         strcat(zs, zs1);
-         sprintf(zs1, "Created %s schedules and ", commas_q(stats[ScheduleCreate]));
-         strcat(zs, zs1);
-         sprintf(zs1, "%s schedule locations.  Working...", commas_q(stats[ScheduleLocCreate]));
-         strcat(zs, zs1);
-         _log(GENERAL, zs);
-         last_reported_time += COMFORT_REPORT_PERIOD;
+      memcpy(padded, card, length);
+      memset(padded + length, ' ', CIF_CARD - length);
+      padded[CIF_CARD] = '\0';
+      card = padded;
+   }
+
+   _log(DEBUG, "Line \"%.80s\", record identity \"%c%c\".", card, card[0], card[1]);
+   if(bulk_load && ((card[0] == 'B' && card[1] == 'S' && card[2] != 'N') ||
+                    (card[0] == 'A' && card[1] == 'A' && card[2] != 'N') ||
+                    (card[0] == 'T' && (card[1] == 'A' || card[1] == 'D'))))
+   {
+      // Bulk load can only insert.
+      _log(MAJOR, "Unexpected amendment card \"%.80s\" in full timetable.", card);
+      return 1;
+   }
+
+   // Once the pipeline is running everything goes through it, so only the writer uses the database.
+   if(opt_workers && (pipe_running || !(card[0] == 'H' && card[1] == 'D')))
+   {
+      if(!pipe_running && pipe_start())
+      {
+         _log(MAJOR, "Failed to start pipelined processing.  Processing in line.");
+         opt_workers = 0;
       }
+      if(pipe_running) return pipe_card(card);
+   }
 
-      card[strlen(card) - 1] = '\0'; // Lose the newline
-      _log(DEBUG, "Line \"%s\", record identity \"%c%c\".", card, card[0], card[1]);
-      if     (card[0] == 'H' && card[1] == 'D') fail = process_HD(card);
-      else if(card[0] == 'B' && card[1] == 'S') fail = process_schedule(card);
-      else if(card[0] == 'B' && card[1] == 'X') fail = process_schedule(card);
-      else if(card[0] == 'L' && card[1] == 'O') fail = process_schedule(card);
-      else if(card[0] == 'L' && card[1] == 'I') fail = process_schedule(card);
-      else if(card[0] == 'L' && card[1] == 'T') fail = process_schedule(card);
-      else if(card[0] == 'C' && card[1] == 'R') fail = process_schedule(card);
-      else if(card[0] == 'A' && card[1] == 'A') fail = process_association(card);
-      else if(card[0] == 'T' && card[1] == 'I') fail = process_tiploc(card);
-      else if(card[0] == 'T' && card[1] == 'A') fail = process_tiploc(card);
-      else if(card[0] == 'T' && card[1] == 'D') fail = process_tiploc(card);
-      else if(card[0] == 'Z' && card[1] == 'Z') ;
-      else _log(MINOR, "Unexpected record %c%c ignored.", card[0], card[1]);
-      stats[CIFRecords]++;
-   }
-
-   fclose(fp);
+   comfort_report();
+   return process_record(card, NULL);
+}
+
+static word process_record(const char * const card, const struct pipe_card * const p)
+{
+   // Apply one card to the database.  p, if not NULL, holds the row prepared by a pipeline worker.
+   word fail = 0;
+   if     (card[0] == 'H' && card[1] == 'D') fail = process_HD(card);
+   else if(card[0] == 'B' && card[1] == 'S') fail = process_schedule(card, p);
+   else if(card[0] == 'B' && card[1] == 'X') fail = process_schedule(card, p);
+   else if(card[0] == 'L' && card[1] == 'O') fail = process_schedule(card, p);
+   else if(card[0] == 'L' && card[1] == 'I') fail = process_schedule(card, p);
+   else if(card[0] == 'L' && card[1] == 'T') fail = process_schedule(card, p);
+   else if(card[0] == 'C' && card[1] == 'R') fail = process_schedule(card, p);
+   else if(card[0] == 'A' && card[1] == 'A') fail = process_association(card, p);
+   else if(card[0] == 'T' && card[1] == 'I') fail = process_tiploc(card);
+   else if(card[0] == 'T' && card[1] == 'A') fail = process_tiploc(card);
+   else if(card[0] == 'T' && card[1] == 'D') fail = process_tiploc(card);
+   else if(card[0] == 'Z' && card[1] == 'Z') ;
+   else _log(MINOR, "Unexpected record %c%c ignored.", card[0], card[1]);
+   stats[CIFRecords]++;
+   return fail;
+}
+
+static void comfort_report(void)
+{
+#define COMFORT_REPORT_PERIOD ((opt_print?1:10) * 60)
+   time_t now = time(NULL);
+   if(now - last_reported_time > COMFORT_REPORT_PERIOD)
+   {
+      char zs[128], zs1[128];
+      sprintf(zs, "Progress:  Processed %s CIF cards.  ", commas_q(stats[CIFRecords]));
+      sprintf(zs1, "Created %s schedules and ", commas_q(stats[ScheduleCreate]));
+      strcat(zs, zs1);
+      sprintf(zs1, "%s schedule locations.  Working...", commas_q(stats[ScheduleLocCreate]));
+      strcat(zs, zs1);
+      _log(GENERAL, zs);
+      last_reported_time += COMFORT_REPORT_PERIOD;
+   }
+}
+
+static word process_end(word fail)
+{
+   // Finish processing a file, committing the changes unless fail is set.  Returns non-zero on failure.
+   fail = pipe_finish(fail);
+   _log(GENERAL, "%s CIF cards received.", commas_q(cards));
+
+   if(opt_test)
+   {
+      _log(GENERAL, "Ignoring data from file in test mode.");
+      return 0;
+   }
+
+   if(bulk_load)
+   {
+      if(!fail) fail = bulk_write_schedule(NULL);
+      return bulk_finish(fail) || fail;
+   }
+
+   if(!fail) fail = batch_flush();
 
    if(!fail)
    {
@@ -911,6 +1263,190 @@ static word process_file(void)
    return fail;
 }
 
+static word pipe_start(void)
+{
+   // Start the writer and worker threads.  The database connection is handed over to the writer until pipe_finish().
+   word i;
+
+   for(i = 0; i < PIPE_SLOTS; i++)
+   {
+      pipe_blocks[i].state = PipeFree;
+      pipe_blocks[i].cards = 0;
+   }
+   pipe_read = pipe_parse = pipe_write = 0;
+   pipe_ending = pipe_failed = false;
+
+   if(pthread_create(&pipe_writer_thread, NULL, pipe_writer, NULL)) return 1;
+   for(pipe_workers = 0; pipe_workers < opt_workers; pipe_workers++)
+   {
+      if(pthread_create(&pipe_worker_threads[pipe_workers], NULL, pipe_worker, NULL)) break;
+   }
+   pipe_running = true;
+   if(!pipe_workers)
+   {
+      pipe_finish(true);
+      return 1;
+   }
+   _log(GENERAL, "Pipelined processing with %d worker threads.", pipe_workers);
+   return 0;
+}
+
+static word pipe_card(const char * const card)
+{
+   // Add a card to the block being read.  Returns non-zero if the pipeline has failed.
+   struct pipe_block * b = &pipe_blocks[pipe_read % PIPE_SLOTS];
+
+   if(b->cards == PIPE_BLOCK || (b->cards >= PIPE_BLOCK / 2 && card[0] == 'B' && card[1] == 'S'))
+   {
+      if(pipe_submit()) return 1;
+      b = &pipe_blocks[pipe_read % PIPE_SLOTS];
+   }
+   struct pipe_card * p = &b->card[b->cards++];
+   memcpy(p->card, card, CIF_CARD);
+   p->card[CIF_CARD] = '\0';
+   return pipe_failed;
+}
+
+static word pipe_submit(void)
+{
+   // Pass the block being read to the workers, and wait for the next slot to be free.
+   pthread_mutex_lock(&pipe_mutex);
+   pipe_blocks[pipe_read % PIPE_SLOTS].state = PipeRead;
+   pipe_read++;
+   pthread_cond_broadcast(&pipe_cond);
+   while(pipe_blocks[pipe_read % PIPE_SLOTS].state != PipeFree) pthread_cond_wait(&pipe_cond, &pipe_mutex);
+   pipe_blocks[pipe_read % PIPE_SLOTS].cards = 0;
+   pthread_mutex_unlock(&pipe_mutex);
+   return pipe_failed;
+}
+
+static word pipe_finish(word fail)
+{
+   // Drain the pipeline, or abandon it if fail is set, and wait for the threads to finish.  Returns non-zero on failure.
+   word i;
+
+   if(!pipe_running) return fail;
+
+   if(fail) pipe_failed = true;
+   if(pipe_blocks[pipe_read % PIPE_SLOTS].cards) pipe_submit();
+   pthread_mutex_lock(&pipe_mutex);
+   pipe_ending = true;
+   pthread_cond_broadcast(&pipe_cond);
+   pthread_mutex_unlock(&pipe_mutex);
+
+   for(i = 0; i < pipe_workers; i++) pthread_join(pipe_worker_threads[i], NULL);
+   pthread_join(pipe_writer_thread, NULL);
+   pipe_running = false;
+
+   return fail || pipe_failed;
+}
+
+static void * pipe_worker(void * arg)
+{
+   struct pipe_block * b;
+
+   pthread_mutex_lock(&pipe_mutex);
+   while(true)
+   {
+      while(pipe_parse == pipe_read && !pipe_ending) pthread_cond_wait(&pipe_cond, &pipe_mutex);
+      if(pipe_parse == pipe_read) break;
+      b = &pipe_blocks[pipe_parse++ % PIPE_SLOTS];
+      b->state = PipeParsing;
+      pthread_mutex_unlock(&pipe_mutex);
+
+      if(!pipe_failed) pipe_prepare(b);
+
+      pthread_mutex_lock(&pipe_mutex);
+      b->state = PipeParsed;
+      pthread_cond_broadcast(&pipe_cond);
+   }
+   pthread_mutex_unlock(&pipe_mutex);
+   return NULL;
+}
+
+static void * pipe_writer(void * arg)
+{
+   struct pipe_block * b;
+   word i;
+
+   mysql_thread_init();
+   pthread_mutex_lock(&pipe_mutex);
+   while(true)
+   {
+      b = &pipe_blocks[pipe_write % PIPE_SLOTS];
+      while(b->state != PipeParsed && !(pipe_ending && pipe_write == pipe_read)) pthread_cond_wait(&pipe_cond, &pipe_mutex);
+      if(b->state != PipeParsed) break;
+      pthread_mutex_unlock(&pipe_mutex);
+
+      for(i = 0; i < b->cards && !pipe_failed; i++)
+      {
+         if(!run || process_record(b->card[i].card, &b->card[i])) pipe_failed = true;
+      }
+      comfort_report();
+
+      pthread_mutex_lock(&pipe_mutex);
+      b->state = PipeFree;
+      pipe_write++;
+      pthread_cond_broadcast(&pipe_cond);
+   }
+   pthread_mutex_unlock(&pipe_mutex);
+   mysql_thread_end();
+   return NULL;
+}
+
+static void pipe_prepare(struct pipe_block * const b)
+{
+   // Prepare the rows for a block of cards.  Must not use the database, or anything else the writer uses.
+   word i, origin_sort_time = 0, origin_valid = false;
+
+   for(i = 0; i < b->cards; i++)
+   {
+      struct pipe_card * p = &b->card[i];
+      const char * c = p->card;
+      p->prepared = PreparedNone;
+
+      if(c[0] == 'B' && c[1] == 'S')
+      {
+         origin_valid = false;
+         if(c[2] == 'D') continue;
+         if(bulk_load && i + 1 < b->cards && b->card[i + 1].card[0] == 'B' && b->card[i + 1].card[1] == 'X')
+         {
+            schedule_row(c, b->card[i + 1].card, p->row);
+            p->prepared = PreparedRow;
+            b->card[++i].prepared = PreparedMerged;
+         }
+         else
+         {
+            schedule_row(c, NULL, p->row);
+            p->prepared = PreparedRow;
+         }
+      }
+      else if(c[0] == 'L' && c[1] == 'O')
+      {
+         p->sort_time = origin_sort_time = location_row(c, 0, p->row);
+         p->prepared = PreparedRow;
+         origin_valid = true;
+      }
+      else if(c[0] == 'L' && (c[1] == 'I' || c[1] == 'T'))
+      {
+         // Without the LO card the writer will have to do it.
+         if(!origin_valid) continue;
+         p->sort_time = location_row(c, origin_sort_time, p->row);
+         p->prepared = PreparedRow;
+      }
+      else if(c[0] == 'C' && c[1] == 'R')
+      {
+         cr_row(c, p->row);
+         p->prepared = PreparedRow;
+      }
+      else if(c[0] == 'A' && c[1] == 'A' && c[2] != 'D')
+      {
+         association_row(c, p->row);
+         p->prepared = PreparedRow;
+      }
+   }
+}
+
 static word process_HD(const char * const c)
 {
    char query[256];
@@ -984,19 +1520,22 @@ static word process_HD(const char * const c)
    return 0;
 }
 
-#define EXTRACT_APPEND(a,b) { strcat(query, ", '"); strcat(query, extract_field_s(c, a, b)); strcat(query, "'"); }
+// EXTRACT_APPEND is used by the pipeline workers, so doesn't use extract_field_s()
+#define EXTRACT_APPEND(a,b) { strcat(query, ", '"); strncat(query, c + (a), (b)); strcat(query, "'"); }
 #define EXTRACT_APPEND_ESCAPE(a,b) { strcat(query, ", '"); strcpy(zs, extract_field_s(c, a, b)); db_real_escape_string(zs1, zs, strlen(zs)); strcat(query, zs1); strcat(query, "'"); }
-static word process_association(const char * const c)
+static word process_association(const char * const c, const struct pipe_card * const p)
 {
+   // p, if not NULL, holds a row prepared by a pipeline worker.
    MYSQL_RES * result;
-   char query[1024], query1[1024], zs[128];
+   char query[1024], query1[1024];
 
    // Record AA
-   _log(DEBUG, "AA card \"%s\".", c);
+   _log(DEBUG, "AA card \"%.80s\".", c);
 
    if(c[2] == 'R' || c[2] == 'D')
    {
       // Delete an association
+      if(batch_flush()) return 1;
       sprintf(query1, " WHERE main_train_uid = '%s'", extract_field_s(c, 3, 6));
       sprintf(query,  " AND assoc_train_uid = '%s'",  extract_field_s(c, 9, 6));
       strcat(query1, query);
@@ -1018,13 +1557,13 @@ static word process_association(const char * const c)
 
       if(num_rows > 1)
       {
-         _log(MINOR, "AA card \"%s\".", c);
+         _log(MINOR, "AA card \"%.80s\".", c);
          _log(MINOR, "   Delete (%c) association found %d matches.  All deleted.", c[2], num_rows);
       }
 
       if(num_rows < 1)
       {
-         _log(MINOR, "AA card \"%s\".", c);
+         _log(MINOR, "AA card \"%.80s\".", c);
          _log(MINOR, "   Delete (%c) association found no matches.", c[2]);
          stats[AssocDeleteMiss]++;
       }
@@ -1040,17 +1579,33 @@ static word process_association(const char * const c)
    }
 
    // Create an association
-   sprintf(query, "INSERT INTO cif_associations values(%d, %ld, %lu", update_id, start_time, NOT_DELETED);
+   if(p && p->prepared) strcpy(query, p->row);
+   else association_row(c, query);
+
+   if(batch_insert(AssociationBatch, query))
+      return 1;
+
+   stats[AssocCreate]++;
+
+   return 0;
+}
+
+static void association_row(const char * const c, char * const query)
+{
+   // Build the cif_associations row "(...)" from an AA card.
+   char zs[32];
+
+   sprintf(query, "(%d, %ld, %lu", update_id, start_time, NOT_DELETED);
 
    // main_train_uid        | char(6)              | NO   |     | NULL    |       |
    EXTRACT_APPEND( 3, 6);
    // assoc_train_uid       | char(6)              | NO   |     | NULL    |       |
    EXTRACT_APPEND( 9, 6);
    // assoc_start_date      | int(10) unsigned     | NO   |     | NULL    |       |
-   sprintf(zs, ", %ld", parse_CIF_datestamp(extract_field_s(c, 15, 6)));
+   sprintf(zs, ", %ld", extract_CIF_datestamp(c, 15));
    strcat(query, zs);
    // assoc_end_date        | int(10) unsigned     | NO   |     | NULL    |       |
-   sprintf(zs, ", %ld", parse_CIF_datestamp(extract_field_s(c, 21, 6)));
+   sprintf(zs, ", %ld", extract_CIF_datestamp(c, 21));
    strcat(query, zs);
    // assoc_days            | char(7)              | NO   |     | NULL    |       |
    EXTRACT_APPEND(27, 7);
@@ -1072,26 +1627,26 @@ static word process_association(const char * const c)
    EXTRACT_APPEND(79, 1);
 
    strcat(query, ")");
-
-   if(db_query(query))
-      return 1;
-
-   stats[AssocCreate]++;
-
-   return 0;
 }
 
-static word process_schedule(const char * const c)
+static word process_schedule(const char * const c, const struct pipe_card * const p)
 {
+   // p, if not NULL, holds a row prepared by a pipeline worker.
    static dword schedule_id;
    static char action;
-   char query[1024], zs[128];
-   word sort_arrive, sort_depart, sort_pass, sort_time;
+   char query[1024];
+   word sort_time;
    static word origin_sort_time;
 
+   if(bulk_load && (c[0] != 'B' || c[1] != 'X'))
+   {
+      // Write any schedule still waiting for a BX card.
+      if(bulk_write_schedule(NULL)) return 1;
+   }
+
    if(c[0] == 'B' && c[1] == 'S')
    {
-      _log(DEBUG, "BS card \"%s\".", c);
+      _log(DEBUG, "BS card \"%.80s\".", c);
       action = c[2];
       if(c[2] == 'R' || c[2] == 'D')
       {
@@ -1104,72 +1659,27 @@ static word process_schedule(const char * const c)
       }
 
       // Create a schedule
-      sprintf(query, "INSERT INTO cif_schedules values(%d, %ld, %lu", update_id, start_time, NOT_DELETED);
-
-      // CIF_bank_holiday_running      | char(1)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(28, 1);
-      // CIF_stp_indicator             | char(1)              | NO   | MUL | NULL    |                |
-      EXTRACT_APPEND(79, 1);
-      // CIF_train_uid                 | char(6)              | NO   | MUL | NULL    |                |
-      EXTRACT_APPEND( 3, 6);
-      // applicable_timetable          | char(1)              | NO   |     | NULL    |                |
-      strcat(query, ", ''"); // in BX record
-      // atoc_code                     | char(2)              | NO   |     | NULL    |                |
-      strcat(query, ", ''"); // in BX record
-      // uic_code                      | char(5)              | NO   |     | NULL    |                |
-      strcat(query, ", ''"); // in BX record
-      // runs_mo                       | tinyint(1)           | NO   |     | NULL    |                |
-      EXTRACT_APPEND(21, 1);
-      // runs_tu                       | tinyint(1)           | NO   |     | NULL    |                |
-      EXTRACT_APPEND(22, 1);
-      // runs_we                       | tinyint(1)           | NO   |     | NULL    |                |
-      EXTRACT_APPEND(23, 1);
-      // runs_th                       | tinyint(1)           | NO   |     | NULL    |                |
-      EXTRACT_APPEND(24, 1);
-      // runs_fr                       | tinyint(1)           | NO   |     | NULL    |                |
-      EXTRACT_APPEND(25, 1);
-      // runs_sa                       | tinyint(1)           | NO   |     | NULL    |                |
-      EXTRACT_APPEND(26, 1);
-      // runs_su                       | tinyint(1)           | NO   |     | NULL    |                |
-      EXTRACT_APPEND(27, 1);
-      // schedule_end_date             | int(10) unsigned     | NO   | MUL | NULL    |                |
-      sprintf(zs, ", %ld", parse_CIF_datestamp(extract_field_s(c, 15, 6)));
-      strcat(query, zs);
-      // signalling_id                 | char(4)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(32, 4);
-      // CIF_train_category            | char(2)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(30, 2);
-      // CIF_headcode                  | char(4)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(36, 4);
-      // CIF_train_service_code        | char(8)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(41, 8);
-      // CIF_business_sector           | char(1)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(49, 1);
-      // CIF_power_type                | char(3)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(50, 3);
-      // CIF_timing_load               | char(4)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(53, 4);
-      // CIF_speed                     | char(3)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(57, 3);
-      // CIF_operating_characteristics | char(6)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(60, 6);
-      // CIF_train_class               | char(1)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(66, 1);
-      // CIF_sleepers                  | char(1)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(67, 1);
-      // CIF_reservations              | char(1)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(68, 1);
-      // CIF_connection_indicator      | char(1)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(69, 1);
-      // CIF_catering_code             | char(4)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(70, 4);
-      // CIF_service_branding          | char(4)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(74, 4);
-      // schedule_start_date           | int(10) unsigned     | NO   | MUL | NULL    |                |
-      sprintf(zs, ", %ld", parse_CIF_datestamp(extract_field_s(c, 9, 6)));
-      strcat(query, zs);
-      // train_status                  | char(1)              | NO   |     | NULL    |                |
-      EXTRACT_APPEND(29, 1);
+      if(bulk_load && p && p->prepared)
+      {
+         // The worker has already combined the card with its BX card, if there is one.
+         schedule_id = ++bulk_schedule_id;
+         stats[ScheduleCreate]++;
+         sprintf(query, "%s, %u, '', '')", p->row, schedule_id);
+         return bulk_write(ScheduleBatch, query);
+      }
+      if(bulk_load)
+      {
+         // Hold the card until the BX card arrives.
+         schedule_id = ++bulk_schedule_id;
+         memcpy(bulk_schedule_card, c, CIF_CARD);
+         bulk_schedule_card[CIF_CARD] = '\0';
+         stats[ScheduleCreate]++;
+         return 0;
+      }
+
+      strcpy(query, "INSERT INTO cif_schedules VALUES");
+      if(p && p->prepared) strcat(query, p->row);
+      else schedule_row(c, NULL, query + strlen(query));
       // id                            | int(10) unsigned     | NO   | PRI | NULL    | auto_increment |
       // deduced_headcode              | char(4)              | NO   |     |         |                |
       // deduced_headcode_status       | char(1)              | NO   |     |         |                |
@@ -1210,167 +1720,40 @@ static word process_schedule(const char * const c)
    if(c[0] == 'B' && c[1] == 'X')
    {
       // BS Extra. 
+      if(p && p->prepared == PreparedMerged) return 0;
+      if(bulk_load) return bulk_write_schedule(c);
       // applicable_timetable          | char(1)              | NO   |     | NULL    |                |
-      sprintf(query, "UPDATE cif_schedules SET applicable_timetable = '%s', atoc_code = '", extract_field_s(c, 13, 1));
       // atoc_code                     | char(2)              | NO   |     | NULL    |                |
-      strcat(query, extract_field_s(c, 11, 2));
-      strcat(query, "', uic_code = '");
       // uic_code                      | char(5)              | NO   |     | NULL    |                |
-      strcat(query, extract_field_s(c, 6, 5));
-      sprintf(zs, "' WHERE id = %d", schedule_id);
-      strcat(query, zs);
+      sprintf(query, "UPDATE cif_schedules SET applicable_timetable = '%.1s', atoc_code = '%.2s', uic_code = '%.5s' WHERE id = %d", c + 13, c + 11, c + 6, schedule_id);
       return db_query(query);
    }
 
    if(c[0] == 'L')
    {
-      if(c[1] == 'O')
-      {
-         //| update_id             | smallint(5) unsigned | NO   |     | NULL    |       |
-         //| cif_schedule_id       | int(10) unsigned     | NO   | MUL | NULL    |       |
-         sprintf(query, "INSERT INTO cif_schedule_locations VALUES(%d, %d", update_id, schedule_id);
-         //| location_type         | char(12)             | NO   |     | NULL    |       |
-         EXTRACT_APPEND(29, 12);
-         //| record_identity       | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(0, 2);
-         //| tiploc_code           | char(7)              | NO   | MUL | NULL    |       |
-         EXTRACT_APPEND(2, 7);
-         //| tiploc_instance       | char(1)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(9, 1);
-         //| arrival               | char(5)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| departure             | char(5)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(10, 5);
-         //| pass                  | char(5)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| public_arrival        | char(4)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| public_departure      | char(4)              | NO   |     | NULL    |       |
-         if(strcmp(extract_field_s(c, 15, 4), "0000")) EXTRACT_APPEND(15, 4)
-            else strcat(query, ", ''");
-         //| sort_time             | smallint(5) unsigned | NO   |     | NULL    |       |
-         //| next_day              | tinyint(1)           | NO   |     | NULL    |       |
-         sort_time = get_sort_time(extract_field_s(c, 10, 5));
-         sprintf(zs, ", %d, 0", sort_time);
-         strcat(query, zs);
-         origin_sort_time = sort_time;
-         //| platform              | char(3)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(19, 3);
-         //| line                  | char(3)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(22, 3);
-         //| path                  | char(3)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| engineering_allowance | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(25, 2);
-         //| pathing_allowance     | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(27, 2);
-         //| performance_allowance | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(41, 2);
-         strcat(query, ")");
-         if(db_query(query)) return 1;
-         stats[ScheduleLocCreate]++;
+      //| update_id             | smallint(5) unsigned | NO   |     | NULL    |       |
+      //| cif_schedule_id       | int(10) unsigned     | NO   | MUL | NULL    |       |
+      size_t l = sprintf(query, "(%d, %d", update_id, schedule_id);
+      if(p && p->prepared)
+      {
+         strcpy(query + l, p->row);
+         sort_time = p->sort_time;
       }
-      else if(c[1] == 'I')
-      {
-         //| update_id             | smallint(5) unsigned | NO   |     | NULL    |       |
-         //| cif_schedule_id       | int(10) unsigned     | NO   | MUL | NULL    |       |
-         sprintf(query, "INSERT INTO cif_schedule_locations VALUES(%d, %d", update_id, schedule_id);
-         //| location_type         | char(12)             | NO   |     | NULL    |       |
-         EXTRACT_APPEND(42, 12);
-         //| record_identity       | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(0, 2);
-         //| tiploc_code           | char(7)              | NO   | MUL | NULL    |       |
-         EXTRACT_APPEND(2, 7);
-         //| tiploc_instance       | char(1)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(9, 1);
-         //| arrival               | char(5)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(10, 5);
-         //| departure             | char(5)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(15, 5);
-         //| pass                  | char(5)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(20, 5);
-         //| public_arrival        | char(4)              | NO   |     | NULL    |       |
-         if(strcmp(extract_field_s(c, 25, 4), "0000")) EXTRACT_APPEND(25, 4)
-            else strcat(query, ", ''");
-         //| public_departure      | char(4)              | NO   |     | NULL    |       |
-         if(strcmp(extract_field_s(c, 29, 4), "0000")) EXTRACT_APPEND(29, 4)
-            else strcat(query, ", ''");
-         //| sort_time             | smallint(5) unsigned | NO   |     | NULL    |       |
-         //| next_day              | tinyint(1)           | NO   |     | NULL    |       |
-         sort_arrive = get_sort_time(extract_field_s(c, 10, 5));
-         sort_depart = get_sort_time(extract_field_s(c, 15, 5));
-         sort_pass   = get_sort_time(extract_field_s(c, 20, 5));
-         if(sort_arrive < INVALID_SORT_TIME) sort_time = sort_arrive;
-         else if(sort_depart < INVALID_SORT_TIME) sort_time = sort_depart;
-         else sort_time = sort_pass;
-         sprintf(zs, ", %d, %d", sort_time, (sort_time < origin_sort_time)?1:0);
-         strcat(query, zs);
-         //| platform              | char(3)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(33, 3);
-         //| line                  | char(3)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(36, 3);
-         //| path                  | char(3)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(39, 3);
-         //| engineering_allowance | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(54, 2);
-         //| pathing_allowance     | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(56, 2);
-         //| performance_allowance | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(58, 2);
-         strcat(query, ")");
-         if(db_query(query)) return 1;
-         stats[ScheduleLocCreate]++;
+      else
+      {
+         sort_time = location_row(c, origin_sort_time, query + l);
       }
-      else if(c[1] == 'T')
-      {
-         //| update_id             | smallint(5) unsigned | NO   |     | NULL    |       |
-         //| cif_schedule_id       | int(10) unsigned     | NO   | MUL | NULL    |       |
-         sprintf(query, "INSERT INTO cif_schedule_locations VALUES(%d, %d", update_id, schedule_id);
-         //| location_type         | char(12)             | NO   |     | NULL    |       |
-         EXTRACT_APPEND(25, 12);
-         //| record_identity       | char(2)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(0, 2);
-         //| tiploc_code           | char(7)              | NO   | MUL | NULL    |       |
-         EXTRACT_APPEND(2, 7);
-         //| tiploc_instance       | char(1)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(9, 1);
-         //| arrival               | char(5)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(10, 5);
-         //| departure             | char(5)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| pass                  | char(5)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| public_arrival        | char(4)              | NO   |     | NULL    |       |
-         if(strcmp(extract_field_s(c, 15, 4), "0000")) EXTRACT_APPEND(15, 4)
-            else strcat(query, ", ''");
-         //| public_departure      | char(4)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| sort_time             | smallint(5) unsigned | NO   |     | NULL    |       |
-         //| next_day              | tinyint(1)           | NO   |     | NULL    |       |
-         sort_time = get_sort_time(extract_field_s(c, 10, 5));
-         sprintf(zs, ", %d, %d", sort_time, (sort_time < origin_sort_time)?1:0);
-         strcat(query, zs);
-         //| platform              | char(3)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(19, 3);
-         //| line                  | char(3)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| path                  | char(3)              | NO   |     | NULL    |       |
-         EXTRACT_APPEND(22, 3);
-         //| engineering_allowance | char(2)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| pathing_allowance     | char(2)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         //| performance_allowance | char(2)              | NO   |     | NULL    |       |
-         strcat(query, ", ''");
-         strcat(query, ")");
-         if(db_query(query)) return 1;
+      if(c[1] == 'O') origin_sort_time = sort_time;
+      if(c[1] == 'O' || c[1] == 'I' || c[1] == 'T')
+      {
+         if(batch_insert(LocationBatch, query)) return 1;
          stats[ScheduleLocCreate]++;
       }
 
       if(conf[conf_huyton_alerts][0])
       {
-         if((!strcasecmp(extract_field_s(c, 2, 7), "HUYTON ")) ||
-            (!strcasecmp(extract_field_s(c, 2, 7), "HUYTJUN")))
+         if((!strncasecmp(c + 2, "HUYTON ", 7)) ||
+            (!strncasecmp(c + 2, "HUYTJUN", 7)))
          {
             if(home_report_index < HOME_REPORT_SIZE)
             {
@@ -1399,51 +1782,270 @@ static word process_schedule(const char * const c)
    if(c[0] == 'C' && c[1] == 'R')
    {
       //| cif_schedule_id               | int(10) unsigned | NO   | MUL | NULL    |       |
-      sprintf(query, "INSERT INTO cif_changes_en_route VALUES(%d", schedule_id);
-      //| tiploc_code                   | char(7)          | NO   | MUL | NULL    |       |
-      EXTRACT_APPEND(2, 7);
-      //| tiploc_instance               | char(1)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(9, 1);
-      //| CIF_train_category            | char(2)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(10, 2);
-      //| signalling_id                 | char(4)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(12, 4);
-      //| CIF_headcode                  | char(4)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(16, 4);
-      //| CIF_train_service_code        | char(8)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(21, 8);
-      //| CIF_power_type                | char(3)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(30, 3);
-      //| CIF_timing_load               | char(4)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(33, 4);
-      //| CIF_speed                     | char(3)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(37, 3);
-      //| CIF_operating_characteristics | char(6)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(40, 6);
-      //| CIF_train_class               | char(1)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(46, 1);
-      //| CIF_sleepers                  | char(1)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(47, 1);
-      //| CIF_reservations              | char(1)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(48, 1);
-      //| CIF_connection_indicator      | char(1)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(49, 1);
-      //| CIF_catering_code             | char(4)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(50, 4);
-      //| CIF_service_branding          | char(4)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(54, 4);
-      //| uic_code                      | char(5)          | NO   |     | NULL    |       |
-      EXTRACT_APPEND(62, 5);
-      strcat(query, ")");
-      if(db_query(query)) return 1;
+      size_t l = sprintf(query, "(%d", schedule_id);
+      if(p && p->prepared) strcpy(query + l, p->row);
+      else cr_row(c, query + l);
+      if(batch_insert(CRBatch, query)) return 1;
       stats[ScheduleCR]++;
       return 0;
    }
 
-   _log(MAJOR, "Unexpected card \"%s\".", c);
+   _log(MAJOR, "Unexpected card \"%.80s\".", c);
    return 1;
 }
 
+static word location_row(const char * const c, const word origin_sort_time, char * const query)
+{
+   // Build the cif_schedule_locations row from an LO, LI or LT card, following on from "(update_id, schedule_id".
+   // Returns the sort time.
+   char zs[32];
+   word sort_arrive, sort_depart, sort_pass, sort_time = INVALID_SORT_TIME;
+
+   query[0] = '\0';
+   if(c[1] == 'O')
+   {
+      //| location_type         | char(12)             | NO   |     | NULL    |       |
+      EXTRACT_APPEND(29, 12);
+      //| record_identity       | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(0, 2);
+      //| tiploc_code           | char(7)              | NO   | MUL | NULL    |       |
+      EXTRACT_APPEND(2, 7);
+      //| tiploc_instance       | char(1)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(9, 1);
+      //| arrival               | char(5)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| departure             | char(5)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(10, 5);
+      //| pass                  | char(5)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| public_arrival        | char(4)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| public_departure      | char(4)              | NO   |     | NULL    |       |
+      if(strncmp(c + 15, "0000", 4)) EXTRACT_APPEND(15, 4)
+         else strcat(query, ", ''");
+      //| sort_time             | smallint(5) unsigned | NO   |     | NULL    |       |
+      //| next_day              | tinyint(1)           | NO   |     | NULL    |       |
+      sort_time = get_sort_time(c + 10);
+      sprintf(zs, ", %d, 0", sort_time);
+      strcat(query, zs);
+      //| platform              | char(3)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(19, 3);
+      //| line                  | char(3)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(22, 3);
+      //| path                  | char(3)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| engineering_allowance | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(25, 2);
+      //| pathing_allowance     | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(27, 2);
+      //| performance_allowance | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(41, 2);
+      strcat(query, ")");
+   }
+   else if(c[1] == 'I')
+   {
+      //| location_type         | char(12)             | NO   |     | NULL    |       |
+      EXTRACT_APPEND(42, 12);
+      //| record_identity       | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(0, 2);
+      //| tiploc_code           | char(7)              | NO   | MUL | NULL    |       |
+      EXTRACT_APPEND(2, 7);
+      //| tiploc_instance       | char(1)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(9, 1);
+      //| arrival               | char(5)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(10, 5);
+      //| departure             | char(5)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(15, 5);
+      //| pass                  | char(5)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(20, 5);
+      //| public_arrival        | char(4)              | NO   |     | NULL    |       |
+      if(strncmp(c + 25, "0000", 4)) EXTRACT_APPEND(25, 4)
+         else strcat(query, ", ''");
+      //| public_departure      | char(4)              | NO   |     | NULL    |       |
+      if(strncmp(c + 29, "0000", 4)) EXTRACT_APPEND(29, 4)
+         else strcat(query, ", ''");
+      //| sort_time             | smallint(5) unsigned | NO   |     | NULL    |       |
+      //| next_day              | tinyint(1)           | NO   |     | NULL    |       |
+      sort_arrive = get_sort_time(c + 10);
+      sort_depart = get_sort_time(c + 15);
+      sort_pass   = get_sort_time(c + 20);
+      if(sort_arrive < INVALID_SORT_TIME) sort_time = sort_arrive;
+      else if(sort_depart < INVALID_SORT_TIME) sort_time = sort_depart;
+      else sort_time = sort_pass;
+      sprintf(zs, ", %d, %d", sort_time, (sort_time < origin_sort_time)?1:0);
+      strcat(query, zs);
+      //| platform              | char(3)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(33, 3);
+      //| line                  | char(3)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(36, 3);
+      //| path                  | char(3)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(39, 3);
+      //| engineering_allowance | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(54, 2);
+      //| pathing_allowance     | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(56, 2);
+      //| performance_allowance | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(58, 2);
+      strcat(query, ")");
+   }
+   else if(c[1] == 'T')
+   {
+      //| location_type         | char(12)             | NO   |     | NULL    |       |
+      EXTRACT_APPEND(25, 12);
+      //| record_identity       | char(2)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(0, 2);
+      //| tiploc_code           | char(7)              | NO   | MUL | NULL    |       |
+      EXTRACT_APPEND(2, 7);
+      //| tiploc_instance       | char(1)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(9, 1);
+      //| arrival               | char(5)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(10, 5);
+      //| departure             | char(5)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| pass                  | char(5)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| public_arrival        | char(4)              | NO   |     | NULL    |       |
+      if(strncmp(c + 15, "0000", 4)) EXTRACT_APPEND(15, 4)
+         else strcat(query, ", ''");
+      //| public_departure      | char(4)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| sort_time             | smallint(5) unsigned | NO   |     | NULL    |       |
+      //| next_day              | tinyint(1)           | NO   |     | NULL    |       |
+      sort_time = get_sort_time(c + 10);
+      sprintf(zs, ", %d, %d", sort_time, (sort_time < origin_sort_time)?1:0);
+      strcat(query, zs);
+      //| platform              | char(3)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(19, 3);
+      //| line                  | char(3)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| path                  | char(3)              | NO   |     | NULL    |       |
+      EXTRACT_APPEND(22, 3);
+      //| engineering_allowance | char(2)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| pathing_allowance     | char(2)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      //| performance_allowance | char(2)              | NO   |     | NULL    |       |
+      strcat(query, ", ''");
+      strcat(query, ")");
+   }
+   return sort_time;
+}
+
+static void cr_row(const char * const c, char * const query)
+{
+   // Build the cif_changes_en_route row from a CR card, following on from "(schedule_id".
+   query[0] = '\0';
+   //| tiploc_code                   | char(7)          | NO   | MUL | NULL    |       |
+   EXTRACT_APPEND(2, 7);
+   //| tiploc_instance               | char(1)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(9, 1);
+   //| CIF_train_category            | char(2)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(10, 2);
+   //| signalling_id                 | char(4)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(12, 4);
+   //| CIF_headcode                  | char(4)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(16, 4);
+   //| CIF_train_service_code        | char(8)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(21, 8);
+   //| CIF_power_type                | char(3)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(30, 3);
+   //| CIF_timing_load               | char(4)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(33, 4);
+   //| CIF_speed                     | char(3)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(37, 3);
+   //| CIF_operating_characteristics | char(6)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(40, 6);
+   //| CIF_train_class               | char(1)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(46, 1);
+   //| CIF_sleepers                  | char(1)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(47, 1);
+   //| CIF_reservations              | char(1)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(48, 1);
+   //| CIF_connection_indicator      | char(1)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(49, 1);
+   //| CIF_catering_code             | char(4)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(50, 4);
+   //| CIF_service_branding          | char(4)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(54, 4);
+   //| uic_code                      | char(5)          | NO   |     | NULL    |       |
+   EXTRACT_APPEND(62, 5);
+   strcat(query, ")");
+}
+
+static void schedule_row(const char * const c, const char * const bx, char * const query)
+{
+   // Build the cif_schedules row "(...", up to but not including the id, from a BS card and, if available, its BX card.
+   char zs[128];
+
+#define BX_APPEND(a,b) { if(bx) { strcat(query, ", '"); strncat(query, bx + (a), (b)); strcat(query, "'"); } else strcat(query, ", ''"); }
+   sprintf(query, "(%d, %ld, %lu", update_id, start_time, NOT_DELETED);
+
+   // CIF_bank_holiday_running      | char(1)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(28, 1);
+   // CIF_stp_indicator             | char(1)              | NO   | MUL | NULL    |                |
+   EXTRACT_APPEND(79, 1);
+   // CIF_train_uid                 | char(6)              | NO   | MUL | NULL    |                |
+   EXTRACT_APPEND( 3, 6);
+   // applicable_timetable          | char(1)              | NO   |     | NULL    |                |
+   BX_APPEND(13, 1);
+   // atoc_code                     | char(2)              | NO   |     | NULL    |                |
+   BX_APPEND(11, 2);
+   // uic_code                      | char(5)              | NO   |     | NULL    |                |
+   BX_APPEND( 6, 5);
+   // runs_mo                       | tinyint(1)           | NO   |     | NULL    |                |
+   EXTRACT_APPEND(21, 1);
+   // runs_tu                       | tinyint(1)           | NO   |     | NULL    |                |
+   EXTRACT_APPEND(22, 1);
+   // runs_we                       | tinyint(1)           | NO   |     | NULL    |                |
+   EXTRACT_APPEND(23, 1);
+   // runs_th                       | tinyint(1)           | NO   |     | NULL    |                |
+   EXTRACT_APPEND(24, 1);
+   // runs_fr                       | tinyint(1)           | NO   |     | NULL    |                |
+   EXTRACT_APPEND(25, 1);
+   // runs_sa                       | tinyint(1)           | NO   |     | NULL    |                |
+   EXTRACT_APPEND(26, 1);
+   // runs_su                       | tinyint(1)           | NO   |     | NULL    |                |
+   EXTRACT_APPEND(27, 1);
+   // schedule_end_date             | int(10) unsigned     | NO   | MUL | NULL    |                |
+   sprintf(zs, ", %ld", extract_CIF_datestamp(c, 15));
+   strcat(query, zs);
+   // signalling_id                 | char(4)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(32, 4);
+   // CIF_train_category            | char(2)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(30, 2);
+   // CIF_headcode                  | char(4)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(36, 4);
+   // CIF_train_service_code        | char(8)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(41, 8);
+   // CIF_business_sector           | char(1)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(49, 1);
+   // CIF_power_type                | char(3)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(50, 3);
+   // CIF_timing_load               | char(4)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(53, 4);
+   // CIF_speed                     | char(3)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(57, 3);
+   // CIF_operating_characteristics | char(6)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(60, 6);
+   // CIF_train_class               | char(1)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(66, 1);
+   // CIF_sleepers                  | char(1)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(67, 1);
+   // CIF_reservations              | char(1)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(68, 1);
+   // CIF_connection_indicator      | char(1)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(69, 1);
+   // CIF_catering_code             | char(4)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(70, 4);
+   // CIF_service_branding          | char(4)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(74, 4);
+   // schedule_start_date           | int(10) unsigned     | NO   | MUL | NULL    |                |
+   sprintf(zs, ", %ld", extract_CIF_datestamp(c, 9));
+   strcat(query, zs);
+   // train_status                  | char(1)              | NO   |     | NULL    |                |
+   EXTRACT_APPEND(29, 1);
+}
+
 static word process_schedule_delete(const char * const c)
 {
    MYSQL_RES * result0, * result1;
@@ -1474,7 +2076,7 @@ static word process_schedule_delete(const char * const c)
       _log(MINOR, "Delete (%c) schedule CIF_train_uid = \"%s\", schedule_start_date = %s, CIF_stp_indicator = %s found %d matches.  All deleted.", c[2], CIF_train_uid, date_text(schedule_start_date, false), CIF_stp_indicator, num_rows);
       if(debug)
       {
-         _log(DEBUG, "\"%s\"", c);
+         _log(DEBUG, "\"%.80s\"", c);
 
          // Bodge!
          query[7] = '*'; query[8] = ' ';
@@ -1496,6 +2098,8 @@ static word process_schedule_delete(const char * const c)
 
       if(conf[conf_huyton_alerts][0])
       {
+         // The locations may still be in the batch.
+         if(batch_flush()) return 1;
          sprintf(query, "SELECT next_day FROM cif_schedule_locations WHERE cif_schedule_id = %u AND (tiploc_code = 'HUYTON' OR tiploc_code = 'HUYTJUN')", id);
          if(!db_query(query))
          {
@@ -1531,12 +2135,185 @@ static word process_schedule_delete(const char * const c)
    else
    {
       stats[ScheduleDeleteMiss]++;
-      _log(MAJOR, "Delete schedule miss: \"%s\".", c);
+      _log(MAJOR, "Delete schedule miss: \"%.80s\".", c);
    }
    return 0;
 }
 
 
+static word batch_insert(const word table, const char * const row)
+{
+   // Add a row "(...)" to the batch for table, or in bulk load mode to its staging file.
+   if(bulk_load) return bulk_write(table, row);
+   return db_batch_insert(&batch[table], row);
+}
+
+static word batch_flush(void)
+{
+   word b;
+
+   for(b = 0; b < MAXBatch; b++)
+   {
+      if(db_batch_flush(&batch[b])) return 1;
+   }
+   return 0;
+}
+
+static void bulk_path(char * const path, const word table)
+{
+   sprintf(path, "%s/cifdb-load-%s.tsv", TEMP_DIRECTORY, batch_table[table]);
+}
+
+static word bulk_start(void)
+{
+   // Drop the secondary indexes, noting them so they can be rebuilt after the load, and open the staging files.
+   char path[256];
+   word b;
+
+   _log(GENERAL, "Bulk loading full timetable.");
+   bulk_schedule_id = 0;
+   bulk_schedule_card[0] = '\0';
+
+   for(b = 0; b < MAXBatch; b++)
+   {
+      if(db_drop_indexes(batch_table[b], bulk_indexes[b])) return 1;
+   }
+
+   for(b = 0; b < MAXBatch; b++)
+   {
+      bulk_path(path, b);
+      if(!(bulk_fp[b] = fopen(path, "w")))
+      {
+         _log(MAJOR, "bulk_start():  Failed to open \"%s\" for writing.  Error %d %s", path, errno, strerror(errno));
+         while(b--) fclose(bulk_fp[b]);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static word bulk_write(const word table, const char * const row)
+{
+   // Write a row "(1, 'a', ...)" to the staging file as a tab separated line.  Escapes within quoted values mean the same
+   // to LOAD DATA as they do in SQL, so are copied as they are.
+   char line[2048];
+   size_t l = 0;
+   const char * c = row + 1;
+
+   while(true)
+   {
+      while(*c == ' ') c++;
+      if(*c == '\'')
+      {
+         for(c++; *c && *c != '\''; c++)
+         {
+            if(*c == '\\' && c[1]) { line[l++] = *c++; line[l++] = *c; }
+            else if(*c == '\t') { line[l++] = '\\'; line[l++] = 't'; }
+            else line[l++] = *c;
+         }
+         if(*c) c++;
+      }
+      else
+      {
+         while(*c && *c != ',' && *c != ')' && *c != ' ') line[l++] = *c++;
+      }
+      while(*c == ' ') c++;
+      if(*c == ',')
+      {
+         line[l++] = '\t';
+         c++;
+      }
+      else if(*c == ')')
+      {
+         line[l++] = '\n';
+         break;
+      }
+      else
+      {
+         _log(MAJOR, "bulk_write():  Malformed row \"%s\".", row);
+         return 1;
+      }
+   }
+
+   if(fwrite(line, 1, l, bulk_fp[table]) != l)
+   {
+      _log(MAJOR, "bulk_write():  Failed to write to staging file.  Error %d %s", errno, strerror(errno));
+      return 1;
+   }
+   return 0;
+}
+
+static word bulk_write_schedule(const char * const bx)
+{
+   // Write the held schedule, if any, with its BX card if we have one.
+   char query[1024], zs[32];
+
+   if(!bulk_schedule_card[0]) return 0;
+
+   schedule_row(bulk_schedule_card, bx, query);
+   sprintf(zs, ", %u, '', '')", bulk_schedule_id);
+   strcat(query, zs);
+   bulk_schedule_card[0] = '\0';
+   return bulk_write(ScheduleBatch, query);
+}
+
+static word bulk_finish(const word abandon)
+{
+   // Close the staging files and, unless it failed or abandon is set, load them.  Then rebuild the indexes.
+   char path[256], query[1280];
+   word b, fail = abandon;
+   qword elapsed;
+
+   for(b = 0; b < MAXBatch; b++)
+   {
+      if(fclose(bulk_fp[b]))
+      {
+         _log(MAJOR, "bulk_finish():  Failed to close staging file.  Error %d %s", errno, strerror(errno));
+         fail = true;
+      }
+   }
+
+   for(b = 0; b < MAXBatch && run; b++)
+   {
+      if(!fail)
+      {
+         elapsed = time_ms();
+         bulk_path(path, b);
+         sprintf(query, "LOAD DATA LOCAL INFILE '%s' INTO TABLE %s", path, batch_table[b]);
+         if(db_query(query))
+         {
+            fail = true;
+         }
+         else
+         {
+            _log(GENERAL, "Loaded %s rows into %s in %s ms.", commas_q(db_affected_rows()), batch_table[b], commas_q(time_ms() - elapsed));
+         }
+      }
+
+      // The indexes are put back even if the load failed, so the tables are left as they were found.
+      if(bulk_indexes[b][0])
+      {
+         elapsed = time_ms();
+         if(db_rebuild_indexes(batch_table[b], bulk_indexes[b]))
+         {
+            fail = true;
+         }
+         else
+         {
+            _log(GENERAL, "Rebuilt indexes on %s in %s ms.", batch_table[b], commas_q(time_ms() - elapsed));
+         }
+      }
+   }
+
+   for(b = 0; b < MAXBatch; b++)
+   {
+      bulk_path(path, b);
+      unlink(path);
+   }
+
+   return fail || !run;
+}
+
 static word process_tiploc(const char * const c)
 {
    char query[1024], zs[128], zs1[256];
@@ -1551,6 +2328,7 @@ static word process_tiploc(const char * const c)
 
    case 'A': // TIPLOC Amend
       // Delete existing one.
+      if(batch_flush()) return 1;
       strcpy(zs, extract_field_s(c, 2, 7));
       sprintf(query, "SELECT * from cif_tiplocs WHERE tiploc_code = '%s' AND deleted > %ld", zs, start_time);
       if(db_query(query)) return 1;
@@ -1562,7 +2340,7 @@ static word process_tiploc(const char * const c)
       {
          if(num_rows > 1)
          {
-            _log(MINOR, "TD card \"%s\".", c);
+            _log(MINOR, "TD card \"%.80s\".", c);
             _log(MINOR, "   Delete (As part of amend) TIPLOC found %d matches.  All deleted.", num_rows);
          }
          sprintf(query, "UPDATE cif_tiplocs SET deleted = %ld WHERE tiploc_code = '%s' AND deleted > %ld", start_time, zs, start_time);
@@ -1571,12 +2349,13 @@ static word process_tiploc(const char * const c)
       }
       else
       {
-         _log(MINOR, "TD card \"%s\".", c);
+         _log(MINOR, "TD card \"%.80s\".", c);
          _log(MINOR, "   Delete (As part of amend) TIPLOC found no matches.");
          stats[TIPLOCAmendMiss]++;
       }
 
-      strcpy(zs, c);
+      memcpy(zs, c, CIF_CARD);
+      zs[CIF_CARD] = '\0';
       strcpy(zs1, extract_field_s(c, 72, 7));
       if(zs1[0] != ' ')
       {
@@ -1588,6 +2367,7 @@ static word process_tiploc(const char * const c)
       break;
 
    case 'D': // TIPLOC Delete
+      if(batch_flush()) return 1;
       strcpy(zs, extract_field_s(c, 2, 7));
       sprintf(query, "SELECT * from cif_tiplocs WHERE tiploc_code = '%s' AND deleted > %ld", zs, start_time);
       if(db_query(query)) return 1;
@@ -1599,7 +2379,7 @@ static word process_tiploc(const char * const c)
       {
          if(num_rows > 1)
          {
-            _log(MINOR, "TD card \"%s\".", c);
+            _log(MINOR, "TD card \"%.80s\".", c);
             _log(MINOR, "   Delete TIPLOC found %d matches.  All deleted.", num_rows);
          }
          sprintf(query, "UPDATE cif_tiplocs SET deleted = %ld WHERE tiploc_code = '%s' AND deleted > %ld", start_time, zs, start_time);
@@ -1608,14 +2388,14 @@ static word process_tiploc(const char * const c)
       }
       else
       {
-         _log(MINOR, "TD card \"%s\".", c);
+         _log(MINOR, "TD card \"%.80s\".", c);
          _log(MINOR, "   Delete TIPLOC found no matches.");
          stats[TIPLOCDeleteMiss]++;
       }
       break;
 
    default:
-      _log(MAJOR, "Unexpected card \"%s\".", c);
+      _log(MAJOR, "Unexpected card \"%.80s\".", c);
       return 1;
    }
 
@@ -1630,7 +2410,7 @@ static word create_tiploc(const char * const c)
    //"update_id                     SMALLINT UNSIGNED NOT NULL,  "
    //"created                       INT UNSIGNED NOT NULL, "
    //"deleted                       INT UNSIGNED NOT NULL, "
-   sprintf(query, "INSERT INTO cif_tiplocs values(%d, %ld, %lu", update_id, start_time, NOT_DELETED);
+   sprintf(query, "(%d, %ld, %lu", update_id, start_time, NOT_DELETED);
 
    //"tiploc_code                   CHAR(7) NOT NULL, "
    EXTRACT_APPEND(2, 7);
@@ -1650,7 +2430,7 @@ static word create_tiploc(const char * const c)
    //"CAPRI_description             CHAR(16) NOT NULL, "
    EXTRACT_APPEND(56, 16);
    strcat(query, ")");
-   if(db_query(query)) return 1;
+   if(batch_insert(TIPLOCBatch, query)) return 1;
    stats[TIPLOCCreate]++;
    return 0;
 }
@@ -1664,6 +2444,21 @@ static char * tiploc_name(const char * const tiploc)
    MYSQL_ROW row;
    static char name[128];
 
+   if(corpus_available())
+   {
+      const char * fn = corpus_tiploc_name(tiploc);
+      if(fn)
+      {
+         strncpy(name, fn, 127);
+         name[127] = '\0';
+      }
+      else
+      {
+         strcpy(name, tiploc);
+      }
+      return name;
+   }
+
    sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
    db_query(query);
    result = db_store_result();
@@ -1700,6 +2495,15 @@ static char * extract_field_s(const char * const c, size_t s, size_t l)
    return result;
 }
 
+static time_t extract_CIF_datestamp(const char * const c, const size_t s)
+{
+   // Re-entrant equivalent of parse_CIF_datestamp(extract_field_s(c, s, 6))
+   char zs[8];
+
+   extract_field(c, s, 6, zs);
+   return parse_CIF_datestamp(zs);
+}
+
 static time_t parse_CIF_datestamp(const char * const s)
 {
    // Only works for yymmdd
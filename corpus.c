@@ -0,0 +1,494 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <mysql.h>
+
+#include "misc.h"
+#include "db.h"
+#include "corpus.h"
+
+#define CORPUS_MAGIC      "CORPUS1"
+#define CORPUS_PATH       "/var/lib/garner/corpus.map"
+#define CORPUS_PATH_DEBUG "/tmp/corpus.map"
+// A long running program looks for a new file at most this often, in seconds.
+#define CORPUS_CHECK_INTERVAL 60
+
+// Each index is a perfect hash, by hash and displace.  The key's bucket gives a displacement, which with the key gives
+// its slot, which holds the entry number.  Every key in the file has a slot of its own, so a lookup is two probes and a
+// comparison.
+enum corpus_indexes {TiplocIndex, StanoxIndex, AlphaIndex, MAXIndex};
+
+struct corpus_header
+{
+   char magic[8];
+   dword entries, entry_offset, names_offset, names_size;
+   struct
+   {
+      dword slots, buckets, disp_offset, slot_offset;
+   } index[MAXIndex];
+};
+
+static const char * map;
+static size_t map_size;
+static const struct corpus_header * header;
+static ino_t map_ino;
+static time_t map_mtime, map_checked;
+static word map_failed;
+
+static const char * corpus_path(void);
+static word corpus_attach(void);
+static size_t corpus_key(const word index, const char * const s, const dword stanox, byte * const key);
+static dword corpus_hash(const byte * const key, const size_t length, const dword seed);
+static const struct corpus_entry * corpus_lookup(const word index, const char * const s, const dword stanox);
+
+word corpus_available(void)
+{
+   return corpus_attach();
+}
+
+const struct corpus_entry * corpus_tiploc(const char * const tiploc)
+{
+   return corpus_lookup(TiplocIndex, tiploc, 0);
+}
+
+const struct corpus_entry * corpus_stanox(const dword stanox)
+{
+   return corpus_lookup(StanoxIndex, NULL, stanox);
+}
+
+const struct corpus_entry * corpus_3alpha(const char * const alpha)
+{
+   return corpus_lookup(AlphaIndex, alpha, 0);
+}
+
+const char * corpus_name(const struct corpus_entry * const entry)
+{
+   // The names block is checked to end with a NUL when it is mapped, so a name within it is terminated.
+   if(entry->fn >= header->names_size) return "";
+   return map + header->names_offset + entry->fn;
+}
+
+const char * corpus_tiploc_name(const char * const tiploc)
+{
+   const struct corpus_entry * entry = corpus_tiploc(tiploc);
+   if(entry && corpus_name(entry)[0]) return corpus_name(entry);
+   return NULL;
+}
+
+const char * corpus_stanox_name(const dword stanox)
+{
+   const struct corpus_entry * entry = corpus_stanox(stanox);
+   if(entry && corpus_name(entry)[0]) return corpus_name(entry);
+   return NULL;
+}
+
+static const char * corpus_path(void)
+{
+   if(conf[conf_corpus_map][0]) return conf[conf_corpus_map];
+   return *conf[conf_debug] ? CORPUS_PATH_DEBUG : CORPUS_PATH;
+}
+
+static word corpus_attach(void)
+{
+   // Map the file, or a newer one if corpusdb has replaced it.  Returns true if a file is mapped.
+   struct stat st;
+   int fd;
+   const char * new_map;
+   const struct corpus_header * h;
+   time_t now = time(NULL);
+   word i;
+
+   if(map && now < map_checked + CORPUS_CHECK_INTERVAL) return true;
+   map_checked = now;
+
+   if(stat(corpus_path(), &st))
+   {
+      if(!map && !map_failed) _log(MINOR, "Corpus lookup file \"%s\" not available.  Error %d %s", corpus_path(), errno, strerror(errno));
+      map_failed = true;
+      return map != NULL;
+   }
+   if(map && st.st_ino == map_ino && st.st_mtime == map_mtime) return true;
+
+   if((fd = open(corpus_path(), O_RDONLY)) < 0) return map != NULL;
+   new_map = (st.st_size < sizeof(struct corpus_header)) ? MAP_FAILED : mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(new_map == MAP_FAILED)
+   {
+      if(!map_failed) _log(MAJOR, "Failed to map corpus lookup file \"%s\".", corpus_path());
+      map_failed = true;
+      return map != NULL;
+   }
+
+   // Check the header before trusting any of it.
+   h = (const struct corpus_header *) new_map;
+   word bad = strcmp(h->magic, CORPUS_MAGIC) ||
+      (size_t) h->entry_offset + (size_t) h->entries * sizeof(struct corpus_entry) > st.st_size ||
+      (size_t) h->names_offset + h->names_size > st.st_size ||
+      (h->names_size && new_map[(size_t) h->names_offset + h->names_size - 1]);
+   for(i = 0; i < MAXIndex && !bad; i++)
+   {
+      if((h->index[i].slots && !h->index[i].buckets) ||
+         (size_t) h->index[i].disp_offset + (size_t) h->index[i].buckets * sizeof(dword) > st.st_size ||
+         (size_t) h->index[i].slot_offset + (size_t) h->index[i].slots * sizeof(dword) > st.st_size)
+         bad = true;
+   }
+   if(bad)
+   {
+      if(!map_failed) _log(MAJOR, "Corpus lookup file \"%s\" is damaged.", corpus_path());
+      map_failed = true;
+      munmap((void *) new_map, st.st_size);
+      return map != NULL;
+   }
+
+   if(map) munmap((void *) map, map_size);
+   map = new_map;
+   map_size = st.st_size;
+   header = h;
+   map_ino = st.st_ino;
+   map_mtime = st.st_mtime;
+   map_failed = false;
+   _log(DEBUG, "Mapped corpus lookup file, %u entries.", header->entries);
+   return true;
+}
+
+static size_t corpus_key(const word index, const char * const s, const dword stanox, byte * const key)
+{
+   // Form the key in key[CORPUS_KEY], upper case without trailing spaces.  Returns its length, 0 if there isn't one.
+   size_t length = 0;
+
+   if(index == StanoxIndex)
+   {
+      if(!stanox) return 0;
+      memcpy(key, &stanox, sizeof(stanox));
+      return sizeof(stanox);
+   }
+
+   while(s[length] && length < CORPUS_KEY)
+   {
+      key[length] = toupper((byte) s[length]);
+      length++;
+   }
+   if(s[length]) return 0;
+   while(length && key[length - 1] == ' ') length--;
+   return length;
+}
+
+static dword corpus_hash(const byte * const key, const size_t length, const dword seed)
+{
+   // FNV-1a, seeded, with a final mix so that the low bits are usable.
+   dword hash = 2166136261u ^ seed;
+   size_t i;
+
+   for(i = 0; i < length; i++)
+   {
+      hash ^= key[i];
+      hash *= 16777619u;
+   }
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6bu;
+   hash ^= hash >> 13;
+   hash *= 0xc2b2ae35u;
+   hash ^= hash >> 16;
+   return hash;
+}
+
+static const struct corpus_entry * corpus_lookup(const word index, const char * const s, const dword stanox)
+{
+   byte key[CORPUS_KEY], found[CORPUS_KEY];
+   size_t length;
+   const struct corpus_entry * entry;
+
+   if(!corpus_attach()) return NULL;
+   if(!header->index[index].slots) return NULL;
+   if(!(length = corpus_key(index, s, stanox, key))) return NULL;
+
+   const dword * const disp = (const dword *) (map + header->index[index].disp_offset);
+   const dword * const slot = (const dword *) (map + header->index[index].slot_offset);
+   dword d = disp[corpus_hash(key, length, 0) % header->index[index].buckets];
+   dword e = slot[corpus_hash(key, length, d) % header->index[index].slots];
+   if(e >= header->entries) return NULL;
+   entry = (const struct corpus_entry *) (map + header->entry_offset) + e;
+
+   // The slot may belong to a different key.
+   switch(index)
+   {
+   case TiplocIndex: if(corpus_key(index, entry->tiploc, 0, found) != length) return NULL; break;
+   case AlphaIndex:  if(corpus_key(index, entry->alpha, 0, found) != length) return NULL; break;
+   case StanoxIndex: corpus_key(index, NULL, entry->stanox, found); break;
+   }
+   if(memcmp(key, found, length)) return NULL;
+   return entry;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Build
+
+struct build_key
+{
+   dword entry, bucket;
+   size_t length;
+   byte key[CORPUS_KEY];
+};
+
+static int build_key_compare(const void * a, const void * b)
+{
+   // By key, then entry number so the first row comes first.
+   const struct build_key * x = a, * y = b;
+   if(x->length != y->length) return (x->length < y->length) ? -1 : 1;
+   int r = memcmp(x->key, y->key, x->length);
+   if(r) return r;
+   return (x->entry < y->entry) ? -1 : (x->entry > y->entry);
+}
+
+static const dword * bucket_count;
+static int build_bucket_compare(const void * a, const void * b)
+{
+   // Largest bucket first.
+   const dword x = *(const dword *) a, y = *(const dword *) b;
+   if(bucket_count[x] != bucket_count[y]) return (bucket_count[x] > bucket_count[y]) ? -1 : 1;
+   return (x > y) - (x < y);
+}
+
+static int build_key_bucket_compare(const void * a, const void * b)
+{
+   const struct build_key * x = a, * y = b;
+   return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+static word build_index(const word index, const struct corpus_entry * const entries, const dword count, dword ** const disp_out, dword ** const slot_out, dword * const slots_out, dword * const buckets_out)
+{
+   // Build the perfect hash for one index.  Returns non-zero on failure.
+   struct build_key * keys;
+   dword * disp, * slot, * counts, * order, * start;
+   byte * used;
+   dword n, e, b, i, j, buckets, d;
+   word result = 0;
+
+   *disp_out = *slot_out = NULL;
+   *slots_out = *buckets_out = 0;
+
+   if(!(keys = malloc((count + 1) * sizeof(struct build_key)))) return 1;
+   for(n = e = 0; e < count; e++)
+   {
+      const char * s = (index == TiplocIndex) ? entries[e].tiploc : entries[e].alpha;
+      if((keys[n].length = corpus_key(index, s, entries[e].stanox, keys[n].key)))
+      {
+         keys[n++].entry = e;
+      }
+   }
+
+   // Keep the first row for each key.
+   qsort(keys, n, sizeof(struct build_key), build_key_compare);
+   for(i = j = 0; i < n; i++)
+   {
+      if(!j || keys[i].length != keys[j - 1].length || memcmp(keys[i].key, keys[j - 1].key, keys[i].length)) keys[j++] = keys[i];
+   }
+   n = j;
+   if(!n)
+   {
+      free(keys);
+      return 0;
+   }
+
+   buckets = n / 4 + 1;
+   disp    = calloc(buckets, sizeof(dword));
+   slot    = malloc(n * sizeof(dword));
+   counts  = calloc(buckets, sizeof(dword));
+   order   = malloc(buckets * sizeof(dword));
+   start   = malloc((buckets + 1) * sizeof(dword));
+   used    = calloc(n, 1);
+   if(!disp || !slot || !counts || !order || !start || !used)
+   {
+      result = 1;
+   }
+   else
+   {
+      for(i = 0; i < n; i++)
+      {
+         keys[i].bucket = corpus_hash(keys[i].key, keys[i].length, 0) % buckets;
+         counts[keys[i].bucket]++;
+      }
+      qsort(keys, n, sizeof(struct build_key), build_key_bucket_compare);
+      for(b = i = 0; b < buckets; b++)
+      {
+         start[b] = i;
+         i += counts[b];
+         order[b] = b;
+      }
+      start[buckets] = n;
+      bucket_count = counts;
+      qsort(order, buckets, sizeof(dword), build_bucket_compare);
+
+      for(b = 0; b < buckets && !result && counts[order[b]]; b++)
+      {
+         const dword bucket = order[b];
+         for(d = 1; d; d++)
+         {
+            // Try this displacement.  A clash within the bucket is spotted by marking slots as they are tried.
+            for(i = start[bucket]; i < start[bucket + 1]; i++)
+            {
+               dword s = corpus_hash(keys[i].key, keys[i].length, d) % n;
+               if(used[s]) break;
+               used[s] = 1;
+               slot[s] = keys[i].entry;
+            }
+            if(i == start[bucket + 1]) break;
+            for(j = start[bucket]; j < i; j++) used[corpus_hash(keys[j].key, keys[j].length, d) % n] = 0;
+         }
+         if(!d) result = 1;
+         disp[bucket] = d;
+      }
+   }
+
+   free(keys); free(counts); free(order); free(start); free(used);
+   if(result)
+   {
+      free(disp); free(slot);
+      return result;
+   }
+   *disp_out = disp;
+   *slot_out = slot;
+   *slots_out = n;
+   *buckets_out = buckets;
+   return 0;
+}
+
+word corpus_build(void)
+{
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   struct corpus_header h;
+   struct corpus_entry * entries;
+   char * names;
+   dword count, e, * disp[MAXIndex], * slot[MAXIndex];
+   size_t names_size, names_length, offset;
+   char path[256];
+   FILE * fp;
+   word i, fail = false;
+
+   _log(GENERAL, "Building corpus lookup file.");
+
+   if(db_query("SELECT tiploc, stanox, 3alpha, fn FROM corpus ORDER BY id")) return 1;
+   result = db_store_result();
+   count = mysql_num_rows(result);
+
+   names_size = 1024 * 1024;
+   entries = malloc((count + 1) * sizeof(struct corpus_entry));
+   names = malloc(names_size);
+   if(!entries || !names)
+   {
+      _log(CRITICAL, "corpus_build():  Out of memory.");
+      free(entries); free(names);
+      mysql_free_result(result);
+      return 1;
+   }
+
+   names_length = 0;
+   for(e = 0; e < count && (row = mysql_fetch_row(result)); e++)
+   {
+      size_t l = strlen(row[3]) + 1;
+      memset(&entries[e], 0, sizeof(struct corpus_entry));
+      // A key too long for the entry is left out of its index.
+      if(strlen(row[0]) < CORPUS_KEY) strcpy(entries[e].tiploc, row[0]);
+      if(strlen(row[2]) < CORPUS_KEY) strcpy(entries[e].alpha, row[2]);
+      entries[e].stanox = atol(row[1]);
+      if(names_length + l > names_size)
+      {
+         char * n = realloc(names, names_size *= 2);
+         if(!n) { fail = true; break; }
+         names = n;
+      }
+      entries[e].fn = names_length;
+      memcpy(names + names_length, row[3], l);
+      names_length += l;
+   }
+   mysql_free_result(result);
+   count = e;
+
+   for(i = 0; i < MAXIndex; i++) disp[i] = slot[i] = NULL;
+
+   memset(&h, 0, sizeof(h));
+   strcpy(h.magic, CORPUS_MAGIC);
+   h.entries = count;
+   offset = sizeof(h);
+   h.entry_offset = offset;
+   offset += count * sizeof(struct corpus_entry);
+   for(i = 0; i < MAXIndex && !fail; i++)
+   {
+      if(build_index(i, entries, count, &disp[i], &slot[i], &h.index[i].slots, &h.index[i].buckets))
+      {
+         _log(CRITICAL, "corpus_build():  Failed to build index %d.", i);
+         fail = true;
+      }
+      h.index[i].disp_offset = offset;
+      offset += h.index[i].buckets * sizeof(dword);
+      h.index[i].slot_offset = offset;
+      offset += h.index[i].slots * sizeof(dword);
+   }
+   h.names_offset = offset;
+   h.names_size = names_length;
+
+   // Written alongside and renamed, so that readers never see a partial file.
+   sprintf(path, "%s.new", corpus_path());
+   if(!fail && !(fp = fopen(path, "w")))
+   {
+      _log(MAJOR, "corpus_build():  Failed to open \"%s\" for writing.  Error %d %s", path, errno, strerror(errno));
+      fail = true;
+   }
+   if(!fail)
+   {
+      fwrite(&h, sizeof(h), 1, fp);
+      fwrite(entries, sizeof(struct corpus_entry), count, fp);
+      for(i = 0; i < MAXIndex; i++)
+      {
+         fwrite(disp[i], sizeof(dword), h.index[i].buckets, fp);
+         fwrite(slot[i], sizeof(dword), h.index[i].slots, fp);
+      }
+      fwrite(names, 1, names_length, fp);
+      if(ferror(fp) | fclose(fp))
+      {
+         _log(MAJOR, "corpus_build():  Failed to write \"%s\".", path);
+         fail = true;
+      }
+      else if(rename(path, corpus_path()))
+      {
+         _log(MAJOR, "corpus_build():  Failed to rename \"%s\".  Error %d %s", path, errno, strerror(errno));
+         fail = true;
+      }
+      if(fail) unlink(path);
+   }
+
+   for(i = 0; i < MAXIndex; i++) { free(disp[i]); free(slot[i]); }
+   free(entries);
+   free(names);
+
+   if(!fail) _log(GENERAL, "Corpus lookup file built, %u entries, %zu bytes.", count, offset + names_length);
+   return fail;
+}
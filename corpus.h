@@ -0,0 +1,46 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Read-only lookup file holding the whole of the corpus table, written by corpusdb and mapped by everything else.
+// A lookup finds the row, lowest id first, that "SELECT ... FROM corpus WHERE <key> = ..." would return.  Keys are
+// matched ignoring case and trailing spaces, as MySQL does.
+
+#define CORPUS_KEY 16
+
+struct corpus_entry
+{
+   char tiploc[CORPUS_KEY], alpha[CORPUS_KEY];
+   dword stanox;
+   dword fn; // Offset of the name in the file.
+};
+
+// True if the file is mapped.  If it isn't, the lookups return NULL and callers should query the database instead.
+extern word corpus_available(void);
+// These return NULL if the key isn't found.
+extern const struct corpus_entry * corpus_tiploc(const char * const tiploc);
+extern const struct corpus_entry * corpus_stanox(const dword stanox);
+extern const struct corpus_entry * corpus_3alpha(const char * const alpha);
+extern const char * corpus_name(const struct corpus_entry * const entry);
+// The name for a TIPLOC or STANOX, or NULL if it isn't found or has no name.
+extern const char * corpus_tiploc_name(const char * const tiploc);
+extern const char * corpus_stanox_name(const dword stanox);
+
+// Rewrite the file from the corpus table.  Returns non-zero on failure.
+extern word corpus_build(void);
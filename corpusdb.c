@@ -28,11 +28,13 @@
 #include <curl/curl.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <zlib.h>
 
 #include "jsmn.h"
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME  "corpusdb"
@@ -66,12 +68,17 @@ static const char * const stats_category[MAXStats] =
 static word fetch_corpus(void);
 static size_t corpus_write_data(void *buffer, size_t size, size_t nmemb, void *userp);
 static word process_corpus(void);
-static void process_corpus_object(const char * object_string);
+static word process_corpus_object(const char * object_string);
 static word update_friendly_names(void);
+static word install_corpus(void);
 
 word opt_insecure, used_insecure, opt_verbose;
 word id_number;
 
+// The new data is loaded into corpus_new, which install_corpus() swaps in.
+static struct db_batch batch;
+static char new_indexes[DB_INDEXES_SIZE];
+
 int main(int argc, char **argv)
 {
    int c;
@@ -161,7 +168,7 @@ int main(int argc, char **argv)
    // Initialise database
    if(db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name])) exit(1);
 
-   if(!fetch_corpus() && !process_corpus() && !update_friendly_names())
+   if(!fetch_corpus() && !process_corpus() && !update_friendly_names() && !install_corpus())
    {
       db_disconnect();
       char report[8192];
@@ -190,6 +197,7 @@ int main(int argc, char **argv)
    }
    else
    {
+      db_query("DROP TABLE IF EXISTS corpus_new");
       email_alert(NAME, BUILD, "Corpus Update Failure Report", "Corpus update failed.  See log file for details.");
    }
    db_disconnect();
@@ -289,18 +297,7 @@ static word fetch_corpus(void)
    if(slist) curl_slist_free_all(slist);
    slist = NULL;
 
-   if(!result)
-   {
-      // Uncompress
-      char * r;
-      _log(GENERAL, "Uncompressing downloaded data.");
-      sprintf(zs, "/bin/gunzip -f %s", filepath_z);
-      if((r = system_call(zs)))
-      {
-         _log(MAJOR, "Failed to uncompress file:  %s", r);
-         result = 5;
-      }
-   }
+   // The file is decompressed as it is read.
    return result;
 }
 
@@ -325,6 +322,7 @@ static size_t corpus_write_data(void *buffer, size_t size, size_t nmemb, void *u
 static word process_corpus(void)
 {
    char zs[1024];
+   word fail = false;
 
 #define MAX_BUF 32768
    char buffer[MAX_BUF];
@@ -337,29 +335,35 @@ static word process_corpus(void)
    size_t iobj = 0;
    size_t buf_end;
 
-   FILE * fp;
+   gzFile fp;
    
 
    // Read in json data
-   if(!(fp = fopen(filepath, "r")))
+   if(!(fp = gzopen(filepath_z, "r")))
    {
-      sprintf(zs, "Failed to open \"%s\" for reading.", filepath);
+      sprintf(zs, "Failed to open \"%s\" for reading.", filepath_z);
       _log(CRITICAL, zs);
       return 11;
    }      
 
-   // Reset the database
+   // Build the new table
    database_upgrade(corpusdb);
+   if(db_query("DROP TABLE IF EXISTS corpus_new") || db_query("CREATE TABLE corpus_new LIKE corpus") || db_drop_indexes("corpus_new", new_indexes))
+   {
+      gzclose(fp);
+      return 13;
+   }
+
    db_start_transaction();
-   db_query("DELETE FROM corpus");
+   db_batch_init(&batch, "INSERT INTO corpus_new VALUES", NULL);
    id_number = 1;
 
    _log(GENERAL, "Processing CORPUS data.");
 
    // Bodge:  Bin off the array stuff
-   buf_end = fread(buffer, 1, 15, fp);
+   buf_end = gzfread(buffer, 1, 15, fp);
 
-   while((buf_end = fread(buffer, 1, MAX_BUF, fp)))
+   while(!fail && (buf_end = gzfread(buffer, 1, MAX_BUF, fp)))
    {
       for(ibuf = 0; ibuf < buf_end; ibuf++)
       {
@@ -377,28 +381,67 @@ static word process_corpus(void)
          if(!in_q && c == '}' && b_depth-- && b_depth == 0)
          {
             obj[iobj] = '\0';
-            process_corpus_object(obj);
+            if(process_corpus_object(obj)) fail = true;
             iobj = 0;
          }
       }
    }
 
-   fclose(fp);
+   int error;
+   const char * message = gzerror(fp, &error);
+   if(error != Z_OK)
+   {
+      _log(CRITICAL, "Failed to uncompress file:  %s", message);
+      gzclose(fp);
+      db_rollback_transaction();
+      return 12;
+   }
+
+   gzclose(fp);
+   if(fail || db_batch_flush(&batch))
+   {
+      db_rollback_transaction();
+      return 13;
+   }
+   db_commit_transaction();
+
+   if(!stats[Locations])
+   {
+      _log(CRITICAL, "No locations found in CORPUS data.");
+      return 14;
+   }
+
+   if(new_indexes[0])
+   {
+      _log(GENERAL, "Building indexes.");
+      if(db_rebuild_indexes("corpus_new", new_indexes)) return 13;
+   }
+
    return 0;
-   
 }
 
-#define EXTRACT_APPEND_SQL(a) { jsmn_find_extract_token(object_string, tokens, 0, a, zs, sizeof( zs )); \
-if(zs[1] == '\0' && zs[0] == ' ') zs[0] = '\0'; \
-db_real_escape_string(zs1, zs, strlen(zs)); \
+#define APPEND_SQL(a) { \
+if(a[1] == '\0' && a[0] == ' ') a[0] = '\0'; \
+db_real_escape_string(zs1, a, strlen(a)); \
 strcat(query, ", '"); strcat(query, zs1); strcat(query, "'"); }
-#define EXTRACT_APPEND_SQL_INT(a) { jsmn_find_extract_token(object_string, tokens, 0, a, zs, sizeof( zs )); \
-if(zs[1] == '\0' && zs[0] == ' ') zs[0] = '0'; \
-db_real_escape_string(zs1, zs, strlen(zs)); \
+#define APPEND_SQL_INT(a) { \
+if(a[1] == '\0' && a[0] == ' ') a[0] = '0'; \
+db_real_escape_string(zs1, a, strlen(a)); \
 strcat(query, ", "); strcat(query, zs1); }
 
-static void process_corpus_object(const char * object_string)
+struct corpus
+{
+   char stanox[128], uic[128], alpha[128], nlcdesc16[128], tiploc[128], nlc[128], nlcdesc[128];
+};
+static const jsmnfield_t corpus_fields[] =
+{
+   JSMN_FIELD(struct corpus, stanox), JSMN_FIELD(struct corpus, uic), JSMN_FIELD_NAMED(struct corpus, alpha, "3alpha"),
+   JSMN_FIELD(struct corpus, nlcdesc16), JSMN_FIELD(struct corpus, tiploc), JSMN_FIELD(struct corpus, nlc), JSMN_FIELD(struct corpus, nlcdesc),
+};
+
+static word process_corpus_object(const char * object_string)
 {
+   // Returns non-zero if the database failed.
    char zs[1024], zs1[1024];
 
    jsmn_parser parser;
@@ -423,32 +466,34 @@ static void process_corpus_object(const char * object_string)
       }
       
       _log(MAJOR, zs);
-      return;
+      return 0;
    }
 
    char query[2048];
-   char nlcdesc16[1024];
+   struct corpus c;
+
+   jsmn_extract_fields(object_string, tokens, 0, corpus_fields, JSMN_FIELDS(corpus_fields), &c);
 
-   sprintf(query, "INSERT INTO corpus VALUES(%d, ''", id_number++); // ID and friendly name
-   EXTRACT_APPEND_SQL_INT("stanox");
-   EXTRACT_APPEND_SQL("uic");
-   EXTRACT_APPEND_SQL("3alpha");
+   sprintf(query, "(%d, ''", id_number++); // ID and friendly name
+   APPEND_SQL_INT(c.stanox);
+   APPEND_SQL(c.uic);
+   APPEND_SQL(c.alpha);
    
-   jsmn_find_extract_token(object_string, tokens, 0, "nlcdesc16", nlcdesc16, sizeof(nlcdesc16));
-   db_real_escape_string(zs1, nlcdesc16, strlen(nlcdesc16));
+   db_real_escape_string(zs1, c.nlcdesc16, strlen(c.nlcdesc16));
    strcat(query, ", '"); 
    if(zs1[0] == ' ') strcat(query, zs1 + 1); 
    else strcat(query, zs1);
       strcat(query, "'");
-   EXTRACT_APPEND_SQL("tiploc");
-   EXTRACT_APPEND_SQL("nlc");
-   EXTRACT_APPEND_SQL("nlcdesc");
+   APPEND_SQL(c.tiploc);
+   APPEND_SQL(c.nlc);
+   APPEND_SQL(c.nlcdesc);
 
    strcat(query, ")");
 
-   if(!db_query(query)) stats[Locations]++;
+   if(db_batch_insert(&batch, query)) return 1;
+   stats[Locations]++;
 
-   return;
+   return 0;
 }
 
 static word update_friendly_names(void)
@@ -474,7 +519,8 @@ static word update_friendly_names(void)
    else
       _log(MAJOR, "No friendly names available in database.");
 
-   db_query("SELECT id, stanox, uic, 3alpha, tiploc, nlc, nlcdesc FROM corpus WHERE fn = ''");
+   db_start_transaction();
+   db_query("SELECT id, stanox, uic, 3alpha, tiploc, nlc, nlcdesc FROM corpus_new WHERE fn = ''");
 
    result0 = db_store_result();
 
@@ -491,7 +537,7 @@ static word update_friendly_names(void)
          if((row1 = mysql_fetch_row(result1)))
          {
             db_real_escape_string(location, row1[0], strlen(row1[0]));
-            sprintf(query, "UPDATE corpus set fn = '%s' where id = %s", location, row0[0]);
+            sprintf(query, "UPDATE corpus_new set fn = '%s' where id = %s", location, row0[0]);
             db_query(query);
             stats[FriendlyNames]++;
             done = true;
@@ -507,7 +553,7 @@ static word update_friendly_names(void)
          if((row1 = mysql_fetch_row(result1)))
          {
             db_real_escape_string(location, row1[0], strlen(row1[0]));
-            sprintf(query, "UPDATE corpus set fn = '%s' where id = %s", location, row0[0]);
+            sprintf(query, "UPDATE corpus_new set fn = '%s' where id = %s", location, row0[0]);
             db_query(query);
             stats[FriendlyNames]++;
            done = true;
@@ -523,7 +569,7 @@ static word update_friendly_names(void)
          if((row1 = mysql_fetch_row(result1)))
          {
             db_real_escape_string(location, row1[0], strlen(row1[0]));
-            sprintf(query, "UPDATE corpus set fn = '%s' where id = %s", location, row0[0]);
+            sprintf(query, "UPDATE corpus_new set fn = '%s' where id = %s", location, row0[0]);
             db_query(query);
             stats[FriendlyNames]++;
             done = true;
@@ -534,7 +580,7 @@ static word update_friendly_names(void)
       if(!done)
       {
          // Couldn't find any info
-         sprintf(query, "update corpus set fn = nlcdesc where id = %s", row0[0]);
+         sprintf(query, "update corpus_new set fn = nlcdesc where id = %s", row0[0]);
          // Don't count these ones. count_fns++;
          db_query(query);
       }
@@ -548,3 +594,16 @@ static word update_friendly_names(void)
    return result;
 }
 
+static word install_corpus(void)
+{
+   // Swap the new table in.
+   _log(GENERAL, "Installing new CORPUS table.");
+   if(db_query("DROP TABLE IF EXISTS corpus_old")) return 1;
+   if(db_query("RENAME TABLE corpus TO corpus_old, corpus_new TO corpus")) return 1;
+   db_query("DROP TABLE corpus_old");
+
+   // The lookup file is a convenience, the other programs query the table without it.
+   if(corpus_build()) _log(MAJOR, "Failed to build corpus lookup file.");
+   return 0;
+}
+
@@ -375,6 +375,49 @@ word database_upgrade(const word caller)
       _log(GENERAL, "Created database table \"cif_changes_en_route\".");
    }
 
+   // Day plans.  The calls at a location on a day, with cancellations and overlays resolved, saved by liverail.
+   if((caller == cifdb || caller == vstpdb) && !table_exists("day_plans"))
+   {
+      db_query(
+"CREATE TABLE day_plans                          "
+"(                                               "
+"id                            INT UNSIGNED NOT NULL AUTO_INCREMENT, "
+"tiploc_code                   CHAR(7) NOT NULL, "
+"day                           INT UNSIGNED NOT NULL, " // 12:00Z on the day.
+"created                       INT UNSIGNED NOT NULL, "
+"complete                      BOOLEAN NOT NULL, "
+"PRIMARY KEY (id), UNIQUE INDEX(tiploc_code, day) "
+") ENGINE = InnoDB"
+               );
+      _log(GENERAL, "Created database table \"day_plans\".");
+   }
+
+   if((caller == cifdb || caller == vstpdb) && !table_exists("day_plan_calls"))
+   {
+      db_query(
+"CREATE TABLE day_plan_calls                     "
+"(                                               "
+"day_plan_id                   INT UNSIGNED NOT NULL, "
+"cif_schedule_id               INT UNSIGNED NOT NULL, "
+"CIF_train_uid                 CHAR(6) NOT NULL, "
+"CIF_stp_indicator             CHAR(1) NOT NULL, "
+"train_status                  CHAR(1) NOT NULL, "
+"CIF_train_category            CHAR(2) NOT NULL, "
+"terminates                    BOOLEAN NOT NULL, "
+"arrival                       CHAR(5) NOT NULL, "
+"public_arrival                CHAR(4) NOT NULL, "
+"departure                     CHAR(5) NOT NULL, "
+"public_departure              CHAR(4) NOT NULL, "
+"pass                          CHAR(5) NOT NULL, "
+"sort_time                     SMALLINT UNSIGNED NOT NULL, "
+"next_day                      BOOLEAN NOT NULL, "
+"platform                      CHAR(3) NOT NULL, "
+"INDEX(day_plan_id) "
+") ENGINE = InnoDB"
+               );
+      _log(GENERAL, "Created database table \"day_plan_calls\".");
+   }
+
    if((caller == cifdb) && !table_exists("cif_tiplocs"))
    {
       db_query(
@@ -902,6 +945,28 @@ word database_upgrade(const word caller)
    return result;
 }
 
+word day_plans_invalidate(const char * const train_uid)
+{
+   // Remove the day plans of every location a train calls at, after any of its schedules has been created, changed or
+   // deleted.  train_uid NULL removes all of them, after a timetable update.  A plan being worked out at the time loses
+   // its day_plans row, so liverail won't mark it complete.  Nothing else removes the plans for past days, so those before
+   // yesterday go too.
+   static word exists;
+   char query[1024];
+   time_t now = time(NULL);
+   // day is 12:00Z on the day.
+   time_t yesterday = now - (now % (24*60*60)) + (12*60*60) - (24*60*60);
+
+   if(!exists && !(exists = table_exists("day_plans"))) return 0;
+
+   strcpy(query, "DELETE day_plans, day_plan_calls FROM day_plans LEFT JOIN day_plan_calls ON day_plan_calls.day_plan_id = day_plans.id");
+   if(train_uid)
+   {
+      sprintf(query + strlen(query), " WHERE day_plans.day < %ld OR day_plans.tiploc_code IN (SELECT tiploc_code FROM cif_schedule_locations INNER JOIN cif_schedules ON cif_schedule_locations.cif_schedule_id = cif_schedules.id WHERE cif_schedules.CIF_train_uid = '%s')", yesterday, train_uid);
+   }
+   return db_query(query);
+}
+
 static word table_exists(const char * const table_like)
 {
    MYSQL_RES * result;
@@ -21,3 +21,4 @@
 enum callers { cifdb, corpusdb, vstpdb, trustdb, tddb, archdb, smartdb, limed };
 
 extern word database_upgrade(const word caller);
+extern word day_plans_invalidate(const char * const train_uid);
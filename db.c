@@ -21,6 +21,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include "misc.h"
 #include "db.h"
 #include "jsmn.h"
@@ -29,8 +30,54 @@ static MYSQL * mysql_object;
 static char server[256], user[256], password[256], database[256];
 static word mode_flags;
 
+// Prepared statements.  The query is kept so the statement can be prepared again after a reconnect.
+#define DB_STATEMENTS 16
+#define DB_PARAMETERS 16
+#define DB_PARAMETER_SIZE 256
+static struct db_statement
+{
+   char * query;
+   struct db_shape * shape;
+   MYSQL_STMT * stmt;
+   word parameters;
+   MYSQL_BIND bind[DB_PARAMETERS];
+   long long integers[DB_PARAMETERS];
+   char strings[DB_PARAMETERS][DB_PARAMETER_SIZE];
+   unsigned long lengths[DB_PARAMETERS];
+} statements[DB_STATEMENTS];
+static word statement_count;
+
+// Query profile.  Every statement is timed and counted against its shape, which is the query with its literals replaced
+// by ? and lists of them collapsed, truncated to DB_SHAPE_SIZE.  Latencies are kept in a log2 histogram of milliseconds:
+// bucket 0 is under 1ms, bucket n is under 2^n ms, and the last bucket takes the rest.
+#define DB_SHAPES 256
+#define DB_SHAPE_SIZE 128
+#define DB_HISTOGRAM 16
+// Default for the db_slow_query config setting, in milliseconds.
+#define DB_SLOW_QUERY_MS 1000
+static struct db_shape
+{
+   char text[DB_SHAPE_SIZE];
+   dword hash;
+   qword count, total_us, max_us;
+   dword histogram[DB_HISTOGRAM];
+} shapes[DB_SHAPES + 1];
+static word shape_count;
+static qword slow_query_us;
+static time_t profile_start;
+static struct db_shape * db_shape(const char * const query);
+static void db_profile(struct db_shape * const shape, const char * const query, const qword start);
+
+// Liveness.  The connection is pinged before use only if it has been idle for this many seconds.
+#define DB_PING_INTERVAL 300
+static time_t last_used;
+static word in_transaction;
+static word db_live(void);
+
 /* Public data */
 word db_errored;
+// Requests sent to the server, for the callers' stats reports.
+qword db_round_trips;
 
 word db_init(const char * const s, const char * const u, const char * const p, const char * const d)
 {
@@ -47,6 +94,9 @@ word db_init(const char * const s, const char * const u, const char * const p, c
    mysql_object = 0;
    db_errored = false;
    mode_flags = DB_MODE_NORMAL;
+   slow_query_us = atol(conf[conf_db_slow_query]) * 1000L;
+   if(!slow_query_us) slow_query_us = DB_SLOW_QUERY_MS * 1000L;
+   profile_start = time(NULL);
 
    // Test if database is there
    return db_connect();
@@ -54,18 +104,15 @@ word db_init(const char * const s, const char * const u, const char * const p, c
 
 word db_query(const char * const query)
 {
-   if(strlen(query) > 4000)
-   {
-      _log(MAJOR, "db_query() called with overlong query.");
-      db_errored = true;
-      return 99;
-   }
-
    _log(PROC, "db_query(\"%s\")", query);
 
-   if(db_connect()) return 9;
+   if(db_live()) return 9;
    
-   if(mysql_query(mysql_object, query))
+   db_round_trips++;
+   qword start = time_us();
+   word r = mysql_real_query(mysql_object, query, strlen(query));
+   db_profile(NULL, query, start);
+   if(r)
    {
       _log(CRITICAL, "db_query():  mysql_query() Error %u: %s    Query:", mysql_errno(mysql_object), mysql_error(mysql_object));
       _log(CRITICAL, query);
@@ -77,6 +124,29 @@ word db_query(const char * const query)
    return 0;
 }
 
+word db_query_long(const char * const query, const size_t length)
+{
+   // As db_query() but with the length supplied, for multi-row INSERTs and the like.  Only the start of the query is logged.
+   _log(PROC, "db_query_long(\"%.200s...\", %ld)", query, length);
+
+   if(db_live()) return 9;
+
+   db_round_trips++;
+   qword start = time_us();
+   word r = mysql_real_query(mysql_object, query, length);
+   db_profile(NULL, query, start);
+   if(r)
+   {
+      _log(CRITICAL, "db_query_long():  mysql_real_query() Error %u: %s    Query:", mysql_errno(mysql_object), mysql_error(mysql_object));
+      _log(CRITICAL, "%.200s...", query);
+      db_errored = true;
+
+      db_disconnect();
+      return 3;
+   }
+   return 0;
+}
+
 MYSQL_RES * db_store_result(void)
 {
    if(mysql_object) return mysql_store_result(mysql_object);
@@ -92,7 +162,6 @@ MYSQL_RES * db_use_result(void)
 qword db_affected_rows(void)
 {
    _log(PROC, "db_affected_rows()");
-   if(db_connect()) return 0LL;
 
    if(mysql_object) return mysql_affected_rows(mysql_object);
    
@@ -104,29 +173,12 @@ word db_row_count(void)
    // Returns number of rows affected by immediately preceding DELETE or UPDATE.
    // Doesn't work after a SELECT.
    // Doesn't work after COMMITting.
-
-   MYSQL_RES * result;
-   MYSQL_ROW row;
-   word rows;
+   // Taken from the client library, which has it from the server's OK packet, so no round trip.
 
    _log(PROC, "db_row_count()");
-   if(db_connect()) return 9;
-
-   if (mysql_query(mysql_object, "SELECT row_count()"))
-   {
-      _log(CRITICAL, "db_row_count():  mysql_query() Error %u: %s", mysql_errno(mysql_object), mysql_error(mysql_object));
-      db_errored = true;
-      
-      db_disconnect();
-      return 3;
-   }
-
-   result = mysql_store_result(mysql_object);
-   row = mysql_fetch_row(result);
-   rows = atoi(row[0]);
-   mysql_free_result(result);
+   if(!mysql_object) return 9;
 
-   return rows;
+   return (word) mysql_affected_rows(mysql_object);
 }
 
 word db_connect(void)
@@ -148,6 +200,13 @@ word db_connect(void)
       flags = 0;
       if(mode_flags & 0x0001) flags += CLIENT_FOUND_ROWS;
 
+      if(mode_flags & DB_MODE_LOCAL_INFILE)
+      {
+         unsigned int local_infile = 1;
+         mysql_options(mysql_object, MYSQL_OPT_LOCAL_INFILE, &local_infile);
+      }
+
+      db_round_trips++;
       if(mysql_real_connect(mysql_object, server, user, password, database, 0, NULL, flags) == NULL) 
       {
          _log(CRITICAL, "db_connect() error 2: Connect failed:  Error %u: %s", mysql_errno(mysql_object), mysql_error(mysql_object));
@@ -166,13 +225,55 @@ word db_connect(void)
          sprintf(zs, "Connection to database \"%s\" opened.", database);
          _log(GENERAL, zs);
       }
+      last_used = time(NULL);
    }
   
    return 0;
 }
 
+static word db_live(void)
+{
+   // Connect if necessary.  A connection which has been idle for a while may have been dropped by the server's
+   // wait_timeout, so ping it first, and reconnect if that fails.  Inside a transaction the work so far would be lost,
+   // so that is an error instead.
+   time_t now = time(NULL);
+
+   if(db_connect()) return 9;
+
+   if(now - last_used > DB_PING_INTERVAL)
+   {
+      _log(PROC, "db_live() pinging idle connection.");
+      db_round_trips++;
+      if(mysql_ping(mysql_object))
+      {
+         _log(MINOR, "db_live():  mysql_ping() Error %u: %s", mysql_errno(mysql_object), mysql_error(mysql_object));
+         // db_disconnect() clears in_transaction.
+         word was_in = in_transaction;
+         db_disconnect();
+         if(was_in)
+         {
+            _log(CRITICAL, "db_live():  Connection lost during a transaction.");
+            db_errored = true;
+            return 9;
+         }
+         if(db_connect()) return 9;
+      }
+   }
+   last_used = now;
+   return 0;
+}
+
 void db_disconnect(void)
 {
+   word i;
+   for(i = 0; i < statement_count; i++)
+   {
+      if(statements[i].stmt) mysql_stmt_close(statements[i].stmt);
+      statements[i].stmt = NULL;
+   }
+
+   in_transaction = false;
+
    if(mysql_object) 
    {
       mysql_close(mysql_object);
@@ -183,10 +284,11 @@ void db_disconnect(void)
 
 void dump_mysql_result_query(const char * const query)
 {
-   if(db_connect()) return;
+   if(db_live()) return;
 
    MYSQL_RES * result;
    
+   db_round_trips++;
    mysql_query(mysql_object, query);
    result = mysql_store_result(mysql_object);
    if(!result) return;
@@ -255,6 +357,7 @@ word db_start_transaction(void)
 
    word r = db_query("START TRANSACTION");
    if(r) db_errored = true;
+   else in_transaction = true;
    _log(TRANSACTION_LOG_LEVEL, "db_start_transaction() returns %d", r);
    return r;
 }
@@ -262,6 +365,7 @@ word db_start_transaction(void)
 word db_commit_transaction(void)
 {
    word r = db_query("COMMIT");
+   in_transaction = false;
    _log(TRANSACTION_LOG_LEVEL, "db_commit_transaction() returns %d, db_errored was %d", r, db_errored);
    if(r) db_errored = true;
    return r;
@@ -270,6 +374,7 @@ word db_commit_transaction(void)
 word db_rollback_transaction(void)
 {
    word r = db_query("ROLLBACK");
+   in_transaction = false;
    if(r) db_errored = true;
    _log(TRANSACTION_LOG_LEVEL, "db_rollback_transaction() returns %d", r);
    return r;
@@ -285,3 +390,355 @@ extern void db_mode(const word flags)
       db_connect();
    }
 }
+
+word db_prepare(const char * const query)
+{
+   // Register a statement with ? placeholders.  It is prepared when first executed, and again after a reconnect.
+   // Returns the statement handle, or 0 on failure.
+   _log(PROC, "db_prepare(\"%s\")", query);
+
+   if(statement_count >= DB_STATEMENTS)
+   {
+      _log(CRITICAL, "db_prepare():  Too many prepared statements.");
+      return 0;
+   }
+   if(!(statements[statement_count].query = strdup(query))) return 0;
+   statements[statement_count].shape = db_shape(query);
+   statements[statement_count].stmt = NULL;
+   memset(statements[statement_count].bind, 0, sizeof(statements[statement_count].bind));
+   return ++statement_count;
+}
+
+void db_bind_integer(const word s, const word p, const long long value)
+{
+   if(!s || s > statement_count || p >= DB_PARAMETERS) return;
+   struct db_statement * st = &statements[s - 1];
+   st->integers[p] = value;
+   st->bind[p].buffer_type = MYSQL_TYPE_LONGLONG;
+   st->bind[p].buffer = &st->integers[p];
+   st->bind[p].is_unsigned = 0;
+   st->bind[p].length = NULL;
+}
+
+void db_bind_string(const word s, const word p, const char * const value)
+{
+   if(!s || s > statement_count || p >= DB_PARAMETERS) return;
+   struct db_statement * st = &statements[s - 1];
+   size_t length = strlen(value);
+   if(length >= DB_PARAMETER_SIZE)
+   {
+      _log(MAJOR, "db_bind_string():  Overlong parameter %d truncated.", p);
+      length = DB_PARAMETER_SIZE - 1;
+   }
+   memcpy(st->strings[p], value, length);
+   st->strings[p][length] = '\0';
+   st->lengths[p] = length;
+   st->bind[p].buffer_type = MYSQL_TYPE_STRING;
+   st->bind[p].buffer = st->strings[p];
+   st->bind[p].buffer_length = DB_PARAMETER_SIZE;
+   st->bind[p].length = &st->lengths[p];
+}
+
+word db_execute(const word s)
+{
+   // Execute a prepared statement with the parameters bound since.  Returns 0 on success, as db_query().
+   if(!s || s > statement_count) return 1;
+   struct db_statement * st = &statements[s - 1];
+
+   _log(PROC, "db_execute(%d) \"%s\"", s, st->query);
+
+   if(db_live()) return 9;
+
+   if(!st->stmt)
+   {
+      db_round_trips++;
+      if(!(st->stmt = mysql_stmt_init(mysql_object)) || mysql_stmt_prepare(st->stmt, st->query, strlen(st->query)))
+      {
+         _log(CRITICAL, "db_execute():  mysql_stmt_prepare() Error %u: %s    Query:", mysql_errno(mysql_object), mysql_error(mysql_object));
+         _log(CRITICAL, st->query);
+         db_errored = true;
+         db_disconnect();
+         return 3;
+      }
+      st->parameters = mysql_stmt_param_count(st->stmt);
+      if(st->parameters > DB_PARAMETERS)
+      {
+         _log(CRITICAL, "db_execute():  Too many parameters in query:");
+         _log(CRITICAL, st->query);
+         db_errored = true;
+         db_disconnect();
+         return 3;
+      }
+   }
+
+   db_round_trips++;
+   qword start = time_us();
+   word r = mysql_stmt_bind_param(st->stmt, st->bind) || mysql_stmt_execute(st->stmt);
+   db_profile(st->shape, st->query, start);
+   if(r)
+   {
+      _log(CRITICAL, "db_execute():  mysql_stmt_execute() Error %u: %s    Query:", mysql_stmt_errno(st->stmt), mysql_stmt_error(st->stmt));
+      _log(CRITICAL, st->query);
+      db_errored = true;
+      db_disconnect();
+      return 3;
+   }
+   return 0;
+}
+
+qword db_statement_affected_rows(const word s)
+{
+   if(!s || s > statement_count || !statements[s - 1].stmt) return 0LL;
+   return mysql_stmt_affected_rows(statements[s - 1].stmt);
+}
+
+// Batched inserts.  Rows are accumulated into multi-row INSERTs of at most DB_BATCH_SIZE bytes, which cost one round trip
+// each instead of one a row.  head starts each statement, e.g. "INSERT INTO t VALUES", and tail, which may be NULL, ends
+// it, e.g. " ON DUPLICATE KEY UPDATE ...".
+void db_batch_init(struct db_batch * const batch, const char * const head, const char * const tail)
+{
+   strcpy(batch->head, head);
+   strcpy(batch->tail, tail ? tail : "");
+   batch->length = 0;
+}
+
+word db_batch_insert(struct db_batch * const batch, const char * const row)
+{
+   // Add a row "(...)" to the batch, sending it first if it's full.
+   size_t length = strlen(row);
+
+   if(batch->length && batch->length + length + strlen(batch->tail) + 2 > DB_BATCH_SIZE)
+   {
+      if(db_batch_flush(batch)) return 1;
+   }
+
+   if(!batch->length)
+   {
+      batch->length = sprintf(batch->buffer, "%s", batch->head);
+   }
+   else
+   {
+      batch->buffer[batch->length++] = ',';
+   }
+   memcpy(batch->buffer + batch->length, row, length + 1);
+   batch->length += length;
+   return 0;
+}
+
+word db_batch_flush(struct db_batch * const batch)
+{
+   // Send what there is.  On failure the rows are discarded, as the caller will roll back.
+   if(!batch->length) return 0;
+
+   strcpy(batch->buffer + batch->length, batch->tail);
+   batch->length += strlen(batch->tail);
+   word r = db_query_long(batch->buffer, batch->length);
+   batch->length = 0;
+   return r ? 1 : 0;
+}
+
+// Secondary indexes.  A table being filled from empty is loaded without its secondary indexes, which are rebuilt in one
+// pass afterwards, as that is much quicker than maintaining them row by row.  Where the table is live, the load goes into
+// a copy, table_new, which then replaces it in a single RENAME.  The RENAME is atomic, so lookups by other programs are
+// never held up and never see a partial table.
+word db_drop_indexes(const char * const table, char * const indexes)
+{
+   // Drop the secondary indexes of table, leaving in indexes, which is DB_INDEXES_SIZE bytes, the "ADD INDEX ..." list to
+   // pass to db_rebuild_indexes().  Fails, dropping nothing, if the list won't fit.
+   char query[DB_INDEXES_SIZE + 256], key[128];
+   size_t il = 0, ql;
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   word fail = false;
+
+   indexes[0] = key[0] = '\0';
+   snprintf(query, sizeof(query), "SHOW INDEX FROM %s", table);
+   if(db_query(query)) return 1;
+   if(!(result = db_store_result()))
+   {
+      _log(CRITICAL, "db_drop_indexes():  No result from SHOW INDEX FROM %s.", table);
+      return 1;
+   }
+   ql = snprintf(query, sizeof(query), "ALTER TABLE %s ", table);
+   // Rows are Table, Non_unique, Key_name, Seq_in_index, Column_name, ...  in key order.
+   while(!fail && (row = mysql_fetch_row(result)))
+   {
+      if(!strcmp(row[2], "PRIMARY")) continue;
+      if(strcmp(row[2], key))
+      {
+         il += snprintf(indexes + il, DB_INDEXES_SIZE - il, "%sADD %sINDEX `%s` (`%s`", key[0] ? "), " : "", atoi(row[1]) ? "" : "UNIQUE ", row[2], row[4]);
+         ql += snprintf(query + ql, sizeof(query) - ql, "%sDROP INDEX `%s`", key[0] ? ", " : "", row[2]);
+         snprintf(key, sizeof(key), "%s", row[2]);
+      }
+      else
+      {
+         il += snprintf(indexes + il, DB_INDEXES_SIZE - il, ", `%s`", row[4]);
+      }
+      // Leave room for the closing bracket.
+      if(il + 1 >= DB_INDEXES_SIZE || ql >= sizeof(query)) fail = true;
+   }
+   mysql_free_result(result);
+   if(fail)
+   {
+      _log(CRITICAL, "db_drop_indexes():  Index list for %s exceeds %d bytes.", table, DB_INDEXES_SIZE);
+      indexes[0] = '\0';
+      return 1;
+   }
+   if(!key[0]) return 0;
+
+   strcpy(indexes + il, ")");
+   return db_query(query);
+}
+
+word db_rebuild_indexes(const char * const table, const char * const indexes)
+{
+   // Put back the indexes dropped by db_drop_indexes().
+   char query[DB_INDEXES_SIZE + 256];
+
+   if(!indexes[0]) return 0;
+   snprintf(query, sizeof(query), "ALTER TABLE %s %s", table, indexes);
+   return db_query(query);
+}
+
+static struct db_shape * db_shape(const char * const query)
+{
+   // Find or add the shape of a query.  Once the table is nearly full new shapes share the last entry.
+   char text[DB_SHAPE_SIZE];
+   const char * q;
+   size_t l = 0;
+   dword hash = 2166136261u;
+   word i;
+
+   for(q = query; *q && l < DB_SHAPE_SIZE - 1; q++)
+   {
+      if(*q == '\'' || *q == '"' || (*q >= '0' && *q <= '9' && !(l && (isalnum((byte) text[l - 1]) || text[l - 1] == '_'))))
+      {
+         // Literal.
+         if(*q == '\'' || *q == '"')
+         {
+            const char quote = *q;
+            for(q++; *q && *q != quote; q++) if(*q == '\\' && q[1]) q++;
+            if(!*q) q--;
+         }
+         else
+         {
+            while(q[1] == '.' || (q[1] >= '0' && q[1] <= '9')) q++;
+         }
+         // Collapse lists, so IN (1, 2, 3) becomes IN (?).
+         if(l >= 2 && text[l - 1] == ',' && text[l - 2] == '?') l--;
+         else if(l >= 3 && text[l - 1] == ' ' && text[l - 2] == ',' && text[l - 3] == '?') l -= 2;
+         else text[l++] = '?';
+      }
+      else if(isspace((byte) *q))
+      {
+         if(l && text[l - 1] != ' ') text[l++] = ' ';
+      }
+      else if(*q == ')' && l >= 5 && !strncmp(text + l - 5, "?),(?", 5))
+      {
+         // And rows of a multi-row INSERT.
+         l -= 3;
+      }
+      else if(*q == ')' && l >= 6 && !strncmp(text + l - 6, "?), (?", 6))
+      {
+         l -= 4;
+      }
+      else
+      {
+         text[l++] = *q;
+      }
+   }
+   text[l] = '\0';
+
+   for(i = 0; i < l; i++)
+   {
+      hash ^= (byte) text[i];
+      hash *= 16777619u;
+   }
+
+   for(i = hash % DB_SHAPES; shapes[i].text[0]; i = (i + 1) % DB_SHAPES)
+   {
+      if(shapes[i].hash == hash && !strcmp(shapes[i].text, text)) return &shapes[i];
+   }
+   if(shape_count >= DB_SHAPES - DB_SHAPES / 8)
+   {
+      if(!shapes[DB_SHAPES].text[0]) strcpy(shapes[DB_SHAPES].text, "(Other statements)");
+      return &shapes[DB_SHAPES];
+   }
+   shape_count++;
+   strcpy(shapes[i].text, text);
+   shapes[i].hash = hash;
+   return &shapes[i];
+}
+
+static void db_profile(struct db_shape * const shape, const char * const query, const qword start)
+{
+   // Record the time taken by a query started at start.  Prepared statements supply their shape.
+   qword elapsed = time_us() - start;
+   struct db_shape * s = shape ? shape : db_shape(query);
+   word bucket;
+   qword ms;
+
+   s->count++;
+   s->total_us += elapsed;
+   if(elapsed > s->max_us) s->max_us = elapsed;
+   for(bucket = 0, ms = elapsed / 1000; ms && bucket < DB_HISTOGRAM - 1; ms >>= 1) bucket++;
+   s->histogram[bucket]++;
+
+   if(elapsed >= slow_query_us)
+   {
+      _log(MINOR, "Slow query took %s ms:", commas_q(elapsed / 1000));
+      _log(MINOR, "%s", query);
+   }
+}
+
+static int db_shape_compare(const void * a, const void * b)
+{
+   // Most total time first.
+   const struct db_shape * sa = *(const struct db_shape * const *) a;
+   const struct db_shape * sb = *(const struct db_shape * const *) b;
+   if(sa->total_us > sb->total_us) return -1;
+   if(sa->total_us < sb->total_us) return 1;
+   return 0;
+}
+
+void db_report_profile(const word reset)
+{
+   // Log the query profile, busiest statement shape first.  If reset is set, the counts are zeroed afterwards.
+   struct db_shape * list[DB_SHAPES + 1];
+   char zs[256];
+   word i, b, n = 0;
+
+   for(i = 0; i <= DB_SHAPES; i++) if(shapes[i].count) list[n++] = &shapes[i];
+   qsort(list, n, sizeof(list[0]), db_shape_compare);
+
+   _log(GENERAL, "");
+   _log(GENERAL, "Database query profile since %s:  %d statement shape%s.", time_text(profile_start, true), n, (n == 1)?"":"s");
+   _log(GENERAL, "%12s %12s %10s %10s  Statement", "Count", "Total ms", "Mean ms", "Max ms");
+   for(i = 0; i < n; i++)
+   {
+      char count[32];
+      strcpy(count, commas_q(list[i]->count));
+      _log(GENERAL, "%12s %12s %10.1f %10.1f  %s", count, commas_q(list[i]->total_us / 1000),
+           (double) list[i]->total_us / list[i]->count / 1000.0, (double) list[i]->max_us / 1000.0, list[i]->text);
+      zs[0] = '\0';
+      for(b = 0; b < DB_HISTOGRAM; b++)
+      {
+         if(list[i]->histogram[b])
+         {
+            if(b == DB_HISTOGRAM - 1) sprintf(zs + strlen(zs), "  >=%ldms %u", 1L << (b - 1), list[i]->histogram[b]);
+            else                      sprintf(zs + strlen(zs), "  <%ldms %u", 1L << b, list[i]->histogram[b]);
+         }
+      }
+      _log(GENERAL, "%25s%s", "", zs);
+   }
+
+   if(reset)
+   {
+      for(i = 0; i <= DB_SHAPES; i++)
+      {
+         shapes[i].count = shapes[i].total_us = shapes[i].max_us = 0;
+         memset(shapes[i].histogram, 0, sizeof(shapes[i].histogram));
+      }
+      profile_start = time(NULL);
+   }
+}
@@ -20,13 +20,16 @@
 
 #include <mysql.h>
 
-#define DB_MODE_NORMAL     0
-#define DB_MODE_FOUND_ROWS 0x0001
+#define DB_MODE_NORMAL       0
+#define DB_MODE_FOUND_ROWS   0x0001
+#define DB_MODE_LOCAL_INFILE 0x0002
 
 extern word db_errored;
+extern qword db_round_trips;
 
 extern word db_init(const char * const server, const char * const user, const char * const password, const char * const database);
 extern word db_query(const char * const query);
+extern word db_query_long(const char * const query, const size_t length);
 extern MYSQL_RES * db_store_result(void);
 extern MYSQL_RES * db_use_result(void);
 extern qword db_affected_rows(void);
@@ -42,3 +45,28 @@ extern word db_start_transaction(void);
 extern word db_commit_transaction(void);
 extern word db_rollback_transaction(void);
 extern void db_mode(const word flags);
+extern void db_report_profile(const word reset);
+
+// Prepared statements
+extern word db_prepare(const char * const query);
+extern void db_bind_integer(const word s, const word p, const long long value);
+extern void db_bind_string(const word s, const word p, const char * const value);
+extern word db_execute(const word s);
+extern qword db_statement_affected_rows(const word s);
+
+// Batched inserts
+#define DB_BATCH_SIZE 262144
+struct db_batch
+{
+   char head[128], tail[128];
+   size_t length;
+   char buffer[DB_BATCH_SIZE];
+};
+extern void db_batch_init(struct db_batch * const batch, const char * const head, const char * const tail);
+extern word db_batch_insert(struct db_batch * const batch, const char * const row);
+extern word db_batch_flush(struct db_batch * const batch);
+
+// Secondary indexes
+#define DB_INDEXES_SIZE 1024
+extern word db_drop_indexes(const char * const table, char * const indexes);
+extern word db_rebuild_indexes(const char * const table, const char * const indexes);
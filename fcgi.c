@@ -0,0 +1,374 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "misc.h"
+#include "fcgi.h"
+
+// Record types and values from the FastCGI specification.
+#define FCGI_VERSION_1         1
+#define FCGI_BEGIN_REQUEST     1
+#define FCGI_ABORT_REQUEST     2
+#define FCGI_END_REQUEST       3
+#define FCGI_PARAMS            4
+#define FCGI_STDIN             5
+#define FCGI_STDOUT            6
+#define FCGI_GET_VALUES        9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE      11
+#define FCGI_RESPONDER         1
+#define FCGI_KEEP_CONN         1
+#define FCGI_REQUEST_COMPLETE  0
+#define FCGI_CANT_MPX_CONN     1
+#define FCGI_UNKNOWN_ROLE      3
+
+#define HEADER 8
+#define MAX_CONTENT 65535
+// Longest STDOUT record we send, a multiple of 8 so there's no padding.
+#define OUT_CHUNK 32768
+
+static enum {Unknown, CGI, FastCGI} mode;
+static word requests;
+static int connection = -1;
+static word request_id, keep_connection;
+static FILE * cgi_stdout;
+static char * out_buffer;
+static size_t out_length;
+// Parameters received so far, and the names put in the environment for the last request.
+static char * params;
+static size_t params_length, params_size;
+static char ** env_names;
+static word env_count, env_size;
+
+static word read_full(void * const buffer, const size_t length);
+static word write_record(const byte type, const word id, const void * const content, const size_t length);
+static void end_request(const word id, const byte status);
+static void set_environment(void);
+static void get_values(void);
+
+word fcgi_mode(void)
+{
+   return mode == FastCGI;
+}
+
+word fcgi_accept(void)
+{
+   byte header[HEADER], content[MAX_CONTENT + 255];
+   word begun, params_done, stdin_done;
+
+   if(mode == Unknown)
+   {
+      // A FastCGI server gives us a listening socket on stdin.  Under CGI it's a pipe, file or nothing.
+      struct sockaddr_storage address;
+      socklen_t length = sizeof(address);
+      if(getpeername(STDIN_FILENO, (struct sockaddr *) &address, &length) < 0 && errno == ENOTCONN)
+      {
+         mode = FastCGI;
+         signal(SIGPIPE, SIG_IGN);
+      }
+      else
+      {
+         mode = CGI;
+      }
+   }
+   if(mode == CGI) return requests++;
+
+   while(true)
+   {
+      if(connection < 0)
+      {
+         connection = accept(STDIN_FILENO, NULL, NULL);
+         if(connection < 0)
+         {
+            if(errno == EINTR) continue;
+            _log(CRITICAL, "fcgi_accept():  accept() failed.  Error %d %s", errno, strerror(errno));
+            return 1;
+         }
+      }
+
+      begun = params_done = stdin_done = false;
+      params_length = 0;
+      while(!(begun && params_done && stdin_done))
+      {
+         if(read_full(header, HEADER)) break;
+         word id = (header[2] << 8) | header[3];
+         size_t length = (header[4] << 8) | header[5];
+         if(read_full(content, length + header[6])) break;
+
+         if(header[0] != FCGI_VERSION_1)
+         {
+            _log(MAJOR, "fcgi_accept():  Unsupported protocol version %d.", header[0]);
+            break;
+         }
+         if(!id)
+         {
+            // Management record.
+            if(header[1] == FCGI_GET_VALUES)
+            {
+               get_values();
+            }
+            else
+            {
+               byte unknown[8] = {header[1], 0, 0, 0, 0, 0, 0, 0};
+               write_record(FCGI_UNKNOWN_TYPE, 0, unknown, sizeof(unknown));
+            }
+            continue;
+         }
+
+         switch(header[1])
+         {
+         case FCGI_BEGIN_REQUEST:
+            if(begun)
+            {
+               // One request at a time.
+               end_request(id, FCGI_CANT_MPX_CONN);
+            }
+            else if(length < 8 || ((content[0] << 8) | content[1]) != FCGI_RESPONDER)
+            {
+               end_request(id, FCGI_UNKNOWN_ROLE);
+            }
+            else
+            {
+               begun = true;
+               request_id = id;
+               keep_connection = content[2] & FCGI_KEEP_CONN;
+            }
+            break;
+
+         case FCGI_ABORT_REQUEST:
+            if(begun && id == request_id)
+            {
+               end_request(id, FCGI_REQUEST_COMPLETE);
+               begun = params_done = stdin_done = false;
+               params_length = 0;
+            }
+            break;
+
+         case FCGI_PARAMS:
+            if(!begun || id != request_id) break;
+            if(!length)
+            {
+               params_done = true;
+            }
+            else
+            {
+               if(params_length + length > params_size)
+               {
+                  char * n = realloc(params, params_length + length);
+                  if(!n)
+                  {
+                     _log(CRITICAL, "fcgi_accept():  Out of memory.");
+                     return 1;
+                  }
+                  params = n;
+                  params_size = params_length + length;
+               }
+               memcpy(params + params_length, content, length);
+               params_length += length;
+            }
+            break;
+
+         case FCGI_STDIN:
+            // Our requests are all GETs, so anything sent is ignored.
+            if(begun && id == request_id && !length) stdin_done = true;
+            break;
+
+         default:
+            break;
+         }
+      }
+
+      if(begun && params_done && stdin_done)
+      {
+         set_environment();
+         fflush(stdout);
+         cgi_stdout = stdout;
+         out_buffer = NULL;
+         out_length = 0;
+         if(!(stdout = open_memstream(&out_buffer, &out_length)))
+         {
+            _log(CRITICAL, "fcgi_accept():  open_memstream() failed.  Error %d %s", errno, strerror(errno));
+            stdout = cgi_stdout;
+            return 1;
+         }
+         requests++;
+         return 0;
+      }
+
+      // Connection closed or broken.
+      close(connection);
+      connection = -1;
+   }
+}
+
+void fcgi_finish(void)
+{
+   size_t sent;
+
+   if(mode != FastCGI)
+   {
+      fflush(stdout);
+      return;
+   }
+   if(stdout == cgi_stdout) return;
+
+   fclose(stdout);
+   stdout = cgi_stdout;
+
+   word fail = false;
+   for(sent = 0; sent < out_length && !fail; sent += OUT_CHUNK)
+   {
+      fail = write_record(FCGI_STDOUT, request_id, out_buffer + sent, (out_length - sent > OUT_CHUNK) ? OUT_CHUNK : out_length - sent);
+   }
+   free(out_buffer);
+   out_buffer = NULL;
+   if(!fail) fail = write_record(FCGI_STDOUT, request_id, NULL, 0);
+   if(!fail) end_request(request_id, FCGI_REQUEST_COMPLETE);
+
+   if(fail || !keep_connection)
+   {
+      close(connection);
+      connection = -1;
+   }
+}
+
+static word read_full(void * const buffer, const size_t length)
+{
+   // Returns non-zero if the connection closed or failed first.
+   size_t got = 0;
+   while(got < length)
+   {
+      ssize_t r = read(connection, (char *) buffer + got, length - got);
+      if(r < 0 && errno == EINTR) continue;
+      if(r <= 0) return 1;
+      got += r;
+   }
+   return 0;
+}
+
+static word write_record(const byte type, const word id, const void * const content, const size_t length)
+{
+   // Returns non-zero on failure.
+   static const byte padding[8];
+   byte header[HEADER];
+   byte pad = (8 - (length % 8)) % 8;
+   header[0] = FCGI_VERSION_1;
+   header[1] = type;
+   header[2] = id >> 8;
+   header[3] = id & 0xff;
+   header[4] = length >> 8;
+   header[5] = length & 0xff;
+   header[6] = pad;
+   header[7] = 0;
+
+   const byte * parts[3] = {header, content, padding};
+   size_t lengths[3] = {HEADER, length, pad};
+   word i;
+   for(i = 0; i < 3; i++)
+   {
+      size_t done = 0;
+      while(done < lengths[i])
+      {
+         ssize_t r = write(connection, parts[i] + done, lengths[i] - done);
+         if(r < 0 && errno == EINTR) continue;
+         if(r <= 0) return 1;
+         done += r;
+      }
+   }
+   return 0;
+}
+
+static void end_request(const word id, const byte status)
+{
+   byte body[8] = {0, 0, 0, 0, status, 0, 0, 0};
+   write_record(FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+static void set_environment(void)
+{
+   // Replace the last request's parameters in the environment with this one's.
+   size_t i = 0;
+   word n;
+
+   for(n = 0; n < env_count; n++)
+   {
+      unsetenv(env_names[n]);
+      free(env_names[n]);
+   }
+   env_count = 0;
+
+   while(i < params_length)
+   {
+      size_t lengths[2];
+      for(n = 0; n < 2; n++)
+      {
+         if(i >= params_length) return;
+         if(params[i] & 0x80)
+         {
+            if(i + 4 > params_length) return;
+            lengths[n] = (((byte) params[i] & 0x7f) << 24) | ((byte) params[i + 1] << 16) | ((byte) params[i + 2] << 8) | (byte) params[i + 3];
+            i += 4;
+         }
+         else
+         {
+            lengths[n] = params[i++];
+         }
+      }
+      if(i + lengths[0] + lengths[1] > params_length) return;
+
+      char * name = strndup(params + i, lengths[0]);
+      char * value = strndup(params + i + lengths[0], lengths[1]);
+      i += lengths[0] + lengths[1];
+      if(!name || !value || !name[0] || strchr(name, '='))
+      {
+         free(name);
+         free(value);
+         continue;
+      }
+      setenv(name, value, true);
+      free(value);
+      if(env_count >= env_size)
+      {
+         char ** e = realloc(env_names, (env_size + 32) * sizeof(char *));
+         if(!e)
+         {
+            free(name);
+            continue;
+         }
+         env_names = e;
+         env_size += 32;
+      }
+      env_names[env_count++] = name;
+   }
+}
+
+static void get_values(void)
+{
+   // Whatever was asked, we handle one request at a time on one connection.
+   static const char reply[] = "\x0e\x01" "FCGI_MAX_CONNS" "1" "\x0d\x01" "FCGI_MAX_REQS" "1" "\x0f\x01" "FCGI_MPXS_CONNS" "0";
+   write_record(FCGI_GET_VALUES_RESULT, 0, reply, sizeof(reply) - 1);
+}
@@ -0,0 +1,39 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Minimal FastCGI responder, so that the web programs can run either as plain CGI or as persistent FastCGI processes
+// (e.g. under mod_fcgid) keeping their database connection from one request to the next.  The mode is detected from
+// standard input, which a FastCGI server makes a listening socket.  Use:
+//
+//    while(!fcgi_accept())
+//    {
+//       ... handle the request, printing the response to stdout ...
+//       fcgi_finish();
+//    }
+//
+// For each request, the parameters from the server are placed in the environment, so getenv("PARMS") etc. work as
+// under CGI, and stdout is pointed at a buffer which fcgi_finish() sends.  In CGI mode there is a single request.
+
+// True if running under a FastCGI server.  Only valid after the first fcgi_accept().
+extern word fcgi_mode(void);
+// Wait for the next request.  Returns non-zero when there are no more.
+extern word fcgi_accept(void);
+// Send the response and finish the request.
+extern void fcgi_finish(void);
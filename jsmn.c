@@ -21,6 +21,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "jsmn.h"
 #include "misc.h"
@@ -121,6 +124,38 @@ static jsmnerr_t jsmn_parse_primitive(jsmn_parser *parser, const char *js,
    return JSMN_SUCCESS;
 }
 
+/**
+ * Finds the first quote, backslash or NUL at or after pos.
+ */
+#ifdef __SSE2__
+__attribute__((no_sanitize_address))
+#endif
+static unsigned int jsmn_string_span(const char *js, unsigned int pos)
+{
+#ifdef __SSE2__
+   // Sixteen bytes at a time.  The length of js isn't known, so the last block read may run up to 15 bytes past the
+   // terminating NUL, and the bytes before pos in the first block are read too.  The loads are aligned, so they never
+   // cross into another page and can't fault, and bytes outside the string are masked off or lie after the NUL, so they
+   // don't affect the result.  But they are outside the object as far as AddressSanitizer and valgrind are concerned,
+   // hence the attribute.
+   const __m128i quote = _mm_set1_epi8('\"'), backslash = _mm_set1_epi8('\\'), nul = _mm_setzero_si128();
+   const size_t misalign = (size_t) (js + pos) & 15;
+   const __m128i * block = (const __m128i *) (js + pos - misalign);
+   __m128i chunk = _mm_load_si128(block);
+   unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)), _mm_cmpeq_epi8(chunk, nul)));
+   mask &= 0xffffu << misalign;
+   while (!mask)
+   {
+      chunk = _mm_load_si128(++block);
+      mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)), _mm_cmpeq_epi8(chunk, nul)));
+   }
+   return (const char *) block - js + __builtin_ctz(mask);
+#else
+   while (js[pos] != '\0' && js[pos] != '\"' && js[pos] != '\\') pos++;
+   return pos;
+#endif
+}
+
 /**
  * Filsl next token with JSON string.
  */
@@ -134,9 +169,11 @@ static jsmnerr_t jsmn_parse_string(jsmn_parser *parser, const char *js,
    parser->pos++;
 
    /* Skip starting quote */
-   for (; js[parser->pos] != '\0'; parser->pos++) 
+   for (; ; parser->pos++) 
    {
+      parser->pos = jsmn_string_span(js, parser->pos);
       char c = js[parser->pos];
+      if (c == '\0') break;
 
       /* Quote: end of string */
       if (c == '\"') 
@@ -212,10 +249,26 @@ jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, jsmntok_t *tokens,
          token->type = (c == '{' ? JSMN_OBJECT : JSMN_ARRAY);
          token->start = parser->pos;
          parser->toksuper = parser->toknext - 1;
+         if (parser->depth < JSMN_STACK) parser->stack[parser->depth] = parser->toksuper;
+         parser->depth++;
          break;
 
       case '}': case ']':
          type = (c == '}' ? JSMN_OBJECT : JSMN_ARRAY);
+         if (parser->depth > 0 && parser->depth <= JSMN_STACK)
+         {
+            /* The innermost open container is on top of the stack */
+            token = &tokens[parser->stack[parser->depth - 1]];
+            if (token->type != type) {
+               _log(MINOR, "jsmn_parse():  Invalid character was wrong type 0x%02x %d\n", js[parser->pos], parser->pos);
+               return JSMN_ERROR_INVAL;
+            }
+            token->end = parser->pos + 1;
+            parser->depth--;
+            parser->toksuper = parser->depth ? parser->stack[parser->depth - 1] : -1;
+            break;
+         }
+         /* Too deep for the stack, or unmatched.  Search back for the open container */
          for (i = parser->toknext - 1; i >= 0; i--) {
             token = &tokens[i];
             if (token->start != -1 && token->end == -1) {
@@ -234,6 +287,7 @@ jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, jsmntok_t *tokens,
             _log(MINOR, "jsmn_parse():  Invalid character was unmatched closing bracket 0x%02x %d\n", js[parser->pos], parser->pos);
             return JSMN_ERROR_INVAL;
          }
+         parser->depth--;
          for (; i >= 0; i--) {
             token = &tokens[i];
             if (token->start != -1 && token->end == -1) {
@@ -261,11 +315,9 @@ jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, jsmntok_t *tokens,
       }
    }
    
-   for (i = parser->toknext - 1; i >= 0; i--) {
-      /* Unmatched opened object or array */
-      if (tokens[i].start != -1 && tokens[i].end == -1) {
-         return JSMN_ERROR_PART;
-      }
+   /* Unmatched opened object or array */
+   if (parser->depth > 0) {
+      return JSMN_ERROR_PART;
    }
 
    // Append an "END" token
@@ -284,6 +336,7 @@ void jsmn_init(jsmn_parser *parser) {
 	parser->pos = 0;
 	parser->toknext = 0;
 	parser->toksuper = -1;
+	parser->depth = 0;
 }
 
 word jsmn_find_name_token(const char * string, const jsmntok_t * tokens, const word object_index, const char * search)
@@ -333,4 +386,38 @@ void jsmn_find_extract_token(const char * string, const jsmntok_t * tokens, cons
       result[0] = '\0';
    }
 }
-      
+
+void jsmn_extract_fields(const char * string, const jsmntok_t * tokens, const word object_index, const jsmnfield_t * const fields, const word count, void * const result)
+{
+   // As jsmn_find_extract_token() for every field in the table, but in one pass over the object's tokens, stopping
+   // once all have been found.  Names are compared in place.  Missing fields are set to "".
+   qword wanted;
+   word i, f;
+
+   if(count > JSMN_MAX_FIELDS)
+   {
+      _log(CRITICAL, "jsmn_extract_fields():  Too many fields.");
+      return;
+   }
+
+   for(f = 0; f < count; f++) ((char *) result)[fields[f].offset] = '\0';
+   wanted = (count == JSMN_MAX_FIELDS) ? ~0ULL : (1ULL << count) - 1;
+
+   for(i = object_index + 1; wanted && tokens[i].start >= 0 && tokens[i].start < tokens[object_index].end; i++)
+   {
+      if(tokens[i].type == JSMN_NAME)
+      {
+         size_t length = tokens[i].end - tokens[i].start;
+         for(f = 0; f < count; f++)
+         {
+            if((wanted & (1ULL << f)) && fields[f].length == length && !strncasecmp(string + tokens[i].start, fields[f].name, length))
+            {
+               // First one wins, as jsmn_find_name_token().
+               wanted &= ~(1ULL << f);
+               if(tokens[i + 1].start >= 0) jsmn_extract_token(string, tokens, i + 1, (char *) result + fields[f].offset, fields[f].size);
+               break;
+            }
+         }
+      }
+   }
+}
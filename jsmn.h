@@ -21,6 +21,7 @@
 #ifndef __JSMN_H_
 #define __JSMN_H_
 
+#include <stddef.h>
 #include "misc.h"
 
 /**
@@ -69,10 +70,15 @@ typedef struct {
  * JSON parser. Contains an array of token blocks available. Also stores
  * the string being parsed now and current position in that string
  */
+/* Depth of the stack of open objects and arrays.  Deeper nesting still parses, but more slowly. */
+#define JSMN_STACK 64
+
 typedef struct {
 	unsigned int pos; /* offset in the JSON string */
 	int toknext; /* next token to allocate */
 	int toksuper; /* superior token node, e.g parent object or array */
+	int depth; /* number of open objects and arrays */
+	int stack[JSMN_STACK]; /* their tokens, innermost last */
 } jsmn_parser;
 
 /**
@@ -93,5 +99,21 @@ extern word jsmn_find_name_token(const char * string, const jsmntok_t * tokens,
 extern void jsmn_extract_token(const char * string, const jsmntok_t * tokens, word index, char * result, const size_t max_length);
 extern void jsmn_find_extract_token(const char * string, const jsmntok_t * tokens, const word object_index, const char * search, char * result, const size_t max_length);
 
+/* Field table for jsmn_extract_fields().  Each entry gives a name and the char array in the caller's structure
+   which receives its value.  JSMN_FIELD() is for a member with the same name as the field. */
+typedef struct {
+	const char * name;
+	size_t length;
+	size_t offset;
+	size_t size;
+} jsmnfield_t;
+
+#define JSMN_FIELD_NAMED(s, f, n) { n, sizeof(n) - 1, offsetof(s, f), sizeof(((s *) 0)->f) }
+#define JSMN_FIELD(s, f) JSMN_FIELD_NAMED(s, f, #f)
+#define JSMN_FIELDS(t) (sizeof(t) / sizeof(t[0]))
+#define JSMN_MAX_FIELDS 64
+
+extern void jsmn_extract_fields(const char * string, const jsmntok_t * tokens, const word object_index, const jsmnfield_t * const fields, const word count, void * const result);
+
 
 #endif /* __JSMN_H_ */
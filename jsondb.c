@@ -27,6 +27,7 @@
 #include <sys/resource.h>
 #include <curl/curl.h>
 #include <dirent.h>
+#include <zlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -34,6 +35,7 @@
 #include "jsmn.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME  "jsondb"
@@ -91,6 +93,7 @@ jsmntok_t tokens[MAX_TOKENS];
 
 // 
 FILE * fp_result;   
+gzFile gz_result;
 static size_t total_bytes;
 
 #define MATCHES 2
@@ -303,7 +306,7 @@ int main(int argc, char **argv)
       // DB may have dropped out due to long delay
       (void) db_connect();
       if(db_start_transaction()) _log(CRITICAL, "Failed to initiate database transaction.");
-      while((buf_end = fread(buffer, 1, MAX_BUF, fp_result)) && run && !db_errored)
+      while((buf_end = gzfread(buffer, 1, MAX_BUF, gz_result)) && run && !db_errored)
       {
          // Comfort report
          time_t now = time(NULL);
@@ -343,10 +346,13 @@ int main(int argc, char **argv)
             pc = c;
          }
       }
-      fclose(fp_result);
-      if(db_errored)
+      int gz_error;
+      const char * gz_message = gzerror(gz_result, &gz_error);
+      if(gz_error != Z_OK) _log(CRITICAL, "Failed to uncompress file:  %s", gz_message);
+      gzclose(gz_result);
+      if(db_errored || gz_error != Z_OK)
       {
-         _log(CRITICAL, "Update rolled back due to database error.");
+         _log(CRITICAL, "Update rolled back due to %s error.", db_errored?"database":"file");
          (void) db_rollback_transaction();
       }
       else
@@ -359,6 +365,8 @@ int main(int argc, char **argv)
          else
          {
             _log(GENERAL, "Committed.");
+            // liverail's day plans were worked out from the old timetable.
+            day_plans_invalidate(NULL);
          }
       }
    }
@@ -1136,9 +1144,9 @@ static void jsmn_dump_tokens(const char * string, const jsmntok_t * tokens, cons
 
 static word fetch_file(void)
 {
-   // Returns 0=Success with relevant file open on fp_result
+   // Returns 0=Success with relevant file open on gz_result
    // Or !0 = failure and file is closed.
-   // DANGER: In failure case, fp_result is INVALID and may not be null.
+   // DANGER: In failure case, gz_result is INVALID and may not be null.
    char zs[256], filepathz[256], filepath[256], url[256];
    time_t now, when;
    struct tm * broken;
@@ -1191,17 +1199,14 @@ static word fetch_file(void)
       if(opt_url || debug)
       {
          sprintf(filepathz, "%s/jsondb-cif-fetch-%ld.gz", TEMP_DIRECTORY, now);
-         sprintf(filepath,  "%s/jsondb-cif-fetch-%ld",    TEMP_DIRECTORY, now);
       }
       else if(fetch_all)
       {
          sprintf(filepathz, "%s/jsondb-cif-all-%02d-%02d-%02d-%s.gz", TEMP_DIRECTORY, broken->tm_year%100, broken->tm_mon + 1, broken->tm_mday, weekdays[broken->tm_wday]);
-         sprintf(filepath,  "%s/jsondb-cif-all-%02d-%02d-%02d-%s",    TEMP_DIRECTORY, broken->tm_year%100, broken->tm_mon + 1, broken->tm_mday, weekdays[broken->tm_wday]);
       }
       else
       {
          sprintf(filepathz, "%s/jsondb-cif-%02d-%02d-%02d-%s.gz", TEMP_DIRECTORY, broken->tm_year%100, broken->tm_mon + 1, broken->tm_mday, weekdays[broken->tm_wday]);
-         sprintf(filepath,  "%s/jsondb-cif-%02d-%02d-%02d-%s",    TEMP_DIRECTORY, broken->tm_year%100, broken->tm_mon + 1, broken->tm_mday, weekdays[broken->tm_wday]);
       }
 
       if(!(fp_result = fopen(filepathz, "w")))
@@ -1273,33 +1278,28 @@ static word fetch_file(void)
 
       if(total_bytes == 0) return 1;
    
-      _log(GENERAL, "Decompressing data...");
-      sprintf(zs, "/bin/gunzip -f %s", filepathz);
-      char * rc;
-      if((rc = system_call(zs)))
+      // The file is decompressed as it is read.  An error page may have been received in place of the compressed data.
+      if((fp_result = fopen(filepathz, "r")))
       {
-         _log(MAJOR, "Failed to uncompress file:  %s", rc);
-         if((fp_result = fopen(filepathz, "r")))
+         char error_message[2048];
+         size_t length;
+         if((length = fread(error_message, 1, 2047, fp_result)) && error_message[0] == '<')
          {
-            char error_message[2048];
-            size_t length;
-            if((length = fread(error_message, 1, 2047, fp_result)) && error_message[0] == '<')
-            {
-               error_message[length] = '\0';
-               _log(MAJOR, "Received message:\n%s", error_message);   
-            }
+            error_message[length] = '\0';
+            _log(MAJOR, "Received message:\n%s", error_message);   
             fclose(fp_result);
+            return 1;
          }
-         return 1;
+         fclose(fp_result);
       }
-      _log(GENERAL, "Decompressed.");
+      strcpy(filepath, filepathz);
    }
    else
    {
       strcpy(filepath, opt_filename);
    }
 
-   if(!(fp_result = fopen(filepath, "r")))
+   if(!(gz_result = gzopen(filepath, "r")))
    {
       _log(MAJOR, "Failed to open \"%s\" for reading.", filepath);
       return 1;
@@ -1307,20 +1307,20 @@ static word fetch_file(void)
 
    // Check if it's really an update
    {
-      sprintf(zs, "grep -q \\\"Delete\\\" %s", filepath);
+      sprintf(zs, "zgrep -q \\\"Delete\\\" %s", filepath);
       word not_update = system(zs);
       if(not_update && (total_bytes < 32000000L)) not_update = false;
       _log(test_mode?GENERAL:DEBUG, "File is an update assessment: %s.", not_update?"File is not an update":"File is an update");
       if(fetch_all && !not_update)
       {
          _log(MAJOR, "Requested full timetable looks like an update.");
-         fclose(fp_result);
+         gzclose(gz_result);
          return 1;
       }
       if(!fetch_all && not_update)
       {
          _log(MAJOR, "Requested update looks like a full timetable.");
-         fclose(fp_result);
+         gzclose(gz_result);
          return 1;
       }
    }
@@ -1329,9 +1329,9 @@ static word fetch_file(void)
    char front[256];
    regmatch_t matches[3];
 
-   if(!fread(front, 1, sizeof(front), fp_result))
+   if(gzread(gz_result, front, sizeof(front)) <= 0)
    {
-      fclose(fp_result);
+      gzclose(gz_result);
       return 1;
    }
    else
@@ -1341,7 +1341,7 @@ static word fetch_file(void)
       {
          // Failed
          _log(MAJOR, "Failed to derive CIF file timestamp.");
-         fclose(fp_result);
+         gzclose(gz_result);
          return 1;
       }
       else
@@ -1365,13 +1365,13 @@ static word fetch_file(void)
          if(!test_mode && !opt_url && !opt_filename && (now < stamp || now - stamp > 36*60*60))
          {
             _log(MAJOR, "Timestamp %s is incorrect.  Received sequence number %d.", time_text(stamp, true), stats[Sequence]);
-            fclose(fp_result);
+            gzclose(gz_result);
             stats[Sequence] = 0;
             return 1;
          }
       }
    }
-   fseeko(fp_result, 0, SEEK_SET);
+   gzrewind(gz_result);
    
    return 0;
 }
@@ -1402,6 +1402,21 @@ static char * tiploc_name(const char * const tiploc)
    MYSQL_ROW row;
    static char name[128];
 
+   if(corpus_available())
+   {
+      const char * fn = corpus_tiploc_name(tiploc);
+      if(fn)
+      {
+         strncpy(name, fn, 127);
+         name[127] = '\0';
+      }
+      else
+      {
+         strcpy(name, tiploc);
+      }
+      return name;
+   }
+
    sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
    db_query(query);
    result = db_store_result();
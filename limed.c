@@ -39,6 +39,7 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
 #include "database.h"
 #include "build.h"
 
@@ -1048,15 +1049,23 @@ static char * location_name(const char * const tiploc)
 
    if(!strlen(r))
    {
-      sprintf(query, "SELECT SUBSTR(fn, 1, 20) FROM corpus WHERE tiploc = '%s'", tiploc);
-      if(!db_query(query))
+      if(corpus_available())
       {
-         result = db_store_result();
-         if((row = mysql_fetch_row(result)) && row[0][0])
+         const char * fn = corpus_tiploc_name(tiploc);
+         if(fn) sprintf(r, "%.20s", fn);
+      }
+      else
+      {
+         sprintf(query, "SELECT SUBSTR(fn, 1, 20) FROM corpus WHERE tiploc = '%s'", tiploc);
+         if(!db_query(query))
          {
-            strcpy(r, row[0]);
+            result = db_store_result();
+            if((row = mysql_fetch_row(result)) && row[0][0])
+            {
+               strcpy(r, row[0]);
+            }
+            mysql_free_result(result);
          }
-         mysql_free_result(result);
       }
    }
 
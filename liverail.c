@@ -29,6 +29,8 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
+#include "fcgi.h"
 #include "build.h"
 
 #define NAME "liverail"
@@ -39,7 +41,15 @@
 #define BUILD RELEASE_BUILD
 #endif
 
+static void request(void);
 static void depsheet(void);
+static void day_plan_add(MYSQL_ROW row0);
+static word day_plans_ready(void);
+static word day_plan_load(const time_t when);
+static word day_plan_build(const time_t when, const word day);
+static void day_plan_save(const dword plan_id);
+static void day_plan_abandon(const dword plan_id);
+static void day_plan_select(void);
 static void display_choice(MYSQL_RES * result0, const char * const view, const time_t when);
 static void display_control_panel(const char * const location, const time_t when);
 static void display_help_text(void);
@@ -193,7 +203,8 @@ word modef[MODES] = {0x0001,0x0001,0x000d,0x000d, 0x000d, 0x0006, 0x0006  , 0x00
 
 static word mobile_trains, mobile_time;
 
-#define MAX_CALLS 4096
+// Enough for every train at the busiest location, as a day plan holds them all.
+#define MAX_CALLS 8192
 static struct call_details
    {
       dword garner_schedule_id;
@@ -206,6 +217,8 @@ static struct call_details
       char arrival[6], public_arrival[6], departure[6], public_departure[6], pass[6];
       char platform[4];
       char tiploc_code[8];
+      char train_status[2];
+      char cif_train_category[4];
    } 
    calls[MAX_CALLS];
 static word call_sequence[MAX_CALLS];
@@ -214,11 +227,31 @@ static word call_count;
 static dword schedules_key;
 
 int main()
+{
+   // Under FastCGI this serves many requests, keeping the configuration and database connection between them.
+   while(!fcgi_accept())
+   {
+      request();
+      fcgi_finish();
+   }
+   exit(0);
+}
+
+static void request(void)
 {
    char zs[1024];
+   static char config_loaded[256];
+   word config_changed = false;
 
    now = time(NULL);
 
+   // Reset everything a previous request may have left behind.
+   call_count = 0;
+   schedules_key = 0;
+   location[0] = '\0';
+   mobile_trains = mobile_time = 0;
+   db_errored = false;
+
    struct timeval ha_clock;
    gettimeofday(&ha_clock, NULL);
    qword start_time = ha_clock.tv_sec;
@@ -244,7 +277,7 @@ int main()
          l = j;
       }
    }
-   if(k) parameters[j++][k] = '\0';
+   if(k && j < PARMS) parameters[j++][k] = '\0';
 
    while(j < PARMS) parameters[j++][0] = '\0';
 
@@ -265,11 +298,17 @@ int main()
          }
       } 
 
-      char * config_fail;
-      if((config_fail = load_config(config_file_path)))
+      if(strcmp(config_file_path, config_loaded))
       {
-         printf("<p>Failed to read config file \"%s\":  %s</p>\n", config_file_path, config_fail);
-         exit(0);
+         char * config_fail;
+         if((config_fail = load_config(config_file_path)))
+         {
+            printf("<p>Failed to read config file \"%s\":  %s</p>\n", config_file_path, config_fail);
+            config_loaded[0] = '\0';
+            return;
+         }
+         strcpy(config_loaded, config_file_path);
+         config_changed = true;
       }
    }
 
@@ -335,7 +374,11 @@ int main()
    location_name(NULL, false);
 
    // Initialise database
-   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name]);
+   if(config_changed)
+   {
+      db_disconnect();
+      db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name]);
+   }
 
    sprintf(zs, "Parameters:  (l = %d)", l);
    _log(GENERAL, zs);
@@ -435,7 +478,6 @@ int main()
          printf("</body></html>\n\n");
       }
    }
-   exit(0);
 }
 
 static void display_choice(MYSQL_RES * result0, const char * const view, const time_t when)
@@ -518,7 +560,6 @@ static void depsheet(void)
 
    MYSQL_RES * result0;
    MYSQL_ROW row0;
-   char query[4096], zs[256];
 
    time_t when;
 
@@ -723,9 +764,11 @@ static void depsheet(void)
                   {
                      printf("\n<input type=\"hidden\" id=\"display_handle\" value=\"AROFF\">");
                   }
+                  mysql_free_result(result0);
                   return;
                }
             }
+            mysql_free_result(result0);
          }
       }
       else
@@ -740,29 +783,243 @@ static void depsheet(void)
    default:
       break;
    }
-   //                    0                          1                      2                             3         4                5             6           7             8            9            10      11         12
-   strcpy(query, "SELECT cif_schedules.id, cif_schedules.CIF_train_uid, cif_schedules.CIF_stp_indicator, next_day, sort_time, record_identity, arrival, public_arrival, departure, public_departure, pass, platform, tiploc_code");
-   strcat(query, " FROM cif_schedules INNER JOIN cif_schedule_locations");
-   strcat(query, " ON cif_schedules.id = cif_schedule_locations.cif_schedule_id");
-      sprintf(zs, " WHERE (cif_schedule_locations.tiploc_code = '%s')", location);
-      strcat(query, zs);
-   
-   strcat(query, " AND (cif_schedules.CIF_stp_indicator = 'N' OR cif_schedules.CIF_stp_indicator = 'P' OR cif_schedules.CIF_stp_indicator = 'O')");
-   
-   sprintf(zs, " AND deleted >= %ld AND created <= %ld", when + (12*60*60), when + (12*60*60));
-   strcat(query, zs);
-   
    // Select the day
    broken.tm_hour = 12;
    broken.tm_min = 0;
    broken.tm_sec = 0;
    word day = broken.tm_wday;
+   when = timegm(&broken);
+
+   word index;
+
+   // 1. Collect the calls, with cancellations and overlays already resolved, from the day plan, working it out if need be.
+   _log(DEBUG, "Step 1:  Collect the calls.");
+   if(day_plan_load(when))
+   {
+      _log(DEBUG, "%10s us ] No day plan.", commas_q(time_us() - start_us));
+      if(day_plan_build(when, day))
+      {
+         printf("<p>Error: MAX_CALLS exceeded.</p>");
+         return;
+      }
+   }
+   _log(DEBUG, "%10s us ] Completed Step 1.", commas_q(time_us() - start_us));
+
+   // 2. Keep the ones this display wants.
+   day_plan_select();
+   _log(DEBUG, "%10s us ] Completed Step 2.", commas_q(time_us() - start_us));
+
+   // 3. Bubble Sort
+   {
+      word i,j;
+
+      word run = true;
+      schedules_key = 0;
+
+      // First, mung the sort_time so that early hours trains come after the others:
+      // In the same loop, set up the sequence map, and calculate the schedules key.
+      for(j=0; j< call_count; j++)
+      {
+         // Early hours trains come after all the others.
+         if(calls[j].sort_time < DAY_START) calls[j].sort_time += 10000;
+         call_sequence[j] = j;
+         if(calls[j].valid) schedules_key += calls[j].garner_schedule_id; // May wrap.
+      }
+
+      for(j = call_count; run && j > 1; j--)
+      {
+         run = false;
+         for(i=1; i < j; i++)
+         {
+            if(calls[call_sequence[i]].sort_time < calls[call_sequence[i-1]].sort_time)
+            {
+               run = true;
+               // Swap
+               word tempo = call_sequence[i];
+               call_sequence[i] = call_sequence[i-1];
+               call_sequence[i-1] = tempo;
+            }
+         }
+      }
+   }
+   _log(DEBUG, "%10s us ] Completed Step 3.", commas_q(time_us() - start_us));
+
+   switch(mode)
+   {
+   case SUMMARY:
+   case SUMMARYU:
+   case DEPART:
+   case PANEL:
+   case DEPARTU:
+   case PANELU:
+   case MOBILE:
+      cif_schedule_count = 0;
+      for(index = 0; index < call_count; index++)
+      {
+         if(calls[index].valid)
+         {
+            cif_schedule_count++;
+         }
+      }
+      report_train_summary(MAX_CALLS, when, cif_schedule_count);
+      for(index = 0; index < call_count; index++)
+      {
+         if(calls[call_sequence[index]].valid)
+         {
+            _log(DEBUG, "%10s us ] Calling report_train_summary( [%d] )", commas_q(time_us() - start_us), index);
+            report_train_summary(call_sequence[index], when, cif_schedule_count);
+         }
+      }
+
+      // If no trains at all, tail won't get printed.
+      if(!cif_schedule_count)
+      {
+         if(mode == SUMMARY || mode == DEPART || mode == PANEL) printf("</tr></table>\n");
+      }
+      break;
+
+   case FULL:
+   case FREIGHT:
+      printf("<table>\n");
+      printf("<tr class=\"small-table\"><th colspan=\"8\">Information From Schedule Database</th><th>Information From TRUST Feed</tr>\n");
+      printf("<tr class=\"small-table\"><th>Detail</th><th>Type</th><th>ID</th><th>CIF UID</th><th>P</th><th>Times WTT(Public)</th><th>From</th><th>To</th><th>Latest Live Data</th></tr>\n");
+      cif_schedule_count = 0;
+      for(index = 0; index < call_count; index++)
+      {
+         // printf("%s<br>\n", row0[0]);
+         if(calls[call_sequence[index]].valid)
+         {
+            cif_schedule_count++;
+            report_train(call_sequence[index], when);
+         }
+      }
+      
+      printf("</table>\n");
+      break;
+
+   default:
+      break;
+   }
+   _log(DEBUG, "%10s us ] End.", commas_q(time_us() - start_us));
+}
+
+// Day plans
+// The calls at a location on a day, with cancellations and overlays already resolved, are saved in day_plans and
+// day_plan_calls the first time anyone looks, so that every later display of that location and day, and its smart updates,
+// is a single indexed read.  vstpdb removes the plans for the locations of a train when its schedules change, and cifdb
+// and jsondb remove them all after a timetable update.  A plan holds every train;  day_plan_select() picks the ones a
+// display wants.
+#define DAY_PLAN_BATCH 256
+// A day_plans row not completed after this many seconds was left by a page that failed, and is discarded.
+#define DAY_PLAN_ABANDONED 300
+
+static void day_plan_add(MYSQL_ROW row0)
+{
+   // Append a call from a row of   0 id, 1 CIF_train_uid, 2 CIF_stp_indicator, 3 next_day, 4 sort_time, 5 terminates, 6 arrival,
+   // 7 public_arrival, 8 departure, 9 public_departure, 10 pass, 11 platform, 12 train_status, 13 CIF_train_category
+   calls[call_count].garner_schedule_id     = atol(row0[0]);
+   calls[call_count].sort_time              = atoi(row0[4]);
+   calls[call_count].next_day               = atoi(row0[3]);
+   calls[call_count].valid                  = true;
+   calls[call_count].terminates             = atoi(row0[5]);
+   calls[call_count].cif_stp_indicator      = row0[2][0];
+   strcpy(calls[call_count].cif_train_uid,    row0[1]);
+   strcpy(calls[call_count].arrival,          row0[6]);
+   strcpy(calls[call_count].public_arrival,   row0[7]);
+   strcpy(calls[call_count].departure,        row0[8]);
+   strcpy(calls[call_count].public_departure, row0[9]);
+   strcpy(calls[call_count].pass,             row0[10]);
+   strcpy(calls[call_count].platform,         row0[11]);
+   strcpy(calls[call_count].train_status,     row0[12]);
+   strcpy(calls[call_count].cif_train_category, row0[13]);
+   strcpy(calls[call_count].tiploc_code,      location);
+   call_count++;
+}
+
+static word day_plans_ready(void)
+{
+   // True if the day plan tables are there.  Until cifdb, jsondb or vstpdb has created them, plans are not used.
+   static word found;
+   MYSQL_RES * result0;
+
+   if(found) return true;
+   if(!db_query("SHOW TABLES LIKE 'day_plan_calls'"))
+   {
+      result0 = db_store_result();
+      if(result0 && mysql_num_rows(result0)) found = true;
+      mysql_free_result(result0);
+   }
+   return found;
+}
+
+static word day_plan_load(const time_t when)
+{
+   // Fill calls[] from the day plan for location, when being 12:00Z on the day.  Returns non-zero if there isn't a complete one.
+   MYSQL_RES * result0;
+   MYSQL_ROW row0;
+   char query[1024];
+   word found = false;
+
+   call_count = 0;
+   if(!day_plans_ready()) return 1;
+   strcpy(query, "SELECT c.cif_schedule_id, c.CIF_train_uid, c.CIF_stp_indicator, c.next_day, c.sort_time, c.terminates, c.arrival, c.public_arrival, c.departure, c.public_departure, c.pass, c.platform, c.train_status, c.CIF_train_category");
+   sprintf(query + strlen(query), " FROM day_plans LEFT JOIN day_plan_calls AS c ON c.day_plan_id = day_plans.id WHERE day_plans.tiploc_code = '%s' AND day_plans.day = %ld AND day_plans.complete", location, when);
+   if(db_query(query)) return 1;
+
+   result0 = db_store_result();
+   while((row0 = mysql_fetch_row(result0)))
+   {
+      found = true;
+      // A plan with no calls gives a single row of NULLs.
+      if(!row0[0]) continue;
+      if(call_count >= MAX_CALLS)
+      {
+         found = false;
+         break;
+      }
+      day_plan_add(row0);
+   }
+   mysql_free_result(result0);
+
+   if(!found) call_count = 0;
+   return !found;
+}
+
+static word day_plan_build(const time_t when, const word day)
+{
+   // Work out the calls at location on the day from the timetable, and save them as its day plan.  Returns non-zero if
+   // there are too many.
+   MYSQL_RES * result0;
+   MYSQL_ROW row0;
+   char query[4096], zs[256];
+   word index, i;
+   dword plan_id = 0;
    word yest = (day + 6) % 7;
    word tom = (day + 1) % 7;
-   when = timegm(&broken);
+
+   // Claim the plan first, so that if vstpdb or cifdb removes it while we're working it won't be marked complete.  If
+   // another page is already working it out, just work it out for ourselves.
+   sprintf(query, "DELETE day_plans, day_plan_calls FROM day_plans LEFT JOIN day_plan_calls ON day_plan_calls.day_plan_id = day_plans.id WHERE day_plans.tiploc_code = '%s' AND day_plans.day = %ld AND NOT day_plans.complete AND day_plans.created < %ld", location, when, now - DAY_PLAN_ABANDONED);
+   if(day_plans_ready() && !db_query(query))
+   {
+      sprintf(query, "INSERT IGNORE INTO day_plans VALUES(0, '%s', %ld, %ld, false)", location, when, now);
+      if(!db_query(query) && db_affected_rows() == 1) plan_id = db_insert_id();
+   }
+
+   // 1. Collect a list of visits
+   //                    0                          1                      2                             3         4                5                              6           7             8            9            10      11        12            13
+   strcpy(query, "SELECT cif_schedules.id, cif_schedules.CIF_train_uid, cif_schedules.CIF_stp_indicator, next_day, sort_time, record_identity = 'LT', arrival, public_arrival, departure, public_departure, pass, platform, train_status, CIF_train_category");
+   strcat(query, " FROM cif_schedules INNER JOIN cif_schedule_locations");
+   strcat(query, " ON cif_schedules.id = cif_schedule_locations.cif_schedule_id");
+   sprintf(zs, " WHERE (cif_schedule_locations.tiploc_code = '%s')", location);
+   strcat(query, zs);
+   
+   strcat(query, " AND (cif_schedules.CIF_stp_indicator = 'N' OR cif_schedules.CIF_stp_indicator = 'P' OR cif_schedules.CIF_stp_indicator = 'O')");
    
-   sprintf(zs, " AND ((((%s) AND (schedule_start_date <= %ld) AND (schedule_end_date >= %ld) AND (NOT next_day)) AND (sort_time >= %d))",  days_runs
-[day],  when + 12*60*60, when - 12*60*60, DAY_START);
+   sprintf(zs, " AND deleted >= %ld AND created <= %ld", when + (12*60*60), when + (12*60*60));
+   strcat(query, zs);
+   
+   sprintf(zs, " AND ((((%s) AND (schedule_start_date <= %ld) AND (schedule_end_date >= %ld) AND (NOT next_day)) AND (sort_time >= %d))",  days_runs[day],  when + 12*60*60, when - 12*60*60, DAY_START);
    strcat(query, zs);
    sprintf(zs, " OR   (((%s) AND (schedule_start_date <= %ld) AND (schedule_end_date >= %ld) AND (    next_day)) AND (sort_time >= %d))",  days_runs[yest], when - 12*60*60, when - 36*60*60, DAY_START);
    strcat(query, zs);
@@ -770,84 +1027,30 @@ static void depsheet(void)
    strcat(query, zs);
    sprintf(zs, " OR   (((%s) AND (schedule_start_date <= %ld) AND (schedule_end_date >= %ld) AND (    next_day)) AND (sort_time <  %d)))", days_runs[day],  when + 12*60*60, when - 12*60*60, DAY_START);
    strcat(query, zs);
-   
-   if(mode == DEPART || mode == DEPARTU || mode == MOBILE || mode == PANEL|| mode == PANELU)
-   {
-      // Passenger departures only
-      sprintf(zs, " AND (public_departure != '' OR departure != '') AND (train_status = 'P' OR train_status = 'B' OR train_status = '1' OR train_status = '5')");
-      strcat(query, zs);
-      // And exclude ECS
-      sprintf(zs, " AND (cif_train_category not like 'E%%')");
-      strcat(query, zs);
-   }
 
-   if(mode == FREIGHT)
-   {
-      // Freight only
-      strcat(query, " AND (train_status = 'F' OR train_status = '2' OR train_status = '3')");
-   }
-
-   word index, i;
-   
-   // 1. Collect a list of visits
-   _log(DEBUG, "Step 1:  Collect a list of visits.");
    call_count = 0;
-   
-   _log(DEBUG, "%10s us ] Prepared Step 1 initial query.", commas_q(time_us() - start_us));
    if(!db_query(query))
    {
-      _log(DEBUG, "%10s us ] Completed Step 1 initial query.", commas_q(time_us() - start_us));
-
       result0 = db_store_result();
       while((row0 = mysql_fetch_row(result0)))
       {
          if(call_count >= MAX_CALLS)
          {
-            printf("<p>Error: MAX_CALLS exceeded.</p>");
-            return;
-         }
-
-         // Insert in array
-         calls[call_count].garner_schedule_id        = atol(row0[0]);
-         calls[call_count].sort_time              = atoi(row0[4]);
-         calls[call_count].next_day               = atoi(row0[3]);
-         calls[call_count].valid                  = true;
-         calls[call_count].terminates             = !(strcmp(row0[5], "LT"));;
-         calls[call_count].cif_stp_indicator      = row0[2][0];
-         strcpy(calls[call_count].cif_train_uid,    row0[1]);
-         strcpy(calls[call_count].arrival,          row0[6]);
-         strcpy(calls[call_count].public_arrival,   row0[7]);
-         strcpy(calls[call_count].departure,        row0[8]);
-         strcpy(calls[call_count].public_departure, row0[9]);
-         strcpy(calls[call_count].pass,             row0[10]);
-         strcpy(calls[call_count].platform,         row0[11]);
-         strcpy(calls[call_count].tiploc_code,      row0[12]);
-         // Sort time should prefer departure for summary and departure displays
-         if(modef[mode] & 0x0004)
-         {
-            word prev = calls[call_count].sort_time;
-            if(calls[call_count].public_departure[0]) 
-            {
-               calls[call_count].sort_time = get_sort_time(calls[call_count].public_departure);
-               // If we have moved across midnight, amend next_day
-               // NOTE sort_time is set by cifdb to WTT arrival whenever possible.  next_day is set by cifdb to match this.
-               //      next_day is NOT in the download.
-               if(calls[call_count].sort_time < prev - 256 && calls[call_count].next_day == 0) calls[call_count].next_day = 1;
-            }
-            else if(calls[call_count].departure[0])
-            {
-               calls[call_count].sort_time = get_sort_time(calls[call_count].departure);
-               // If we have moved across midnight, amend next_day
-               if(calls[call_count].sort_time < prev - 256 && calls[call_count].next_day == 0) calls[call_count].next_day = 1;
-            }
-            else if(calls[call_count].pass[0])        calls[call_count].sort_time = get_sort_time(calls[call_count].pass);
+            mysql_free_result(result0);
+            day_plan_abandon(plan_id);
+            return 1;
          }
-         call_count++;
+         day_plan_add(row0);
       }
       mysql_free_result(result0);
    }
-   _log(DEBUG, "%10s us ] Completed Step 1.", commas_q(time_us() - start_us));
-   
+   else
+   {
+      // Don't save a plan with calls missing.
+      day_plan_abandon(plan_id);
+      plan_id = 0;
+   }
+
    // 2. Cancel any which are overriden
    for(index = 0; index < call_count; index++)
    {
@@ -864,8 +1067,7 @@ static void depsheet(void)
          }
       }
    }
-   _log(DEBUG, "%10s us ] Completed Step 2.", commas_q(time_us() - start_us));
-   
+
    // 3. Next, remove those which are cancelled, and remove those overriden by overlays that don't call
    // NOTE:  Overlay may not call at this station!
    _log(DEBUG, "3. Commencing C and O check.  day = %d", day);
@@ -934,103 +1136,112 @@ static void depsheet(void)
             }
             mysql_free_result(result0);
          }
+         else if(plan_id)
+         {
+            // Nor one which may include a cancelled train.
+            day_plan_abandon(plan_id);
+            plan_id = 0;
+         }
       }
    }
 
-   _log(DEBUG, "%10s us ] Completed Step 3.", commas_q(time_us() - start_us));
-
-   // 5. Bubble Sort
-   {
-      word i,j;
+   if(plan_id) day_plan_save(plan_id);
+   return 0;
+}
 
-      word run = true;
-      schedules_key = 0;
+static void day_plan_save(const dword plan_id)
+{
+   // Save the valid calls in plan plan_id, and mark it complete unless it has been removed while we were working.
+   static char query[DAY_PLAN_BATCH * 160 + 64];
+   size_t length = 0;
+   word index, batch = 0;
+   word fail = false;
 
-      // First, mung the sort_time so that early hours trains come after the others:
-      // In the same loop, set up the sequence map, and calculate the schedules key.
-      for(j=0; j< call_count; j++)
+   for(index = 0; index < call_count && !fail; index++)
+   {
+      if(!calls[index].valid) continue;
+      if(!batch) length = sprintf(query, "INSERT INTO day_plan_calls VALUES");
+      length += sprintf(query + length, "%s(%u, %u, '%s', '%c', '%s', '%s', %d, '%s', '%s', '%s', '%s', '%s', %d, %d, '%s')", batch?", ":"",
+                        plan_id, calls[index].garner_schedule_id, calls[index].cif_train_uid, calls[index].cif_stp_indicator,
+                        calls[index].train_status, calls[index].cif_train_category, calls[index].terminates?1:0,
+                        calls[index].arrival, calls[index].public_arrival, calls[index].departure, calls[index].public_departure, calls[index].pass,
+                        calls[index].sort_time, calls[index].next_day, calls[index].platform);
+      if(++batch >= DAY_PLAN_BATCH)
       {
-         // Early hours trains come after all the others.
-         if(calls[j].sort_time < DAY_START) calls[j].sort_time += 10000;
-         call_sequence[j] = j;
-         if(calls[j].valid) schedules_key += calls[j].garner_schedule_id; // May wrap.
+         fail = db_query_long(query, length);
+         batch = 0;
       }
+   }
+   if(batch && !fail) fail = db_query_long(query, length);
 
-      for(j = call_count; run && j > 1; j--)
+   if(!fail)
+   {
+      sprintf(query, "UPDATE day_plans SET complete = true WHERE id = %u", plan_id);
+      if(!db_query(query) && db_affected_rows() == 1)
       {
-         run = false;
-         for(i=1; i < j; i++)
-         {
-            if(calls[call_sequence[i]].sort_time < calls[call_sequence[i-1]].sort_time)
-            {
-               run = true;
-               // Swap
-               word tempo = call_sequence[i];
-               call_sequence[i] = call_sequence[i-1];
-               call_sequence[i-1] = tempo;
-            }
-         }
+         _log(DEBUG, "Saved day plan %u for \"%s\".", plan_id, location);
+         return;
       }
    }
-   _log(DEBUG, "%10s us ] Completed Step 5.", commas_q(time_us() - start_us));
+   day_plan_abandon(plan_id);
+}
 
-   switch(mode)
+static void day_plan_abandon(const dword plan_id)
+{
+   char query[256];
+
+   if(!plan_id) return;
+   sprintf(query, "DELETE FROM day_plans WHERE id = %u", plan_id);
+   db_query(query);
+   sprintf(query, "DELETE FROM day_plan_calls WHERE day_plan_id = %u", plan_id);
+   db_query(query);
+}
+
+static void day_plan_select(void)
+{
+   // Drop the calls this display doesn't show, and set the sort times it wants.
+   word index, kept = 0;
+
+   for(index = 0; index < call_count; index++)
    {
-   case SUMMARY:
-   case SUMMARYU:
-   case DEPART:
-   case PANEL:
-   case DEPARTU:
-   case PANELU:
-   case MOBILE:
-      cif_schedule_count = 0;
-      for(index = 0; index < call_count; index++)
+      if(!calls[index].valid) continue;
+      if(mode == DEPART || mode == DEPARTU || mode == MOBILE || mode == PANEL || mode == PANELU)
       {
-         if(calls[index].valid)
-         {
-            cif_schedule_count++;
-         }
+         // Passenger departures only, excluding ECS
+         if(!calls[index].public_departure[0] && !calls[index].departure[0]) continue;
+         if(!calls[index].train_status[0] || !strchr("PB15", calls[index].train_status[0])) continue;
+         if(calls[index].cif_train_category[0] == 'E') continue;
       }
-      report_train_summary(MAX_CALLS, when, cif_schedule_count);
-      for(index = 0; index < call_count; index++)
+      if(mode == FREIGHT)
       {
-         if(calls[call_sequence[index]].valid)
-         {
-            _log(DEBUG, "%10s us ] Calling report_train_summary( [%d] )", commas_q(time_us() - start_us), index);
-            report_train_summary(call_sequence[index], when, cif_schedule_count);
-         }
+         // Freight only
+         if(!calls[index].train_status[0] || !strchr("F23", calls[index].train_status[0])) continue;
       }
+      if(kept != index) calls[kept] = calls[index];
 
-      // If no trains at all, tail won't get printed.
-      if(!cif_schedule_count)
+      // Sort time should prefer departure for summary and departure displays
+      if(modef[mode] & 0x0004)
       {
-         if(mode == SUMMARY || mode == DEPART || mode == PANEL) printf("</tr></table>\n");
-      }
-      break;
-
-   case FULL:
-   case FREIGHT:
-      printf("<table>\n");
-      printf("<tr class=\"small-table\"><th colspan=\"8\">Information From Schedule Database</th><th>Information From TRUST Feed</tr>\n");
-      printf("<tr class=\"small-table\"><th>Detail</th><th>Type</th><th>ID</th><th>CIF UID</th><th>P</th><th>Times WTT(Public)</th><th>From</th><th>To</th><th>Latest Live Data</th></tr>\n");
-      cif_schedule_count = 0;
-      for(index = 0; index < call_count; index++)
-      {
-         // printf("%s<br>\n", row0[0]);
-         if(calls[call_sequence[index]].valid)
+         word prev = calls[kept].sort_time;
+         if(calls[kept].public_departure[0]) 
          {
-            cif_schedule_count++;
-            report_train(call_sequence[index], when);
+            calls[kept].sort_time = get_sort_time(calls[kept].public_departure);
+            // If we have moved across midnight, amend next_day
+            // NOTE sort_time is set by cifdb to WTT arrival whenever possible.  next_day is set by cifdb to match this.
+            //      next_day is NOT in the download.
+            if(calls[kept].sort_time < prev - 256 && calls[kept].next_day == 0) calls[kept].next_day = 1;
          }
+         else if(calls[kept].departure[0])
+         {
+            calls[kept].sort_time = get_sort_time(calls[kept].departure);
+            // If we have moved across midnight, amend next_day
+            if(calls[kept].sort_time < prev - 256 && calls[kept].next_day == 0) calls[kept].next_day = 1;
+         }
+         else if(calls[kept].pass[0])        calls[kept].sort_time = get_sort_time(calls[kept].pass);
       }
-      
-      printf("</table>\n");
-      break;
-
-   default:
-      break;
+      kept++;
    }
-   _log(DEBUG, "%10s us ] End.", commas_q(time_us() - start_us));
+   call_count = kept;
 }
 
 static void report_train(const word index, const time_t when)
@@ -1460,43 +1671,33 @@ static void report_train_summary(const word index, const time_t when, const word
                      }
                      if(status < Departed)
                      {
-                        sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s", row1[0]);
-                        if(!db_query(query))
+                        const char * movement_tiploc = NULL;
+                        result2 = NULL;
+                        if(corpus_available())
+                        {
+                           const struct corpus_entry * entry = corpus_stanox(atol(row1[0]));
+                           if(entry) movement_tiploc = entry->tiploc;
+                        }
+                        else
                         {
-                           result2 = db_store_result();
-                           if((row2 = mysql_fetch_row(result2)))
+                           sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s", row1[0]);
+                           if(!db_query(query))
                            {
-                              _log(DEBUG, "Looking for TIPLOC \"%s\" found movement at TIPLOC \"%s\".", calls[index].tiploc_code, row2[0]);
-                              if(!strcasecmp(calls[index].tiploc_code, row2[0]))
+                              result2 = db_store_result();
+                              if((row2 = mysql_fetch_row(result2))) movement_tiploc = row2[0];
+                           }
+                        }
+                        if(movement_tiploc)
+                        {
+                           _log(DEBUG, "Looking for TIPLOC \"%s\" found movement at TIPLOC \"%s\".", calls[index].tiploc_code, movement_tiploc);
+                           if(!strcasecmp(calls[index].tiploc_code, movement_tiploc))
+                           {
+                              if((flags & 0x0003) == 0x0001)
                               {
-                                 if((flags & 0x0003) == 0x0001)
-                                 {
-                                    _log(DEBUG, "Hit - Departure.");
-                                    // Got a departure report at our station
-                                    // Check if it is about the right time, in case train calls twice.
-                                    {
-                                       char z[8];
-                                       z[0] = train_time[0]; z[1] = train_time[1]; z[2] = '\0';
-                                       word sched = atoi(z)*60;
-                                       z[0] = train_time[2]; z[1] = train_time[3];
-                                       sched += atoi(z);
-                                       time_t planned_timestamp = atol(row1[3]);
-                                       struct tm * broken = localtime(&planned_timestamp);
-                                       word planned = broken->tm_hour * 60 + broken->tm_min;
-                                       if(planned > sched - 8 && planned < sched + 8) // This might fail close to midnight!
-                                       {
-                                          // Near enough!
-                                          status = Departed;
-                                          strcpy(actual, row1[1]);
-                                          deviation = atoi(row1[2]);
-                                          late = ((flags & 0x0018) == 0x0010);
-                                       }
-                                    }
-                                 }
-                                 else if(status < Arrived)
+                                 _log(DEBUG, "Hit - Departure.");
+                                 // Got a departure report at our station
+                                 // Check if it is about the right time, in case train calls twice.
                                  {
-                                    _log(DEBUG, "Hit - Arrival.");
-                                    // Got an arrival from our station AND haven't seen a departure yet
                                     char z[8];
                                     z[0] = train_time[0]; z[1] = train_time[1]; z[2] = '\0';
                                     word sched = atoi(z)*60;
@@ -1508,16 +1709,17 @@ static void report_train_summary(const word index, const time_t when, const word
                                     if(planned > sched - 8 && planned < sched + 8) // This might fail close to midnight!
                                     {
                                        // Near enough!
-                                       status = Arrived;
+                                       status = Departed;
                                        strcpy(actual, row1[1]);
                                        deviation = atoi(row1[2]);
                                        late = ((flags & 0x0018) == 0x0010);
                                     }
                                  }
                               }
-                              // Check for "gone"
-                              if(status < Departed)
+                              else if(status < Arrived)
                               {
+                                 _log(DEBUG, "Hit - Arrival.");
+                                 // Got an arrival from our station AND haven't seen a departure yet
                                  char z[8];
                                  z[0] = train_time[0]; z[1] = train_time[1]; z[2] = '\0';
                                  word sched = atoi(z)*60;
@@ -1526,20 +1728,40 @@ static void report_train_summary(const word index, const time_t when, const word
                                  time_t planned_timestamp = atol(row1[3]);
                                  struct tm * broken = localtime(&planned_timestamp);
                                  word planned = broken->tm_hour * 60 + broken->tm_min;
-                                 if(planned > sched + 2)
+                                 if(planned > sched - 8 && planned < sched + 8) // This might fail close to midnight!
                                  {
-                                    status = DepartedDeduced;
+                                    // Near enough!
+                                    status = Arrived;
                                     strcpy(actual, row1[1]);
                                     deviation = atoi(row1[2]);
                                     late = ((flags & 0x0018) == 0x0010);
-                                    sched += (60*24) + (late?deviation:(-deviation));
-                                    sched %= (60*24);
-                                    sprintf(deduced_actual, "%02d%02d", sched/60, sched%60);
                                  }
                               }
                            }
-                           mysql_free_result(result2);
+                           // Check for "gone"
+                           if(status < Departed)
+                           {
+                              char z[8];
+                              z[0] = train_time[0]; z[1] = train_time[1]; z[2] = '\0';
+                              word sched = atoi(z)*60;
+                              z[0] = train_time[2]; z[1] = train_time[3];
+                              sched += atoi(z);
+                              time_t planned_timestamp = atol(row1[3]);
+                              struct tm * broken = localtime(&planned_timestamp);
+                              word planned = broken->tm_hour * 60 + broken->tm_min;
+                              if(planned > sched + 2)
+                              {
+                                 status = DepartedDeduced;
+                                 strcpy(actual, row1[1]);
+                                 deviation = atoi(row1[2]);
+                                 late = ((flags & 0x0018) == 0x0010);
+                                 sched += (60*24) + (late?deviation:(-deviation));
+                                 sched %= (60*24);
+                                 sprintf(deduced_actual, "%02d%02d", sched/60, sched%60);
+                              }
+                           }
                         }
+                        if(result2) mysql_free_result(result2);
                      }
                   }
                   mysql_free_result(result1);
@@ -2235,6 +2457,7 @@ static void train(void)
          {
             printf("</table><br>\n");
          }
+         mysql_free_result(result0);
       }
 
       // CR Records              0            1                  2                 3               4             5                      6                  7           8                 9                           10                11              12               13                    14                     15               16
@@ -2609,6 +2832,7 @@ static void train_text(void)
       {
          sprintf(train, "%s %s to ", show_time(row0[1]), location_name(row0[0], true));
       }
+      mysql_free_result(result0);
    }
    sprintf(query, "SELECT tiploc_code FROM cif_schedule_locations WHERE record_identity = 'LT' AND cif_schedule_id = %u", schedule_id);
    if(!db_query(query))
@@ -2618,6 +2842,7 @@ static void train_text(void)
       {
          strcat (train, location_name(row0[0], true));
       }
+      mysql_free_result(result0);
    }
 
    //                      0        1                         2                  3              4                     5          6              7              
@@ -2835,35 +3060,37 @@ static void train_text(void)
          if(!db_query(query))
          {
             printf("                          Location   Arr     Dep    P PathLine\n");
-            result0 = db_store_result();
-            while((row0 = mysql_fetch_row(result0)))
+            result1 = db_store_result();
+            while((row1 = mysql_fetch_row(result1)))
             {
-               printf("%34s  %-6s  ", location_name(row0[2],false), show_time_text(row0[4]));
+               printf("%34s  %-6s  ", location_name(row1[2],false), show_time_text(row1[4]));
                // d or p
-               if(row0[5][0] >= '0')
+               if(row1[5][0] >= '0')
                {
-                  printf("%-6s", show_time_text(row0[5]));
+                  printf("%-6s", show_time_text(row1[5]));
                }
                else
                {
                   char pd[8];
-                  strcpy(pd, show_time_text(row0[6]));
+                  strcpy(pd, show_time_text(row1[6]));
                   pd[2] = '/';
                   printf("%-6s", pd);
                }
                
-               printf("%3s %3s %3s ", row0[9], row0[11], row0[10]);
+               printf("%3s %3s %3s ", row1[9], row1[11], row1[10]);
 
-               if(row0[12][0]) printf("[%s]", show_time_text(row0[12]));  // Eng
-               if(row0[13][0]) printf("(%s)", show_time_text(row0[13]));  // Path
-               if(row0[14][0]) printf("{%s}", show_time_text(row0[14]));  // Perf
-               printf("%s", show_act_text(row0[15]));
+               if(row1[12][0]) printf("[%s]", show_time_text(row1[12]));  // Eng
+               if(row1[13][0]) printf("(%s)", show_time_text(row1[13]));  // Path
+               if(row1[14][0]) printf("{%s}", show_time_text(row1[14]));  // Perf
+               printf("%s", show_act_text(row1[15]));
 
                printf("\n");
             }
+            mysql_free_result(result1);
          }
          printf("\n[] Engineering allowance.     () Pathing allowance.    {} Performance allowance.\n");
       }
+      mysql_free_result(result0);
 
       printf("</pre>\n");
    }
@@ -2890,6 +3117,24 @@ static char * location_name_and_codes(const char * const tiploc)
    MYSQL_RES * result0;
    MYSQL_ROW row0;
 
+   if(corpus_available())
+   {
+      const char * fn = corpus_tiploc_name(tiploc);
+      if(fn)
+      {
+         // fn is used before the second lookup, which may map a newer file.
+         const struct corpus_entry * entry;
+         sprintf(result, "%s (%s", fn, tiploc);
+         if((entry = corpus_tiploc(tiploc)) && entry->alpha[0]) sprintf(result + strlen(result), " %s", entry->alpha);
+         strcat(result, ")");
+      }
+      else
+      {
+         strcpy(result, tiploc);
+      }
+      return result;
+   }
+
    sprintf(query, "select fn, 3alpha from corpus where tiploc = '%s'", tiploc);
    db_query(query);
    result0 = db_store_result();
@@ -2943,6 +3188,19 @@ static char * location_name(const char * const tiploc, const word use_cache)
    if(      mode == PANEL && !strcmp(tiploc, "ALERTN"))  strcpy(cache_val[next_cache], "Liverpool South Pwy");
    else if (mode == PANEL && !strcmp(tiploc, "LVRPLSH")) strcpy(cache_val[next_cache], "Liverpool Lime Street");
    else if (mode == PANEL && !strcmp(tiploc, "MNCRIAP")) strcpy(cache_val[next_cache], "Manchester Airport");
+   else if(corpus_available())
+   {
+      const char * fn = corpus_tiploc_name(tiploc);
+      if(fn)
+      {
+         strncpy(cache_val[next_cache], fn, 127);
+         cache_val[next_cache][127] = '\0';
+      }
+      else
+      {
+         strcpy(cache_val[next_cache], tiploc);
+      }
+   }
    else 
    {
       sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
@@ -2972,7 +3230,19 @@ static char * show_stanox(const char * const stanox)
    MYSQL_RES * result0;
    MYSQL_ROW row0;
 
-   if(stanox[0] != '\0')
+   if(stanox[0] != '\0' && corpus_available())
+   {
+      const char * fn = corpus_stanox_name(atol(stanox));
+      if(fn)
+      {
+         strcpy(result, fn);
+      }
+      else
+      {
+         strcpy(result, stanox);
+      }
+   }
+   else if(stanox[0] != '\0')
    {
       sprintf(query, "SELECT fn FROM corpus WHERE stanox = %s", stanox);
       db_query(query);
@@ -2985,6 +3255,7 @@ static char * show_stanox(const char * const stanox)
       {
          strcpy(result, stanox);
       }
+      mysql_free_result(result0);
    }
    else
    {
@@ -3000,13 +3271,28 @@ static char * show_stanox_link(const char * const stanox)
    MYSQL_RES * result0;
    MYSQL_ROW row0;
 
+   if(corpus_available())
+   {
+      const struct corpus_entry * entry = corpus_stanox(atol(stanox));
+      if(entry && entry->tiploc[0])
+      {
+         return location_name_link(entry->tiploc, true, "sum", 0);
+      }
+      strcpy(result, stanox);
+      return result;
+   }
+
    sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s", stanox);
    db_query(query);
    result0 = db_store_result();
    if((row0 = mysql_fetch_row(result0)) && row0[0][0]) 
    {
-      return location_name_link(row0[0], true, "sum", 0);
+      char tiploc[16];
+      strcpy(tiploc, row0[0]);
+      mysql_free_result(result0);
+      return location_name_link(tiploc, true, "sum", 0);
    }
+   mysql_free_result(result0);
 
    strcpy(result, stanox);
    return result;
@@ -3221,6 +3507,7 @@ static void display_status(void)
          else status = 0;
          strcpy(status_text, time_text(when, true));
       }
+      mysql_free_result(result);
    }
    printf("<tr><td class=\"status-head\" colspan=2><br>Timetable feed</td></tr>");
    printf("<tr><td class=\"status-text\">Last update timestamp </td>");
@@ -3253,6 +3540,7 @@ static void display_status(void)
             }
          }
       }
+      mysql_free_result(result);
    }
    printf("<tr><td class=\"status-head\" colspan=2><br>VSTP feed</td></tr>");
    printf("<tr><td class=\"status-text\">Last message processed </td>");
@@ -3285,6 +3573,7 @@ static void display_status(void)
             }
          }
       }
+      mysql_free_result(result);
    }
    printf("<tr><td class=\"status-head\" colspan=2><br>Train movement feed</td></tr>");
    printf("<tr><td class=\"status-text\">Most recent timestamp </td>");
@@ -3351,6 +3640,7 @@ static void display_status(void)
             sprintf(status_text, "%u per minute.", rate);
          }
       }
+      mysql_free_result(result);
    }
    printf("<tr><td class=\"status-text\">Message process rate </td>");
    printf("<td class=\"status%d\"> %s </td>\n", status, status_text);
@@ -3381,6 +3671,7 @@ static void display_status(void)
             }
          }
       }
+      mysql_free_result(result);
    }
    printf("<tr><td class=\"status-head\" colspan=2><br>Train describer feed</td></tr>");
    printf("<tr><td class=\"status-text\">Most recent timestamp </td>");
@@ -3411,6 +3702,7 @@ static void display_status(void)
             }
          }
       }
+      mysql_free_result(result);
    }
    printf("<tr><td class=\"status-text\">Last message processed </td>");
    printf("<td class=\"status%d\"> %s </td>\n", status, status_text);
@@ -3445,6 +3737,7 @@ static void display_status(void)
             sprintf(status_text, "%u per minute.", rate);
          }
       }
+      mysql_free_result(result);
    }
    printf("<tr><td class=\"status-text\">Message process rate </td>");
    printf("<td class=\"status%d\"> %s </td>\n", status, status_text);
@@ -3478,6 +3771,7 @@ static void display_status(void)
             sprintf(status_text, "%u per minute.", rate);
          }
       }
+      mysql_free_result(result);
    }
    printf("<tr><td class=\"status-text\">Relevant message process rate </td>");
    printf("<td class=\"status%d\"> %s </td>\n", status, status_text);
@@ -3531,6 +3825,7 @@ static void display_status_panel(const word column)
          else status = 0;
          strcpy(status_text, time_text(when, true));
       }
+      mysql_free_result(result);
    }
    printf("tr%d21|status%d||%s\n", column, status, status_text);
 
@@ -3560,6 +3855,7 @@ static void display_status_panel(const word column)
             }
          }
       }
+      mysql_free_result(result);
    }
    printf("tr%d23|status%d||%s\n", column, status, status_text);
 
@@ -3589,6 +3885,7 @@ static void display_status_panel(const word column)
             }
          }
       }
+      mysql_free_result(result);
    }
    printf("tr%d25|status%d||%s\n", column, status, status_text);
 
@@ -3621,6 +3918,7 @@ static void display_status_panel(const word column)
             sprintf(status_text, "(%u per minute.)", rate);
          }
       }
+      mysql_free_result(result);
    }
    printf("tr%d26|status%d||%s\n", column, status, status_text);
 
@@ -3649,6 +3947,7 @@ static void display_status_panel(const word column)
             }
          }
       }
+      mysql_free_result(result);
    }
    printf("tr%d28|status%d||%s\n", column, status, status_text);
 
@@ -3681,6 +3980,7 @@ static void display_status_panel(const word column)
             sprintf(status_text, "(%u per minute.)", rate);
          }
       }
+      mysql_free_result(result);
    }
    printf("tr%d29|status%d||%s\n", column, status, status_text);
 
@@ -30,10 +30,15 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
+#include "tdshm.h"
+#include "fcgi.h"
 #include "build.h"
 
+static void request(void);
 static void page(void);
 static void update(void);
+static word update_shm(const dword handle);
 static void query(void);
 static char * location_name(const char * const tiploc);
 static char * show_handle(const dword h);
@@ -55,7 +60,22 @@ static char parameters[PARMS][PARMSIZE];
 
 int main()
 {
+   // Under FastCGI this serves many requests, keeping the configuration and database connection between them.
+   while(!fcgi_accept())
+   {
+      request();
+      fcgi_finish();
+   }
+   exit(0);
+}
+
+static void request(void)
+{
+   static char config_loaded[256];
+   word config_changed = false;
+
    now = time(NULL);
+   db_errored = false;
 
    char * parms = getenv("PARMS");
    // Parse parms
@@ -80,7 +100,7 @@ int main()
          l = j;
       }
    }
-   if(k) parameters[j++][k] = '\0';
+   if(k && j < PARMS) parameters[j++][k] = '\0';
 
    while(j < PARMS) parameters[j++][0] = '\0';
 
@@ -99,11 +119,17 @@ int main()
          }
       } 
 
-      char * config_fail;
-      if((config_fail = load_config(config_file_path)))
+      if(strcmp(config_file_path, config_loaded))
       {
-         printf("<p>Failed to read config file \"%s\":  %s</p>\n", config_file_path, config_fail);
-         exit(0);
+         char * config_fail;
+         if((config_fail = load_config(config_file_path)))
+         {
+            printf("<p>Failed to read config file \"%s\":  %s</p>\n", config_file_path, config_fail);
+            config_loaded[0] = '\0';
+            return;
+         }
+         strcpy(config_loaded, config_file_path);
+         config_changed = true;
       }
    }
 
@@ -147,7 +173,11 @@ int main()
    }
 
    // Initialise database
-   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name]);
+   if(config_changed)
+   {
+      db_disconnect();
+      db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name]);
+   }
 
    _log(GENERAL, "Parameters:  (l = %d)", l);
    for(i=0;i <10; i++)
@@ -161,8 +191,6 @@ int main()
    case UpdateMode: update(); break;
    case QueryMode: query(); break;
    }
-
-   exit(0);
 }
 
 static void page(void)
@@ -211,6 +239,8 @@ static void update(void)
    // parameters[1] = handle
    // Describer(s) in parameters[2..] 
 
+   if(!update_shm(handle)) return;
+
    if(!db_query("SELECT MAX(handle) from td_updates"))
    {
       result = db_store_result();
@@ -222,6 +252,7 @@ static void update(void)
       {
          new_handle = 0;
       }
+      mysql_free_result(result);
    }
    else
    {
@@ -334,6 +365,33 @@ static void update(void)
    }
 }
 
+static word update_shm(const dword handle)
+{
+   // Answer the poll from the states tddb publishes in shared memory.  Returns non-zero, having output nothing, if
+   // they aren't available, e.g. tddb is on another machine, and the database must be used instead.
+   static char reply[TDSHM_REPLY];
+   const char * describers[PARMS];
+   dword new_handle, lines;
+   word count;
+   size_t length;
+
+   const struct tdshm * shm = tdshm_map();
+   if(!shm) return 1;
+
+   describers[0] = parameters[2];
+   for(count = 1; count + 2 < PARMS && parameters[count + 2][0]; count++) describers[count] = parameters[count + 2];
+   length = tdshm_reply(shm, handle, describers, count, NAME, BUILD, reply, sizeof(reply), &new_handle, &lines);
+   tdshm_unmap(shm);
+   if(!length)
+   {
+      _log(GENERAL, "Shared memory not usable.");
+      return 1;
+   }
+   _log(DEBUG, "Handle = %d, new_handle = %d, %d lines from shared memory.", handle, new_handle, lines);
+   fwrite(reply, 1, length, stdout);
+   return 0;
+}
+
 static void query(void)
 {
    char headcode[8], re_ob_headcode[8], query[512], query1[256];
@@ -528,15 +586,23 @@ static char * location_name(const char * const tiploc)
 
    if(!strlen(response))
    {
-      sprintf(query, "SELECT SUBSTR(fn, 1, 20) FROM corpus WHERE tiploc = '%s'", tiploc);
-      if(!db_query(query))
+      if(corpus_available())
       {
-         result = db_store_result();
-         if((row = mysql_fetch_row(result)) && row[0][0])
+         const char * fn = corpus_tiploc_name(tiploc);
+         if(fn) sprintf(response, "%.20s", fn);
+      }
+      else
+      {
+         sprintf(query, "SELECT SUBSTR(fn, 1, 20) FROM corpus WHERE tiploc = '%s'", tiploc);
+         if(!db_query(query))
          {
-            strcpy(response, row[0]);
+            result = db_store_result();
+            if((row = mysql_fetch_row(result)) && row[0][0])
+            {
+               strcpy(response, row[0]);
+            }
+            mysql_free_result(result);
          }
-         mysql_free_result(result);
       }
    }
 
@@ -19,6 +19,7 @@
 */
 
 var url_base = "/rail/livesig/";
+var url_events = "/rail/livesig-events/"; /* livesigd, via Apache.  '' to always poll. */
 var tick_period = 1024; /* ms between ticks */
 var refresh_tick_limit = 4; /* Ticks between updates */ 
 var refresh_tick_count = refresh_tick_limit;
@@ -36,6 +37,11 @@ var saved_caption = 'livesig';
 var svg_doc;
 var visible = true;
 var hidden_count;
+// Event stream from livesigd.  While it is open the tick doesn't poll.  If it can't be opened we go back to polling.
+var events = null;
+var events_received = false;
+var events_failed = false;
+var events_silent = 0;
 
 // Global items deduced from SVG at startup
 var progress_points;
@@ -108,6 +114,49 @@ function startup()
    else
    {
       tick_timer = setInterval('tick()', tick_period);
+      events_open();
+   }
+}
+
+function events_open()
+{
+   if(events_failed || url_events === '' || typeof EventSource === 'undefined') return;
+
+   events_received = false;
+   events_silent = 0;
+   events = new EventSource(url_events + got_handle + '/' + describers);
+   events.onmessage = function(e)
+   {
+      events_received = true;
+      events_silent = 0;
+      progress_colour('limegreen');
+      process_updates(e.data);
+   }
+   events.onerror = function()
+   {
+      if(!events_received || events.readyState === EventSource.CLOSED)
+      {
+         // Not available.  Poll livesig.cgi instead.
+         events_close();
+         events_failed = true;
+         got_handle = reset_handle;
+         refresh_tick_count = refresh_tick_limit;
+      }
+      else
+      {
+         // EventSource will reconnect and carry on from the last handle.
+         feed_fault = 2;
+         progress_colour('red');
+      }
+   }
+}
+
+function events_close()
+{
+   if(events)
+   {
+      events.close();
+      events = null;
    }
 }
 
@@ -121,6 +170,7 @@ function tick()
          // Becoming hidden
          hidden_count = 0;
          visible = false;
+         events_close();
       }
       hidden_count++;
       if(hidden_count === 4096)
@@ -146,6 +196,7 @@ function tick()
          got_handle = reset_handle;
          refresh_tick_count = refresh_tick_limit;
          visible = true;
+         events_open();
       }
    }
 
@@ -179,6 +230,16 @@ function tick()
       }
    }
 
+   if(events && ++events_silent > 64)
+   {
+      // livesigd sends the status line every 16s, so something is wrong.  Start again.
+      events_close();
+      got_handle = reset_handle;
+      feed_fault = 2;
+      progress_colour('red');
+      events_open();
+   }
+
    if(++refresh_tick_count < refresh_tick_limit) return;
    refresh_tick_count = 0;
 
@@ -189,7 +250,7 @@ function tick()
       clock_object.textContent = now.toTimeString().substring(0, 5);
    }
    
-   if(visible && !updating_timeout)
+   if(visible && !updating_timeout && !events)
    {
       updating_timeout = 1;
 
@@ -0,0 +1,775 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Live signalling event server.  Streams berth and signal changes from tddb's shared memory to livesig.js as
+// Server-Sent Events, in the same format as a livesig.cgi update, so that browsers needn't poll.
+//
+// Requests (proxied by Apache, see Apache-setup.txt):
+//    GET /<handle>/<describer>/<describer>...     Event stream.  Each event is a livesig.cgi update, id is the handle.
+//    GET /L/<handle>/<describer>/<describer>...   Long poll.  One update, sent when there's a change or after a while.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+
+#include "misc.h"
+#include "tdshm.h"
+#include "build.h"
+
+#define NAME  "livesigd"
+
+#ifndef RELEASE_BUILD
+#define BUILD "Z218p"
+#else
+#define BUILD RELEASE_BUILD
+#endif
+
+static void perform(void);
+static void tick(void);
+static void client_accept(void);
+static void client_read(const int s);
+static void client_write(const int s);
+static void client_request(const int s);
+static void client_update(const int s, const word force);
+static void client_refuse(const int s, const char * const status);
+static void client_send(const int s, const char * const data, const size_t length);
+static void client_close(const int s);
+static void report_stats(void);
+
+static word debug, run, interrupt;
+
+// Listening port.  Apache proxies to this on the same machine.
+#define LIVESIGD_PORT 55860
+// How often the shared memory is checked for changes, in ms.
+#define TICK 250
+// A streaming client is sent the status line at least this often, in seconds, even if nothing has changed.
+#define STATUS_INTERVAL 16
+// A long poll is answered after this many seconds if nothing has changed.
+#define LONG_POLL_WAIT 24
+// A client has this long to send its request.
+#define REQUEST_TIMEOUT 16
+// Seconds between attempts to map the shared memory when it's missing or stale.
+#define SHM_RETRY 16
+// A client that falls this far behind is dropped.  An event stream will reconnect and catch up.
+#define MAX_PENDING (4 * 1024 * 1024)
+
+#define REQUEST_SIZE 2048
+#define CLIENT_DESCRIBERS 8
+
+// Time in hours (local) when daily statistical report is produced.
+// (Set > 23 to disable daily report.)
+#define REPORT_HOUR 4
+#define REPORT_MINUTE 2
+
+static time_t start_time, now;
+static int epoll_fd, server;
+static const struct tdshm * shm;
+static time_t shm_retry_due;
+static dword shm_handle;
+
+enum client_states {ClientFree, ClientRequest, ClientStream, ClientPoll, ClientClosing};
+static struct client
+{
+   byte state;
+   char request[REQUEST_SIZE];
+   size_t request_length;
+   char describer[CLIENT_DESCRIBERS][8];
+   word describers;
+   dword handle;
+   time_t due;
+   char * out;
+   size_t out_length, out_sent;
+} client[FD_SETSIZE];
+static word clients;
+
+static char reply[TDSHM_REPLY];
+// An event can be up to twice as long as the reply, with "data: " on each line.
+static char event[TDSHM_REPLY * 2];
+
+// Stats
+enum stats_categories {Connect, StreamRequest, PollRequest, BadRequest, Unavailable, Event, Reply, Dropped, MAXstats};
+static qword stats[MAXstats];
+static qword grand_stats[MAXstats];
+static const char * stats_category[MAXstats] =
+   {
+      "Connection", "Event stream request", "Long poll request", "Bad request", "Refused, no data", "Event sent", "Long poll reply", "Slow client dropped",
+   };
+
+// Signal handling
+void termination_handler(int signum)
+{
+   if(signum != SIGHUP)
+   {
+      run = false;
+      interrupt = true;
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   int c;
+   char config_file_path[256];
+   word usage = false;
+   strcpy(config_file_path, "/etc/openrail.conf");
+   while ((c = getopt (argc, argv, ":c:")) != -1)
+   {
+      switch (c)
+      {
+      case 'c':
+         strcpy(config_file_path, optarg);
+         break;
+      case ':':
+         break;
+      case '?':
+      default:
+         usage = true;
+         break;
+      }
+   }
+
+   char * config_fail;
+   if((config_fail = load_config(config_file_path)))
+   {
+      printf("Failed to read config file \"%s\":  %s\n", config_file_path, config_fail);
+      usage = true;
+   }
+
+   debug = *conf[conf_debug];
+
+   if(usage)
+   {
+      printf("\tUsage: %s [-c /path/to/config/file.conf]\n\n", argv[0] );
+      exit(1);
+   }
+
+   int lfp = 0;
+
+   // Set up log
+   _log_init(debug?"/tmp/livesigd.log":"/var/log/garner/livesigd.log", debug?1:0);
+
+   // Enable core dumps
+   struct rlimit limit;
+   if(!getrlimit(RLIMIT_CORE, &limit))
+   {
+      limit.rlim_cur = RLIM_INFINITY;
+      setrlimit(RLIMIT_CORE, &limit);
+   }
+
+   start_time = time(NULL);
+
+   // DAEMONISE
+   if(!debug)
+   {
+      int i=fork();
+      if (i<0)
+      {
+         /* fork error */
+         _log(CRITICAL, "fork() error.  Aborting.");
+         exit(1);
+      }
+      if (i>0) exit(0); /* parent exits */
+      /* child (daemon) continues */
+
+      pid_t sid = setsid(); /* obtain a new process group */
+      if(sid < 0)
+      {
+         /* setsid error */
+         _log(CRITICAL, "setsid() error.  Aborting.");
+         exit(1);
+      }
+
+      for (i=getdtablesize(); i>=0; --i) close(i); /* close all descriptors */
+
+      umask(022); // Created files will be rw for root, r for all others
+
+      i = chdir("/var/run/");
+      if(i < 0)
+      {
+         /* chdir error */
+         _log(CRITICAL, "chdir() error.  Aborting.");
+         exit(1);
+      }
+
+      if((lfp = open("/var/run/livesigd.pid", O_RDWR|O_CREAT, 0640)) < 0)
+      {
+         _log(CRITICAL, "Unable to open pid file \"/var/run/livesigd.pid\".  Aborting.");
+         exit(1); /* can not open */
+      }
+
+      if (lockf(lfp,F_TLOCK,0)<0)
+      {
+         _log(CRITICAL, "Failed to obtain lock.  Aborting.");
+         exit(1); /* can not lock */
+      }
+
+      char str[128];
+      sprintf(str, "%d\n", getpid());
+      i = write(lfp, str, strlen(str)); /* record pid to lockfile */
+
+      _log(GENERAL, "");
+      _log(GENERAL, "%s %s", NAME, BUILD);
+      _log(GENERAL, "Running as daemon.");
+   }
+   else
+   {
+      _log(GENERAL, "");
+      _log(GENERAL, "%s %s", NAME, BUILD);
+      _log(GENERAL, "Running in local mode.");
+   }
+
+   run = true;
+   interrupt = false;
+
+   if(signal(SIGTERM, termination_handler) == SIG_IGN) signal(SIGTERM, SIG_IGN);
+   if(signal(SIGINT,  termination_handler) == SIG_IGN) signal(SIGINT,  SIG_IGN);
+   if(signal(SIGHUP,  termination_handler) == SIG_IGN) signal(SIGHUP,  SIG_IGN);
+   signal(SIGPIPE, SIG_IGN);
+   if(!debug) signal(SIGCHLD, SIG_IGN); /* ignore child */
+   if(!debug) signal(SIGTSTP, SIG_IGN); /* ignore tty signals */
+   if(!debug) signal(SIGTTOU, SIG_IGN);
+   if(!debug) signal(SIGTTIN, SIG_IGN);
+
+   // Zero the stats
+   {
+      word i;
+      for(i=0; i < MAXstats; i++) { stats[i] = 0; grand_stats[i] = 0; }
+   }
+
+   perform();
+
+   if(lfp) close(lfp);
+
+   if(interrupt)
+   {
+      _log(CRITICAL, "Terminated due to interrupt.");
+   }
+   return 0;
+}
+
+static void perform(void)
+{
+   struct epoll_event events[64];
+   word last_report_day;
+   int s;
+
+   {
+      struct tm * broken;
+      now = time(NULL);
+      broken = localtime(&now);
+      last_report_day = broken->tm_wday;
+   }
+
+   for(s = 0; s < FD_SETSIZE; s++) client[s].state = ClientFree;
+   clients = 0;
+   shm = NULL;
+   shm_retry_due = 0;
+
+   epoll_fd = epoll_create1(0);
+   if(epoll_fd < 0)
+   {
+      _log(CRITICAL, "Failed to create epoll instance.  Error %d %s.  Fatal.", errno, strerror(errno));
+      exit(1);
+   }
+
+   // Server socket.  Retry until we can bind, in case an old copy is still going away.
+   server = -1;
+   while(run && server < 0)
+   {
+      struct sockaddr_in server_addr;
+      server = socket(AF_INET, SOCK_STREAM, 0);
+      if(server < 0)
+      {
+         _log(CRITICAL, "Failed to create server socket.  Error %d %s.  Fatal.", errno, strerror(errno));
+         exit(1);
+      }
+      int one = 1;
+      setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      memset((void *) &server_addr, 0, sizeof(server_addr));
+      server_addr.sin_family = AF_INET;
+      server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      server_addr.sin_port = htons(LIVESIGD_PORT);
+      if(bind(server, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0 || listen(server, 64) < 0)
+      {
+         _log(MAJOR, "Failed to bind to port %d.  Error %d %s.  Will retry...", LIVESIGD_PORT, errno, strerror(errno));
+         close(server);
+         server = -1;
+         word i;
+         for(i = 0; i < 32 && run; i++) sleep(1);
+      }
+   }
+   if(server < 0) return;
+   {
+      int oldflags = fcntl(server, F_GETFL, 0);
+      oldflags |= O_NONBLOCK;
+      fcntl(server, F_SETFL, oldflags);
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = server;
+      if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server, &ev))
+      {
+         _log(CRITICAL, "Failed to register server socket.  Error %d %s.  Fatal.", errno, strerror(errno));
+         exit(1);
+      }
+   }
+   _log(GENERAL, "Listening on port %d.", LIVESIGD_PORT);
+
+   qword next_tick = 0;
+   while(run)
+   {
+      qword t = time_us() / 1000;
+      if(t >= next_tick)
+      {
+         now = time(NULL);
+         {
+            struct tm * broken = localtime(&now);
+            if(broken->tm_wday != last_report_day && broken->tm_hour >= REPORT_HOUR && broken->tm_min >= REPORT_MINUTE)
+            {
+               last_report_day = broken->tm_wday;
+               report_stats();
+            }
+         }
+         tick();
+         next_tick = t + TICK;
+      }
+
+      int result = epoll_wait(epoll_fd, events, 64, next_tick - t);
+      if(result < 0)
+      {
+         if(errno != EINTR)
+         {
+            _log(CRITICAL, "epoll_wait() returns error %d %s.  Fatal.", errno, strerror(errno));
+            run = false;
+         }
+      }
+      else
+      {
+         int e;
+         now = time(NULL);
+         for(e = 0; e < result; e++)
+         {
+            s = events[e].data.fd;
+            if(s == server)
+            {
+               client_accept();
+            }
+            else
+            {
+               if(events[e].events & EPOLLOUT) client_write(s);
+               if(client[s].state != ClientFree && (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) client_read(s);
+            }
+         }
+      }
+   }
+
+   for(s = 0; s < FD_SETSIZE; s++) if(client[s].state != ClientFree) client_close(s);
+   close(server);
+   close(epoll_fd);
+   tdshm_unmap(shm);
+   report_stats();
+}
+
+static void tick(void)
+{
+   // Look for changes, and deal with anything waiting on a timer.
+   int s;
+   word changed;
+
+   if(shm && !tdshm_usable(shm) && now >= shm_retry_due)
+   {
+      // tddb has gone away, or is restarting.  Map it afresh in case the segment was replaced.
+      _log(MAJOR, "Shared memory is not usable.");
+      tdshm_unmap(shm);
+      shm = NULL;
+   }
+   if(!shm && now >= shm_retry_due)
+   {
+      if((shm = tdshm_map()))
+      {
+         _log(GENERAL, "Shared memory mapped.");
+         shm_handle = shm->handle;
+      }
+      shm_retry_due = now + SHM_RETRY;
+   }
+   if(!shm || !tdshm_usable(shm)) return;
+
+   changed = (shm->handle != shm_handle);
+   shm_handle = shm->handle;
+
+   for(s = 0; s < FD_SETSIZE; s++)
+   {
+      switch(client[s].state)
+      {
+      case ClientRequest:
+         if(now >= client[s].due) client_close(s);
+         break;
+
+      case ClientStream:
+      case ClientPoll:
+         if(changed || now >= client[s].due) client_update(s, now >= client[s].due);
+         break;
+      }
+   }
+}
+
+static void client_accept(void)
+{
+   int s;
+   while((s = accept(server, NULL, NULL)) >= 0)
+   {
+      if(s >= FD_SETSIZE)
+      {
+         _log(MAJOR, "Connection on socket %d refused.  Too many clients.", s);
+         close(s);
+         continue;
+      }
+      int oldflags = fcntl(s, F_GETFL, 0);
+      oldflags |= O_NONBLOCK;
+      fcntl(s, F_SETFL, oldflags);
+      // Events are small and must go at once.
+      int one = 1;
+      setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = s;
+      if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev))
+      {
+         _log(MAJOR, "Failed to register socket %d.  Error %d %s.", s, errno, strerror(errno));
+         close(s);
+         continue;
+      }
+      client[s].state = ClientRequest;
+      client[s].request_length = 0;
+      client[s].describers = 0;
+      client[s].due = now + REQUEST_TIMEOUT;
+      client[s].out = NULL;
+      client[s].out_length = client[s].out_sent = 0;
+      clients++;
+      stats[Connect]++;
+      _log(DEBUG, "Client connected on socket %d.  %d clients.", s, clients);
+   }
+   if(errno != EAGAIN && errno != EWOULDBLOCK)
+   {
+      _log(MAJOR, "accept() failed.  Error %d %s", errno, strerror(errno));
+   }
+}
+
+static void client_read(const int s)
+{
+   struct client * c = &client[s];
+   char discard[256];
+   ssize_t got;
+
+   if(c->state == ClientRequest)
+   {
+      got = read(s, c->request + c->request_length, REQUEST_SIZE - 1 - c->request_length);
+   }
+   else
+   {
+      // Nothing more is expected.  We are only waiting to hear that it has gone.
+      got = read(s, discard, sizeof(discard));
+   }
+   if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+   if(got <= 0)
+   {
+      client_close(s);
+      return;
+   }
+   if(c->state != ClientRequest) return;
+
+   c->request_length += got;
+   c->request[c->request_length] = '\0';
+   if(strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n"))
+   {
+      client_request(s);
+   }
+   else if(c->request_length >= REQUEST_SIZE - 1)
+   {
+      stats[BadRequest]++;
+      client_close(s);
+   }
+}
+
+static void client_request(const int s)
+{
+   // Parse a complete request and start the reply.
+   struct client * c = &client[s];
+   char parameters[CLIENT_DESCRIBERS + 2][8];
+   word p, k, stream;
+   const char * r;
+
+   _log(DEBUG, "Request on socket %d:  \"%.*s\"", s, (int) (strcspn(c->request, "\r\n")), c->request);
+
+   if(strncmp(c->request, "GET /", 5))
+   {
+      stats[BadRequest]++;
+      client_refuse(s, "400 Bad Request");
+      return;
+   }
+
+   // Split the path, keeping only the characters livesig.cgi would.
+   r = c->request + 5;
+   p = k = 0;
+   memset(parameters, 0, sizeof(parameters));
+   while(*r && *r != ' ' && *r != '?' && p < CLIENT_DESCRIBERS + 2)
+   {
+      if(*r == '/')
+      {
+         p++;
+         k = 0;
+      }
+      else if(((*r >= 'A' && *r <= 'Z') || (*r >= '0' && *r <= '9')) && k < sizeof(parameters[0]) - 1)
+      {
+         parameters[p][k++] = *r;
+      }
+      r++;
+   }
+   p = 0;
+   stream = strcmp(parameters[0], "L");
+   if(!stream) p++;
+   c->handle = strtoul(parameters[p++], NULL, 36);
+   strcpy(c->describer[0], parameters[p++]);
+   for(c->describers = 1; p < CLIENT_DESCRIBERS + 2 && parameters[p][0] && c->describers < CLIENT_DESCRIBERS; p++)
+   {
+      strcpy(c->describer[c->describers++], parameters[p]);
+   }
+   // An event stream that has reconnected carries on from the last event received.
+   if(stream && (r = strcasestr(c->request, "\nLast-Event-ID:")))
+   {
+      r += 15;
+      while(*r == ' ') r++;
+      c->handle = strtoul(r, NULL, 36);
+   }
+
+   if(!shm || !tdshm_usable(shm))
+   {
+      // Client will fall back to livesig.cgi.
+      stats[Unavailable]++;
+      client_refuse(s, "503 Service Unavailable");
+      return;
+   }
+
+   if(stream)
+   {
+      static const char * const head = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\nretry: 4000\n\n";
+      stats[StreamRequest]++;
+      c->state = ClientStream;
+      client_send(s, head, strlen(head));
+   }
+   else
+   {
+      stats[PollRequest]++;
+      c->state = ClientPoll;
+      c->due = now + LONG_POLL_WAIT;
+   }
+   // An event stream starts with an event, and a long poll from scratch gets the full state at once, even if it's empty.
+   client_update(s, stream || c->handle > shm->handle);
+}
+
+static void client_update(const int s, const word force)
+{
+   // Send a client anything that has changed for its describers since its handle, or the status line alone if force.
+   struct client * c = &client[s];
+   const char * describers[CLIENT_DESCRIBERS];
+   dword new_handle, lines;
+   size_t length;
+   word i;
+
+   for(i = 0; i < c->describers; i++) describers[i] = c->describer[i];
+   length = tdshm_reply(shm, c->handle, describers, c->describers, NAME, BUILD, reply, sizeof(reply), &new_handle, &lines);
+   if(!length) return;
+
+   // Nothing else of interest happened.
+   c->handle = new_handle;
+   if(!lines && !force) return;
+
+   if(c->state == ClientStream)
+   {
+      // One "data:" line per line of the reply, and the handle as the event id.
+      size_t e = sprintf(event, "id: %.*s\n", (int) strcspn(reply, "\n"), reply);
+      const char * line = reply;
+      while(line < reply + length)
+      {
+         const char * end = memchr(line, '\n', reply + length - line);
+         if(!end) end = reply + length;
+         e += sprintf(event + e, "data: %.*s\n", (int) (end - line), line);
+         line = end + 1;
+      }
+      event[e++] = '\n';
+      client_send(s, event, e);
+      c->due = now + STATUS_INTERVAL;
+      stats[Event]++;
+   }
+   else if(c->state == ClientPoll)
+   {
+      char head[256];
+      sprintf(head, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nCache-Control: no-cache\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", length);
+      c->state = ClientClosing;
+      client_send(s, head, strlen(head));
+      client_send(s, reply, length);
+      stats[Reply]++;
+      if(c->state != ClientFree && !c->out) client_close(s);
+   }
+}
+
+static void client_refuse(const int s, const char * const status)
+{
+   char head[256];
+   sprintf(head, "HTTP/1.1 %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", status);
+   client[s].state = ClientClosing;
+   client_send(s, head, strlen(head));
+   if(client[s].state != ClientFree && !client[s].out) client_close(s);
+}
+
+static void client_send(const int s, const char * const data, const size_t length)
+{
+   // Write what we can now, and queue the rest.
+   struct client * c = &client[s];
+   size_t sent = 0;
+
+   if(c->state == ClientFree) return;
+   if(!c->out)
+   {
+      ssize_t r = write(s, data, length);
+      if(r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+         client_close(s);
+         return;
+      }
+      if(r > 0) sent = r;
+      if(sent == length) return;
+   }
+
+   if(c->out_length + length - sent > MAX_PENDING)
+   {
+      _log(MINOR, "Client on socket %d dropped.  %s bytes waiting.", s, commas_q(c->out_length - c->out_sent));
+      stats[Dropped]++;
+      client_close(s);
+      return;
+   }
+   char * n = realloc(c->out, c->out_length + length - sent);
+   if(!n)
+   {
+      _log(CRITICAL, "client_send():  Out of memory.");
+      client_close(s);
+      return;
+   }
+   if(!c->out)
+   {
+      // Start watching for room to write.
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLOUT;
+      ev.data.fd = s;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &ev);
+   }
+   c->out = n;
+   memcpy(c->out + c->out_length, data + sent, length - sent);
+   c->out_length += length - sent;
+}
+
+static void client_write(const int s)
+{
+   // Room to write the queued output.
+   struct client * c = &client[s];
+
+   if(c->state == ClientFree || !c->out) return;
+   ssize_t r = write(s, c->out + c->out_sent, c->out_length - c->out_sent);
+   if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+   if(r <= 0)
+   {
+      client_close(s);
+      return;
+   }
+   c->out_sent += r;
+   if(c->out_sent < c->out_length) return;
+
+   free(c->out);
+   c->out = NULL;
+   c->out_length = c->out_sent = 0;
+   if(c->state == ClientClosing)
+   {
+      client_close(s);
+      return;
+   }
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.fd = s;
+   epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &ev);
+}
+
+static void client_close(const int s)
+{
+   if(client[s].state == ClientFree) return;
+   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, NULL);
+   close(s);
+   free(client[s].out);
+   client[s].out = NULL;
+   client[s].state = ClientFree;
+   clients--;
+   _log(DEBUG, "Client on socket %d closed.  %d clients.", s, clients);
+}
+
+static void report_stats(void)
+{
+   char zs[512];
+   word i;
+   char report[4096];
+
+   _log(GENERAL, "");
+   sprintf(zs, "%25s: %-12s Total", "", "Day");
+   _log(GENERAL, zs);
+   strcpy(report, zs);
+   strcat(report, "\n");
+
+   sprintf(zs, "%25s: %-12s %ld days", "Run time", "", (time(NULL) - start_time)/(24*60*60));
+   _log(GENERAL, zs);
+   strcat(report, zs);
+   strcat(report, "\n");
+   for(i=0; i<MAXstats; i++)
+   {
+      grand_stats[i] += stats[i];
+      sprintf(zs, "%25s: %-12s ", stats_category[i], commas_q(stats[i]));
+      strcat(zs, commas_q(grand_stats[i]));
+      _log(GENERAL, zs);
+      strcat(report, zs);
+      strcat(report, "\n");
+      stats[i] = 0;
+   }
+   sprintf(zs, "%25s: %d", "Clients connected", clients);
+   _log(GENERAL, zs);
+   strcat(report, zs);
+   strcat(report, "\n");
+
+   email_alert(NAME, BUILD, "Statistics Report", report);
+   _log(GENERAL, "");
+}
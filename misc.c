@@ -26,7 +26,9 @@
 #include <sys/timex.h>
 #include <stdarg.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
+#include <signal.h>
 #include <netdb.h>
 #include <wait.h>
 #include <sys/stat.h>
@@ -463,13 +465,15 @@ static const char * const config_keys[MAX_CONF] = {"db_server", "db_name", "db_u
                                                    "report_email",
                                                    "stomp_topics", "stomp_topic_names", "stomp_topic_log",
                                                    "stompy_bin", "trustdb_no_deduce_act", "huyton_alerts",
-                                                   "live_server", "tddb_report_new", "debug",};
+                                                   "live_server", "tddb_report_new", "debug",
+                                                   "stompy_fsync", "stompy_stream_memory", "db_slow_query", "corpus_map",};
 static const byte config_type[MAX_CONF] = { 0, 0, 0, 0,
                                             0, 0,
                                             0,
                                             0, 0, 0,
                                             1, 1, 1,
                                             1, 1, 1,
+                                            0, 0, 0, 0,
 };
 
 char * load_config(const char * const filepath)
@@ -597,13 +601,28 @@ ssize_t read_all(const int socket, void * buffer, const size_t size)
    return size;
 }
 
+// stompy client protocol.  See the description in stompy.c.
 static fd_set sockets;
 static int stompy_socket;
+static byte stompy_windowed;
+static word stompy_unacked_a;
+static qword stompy_last_seq, stompy_acked_seq;
+
 word open_stompy(const word port)
 {
+   return open_stompy_window(port, 1);
+}
+
+word open_stompy_window(const word port, const word window)
+{
+   // Window is the number of frames stompy may send before waiting for an ack.
+   // 1 gives the original stop-and-wait protocol.
    struct sockaddr_in serv_addr;
    struct hostent *server;
    stompy_socket = -1;
+   stompy_windowed = false;
+   stompy_unacked_a = 0;
+   stompy_last_seq = stompy_acked_seq = 0;
 
    _log(GENERAL, "Connecting socket to stompy...");
    stompy_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -638,56 +657,102 @@ word open_stompy(const word port)
       stompy_socket = -1;
       return 1;
    }
-   _log(GENERAL, "Connected.  Waiting for messages...");
+
+   // Send acks immediately
+   int one = 1;
+   setsockopt(stompy_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+   if(window > 1)
+   {
+      // Request windowed mode.
+      byte request[1 + sizeof(dword)];
+      dword w = window;
+      request[0] = 'W';
+      memcpy(request + 1, &w, sizeof(dword));
+      if(write(stompy_socket, request, sizeof(request)) != sizeof(request))
+      {
+         _log(CRITICAL, "Failed to send window request.  Error %d %s", errno, strerror(errno));
+         close(stompy_socket);
+         stompy_socket = -1;
+         return 1;
+      }
+      _log(GENERAL, "Connected.  Requested window of %d frames.  Waiting for messages...", window);
+   }
+   else
+   {
+      _log(GENERAL, "Connected.  Waiting for messages...");
+   }
    FD_ZERO(&sockets);
    FD_SET(stompy_socket, &sockets);
    return 0;
 }
 
-word read_stompy(void * buffer, const size_t max_size, const word seconds)
+static word read_stompy_bytes(void * buffer, const size_t size, const word seconds, const word timeout_result)
 {
-   // Given a blocking socket, blocks until a full STOMP frame has been read, or end-of-file/error/timeout
-   // Return 0 Success.
-   //        1 End of file.
-   //        2 Error.  See errno.
-   //        3 Timeout.
-   //        4 Closed.
-   //        5 Message too long.
-   //        6 Timeout on message body.
-
+   // Blocks until size bytes have been read, or end-of-file/error/timeout.
+   // Returns 0 success, 1 EOF, 2 error or timeout_result.
    ssize_t l;
    size_t got = 0;
-   ssize_t length;
    word result = 0;
    fd_set active_sockets;
    struct timeval wait_time;
-   _log(PROC, "read_stompy(~, %ld, %d)", max_size, seconds);
-
-   if(stompy_socket < 0) return 4;
-
 
-   while(got < sizeof(ssize_t) && !result)
+   while(got < size && !result)
    {
       active_sockets = sockets;
       wait_time.tv_sec = seconds;
       wait_time.tv_usec = 0;
       int r = select(FD_SETSIZE, &active_sockets, NULL, NULL, seconds?(&wait_time):NULL);
-      _log(DEBUG, "First select returns %d.", r);
-      if(r == 0) result = 3;
+      if(r == 0) result = timeout_result;
       if(r <  0) result = 2;
 
       if(!result)
       {
-         l = read(stompy_socket, buffer + got, sizeof(size_t) - got);
+         l = read(stompy_socket, buffer + got, size - got);
          if(l < 0) result = 2;
          if(l == 0) result = 1;
-         got += l;
+         if(l > 0) got += l;
       }
    }
+   if(result == timeout_result && got) _log(MAJOR, "read_stompy() Timeout after receiving 0x%08zx of 0x%08zx bytes.", got, size);
+   return result;
+}
 
-   if(result) return result;
+word read_stompy(void * buffer, const size_t max_size, const word seconds)
+{
+   // Given a blocking socket, blocks until a full STOMP frame has been read, or end-of-file/error/timeout
+   // Return 0 Success.
+   //        1 End of file.
+   //        2 Error.  See errno.
+   //        3 Timeout.
+   //        4 Closed.
+   //        5 Message too long.
+   //        6 Timeout on message body.
+
+   ssize_t length;
+   qword seq;
+   word result;
+   _log(PROC, "read_stompy(~, %ld, %d)", max_size, seconds);
+
+   if(stompy_socket < 0) return 4;
+
+   if((result = read_stompy_bytes(&length, sizeof(ssize_t), seconds, 3))) return result;
+
+   if(length < 0)
+   {
+      // stompy has accepted our window request.  Frames from here on carry a sequence number.
+      if((result = read_stompy_bytes(&seq, sizeof(qword), seconds, 6))) return result;
+      _log(DEBUG, "Windowed mode starts after sequence number %lld.", seq);
+      stompy_windowed = true;
+      stompy_last_seq = stompy_acked_seq = seq;
+      if((result = read_stompy_bytes(&length, sizeof(ssize_t), seconds, 3))) return result;
+   }
+
+   if(stompy_windowed)
+   {
+      if((result = read_stompy_bytes(&seq, sizeof(qword), seconds, 6))) return result;
+   }
 
-   memcpy(&length, buffer, sizeof(ssize_t));
    _log(DEBUG, "Received frame length = 0x%zx", length);
    if(length > max_size) 
    {
@@ -695,39 +760,56 @@ word read_stompy(void * buffer, const size_t max_size, const word seconds)
       return 5;
    }
 
-   got = 0;
-   while(got < length && !result)
+   if((result = read_stompy_bytes(buffer, length, seconds, 6)))
    {
-      active_sockets = sockets;
-      wait_time.tv_sec = seconds;
-      wait_time.tv_usec = 0;
-      int r = select(FD_SETSIZE, &active_sockets, NULL, NULL, seconds?(&wait_time):NULL);
-      _log(DEBUG, "Second select returns %d.", r);
-      if(r == 0) result = 6;
-      if(r <  0) result = 2;
-
-      if(!result)
-      {
-         l = read(stompy_socket, buffer + got, length - got);
-         if(l < 0) result = 2;
-         if(l == 0) result = 1;
-         got += l;
-      }
+      if(result == 6) _log(MAJOR, "read_stompy() Error 6:  Timeout while waiting for message body.");
+      return result;
    }
 
-   if(result == 6) _log(MAJOR, "read_stompy() Error 6:  Timeout while waiting for message body.  Received 0x%08zx of 0x%08zx bytes.", got, length);
+   if(stompy_windowed) stompy_last_seq = seq;
+   else stompy_unacked_a++;
 
-   return result;
+   return 0;
+}
+
+word stompy_pending(const dword ms)
+{
+   // Returns true if anything arrives from stompy within ms milliseconds.
+   fd_set active_sockets = sockets;
+   struct timeval wait_time;
+
+   if(stompy_socket < 0) return false;
+   wait_time.tv_sec = ms / 1000;
+   wait_time.tv_usec = (ms % 1000) * 1000;
+   return (select(FD_SETSIZE, &active_sockets, NULL, NULL, &wait_time) > 0) ? true : false;
 }
 
 word ack_stompy(void)
 {
+   // Acknowledge all frames read so far.
+   byte ack[256];
+   size_t l = 0;
    _log(PROC, "ack_stompy()");
    if(stompy_socket < 0) return 1;
-   if(write(stompy_socket, "A", 1) < 1) return 1;
+
+   // Frames which arrived before the window was accepted are acknowledged individually.
+   while(stompy_unacked_a && l < sizeof(ack) - 1 - sizeof(qword))
+   {
+      ack[l++] = 'A';
+      stompy_unacked_a--;
+   }
+   if(stompy_windowed && stompy_last_seq != stompy_acked_seq)
+   {
+      ack[l++] = 'K';
+      memcpy(ack + l, &stompy_last_seq, sizeof(qword));
+      l += sizeof(qword);
+   }
+   if(!l) return 0;
+   if(write(stompy_socket, ack, l) < l) return 1;
+   stompy_acked_seq = stompy_last_seq;
    return 0;
-   
 }
+
 void close_stompy(void)
 {
    _log(PROC, "close_stompy()");
@@ -838,3 +920,17 @@ char * show_inst_percent(qword * s, qword * t, const qword l, const qword n)
 
    return display;
 }
+
+word signal_pending(const int signum)
+{
+   // For a signal which has been blocked, returns true and clears it if it has been received since the last call.
+   // Blocking the signal stops it interrupting a read, and lets it be picked up at a convenient point in a loop.
+   sigset_t pending;
+   int sig;
+
+   if(sigpending(&pending) || !sigismember(&pending, signum)) return false;
+   sigemptyset(&pending);
+   sigaddset(&pending, signum);
+   sigwait(&pending, &sig);
+   return true;
+}
@@ -36,6 +36,7 @@ enum config_keys {conf_db_server, conf_db_name, conf_db_user, conf_db_password,
                   conf_stomp_topics, conf_stomp_topic_names, conf_stomp_topic_log,
                   conf_stompy_bin, conf_trustdb_no_deduce_act, conf_huyton_alerts,
                   conf_live_server, conf_tddb_report_new, conf_debug, 
+                  conf_stompy_fsync, conf_stompy_stream_memory, conf_db_slow_query, conf_corpus_map,
                   MAX_CONF};
 extern char * conf[MAX_CONF];
 enum log_types {GENERAL, PROC, DEBUG, MINOR, MAJOR, CRITICAL, ABEND};
@@ -57,9 +58,12 @@ extern char * show_time_text(const char * const input);
 extern char * load_config(const char * const filepath);
 extern qword time_ms(void);
 extern qword time_us(void);
+extern word signal_pending(const int signum);
 extern ssize_t read_all(const int socket, void * buffer, const size_t size);
 extern word open_stompy(const word port);
+extern word open_stompy_window(const word port, const word window);
 extern word read_stompy(void * buffer, const size_t max_size, const word seconds);
+extern word stompy_pending(const dword ms);
 extern word ack_stompy(void);
 extern void close_stompy(void);
 extern void extract_match(const char * const source, const regmatch_t * const matches, const unsigned int match, char * result, const size_t max_length);
@@ -29,6 +29,7 @@
 
 #include "misc.h"
 #include "db.h"
+#include "fcgi.h"
 #include "build.h"
 
 #define NAME "ops"
@@ -56,15 +57,30 @@ static char query[4096];
 
 static char host[256];
 
+static void request(void);
 static void display_control_panel(const char * const b);
 static void describers(void);
 static void banners(void);
 
 int main()
 {
+   // Under FastCGI this serves many requests, keeping the configuration and database connection between them.
+   while(!fcgi_accept())
+   {
+      request();
+      fcgi_finish();
+   }
+   exit(0);
+}
+
+static void request(void)
+{
+   static char config_loaded[256];
+   word config_changed = false;
    char zs[1024];
 
    now = time(NULL);
+   db_errored = false;
    qword start_time = time_us();
 
    char * parms = getenv("PARMS");
@@ -86,7 +102,7 @@ int main()
          l = j;
       }
    }
-   if(k) parameters[j++][k] = '\0';
+   if(k && j < PARMS) parameters[j++][k] = '\0';
 
    while(j < PARMS) parameters[j++][0] = '\0';
 
@@ -95,11 +111,17 @@ int main()
 
       strcpy(config_file_path, "/etc/openrail.conf");
 
-      char * config_fail;
-      if((config_fail = load_config(config_file_path)))
+      if(strcmp(config_file_path, config_loaded))
       {
-         printf("<p>Failed to read config file \"%s\":  %s</p>\n", config_file_path, config_fail);
-         exit(0);
+         char * config_fail;
+         if((config_fail = load_config(config_file_path)))
+         {
+            printf("<p>Failed to read config file \"%s\":  %s</p>\n", config_file_path, config_fail);
+            config_loaded[0] = '\0';
+            return;
+         }
+         strcpy(config_loaded, config_file_path);
+         config_changed = true;
       }
    }
 
@@ -142,7 +164,11 @@ int main()
    printf("<body>\n");
 
    // Initialise database
-   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name]);
+   if(config_changed)
+   {
+      db_disconnect();
+      db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name]);
+   }
 
    sprintf(zs, "Parameters:  (l = %d)", l);
    _log(GENERAL, zs);
@@ -180,7 +206,6 @@ int main()
         
       printf("</body></html>\n\n");
    }
-   exit(0);
 }
 
 static void display_control_panel(const char * const b)
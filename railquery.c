@@ -30,6 +30,8 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
+#include "fcgi.h"
 #include "build.h"
 
 #define NAME "railquery"
@@ -41,6 +43,7 @@
 #define BUILD RELEASE_BUILD
 #endif
 
+static void request(void);
 static void display_menu(void);
 static void report_b(void);
 static void report_c(void);
@@ -73,7 +76,22 @@ MYSQL_ROW      db_row[QUERIES];
 
 int main()
 {
+   // Under FastCGI this serves many requests, keeping the configuration and database connection between them.
+   while(!fcgi_accept())
+   {
+      request();
+      fcgi_finish();
+   }
+   exit(0);
+}
+
+static void request(void)
+{
+   static char config_loaded[256];
+   word config_changed = false;
+
    now = time(NULL);
+   db_errored = false;
 
    qword start_time = time_ms();
    mode = '-';
@@ -102,7 +120,7 @@ int main()
          l = j;
       }
    }
-   if(k) parameters[j++][k] = '\0';
+   if(k && j < PARMS) parameters[j++][k] = '\0';
 
    while(j < PARMS) parameters[j++][0] = '\0';
 
@@ -111,11 +129,17 @@ int main()
 
       strcpy(config_file_path, "/etc/openrail.conf");
 
-      char * config_fail;
-      if((config_fail = load_config(config_file_path)))
+      if(strcmp(config_file_path, config_loaded))
       {
-         printf("<p>Failed to read config file \"%s\":  %s</p>\n", config_file_path, config_fail);
-         exit(0);
+         char * config_fail;
+         if((config_fail = load_config(config_file_path)))
+         {
+            printf("<p>Failed to read config file \"%s\":  %s</p>\n", config_file_path, config_fail);
+            config_loaded[0] = '\0';
+            return;
+         }
+         strcpy(config_loaded, config_file_path);
+         config_changed = true;
       }
    }
 
@@ -154,7 +178,11 @@ int main()
    printf("<body style=\"font-family: arial,sans-serif;\" onload=\"startup();\">\n");
 
    // Initialise database
-   db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name]);
+   if(config_changed)
+   {
+      db_disconnect();
+      db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name]);
+   }
 
    _log(GENERAL, "Parameters:  (l = %d)", l);
    for(i=0;i < PARMS; i++)
@@ -204,8 +232,6 @@ int main()
    printf("</div></p>");
 
    printf("</body></html>\n\n");
-   
-   exit(0);
 }
 
 static void display_menu(void)
@@ -839,6 +865,21 @@ static char * location_name(const char * const tiploc)
    char query[256];
    static char result[256];
 
+   if(corpus_available())
+   {
+      const char * fn = corpus_tiploc_name(tiploc);
+      if(fn)
+      {
+         strncpy(result, fn, 127);
+         result[127] = '\0';
+      }
+      else
+      {
+         strcpy(result, tiploc);
+      }
+      return result;
+   }
+
    sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
    db_query(query);
    db_result[2] = db_store_result();
@@ -862,6 +903,21 @@ static char * location_name_stanox(const word stanox)
    char query[256];
    static char result[256];
 
+   if(corpus_available())
+   {
+      const char * fn = corpus_stanox_name(stanox);
+      if(fn)
+      {
+         strncpy(result, fn, 127);
+         result[127] = '\0';
+      }
+      else
+      {
+         sprintf(result, "%d", stanox);
+      }
+      return result;
+   }
+
    sprintf(query, "select fn from corpus where stanox = %d", stanox);
    db_query(query);
    db_result[2] = db_store_result();
@@ -28,6 +28,7 @@
 
 #include "misc.h"
 #include "db.h"
+#include "corpus.h"
 #include "build.h"
 
 static void report(const char * const tiploc, const word year, const word month);
@@ -533,32 +534,43 @@ static void report_train_day(const word index, const time_t when, const char * c
                      }
                      if(status < Departed)
                      {
-                        sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s", row1[1]);
-                        if(!db_query(query))
+                        const char * movement_tiploc = NULL;
+                        result2 = NULL;
+                        if(corpus_available())
                         {
-                           result2 = db_store_result();
-                           if((row2 = mysql_fetch_row(result2)))
+                           const struct corpus_entry * entry = corpus_stanox(atol(row1[1]));
+                           if(entry) movement_tiploc = entry->tiploc;
+                        }
+                        else
+                        {
+                           sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s", row1[1]);
+                           if(!db_query(query))
+                           {
+                              result2 = db_store_result();
+                              if((row2 = mysql_fetch_row(result2))) movement_tiploc = row2[0];
+                           }
+                        }
+                        if(movement_tiploc)
+                        {
+                           if(!strcasecmp(tiploc, movement_tiploc))
                            {
-                              if(!strcasecmp(tiploc, row2[0]))
+                              // Bug: For a train which calls twice, we will analyse the first visit twice.
+                              if(!strcasecmp("departure", row1[0]))
+                              {
+                                 // Got a departure report at our station
+                                 status = Departed;
+                                 strcpy(actual, row1[2]);
+                                 deviation = atoi(row1[3]);
+                                 late = ((flags & 0x0018) == 0x0010);
+                              }
+                              else if(status < Arrived)
                               {
-                                 // Bug: For a train which calls twice, we will analyse the first visit twice.
-                                 if(!strcasecmp("departure", row1[0]))
-                                 {
-                                    // Got a departure report at our station
-                                    status = Departed;
-                                    strcpy(actual, row1[2]);
-                                    deviation = atoi(row1[3]);
-                                    late = ((flags & 0x0018) == 0x0010);
-                                 }
-                                 else if(status < Arrived)
-                                 {
-                                    // Got an arrival from our station AND haven't seen a departure yet
-                                    status = Arrived;
-                                 }
+                                 // Got an arrival from our station AND haven't seen a departure yet
+                                 status = Arrived;
                               }
                            }
-                           mysql_free_result(result2);
                         }
+                        if(result2) mysql_free_result(result2);
                      }
                   }
                   mysql_free_result(result1);
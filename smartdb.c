@@ -28,6 +28,7 @@
 #include <curl/curl.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <zlib.h>
 
 #include "jsmn.h"
 #include "misc.h"
@@ -57,10 +58,15 @@ word debug;
 static word fetch_file(void);
 static size_t file_write_data(void *buffer, size_t size, size_t nmemb, void *userp);
 static word process_file(void);
-static void process_smart_object(const char * const object_string);
+static word process_smart_object(const char * const object_string);
+static word install_smart(void);
 
 dword count_records;
 
+// Loaded by process_file(), installed by install_smart().
+static struct db_batch batch;
+static char new_indexes[DB_INDEXES_SIZE];
+
 word opt_insecure, used_insecure, opt_verbose;
 
 int main(int argc, char **argv)
@@ -147,7 +153,7 @@ int main(int argc, char **argv)
    // Initialise database
    if(db_init(conf[conf_db_server], conf[conf_db_user], conf[conf_db_password], conf[conf_db_name])) exit(1);
 
-   if(!fetch_file() && !process_file())
+   if(!fetch_file() && !process_file() && !install_smart())
    {
       db_disconnect();
       char report[8192];
@@ -175,6 +181,7 @@ int main(int argc, char **argv)
       exit(0);
    }
 
+   db_query("DROP TABLE IF EXISTS smart_new");
    email_alert(NAME, BUILD, "SMART Data Update Failure Report", "SMART data update failed.  See log file for details.");
    
    db_disconnect();
@@ -272,18 +279,7 @@ static word fetch_file(void)
    if(slist) curl_slist_free_all(slist);
    slist = NULL;
 
-   if(!result)
-   {
-      // Uncompress
-      char * r;
-      _log(GENERAL, "Uncompressing downloaded data.");
-      sprintf(zs, "/bin/gunzip -f %s", filepath_z);
-      if((r = system_call(zs)))
-      {
-         _log(MAJOR, "Failed to uncompress file:  %s", r);
-         result = 5;
-      }
-   }
+   // The file is decompressed as it is read.
    return result;
 }
 
@@ -305,6 +301,7 @@ static size_t file_write_data(void *buffer, size_t size, size_t nmemb, void *use
 static word process_file(void)
 {
    char zs[1024];
+   word fail = false;
 
 #define MAX_BUF 32768
    char buffer[MAX_BUF];
@@ -317,26 +314,32 @@ static word process_file(void)
    size_t iobj = 0;
    size_t buf_end;
 
-   FILE * fp;
+   gzFile fp;
    
    _log(GENERAL, "Processing SMART data.");
 
    // Read in json data
-   if(!(fp = fopen(filepath, "r")))
+   if(!(fp = gzopen(filepath_z, "r")))
    {
-      sprintf(zs, "Failed to open \"%s\" for reading.", filepath);
+      sprintf(zs, "Failed to open \"%s\" for reading.", filepath_z);
       _log(CRITICAL, zs);
       return 11;
    }      
 
-   // Reset the database
+   // Build the new table
    database_upgrade(smartdb);
-   db_query("DELETE FROM smart");
+   if(db_query("DROP TABLE IF EXISTS smart_new") || db_query("CREATE TABLE smart_new LIKE smart") || db_drop_indexes("smart_new", new_indexes))
+   {
+      gzclose(fp);
+      return 13;
+   }
+   db_start_transaction();
+   db_batch_init(&batch, "INSERT INTO smart_new VALUES", NULL);
 
    // Bodge:  Bin off the array stuff
-   buf_end = fread(buffer, 1, 14, fp);
+   buf_end = gzfread(buffer, 1, 14, fp);
 
-   while((buf_end = fread(buffer, 1, MAX_BUF, fp)))
+   while(!fail && (buf_end = gzfread(buffer, 1, MAX_BUF, fp)))
    {
       // printf("Read %zd bytes.\n", buf_end);
       for(ibuf = 0; ibuf < buf_end; ibuf++)
@@ -355,16 +358,52 @@ static word process_file(void)
          if(!in_q && c == '}' && b_depth-- && b_depth == 0)
          {
             obj[iobj] = '\0';
-            process_smart_object(obj);
+            if(process_smart_object(obj)) fail = true;
             iobj = 0;
          }
       }
    }
 
-   fclose(fp);
+   int error;
+   const char * message = gzerror(fp, &error);
+   if(error != Z_OK)
+   {
+      _log(CRITICAL, "Failed to uncompress file:  %s", message);
+      gzclose(fp);
+      db_rollback_transaction();
+      return 12;
+   }
+
+   gzclose(fp);
+   if(fail || db_batch_flush(&batch))
+   {
+      db_rollback_transaction();
+      return 13;
+   }
+   db_commit_transaction();
+
+   if(!count_records)
+   {
+      _log(CRITICAL, "No records found in SMART data.");
+      return 14;
+   }
+
+   if(new_indexes[0])
+   {
+      _log(GENERAL, "Building indexes.");
+      if(db_rebuild_indexes("smart_new", new_indexes)) return 13;
+   }
 
    return 0;
-   
+}
+
+static word install_smart(void)
+{
+   _log(GENERAL, "Installing new SMART table.");
+   if(db_query("DROP TABLE IF EXISTS smart_old")) return 1;
+   if(db_query("RENAME TABLE smart TO smart_old, smart_new TO smart")) return 1;
+   db_query("DROP TABLE smart_old");
+   return 0;
 }
 
 #define EXTRACT_APPEND_SQL(a,b) { jsmn_find_extract_token(object_string, tokens, 0, a, zs, sizeof( zs )); \
@@ -377,8 +416,9 @@ if(strlen(zs1) > b) \
 } \
 strcat(query, ", '"); strcat(query, zs1); strcat(query, "'"); }
 
-static void process_smart_object(const char * const object_string)
+static word process_smart_object(const char * const object_string)
 {
+   // Returns non-zero if the database failed.
    char zs[1024], zs1[1024];
 
    jsmn_parser parser;
@@ -403,13 +443,13 @@ static void process_smart_object(const char * const object_string)
       }
       
       _log(MAJOR, zs);
-      return;
+      return 0;
    }
 
    // jsmn_dump_tokens(object_string, tokens, 0);
    // printf("|%s|\n", object_string);
    char query[2048];
-   strcpy(query, "INSERT INTO smart VALUES(0"); // ID 
+   strcpy(query, "(0"); // ID 
    EXTRACT_APPEND_SQL("fromberth", 4);
    EXTRACT_APPEND_SQL("td", 2);
    EXTRACT_APPEND_SQL("stanox", 10);
@@ -426,7 +466,8 @@ static void process_smart_object(const char * const object_string)
 
    strcat(query, ")");
 
-   if(!db_query(query)) count_records++;
-   return;
+   if(db_batch_insert(&batch, query)) return 1;
+   count_records++;
+   return 0;
 }
 
@@ -32,9 +32,13 @@
 #include <sys/resource.h>
 #include <sys/sysinfo.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <netdb.h>
 #include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 
 #include "misc.h"
 #include "build.h"
@@ -70,15 +74,14 @@ static ssize_t stomp_tx_queue_on, stomp_tx_queue_off;
 #define STOMP_HOST "datafeeds.networkrail.co.uk"
 #define STOMP_PORT 61618
 
-// Select timeout period in seconds
-#define SELECT_TIMEOUT 2
-
 // Sockets
-static fd_set read_sockets, write_sockets, active_read_sockets, active_write_sockets;
 static int s_stomp;
 static byte s_stream[FD_SETSIZE];
-#define STREAMS 3
+// Maximum number of streams.  The number in use is set by the stomp_topics config.  A topic may be listed more
+// than once to feed more than one client.
+#define STREAMS 16
 #define STOMP STREAMS
+static word streams;
 static byte s_type[FD_SETSIZE];
 enum s_types {CLIENT, SERVER, TYPES};
 static int s_number[STREAMS][TYPES];
@@ -91,6 +94,18 @@ static char * stomp_topic_names[STREAMS];
 static word stomp_topic_log[STREAMS];
 static char topics[1024];
 
+// Event core
+// Sockets are registered edge-triggered.  s_ready records readiness reported by epoll, and is cleared when a
+// read or write comes up short.  s_want records what we are currently interested in.  Any socket which is
+// both wanted and ready is serviced.
+static int epoll_fd, timer_fd;
+#define EV_READ  1
+#define EV_WRITE 2
+static byte s_want[FD_SETSIZE], s_ready[FD_SETSIZE];
+static int s_registered[FD_SETSIZE];
+static word s_registered_count;
+#define MAX_EVENTS 64
+
 // Stats
 static time_t start_time;
 enum stats_categories {StompBytes, ConnectAttempt, StompMessage, StompInvalid, BaseStreamFrameSent, 
@@ -100,8 +115,8 @@ static qword stats[MAXstats];
 static qword grand_stats[MAXstats];
 static const char * stats_category[MAXstats] = 
    {
-      "STOMP Bytes", "STOMP Connect Attempt", "Accepted STOMP Message", "Discarded STOMP Message", "", "", "",
-      "Frame Disc Write", "Frame Disc Read",
+      "STOMP Bytes", "STOMP Connect Attempt", "Accepted STOMP Message", "Discarded STOMP Message",
+      [DiscWrite] = "Frame Disc Write", "Frame Disc Read",
    };
 
 // Timers
@@ -124,6 +139,32 @@ static time_t stomp_holdoff_time[8] = { 8, 64, 64, 128, 128, 128, 128, 256};
 // This and sub-directories will be created if required.
 #define STOMPY_SPOOL "/var/spool/stompy"
 static char spool_path[STREAMS][1024];
+// Each stream's spool directory holds a journal.  This is a series of segment files, each named after the sequence
+// number of its first record, and a file "cursor" recording where reading is to resume.  A record is a journal_header
+// followed by the frame without its terminating \0.  Frames are appended to the newest segment, and segments are
+// deleted once every frame in them has been sent and acked.
+#define JOURNAL_SEGMENT_SIZE (16 * 1024 * 1024)
+// Maximum frames written between syncs, whatever the policy.
+#define JOURNAL_SYNC_FRAMES 256
+struct journal_header
+{
+   dword length;
+   dword crc;   // CRC-32 of stamp, seq and frame.
+   qword stamp;
+   qword seq;
+};
+static struct journal
+{
+   qword first_segment, write_segment, read_segment;
+   off_t write_offset, read_offset;
+   qword write_seq, read_seq;  // Next record to be written, and the record at the cursor.
+   qword oldest;               // Stamp of the record at the cursor.
+   dword next_length;          // Size of buffer it needs.
+   int write_fd, read_fd, cursor_fd;
+   dword unsynced;
+} journal[STREAMS];
+static enum {JOURNAL_SYNC_INTERVAL, JOURNAL_SYNC_ALWAYS, JOURNAL_SYNC_NEVER} journal_sync_policy;
+static time_t journal_sync_interval, journal_sync_due;
 
 // Command file
 #define COMMAND_FILE "/tmp/stompy.cmd"
@@ -135,20 +176,62 @@ static char spool_path[STREAMS][1024];
 #define MESSAGE_LOG_FILEPATH "/var/log/garner/stompy.messagelog"
 
 // Frame buffers and queues thereof
-#define BUFFERS 32
+// Buffers are carved from slabs in several size classes, so a small frame only ties up a small buffer.  Slabs are
+// allocated as required and never freed.  When the buffers in a stream's queue reach stream_budget bytes, the queue
+// goes to disc.
 #define FRAME_SIZE 64000
+#define SLAB_SIZE (1024 * 1024)
+#define SIZE_CLASSES 5
+static const dword size_class[SIZE_CLASSES] = {1024, 4096, 16384, 32768, FRAME_SIZE};
+// Default stream_budget, in megabytes.
+#define STREAM_BUDGET 4
 static struct frame_buffer
 {
-   char frame[FRAME_SIZE];
    qword stamp;
+   // Position in the journal, if the frame was read from it.  segment 0 if not.
+   qword segment, seq;
+   off_t offset;
    struct frame_buffer * next;
-} buffers[BUFFERS];
-static struct frame_buffer * empty_list, * stream_q_on[STREAMS], * stream_q_off[STREAMS];
+   word size_class;
+   char frame[];  // size_class[size_class] bytes.
+} * empty_list[SIZE_CLASSES], * stream_q_on[STREAMS], * stream_q_off[STREAMS];
+static qword pool_bytes, pool_in_use, stream_bytes[STREAMS], stream_budget;
+static char journal_scratch[FRAME_SIZE];
+
+// STOMP receive buffer.  Must hold a complete frame.
+#define MAX_HEADER 1024
+#define STOMP_RX_SIZE (4 * FRAME_SIZE)
+static char stomp_rx[STOMP_RX_SIZE];
+static char stomp_rx_headers[MAX_HEADER];
+// Offsets into stomp_rx:  Data from off to on are unprocessed.  start and body are the start of the current frame
+// and of its body.  scan is where to resume searching for a terminator.
+static ssize_t stomp_rx_on, stomp_rx_off, stomp_rx_start, stomp_rx_body, stomp_rx_scan;
+static ssize_t stomp_rx_content_length, stomp_rx_skip;
+static word stomp_rx_stream, stomp_rx_validated, stomp_rx_fail_send_ack, stomp_rx_connected;
+static char * stomp_rx_mid;
  
 // Client interface
+// Each frame is sent to the client as a ssize_t length (including the terminating \0) followed by the frame.
+// The client replies "A" to acknowledge the oldest unacknowledged frame.
+// A client may send "W" followed by a dword window size.  Up to that many frames will then be sent without waiting
+// for an ack.  Before the next frame, stompy sends a length of -1 followed by the qword sequence number of the last
+// frame already sent.  From then on each length is followed by the qword sequence number of the frame, and the client
+// may reply "K" followed by a qword sequence number, which acknowledges that frame and all those before it.
+// A window of 1 is the original stop-and-wait protocol.
 static ssize_t client_length[STREAMS], client_index[STREAMS];
 static struct frame_buffer * client_buffer[STREAMS];
 static enum { CLIENT_IDLE, CLIENT_AWAIT_ACK, CLIENT_RUN} client_state[STREAMS];
+// The first client_in_flight frames in the stream queue have been sent, or are being sent, and are not yet acked.
+#define CLIENT_WINDOW_MAX 64
+static word client_window[STREAMS], client_in_flight[STREAMS];
+static byte client_windowed[STREAMS], client_window_announce[STREAMS];
+static qword client_seq[STREAMS];
+#define CLIENT_HEADER_SIZE (2 * (sizeof(ssize_t) + sizeof(qword)))
+static byte client_header[STREAMS][CLIENT_HEADER_SIZE];
+static ssize_t client_header_length[STREAMS], client_header_index[STREAMS];
+#define CLIENT_RX_SIZE 64
+static byte client_rx[STREAMS][CLIENT_RX_SIZE];
+static ssize_t client_rx_length[STREAMS];
 
 // Instrumentation
 enum inst_categories {StartPeriod, StartIdle, TotalIdle, BaseStartWaitClientAck, BaseTotalWaitClientAck = BaseStartWaitClientAck + STREAMS,
@@ -157,12 +240,24 @@ enum inst_categories {StartPeriod, StartIdle, TotalIdle, BaseStartWaitClientAck,
 static qword inst[MAXinst];
 
 static void perform(void);
+static void event_add(const int s);
+static void event_remove(const int s);
+static void event_want(const int s, const byte e);
+static void event_unwant(const int s, const byte e);
+static void event_not_ready(const int s, const byte e);
+static void set_timer(void);
 static void set_up_server_sockets(void);
 static void stomp_write(void);
 static void stomp_read(void);
+static void stomp_rx_frames(void);
+static word stomp_rx_validate(void);
+static word stomp_rx_buffer(const ssize_t length);
+static void stomp_send_ack(void);
 static void client_write(const int s);
 static void client_read(const int s);
 static void client_accept(const int s);
+static void client_reset(const word stream);
+static void client_disconnect(const word stream);
 static void user_command(void);
 static void send_subscribes(void);
 static void handle_shutdown(word report);
@@ -178,20 +273,30 @@ static void report_status(void);
 static void dump_headers(const char * const h);
 
 static void init_buffers_queues(void);
-static struct frame_buffer * new_buffer(void);
+static struct frame_buffer * new_buffer(const size_t length);
 static void free_buffer(struct frame_buffer * const b);
 static void enqueue(const word s, struct frame_buffer * const b);
 static struct frame_buffer * dequeue(const word s);
-static struct frame_buffer * queue_front(const word s);
+static struct frame_buffer * queue_entry(const word s, const word n);
 static word queue_length(const word s);
 
 static void dump_buffer_to_disc(const word s, struct frame_buffer * const b);
 static word dump_queue_to_disc(const word s);
-static int is_a_buffer(const struct dirent *d);
 static word load_queue_from_disc(const word s);
 static int disc_queue_length(const word s);
 static qword disc_queue_oldest(const word s);
-static void log_message(const word s);
+static word journal_open(const word s);
+static void journal_close(const word s);
+static word journal_append(const word s, struct frame_buffer * const b);
+static word journal_peek(const word s);
+static struct frame_buffer * journal_read(const word s);
+static void journal_skip(const word s);
+static void journal_rewind(const word s, const struct frame_buffer * const b);
+static void journal_checkpoint(const word s);
+static void journal_sync(const word s);
+static void journal_sync_all(void);
+static void load_buffer_from_disc(struct frame_buffer * const b, const word s, const char * const name);
+static void log_message(const word s, const struct frame_buffer * const b);
 //static word count_messages(const struct frame_buffer * const b);
 static void heartbeat_tx(void);
 static char * show_percent(qword * s, qword * t, const qword l, const qword n);
@@ -254,8 +359,10 @@ int main(int argc, char *argv[])
       char * q;
       char * e = p + strlen(p);
       int i;
+      streams = 1;
       for(i = 0; i < STREAMS; i++)
       {
+         if(p < e) streams = i + 1;
          q = strchr(p, ';');
          if(q)
          {
@@ -309,6 +416,23 @@ int main(int argc, char *argv[])
       }
    }
 
+   // Journal sync policy
+   journal_sync_interval = 0;
+   if(!strcasecmp(conf[conf_stompy_fsync], "always"))     journal_sync_policy = JOURNAL_SYNC_ALWAYS;
+   else if(!strcasecmp(conf[conf_stompy_fsync], "never")) journal_sync_policy = JOURNAL_SYNC_NEVER;
+   else
+   {
+      journal_sync_policy = JOURNAL_SYNC_INTERVAL;
+      journal_sync_interval = atoi(conf[conf_stompy_fsync]);
+      if(journal_sync_interval <= 0) journal_sync_interval = 1;
+   }
+   journal_sync_due = 0x7fffffff;
+
+   // Memory budget
+   stream_budget = atoi(conf[conf_stompy_stream_memory]);
+   if(stream_budget <= 0) stream_budget = STREAM_BUDGET;
+   stream_budget *= 1024 * 1024;
+
    int lfp = 0;
 
    now = start_time = time(NULL);
@@ -351,7 +475,7 @@ int main(int argc, char *argv[])
          exit(1);
       }
 
-      for(s = 0; s < STREAMS; s++)
+      for(s = 0; s < streams; s++)
       {
          sprintf(spool_path[s], "%s/%s%d", STOMPY_SPOOL, debug?"d-":"", s);
 
@@ -370,9 +494,9 @@ int main(int argc, char *argv[])
                _log(CRITICAL, "Failed to chmod spool directory \"%s\".  Error %d %s", spool_path[s], errno, strerror(errno));
             }
          }
-         if(disc_queue_length(s) < 0)
+         if(journal_open(s))
          {
-            _log(CRITICAL, "Spool directory missing for stream %d.  Fatal.", s);
+            _log(CRITICAL, "Failed to open journal for stream %d.  Fatal.", s);
             exit(1);
          }
       }
@@ -496,7 +620,7 @@ int main(int argc, char *argv[])
    {
       word stream;
       _log(GENERAL, "Configured STOMP topics:");
-      for(stream = 0; stream < STREAMS; stream++)
+      for(stream = 0; stream < streams; stream++)
       if(stomp_topics[stream][0])
       {
          _log(GENERAL, "   %d: \"%s\" (%s) Logging %s.", stream, stomp_topics[stream], stomp_topic_names[stream], stomp_topic_log[stream]?"enabled":"disabled");
@@ -531,17 +655,39 @@ int main(int argc, char *argv[])
 static void perform(void)
 {
    int s;
-   word stream, type;
-
-   struct timeval wait_time;
+   word stream, type, i;
+   struct epoll_event events[MAX_EVENTS];
 
    // Initialise queues
    stomp_tx_queue_on = stomp_tx_queue_off = 0;
    init_buffers_queues();
 
+   // Initialise event core.
+   s_registered_count = 0;
+   epoll_fd = epoll_create1(0);
+   if(epoll_fd < 0)
+   {
+      _log(CRITICAL, "Failed to create epoll instance.  Error %d %s.  Fatal.", errno, strerror(errno));
+      exit(1);
+   }
+   timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+   if(timer_fd < 0)
+   {
+      _log(CRITICAL, "Failed to create timer.  Error %d %s.  Fatal.", errno, strerror(errno));
+      exit(1);
+   }
+   {
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = timer_fd;
+      if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev))
+      {
+         _log(CRITICAL, "Failed to register timer.  Error %d %s.  Fatal.", errno, strerror(errno));
+         exit(1);
+      }
+   }
+
    // Initialise all socket settings.
-   FD_ZERO (&read_sockets);
-   FD_ZERO (&write_sockets);
    s_stomp = -1;
    for(stream = 0; stream < STREAMS; stream++)
    {
@@ -549,11 +695,10 @@ static void perform(void)
       {
          s_number[stream][type] = -1;
       }
-      client_state[stream] = CLIENT_IDLE;
-      client_buffer[stream] = NULL;
+      client_reset(stream);
       stream_state[stream] = STREAM_DISC;
 
-      inst[CountOnDisc] += disc_queue_length(stream);
+      if(stream < streams) inst[CountOnDisc] += disc_queue_length(stream);
    }
 
    run = true;
@@ -575,6 +720,7 @@ static void perform(void)
    // Set up STOMP interface
    stomp_read_state = STOMP_IDLE;
    stomp_read_buffer = NULL;
+   stomp_rx_on = stomp_rx_off = 0;
    stomp_manager(SM_START, NULL);
 
 
@@ -590,21 +736,19 @@ static void perform(void)
       if(now >= alarms_due)       report_alarms();
       if(now >= rates_due)        report_rates("");
       if(now >= stomp_timeout)    stomp_manager(SM_TIMEOUT, NULL);
+      if(now >= journal_sync_due) journal_sync_all();
+      set_timer();
 
-      if(controlled_shutdown)
-      {
-         wait_time.tv_sec  = 0;
-         wait_time.tv_usec = 0x40000L;
-      }
-      else
+      // Don't wait if there is still work to do on a socket.
+      word pending = false;
+      for(i = 0; i < s_registered_count && !pending; i++)
       {
-         wait_time.tv_sec  = SELECT_TIMEOUT;
-         wait_time.tv_usec = 0;
+         s = s_registered[i];
+         if(s_want[s] & s_ready[s]) pending = true;
       }
-      active_read_sockets = read_sockets;
-      active_write_sockets = write_sockets;
+
       inst[StartIdle] = time_us();
-      int result = select(FD_SETSIZE, &active_read_sockets, &active_write_sockets, NULL, &wait_time);
+      int result = epoll_wait(epoll_fd, events, MAX_EVENTS, pending?0:(controlled_shutdown?256:-1));
       inst[TotalIdle] += (time_us() - inst[StartIdle]);
       inst[StartIdle] = 0LL;
       if(result < 0)
@@ -615,26 +759,50 @@ static void perform(void)
          }
          else
          {
-            _log(CRITICAL, "Select returns error %d %s.  Fatal.", errno, strerror(errno));
+            _log(CRITICAL, "epoll_wait() returns error %d %s.  Fatal.", errno, strerror(errno));
             run = false;
          }
       }
-      else if (result == 0)
+      else if (result == 0 && !pending)
       {
-         // Select has timed out
+         // Timed out
          if(controlled_shutdown) handle_shutdown(true);
       }
       else
       {
          // Got some activity.
-         for(s = 0; s < FD_SETSIZE; s++)
+         int e;
+         for(e = 0; e < result; e++)
+         {
+            s = events[e].data.fd;
+            if(s == timer_fd)
+            {
+               qword expirations;
+               if(read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+               {
+                  _log(MAJOR, "Error reading timer.  Error %d %s.", errno, strerror(errno));
+               }
+            }
+            else
+            {
+               if(events[e].events & (EPOLLIN  | EPOLLERR | EPOLLHUP)) s_ready[s] |= EV_READ;
+               if(events[e].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) s_ready[s] |= EV_WRITE;
+            }
+         }
+
+         // Service every socket which is wanted and ready.  Work on a copy of the list as handlers open and close sockets.
+         int active[FD_SETSIZE];
+         word active_count = s_registered_count;
+         memcpy(active, s_registered, active_count * sizeof(int));
+         for(i = 0; i < active_count; i++)
          {
-            if(FD_ISSET(s, &active_write_sockets))
+            s = active[i];
+            if(s_want[s] & s_ready[s] & EV_WRITE)
             {
                if(s_stream[s] == STOMP) stomp_write();
                else client_write(s);
             }
-            if(FD_ISSET(s, &active_read_sockets))
+            if(s_want[s] & s_ready[s] & EV_READ)
             {
                if(s_type[s] == SERVER) client_accept(s);
                else if(s_stream[s] == STOMP) stomp_read();
@@ -650,6 +818,89 @@ static void perform(void)
 
    report_status();
    report_stats();
+
+   for(stream = 0; stream < streams; stream++) journal_close(stream);
+
+   close(timer_fd);
+   close(epoll_fd);
+}
+
+static void event_add(const int s)
+{
+   // Register a socket with the event core.  Initially it is assumed to be ready for anything, and wanted for nothing.
+   struct epoll_event ev;
+   _log(PROC, "event_add(%d)", s);
+
+   if(s < 0 || s >= FD_SETSIZE)
+   {
+      _log(CRITICAL, "Socket %d out of range.  Fatal.", s);
+      exit(1);
+   }
+   ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+   ev.data.fd = s;
+   if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev))
+   {
+      _log(CRITICAL, "Failed to register socket %d.  Error %d %s.", s, errno, strerror(errno));
+   }
+   s_want[s] = 0;
+   s_ready[s] = EV_READ | EV_WRITE;
+   s_registered[s_registered_count++] = s;
+}
+
+static void event_remove(const int s)
+{
+   // Deregister a socket.  Call before closing it.
+   word i;
+   _log(PROC, "event_remove(%d)", s);
+
+   if(s < 0 || s >= FD_SETSIZE) return;
+   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, NULL);
+   s_want[s] = s_ready[s] = 0;
+   for(i = 0; i < s_registered_count; i++)
+   {
+      if(s_registered[i] == s)
+      {
+         s_registered[i] = s_registered[--s_registered_count];
+         return;
+      }
+   }
+}
+
+static void event_want(const int s, const byte e)
+{
+   if(s >= 0 && s < FD_SETSIZE) s_want[s] |= e;
+}
+
+static void event_unwant(const int s, const byte e)
+{
+   if(s >= 0 && s < FD_SETSIZE) s_want[s] &= ~e;
+}
+
+static void event_not_ready(const int s, const byte e)
+{
+   // Called when a read or write comes up short.  epoll will tell us when it's ready again.
+   if(s >= 0 && s < FD_SETSIZE) s_ready[s] &= ~e;
+}
+
+static void set_timer(void)
+{
+   // Arm the timer for the earliest timer due.
+   struct itimerspec its;
+   time_t due = heartbeat_tx_due;
+   if(stats_due < due)      due = stats_due;
+   if(alarms_due < due)     due = alarms_due;
+   if(rates_due < due)      due = rates_due;
+   if(stomp_timeout < due)  due = stomp_timeout;
+   if(journal_sync_due < due) due = journal_sync_due;
+   if(server_sockets_due < due && !controlled_shutdown) due = server_sockets_due;
+
+   its.it_interval.tv_sec = its.it_interval.tv_nsec = 0;
+   its.it_value.tv_sec = due;
+   its.it_value.tv_nsec = 0;
+   if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+   {
+      _log(CRITICAL, "Failed to set timer.  Error %d %s.", errno, strerror(errno));
+   }
 }
 
 static void set_up_server_sockets(void)
@@ -664,7 +915,7 @@ static void set_up_server_sockets(void)
    server_sockets_due = 0x7fffffff;
    if(controlled_shutdown) return;
 
-   for(stream = 0; stream < STREAMS; stream++)
+   for(stream = 0; stream < streams; stream++)
    {
       if(stomp_topics[stream][0] && s_number[stream][SERVER] < 0)
       {
@@ -700,7 +951,8 @@ static void set_up_server_sockets(void)
             exit(1);
          }
       
-         FD_SET (s, &read_sockets);
+         event_add(s);
+         event_want(s, EV_READ);
          s_type[s] = SERVER;
          s_stream[s] = stream;
          s_number[stream][SERVER] = s;
@@ -720,6 +972,11 @@ static void stomp_write(void)
    {
 
       ssize_t sent = write(s_stomp, stomp_tx_queue + stomp_tx_queue_off, stomp_tx_queue_on - stomp_tx_queue_off);
+      if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+         event_not_ready(s_stomp, EV_WRITE);
+         return;
+      }
       if(sent < 0)
       {
          _log(MAJOR, "Failed to write to STOMP server.  Error %d %s", errno, strerror(errno));
@@ -727,6 +984,7 @@ static void stomp_write(void)
       }
       else
       {
+         if(sent < stomp_tx_queue_on - stomp_tx_queue_off) event_not_ready(s_stomp, EV_WRITE);
          stomp_tx_queue_off += sent;
          _log(DEBUG, "stomp_write():  Sent %d bytes.  Last byte 0x%02x.", sent, stomp_tx_queue[stomp_tx_queue_off-1]);
       }
@@ -735,7 +993,7 @@ static void stomp_write(void)
    {
       stomp_tx_queue_on = stomp_tx_queue_off = 0;
 
-      FD_CLR(s_stomp, &write_sockets);
+      event_unwant(s_stomp, EV_WRITE);
       _log(DEBUG, "stomp_write():  Queue now empty.");
       if(controlled_shutdown && stomp_read_state == STOMP_IDLE)
       {
@@ -750,22 +1008,27 @@ static void stomp_write(void)
 
 static void stomp_read(void)
 {
-#define MAX_HEADER 1024
-   static char headers[MAX_HEADER];
-   static ssize_t stomp_read_h_i, stomp_read_b_i;
-   static char * mid, * s, * body;
-   static word stream;
-   static word fail_send_ack;
-   char d[1024];
-
    _log(PROC, "stomp_read()");
 
-   // N.B. Handling of stomp_read_buffer
-   // If a receive is interrupted by an error, stomp_read_buffer remains pointing to a buffer (which contains 
-   // garbage).  This will be re-used for the next frame.
-
    if(s_stomp < 0) return;
-   ssize_t l = read(s_stomp, d, 1024);
+
+   // Move any incomplete frame to the start of the receive buffer
+   if(stomp_rx_off)
+   {
+      stomp_rx_on -= stomp_rx_off;
+      memmove(stomp_rx, stomp_rx + stomp_rx_off, stomp_rx_on);
+      stomp_rx_start -= stomp_rx_off;
+      stomp_rx_body  -= stomp_rx_off;
+      stomp_rx_scan  -= stomp_rx_off;
+      stomp_rx_off = 0;
+   }
+
+   ssize_t l = read(s_stomp, stomp_rx + stomp_rx_on, STOMP_RX_SIZE - stomp_rx_on);
+   if(l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+   {
+      event_not_ready(s_stomp, EV_READ);
+      return;
+   }
    if(l < 0)
    {
       _log(MAJOR, "STOMP read error %d %s", errno, strerror(errno));
@@ -780,68 +1043,94 @@ static void stomp_read(void)
       return;
    }
 
+   if(l < STOMP_RX_SIZE - stomp_rx_on) event_not_ready(s_stomp, EV_READ);
    _log(DEBUG, "stomp_read():  Received %d characters.", l);
    stats[StompBytes] += l;
+   stomp_rx_on += l;
+
+   stomp_rx_frames();
+
+   if(controlled_shutdown && stomp_read_state == STOMP_IDLE && stomp_tx_queue_on == 0)
+   {
+      stomp_manager(SM_FAIL, NULL);
+   }
+}
+
+static void stomp_rx_frames(void)
+{
+   // Process whatever complete frames, or parts of frames, are in the receive buffer.
+   // Headers and body terminators are found with memmem() and memchr() rather than byte by byte, and bodies
+   // are copied to the frame buffer in one go.
+   char * p;
 
-   ssize_t i;
+   // N.B. Handling of stomp_read_buffer
+   // If a receive is interrupted by an error, stomp_read_buffer remains pointing to a buffer (which contains 
+   // garbage).  This will be re-used for the next frame.
 
-   for(i=0; i < l; i++)
+   while(stomp_rx_off < stomp_rx_on)
    {
-      // _log(DEBUG, "stomp_read() Rx %02x %02x %c", i, d[i], (d[i]<0x20 || d[i] > 0x7e) ? '.':d[i]);
       switch(stomp_read_state)
       {
       case STOMP_IDLE: // Start
-         stomp_read_h_i = stomp_read_b_i = fail_send_ack = 0;
+         stomp_rx_fail_send_ack = false;
+         stomp_rx_skip = 0;
 
          // First character - could be a heartbeat
-         if(d[i] == '\n')
+         if(stomp_rx[stomp_rx_off] == '\n')
          {
             // Heartbeat
             _log(DEBUG, "STOMP heartbeat received.");
-            stomp_read_state = STOMP_IDLE;
+            stomp_rx_off++;
             stomp_manager(SM_RX_DONE, NULL);
          }
          else
          {
-            headers[stomp_read_h_i++] = d[i];
+            stomp_rx_start = stomp_rx_scan = stomp_rx_off;
             stomp_read_state = STOMP_HEADER;
-         }               
+         }
          break;
 
       case STOMP_HEADER: // Header
-         if(stomp_read_h_i >= MAX_HEADER)
+         p = memmem(stomp_rx + stomp_rx_scan, stomp_rx_on - stomp_rx_scan, "\n\n", 2);
+         if(!p)
+         {
+            if(stomp_rx_on - stomp_rx_start >= MAX_HEADER)
+            {
+               _log(MAJOR, "Received STOMP headers too long.  Frame discarded.");
+               stats[StompInvalid]++;
+               stomp_read_state = STOMP_FAIL;
+            }
+            else
+            {
+               // Need more.  Resume the search at the last character, which may be the first \n.
+               stomp_rx_scan = stomp_rx_on - 1;
+               stomp_rx_off = stomp_rx_start;
+               return;
+            }
+         }
+         else if(p + 1 - stomp_rx - stomp_rx_start >= MAX_HEADER - 2)
          {
             _log(MAJOR, "Received STOMP headers too long.  Frame discarded.");
             stats[StompInvalid]++;
+            stomp_rx_off = p + 2 - stomp_rx;
             stomp_read_state = STOMP_FAIL;
          }
          else
          {
-            if(d[i] == '\n' && headers[stomp_read_h_i - 1] == '\n')
-            {
-               // End of header
-               headers[stomp_read_h_i++] = '\0';
-               if(debug)
-               {
-                  _log(DEBUG, "Headers received:");
-                  dump_headers(headers);
-               }
-               stomp_read_state = STOMP_BODY;
-               stomp_read_b_i = 0;
-            }
-            else
+            // End of header
+            ssize_t length = p + 1 - stomp_rx - stomp_rx_start;
+            memcpy(stomp_rx_headers, stomp_rx + stomp_rx_start, length);
+            stomp_rx_headers[length] = '\0';
+            if(debug)
             {
-               if(stomp_read_h_i < MAX_HEADER - 2)
-               {
-                  headers[stomp_read_h_i++] = d[i];
-               }
-               else
-               {
-                  _log(MAJOR, "Received STOMP headers too long.  Frame discarded.");
-                  stats[StompInvalid]++;
-                  stomp_read_state = STOMP_FAIL;
-               }
+               _log(DEBUG, "Headers received:");
+               dump_headers(stomp_rx_headers);
             }
+            char * cl = strstr(stomp_rx_headers, "\ncontent-length:");
+            stomp_rx_content_length = cl ? atol(cl + 16) : -1;
+            stomp_rx_off = stomp_rx_body = stomp_rx_scan = p + 2 - stomp_rx;
+            stomp_rx_validated = false;
+            stomp_read_state = STOMP_BODY;
          }
          break;
 
@@ -850,267 +1139,341 @@ static void stomp_read(void)
          {
             // In this case we don't care about the body contents
             // Discard until we get the terminating NULL
-            if(d[i] == '\0')
-            {
-               stomp_read_state = STOMP_IDLE;
-               stomp_manager(SM_RX_DONE, headers);
-            }
+            if(stomp_rx_content_length >= 0) stomp_rx_skip = stomp_rx_content_length;
+            stomp_rx_off = stomp_rx_body;
+            stomp_read_state = STOMP_FAIL;
+            stomp_rx_connected = true;
+            break;
          }
-         else
+
+         if(stomp_rx_on <= stomp_rx_body)
+         {
+            // Need more
+            stomp_rx_off = stomp_rx_start;
+            return;
+         }
+
+         if(!stomp_rx_validated)
          {
-            if(stomp_read_b_i == 0 && d[i] == '\0')
+            if(stomp_rx[stomp_rx_body] == '\0' && stomp_rx_content_length <= 0)
             {
                _log(MAJOR, "STOMP frame received has an empty body.  Discarded.  Headers:");
-               dump_headers(headers);
+               dump_headers(stomp_rx_headers);
+               stomp_rx_off = stomp_rx_body + 1;
                stomp_read_state = STOMP_IDLE;
-               stomp_manager(SM_RX_DONE, headers);
+               stomp_manager(SM_RX_DONE, stomp_rx_headers);
                stats[StompInvalid]++;
+               break;
             }
-            else if(stomp_read_b_i == 0)
+            stomp_rx_validated = true;
+            if(stomp_rx_validate())
             {
-               if(!strstr(headers, "MESSAGE"))
-               {
-                  _log(MAJOR, "STOMP frame received is not a MESSAGE.  Discarded.  Headers:");
-                  dump_headers(headers);
-                  stomp_read_state = STOMP_FAIL;
-                  stats[StompInvalid]++;
-               }
-               else
-               {
-                  // Find which stream
-                  s = strstr(headers, "subscription:");
-                  if(s)
-                  {
-                     s += 13;
-                     _log(DEBUG, "Stream id %c.", *s);
-                  }
-                  else
-                  {
-                     _log(MAJOR, "STOMP MESSAGE received with no subscription value.  Discarded.  Headers:");
-                     dump_headers(headers);
-                     stomp_read_state = STOMP_FAIL;
-                     stats[StompInvalid]++;
-                  }
-               }
-               if(stomp_read_state == STOMP_BODY)
-               {
-                  mid = strstr(headers, "message-id:");
-                  if(mid)
-                  {
-                     mid += 11;
-                  }
-                  else
-                  {
-                     _log(MAJOR, "STOMP MESSAGE received with no message id.  Discarded.  Headers:");
-                     dump_headers(headers);
-                     stomp_read_state = STOMP_FAIL;
-                     stats[StompInvalid]++;
-                  }
-               }
-               // Set up where it's going, and get a queue entry if appropriate
-               if(stomp_read_state == STOMP_BODY)
-               {
-                  switch(*s)
-                  {
-                  case '0':  case '1': case '2': case '3':
-                     stream = *s - '0';
-                     // Note the following code allows one stream to hog all the buffers.  Is that a good idea?
-                     if(!stomp_read_buffer) stomp_read_buffer = new_buffer();
-                     if(stomp_read_buffer)
-                     {
-                        body = stomp_read_buffer->frame;
-                     }
-                     else
-                     {
-                        // Handle run out of buffers:  Dump queue to disc, switch to disc mode ask for a buffer again.
-                        _log(GENERAL, "No buffers available for stream %d (%s).  Saving to disc.", stream, stomp_topic_names[stream]);
-                        if(!dump_queue_to_disc(stream))
-                        {
-                           // None in our queue, find some elsewhere
-                           word s;
-                           for(s = 0; s < STREAMS; s++) 
-                           {
-                              if(dump_queue_to_disc(s)) 
-                              {
-                                 // Found some!
-                                 if(stream_state[s] == STREAM_RUN) stream_state[s] = STREAM_DISC;
-                                 _log(GENERAL, "Dumped queue to disc and switched to disc mode on stream %d (%s) to free space.", s, stomp_topic_names[s]);
-                                 s = STREAMS;
-                              }
-                           }
-                        }
-                        if(stream_state[stream] == STREAM_RUN) stream_state[stream] = STREAM_DISC;
-                        stomp_read_buffer = new_buffer();
-                        if(!stomp_read_buffer)
-                        {
-                           _log(CRITICAL, "Failed to find a free buffer.  STOMP MESSAGE discarded.");
-                           stomp_read_state = STOMP_FAIL;
-                           fail_send_ack = true; // Failure at our end.  Need to send ack or message feed will cease.
-            stats[StompInvalid]++;
-                           body = NULL;
-                        }
-                        else
-                           body = stomp_read_buffer->frame;
-                     }
-                     break;
-                     
-                  default: _log(MAJOR, "STOMP MESSAGE received with unrecognised subscription value \"%c\".", *s);
-                     stomp_read_state = STOMP_FAIL;
-                     body = NULL;
-                     stats[StompInvalid]++;
-                     break;
-                  }
-               }
+               // Discard the rest of the frame
+               if(stomp_rx_content_length >= 0) stomp_rx_skip = stomp_rx_content_length;
+               stomp_rx_off = stomp_rx_body;
+               stomp_read_state = STOMP_FAIL;
+               break;
             }
+         }
 
-            if(stomp_read_state == STOMP_BODY) 
+         // Find the end of the body
+         p = NULL;
+         if(stomp_rx_content_length >= 0)
+         {
+            if(stomp_rx_content_length + 1 >= FRAME_SIZE)
             {
-               stomp_read_b_i++;
-
-               // Handle overlong body
-               if(body && stomp_read_b_i >= FRAME_SIZE)
+               p = stomp_rx + stomp_rx_body + FRAME_SIZE;
+            }
+            else if(stomp_rx_on - stomp_rx_body > stomp_rx_content_length)
+            {
+               p = stomp_rx + stomp_rx_body + stomp_rx_content_length;
+               if(*p) 
                {
-                  _log(CRITICAL, "STOMP MESSAGE received with overlong payload.  Discarded.  Headers:");
-                  dump_headers(headers);
-                  stats[StompInvalid]++;
-                  stomp_read_state = STOMP_FAIL;
-                  fail_send_ack = true; // Failure at our end.  Need to send ack or message feed will cease.
-                  body = NULL;
+                  _log(MAJOR, "STOMP MESSAGE body does not match content-length %ld.", stomp_rx_content_length);
+                  stomp_rx_content_length = -1;
+                  stomp_rx_scan = stomp_rx_body;
+                  p = NULL;
                }
+            }
+         }
+         if(stomp_rx_content_length < 0)
+         {
+            p = memchr(stomp_rx + stomp_rx_scan, '\0', stomp_rx_on - stomp_rx_scan);
+            if(!p && stomp_rx_on - stomp_rx_body >= FRAME_SIZE - 1) p = stomp_rx + stomp_rx_body + FRAME_SIZE;
+         }
+         if(!p)
+         {
+            // Need more
+            stomp_rx_scan = stomp_rx_on;
+            stomp_rx_off = stomp_rx_start;
+            return;
+         }
 
-               // Stick character in buffer
-               if(body) *body++ = d[i];
+         // Handle overlong body
+         ssize_t length = p + 1 - stomp_rx - stomp_rx_body; // INCLUDING the terminating \0
+         if(length >= FRAME_SIZE)
+         {
+            _log(CRITICAL, "STOMP MESSAGE received with overlong payload.  Discarded.  Headers:");
+            dump_headers(stomp_rx_headers);
+            stats[StompInvalid]++;
+            stomp_rx_fail_send_ack = true; // Failure at our end.  Need to send ack or message feed will cease.
+            if(stomp_rx_content_length >= 0) stomp_rx_skip = stomp_rx_content_length;
+            stomp_rx_off = stomp_rx_body;
+            stomp_read_state = STOMP_FAIL;
+            break;
+         }
 
-               if(body && !d[i])
-               {
-                  // Deal with frame
-                  _log(DEBUG, "Got end of message frame.  Processing...");
-                  stomp_read_buffer->stamp = time_us();
-                  _log(DEBUG, "Stamp is %lld.", stomp_read_buffer->stamp);
-                  inst[BaseCountStreamRX + stream]++;
-                  if(!(*conf[conf_stompy_bin])) 
-                  {
-                     if(stream_state[stream] == STREAM_RUN)
-                     {
-                        enqueue(stream, stomp_read_buffer);
-                     }
-                     else
-                     {
-                        // write buffer to disc and free it
-                        dump_buffer_to_disc(stream, stomp_read_buffer);
-                     }
-                     stomp_read_buffer = NULL; // Buffer has been emptied or recorded in the queue, so we no longer own it.
-                  }
-                  stats[StompMessage]++;
+         // Deal with frame
+         _log(DEBUG, "Got end of message frame.  Processing...");
+         stomp_rx_off = stomp_rx_body + length;
+         if(stomp_rx_buffer(length))
+         {
+            stomp_send_ack(); // Failure at our end.  Need to send ack or message feed will cease.
+            stomp_read_state = STOMP_IDLE;
+            stomp_manager(SM_RX_DONE, NULL);
+            break;
+         }
+         memcpy(stomp_read_buffer->frame, stomp_rx + stomp_rx_body, length);
+         stomp_read_buffer->stamp = time_us();
+         _log(DEBUG, "Stamp is %lld.", stomp_read_buffer->stamp);
+         inst[BaseCountStreamRX + stomp_rx_stream]++;
+         if(!(*conf[conf_stompy_bin])) 
+         {
+            if(stream_state[stomp_rx_stream] == STREAM_RUN && stream_bytes[stomp_rx_stream] + size_class[stomp_read_buffer->size_class] > stream_budget)
+            {
+               // Memory budget used up:  Dump queue to disc, switch to disc mode.
+               _log(GENERAL, "Memory budget used up on stream %d (%s).  Saving to disc.", stomp_rx_stream, stomp_topic_names[stomp_rx_stream]);
+               dump_queue_to_disc(stomp_rx_stream);
+               stream_state[stomp_rx_stream] = STREAM_DISC;
+            }
+            if(stream_state[stomp_rx_stream] == STREAM_RUN)
+            {
+               enqueue(stomp_rx_stream, stomp_read_buffer);
+            }
+            else
+            {
+               // write buffer to disc and free it
+               dump_buffer_to_disc(stomp_rx_stream, stomp_read_buffer);
+            }
+            stomp_read_buffer = NULL; // Buffer has been emptied or recorded in the queue, so we no longer own it.
+         }
+         stats[StompMessage]++;
                   
-                  if(s_number[stream][CLIENT] >= 0 && client_state[stream] != CLIENT_AWAIT_ACK)
-                  {
-                     FD_SET(s_number[stream][CLIENT], &write_sockets);
-                  }
+         if(s_number[stomp_rx_stream][CLIENT] >= 0 && client_state[stomp_rx_stream] != CLIENT_AWAIT_ACK)
+         {
+            event_want(s_number[stomp_rx_stream][CLIENT], EV_WRITE);
+         }
 
-                  // Send ACK
-                  {
-                     char ack_h[1024];
-                     sprintf(ack_h, "ACK\nsubscription:%c\nmessage-id:", *s);
-                     ssize_t i = strlen(ack_h);
-                     while((ack_h[i++] = *mid++) != '\n');
-                     ack_h[i++] = '\n';
-                     ack_h[i++] = '\0';
-                     if(debug)
-                     {
-                        _log(DEBUG, "Ack message headers:");
-                        dump_headers(ack_h);
-                     }
-                     stomp_queue_tx(ack_h, i);
-                  }
+         stomp_send_ack();
                   
-                  // All done
-                  stomp_read_state = STOMP_IDLE;
-                  stomp_manager(SM_RX_DONE, NULL);
-               }
-            }
-         }
+         // All done
+         stomp_read_state = STOMP_IDLE;
+         stomp_manager(SM_RX_DONE, NULL);
          break;
       
       case STOMP_FAIL: // Just bin data until the end of the STOMP frame.
-         if(d[i] == '\0')
+         if(stomp_rx_skip)
+         {
+            ssize_t skip = stomp_rx_on - stomp_rx_off;
+            if(skip > stomp_rx_skip) skip = stomp_rx_skip;
+            stomp_rx_off += skip;
+            stomp_rx_skip -= skip;
+            break;
+         }
+         p = memchr(stomp_rx + stomp_rx_off, '\0', stomp_rx_on - stomp_rx_off);
+         if(!p)
+         {
+            stomp_rx_off = stomp_rx_on;
+            return;
+         }
+         stomp_rx_off = p + 1 - stomp_rx;
+         if(stomp_rx_fail_send_ack) stomp_send_ack();
+         stomp_read_state = STOMP_IDLE;
+         if(stomp_rx_connected)
+         {
+            stomp_rx_connected = false;
+            stomp_manager(SM_RX_DONE, stomp_rx_headers);
+         }
+         else
          {
-            if(fail_send_ack)
-               // Send ACK
-            {
-               char ack_h[1024];
-               sprintf(ack_h, "ACK\nsubscription:%c\nmessage-id:", *s);
-               ssize_t i = strlen(ack_h);
-               while((ack_h[i++] = *mid++) != '\n');
-               ack_h[i++] = '\n';
-               ack_h[i++] = '\0';
-               if(debug)
-               {
-                  _log(DEBUG, "Ack message headers:");
-                  dump_headers(ack_h);
-               }
-               stomp_queue_tx(ack_h, i);
-            }
-            stomp_read_state = STOMP_IDLE;
             stomp_manager(SM_RX_DONE, NULL);
          }
          break;
       }
    }
+}
 
-   if(controlled_shutdown && stomp_read_state == STOMP_IDLE && stomp_tx_queue_on == 0)
+static word stomp_rx_validate(void)
+{
+   // Check the headers of a received MESSAGE.
+   // Returns 0 if the message is to be accepted.
+   char * s;
+
+   if(!strstr(stomp_rx_headers, "MESSAGE"))
    {
-      stomp_manager(SM_FAIL, NULL);
+      _log(MAJOR, "STOMP frame received is not a MESSAGE.  Discarded.  Headers:");
+      dump_headers(stomp_rx_headers);
+      stats[StompInvalid]++;
+      return 1;
    }
-}
 
-static void client_write(const int s)
-{
-   word stream = s_stream[s];
-   _log(PROC, "client_write(%d):  Stream %d, client state %d", s, stream, client_state[stream]);
+   // Find which stream
+   s = strstr(stomp_rx_headers, "subscription:");
+   if(s)
+   {
+      s += 13;
+      _log(DEBUG, "Stream id %c.", *s);
+   }
+   else
+   {
+      _log(MAJOR, "STOMP MESSAGE received with no subscription value.  Discarded.  Headers:");
+      dump_headers(stomp_rx_headers);
+      stats[StompInvalid]++;
+      return 1;
+   }
 
-   ssize_t l;
+   stomp_rx_mid = strstr(stomp_rx_headers, "message-id:");
+   if(stomp_rx_mid)
+   {
+      stomp_rx_mid += 11;
+   }
+   else
+   {
+      _log(MAJOR, "STOMP MESSAGE received with no message id.  Discarded.  Headers:");
+      dump_headers(stomp_rx_headers);
+      stats[StompInvalid]++;
+      return 1;
+   }
 
-   if(client_state[stream] == CLIENT_AWAIT_ACK)
+   // Set up where it's going
+   stomp_rx_stream = atoi(s);
+   if(*s < '0' || *s > '9' || stomp_rx_stream >= streams || !stomp_topics[stomp_rx_stream][0])
    {
-      // Shouldn't happen
-      _log(CRITICAL, "client_write() Unexpected state CLIENT_AWAIT_ACK on stream %d", stream);
-      FD_CLR(s, &write_sockets);
-      return;
+      _log(MAJOR, "STOMP MESSAGE received with unrecognised subscription value \"%c\".", *s);
+      stats[StompInvalid]++;
+      return 1;
    }
 
-   if(client_state[stream] == CLIENT_IDLE && controlled_shutdown)
+   return 0;
+}
+
+static word stomp_rx_buffer(const ssize_t length)
+{
+   // Find a buffer for a received frame of length bytes.  Returns 0 on success.
+   if(stomp_read_buffer && size_class[stomp_read_buffer->size_class] < length)
    {
-      dump_queue_to_disc(stream);
-      stream_state[stream] = STREAM_LOCK;
-      close(s);
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
-      s_number[s][CLIENT] = -1;
-      return;
+      free_buffer(stomp_read_buffer);
+      stomp_read_buffer = NULL;
    }
-   
-   if(client_state[stream] == CLIENT_IDLE)
+   if(!stomp_read_buffer) stomp_read_buffer = new_buffer(length);
+   if(!stomp_read_buffer)
    {
-      if(client_buffer[stream]) _log(CRITICAL, "Unexpected client buffer!");
-      client_buffer[stream] = queue_front(stream);
-      if(!client_buffer[stream])
+      // Handle run out of memory:  Dump queue to disc, switch to disc mode ask for a buffer again.
+      word stream = stomp_rx_stream;
+      _log(GENERAL, "No buffers available for stream %d (%s).  Saving to disc.", stream, stomp_topic_names[stream]);
+      if(!dump_queue_to_disc(stream))
       {
-         // Queue is empty
-         if(stream_state[stream] == STREAM_RUN || stream_state[stream] == STREAM_LOCK)
+         // None in our queue, find some elsewhere
+         word s;
+         for(s = 0; s < streams; s++) 
          {
-            // Nothing more to do
-            FD_CLR(s, &write_sockets);
-            return;
+            if(dump_queue_to_disc(s)) 
+            {
+               // Found some!
+               if(stream_state[s] == STREAM_RUN) stream_state[s] = STREAM_DISC;
+               _log(GENERAL, "Dumped queue to disc and switched to disc mode on stream %d (%s) to free space.", s, stomp_topic_names[s]);
+               s = streams;
+            }
+         }
+      }
+      if(stream_state[stream] == STREAM_RUN) stream_state[stream] = STREAM_DISC;
+      stomp_read_buffer = new_buffer(length);
+      if(!stomp_read_buffer)
+      {
+         _log(CRITICAL, "Failed to find a free buffer.  STOMP MESSAGE discarded.");
+         stats[StompInvalid]++;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static void stomp_send_ack(void)
+{
+   char ack_h[1024];
+   char * mid = stomp_rx_mid;
+   sprintf(ack_h, "ACK\nsubscription:%d\nmessage-id:", stomp_rx_stream);
+   ssize_t i = strlen(ack_h);
+   while(i < (ssize_t) sizeof(ack_h) - 2 && (ack_h[i++] = *mid++) != '\n');
+   ack_h[i++] = '\n';
+   ack_h[i++] = '\0';
+   if(debug)
+   {
+      _log(DEBUG, "Ack message headers:");
+      dump_headers(ack_h);
+   }
+   stomp_queue_tx(ack_h, i);
+}
+
+static void client_write(const int s)
+{
+   word stream = s_stream[s];
+   _log(PROC, "client_write(%d):  Stream %d, client state %d, in flight %d", s, stream, client_state[stream], client_in_flight[stream]);
+
+   ssize_t l;
+
+   if(client_state[stream] == CLIENT_AWAIT_ACK)
+   {
+      // Shouldn't happen
+      _log(CRITICAL, "client_write() Unexpected state CLIENT_AWAIT_ACK on stream %d", stream);
+      event_unwant(s, EV_WRITE);
+      return;
+   }
+
+   if(client_state[stream] == CLIENT_IDLE && controlled_shutdown)
+   {
+      if(client_in_flight[stream])
+      {
+         // Wait for the client to ack what it has already been sent.
+         event_unwant(s, EV_WRITE);
+         return;
+      }
+      dump_queue_to_disc(stream);
+      stream_state[stream] = STREAM_LOCK;
+      client_disconnect(stream);
+      return;
+   }
+
+   if(client_state[stream] == CLIENT_IDLE && client_in_flight[stream] >= client_window[stream])
+   {
+      // Window is full
+      client_state[stream] = CLIENT_AWAIT_ACK;
+      event_unwant(s, EV_WRITE);
+      inst[BaseStartWaitClientAck + stream] = time_us();
+      return;
+   }
+   
+   if(client_state[stream] == CLIENT_IDLE)
+   {
+      if(client_buffer[stream]) _log(CRITICAL, "Unexpected client buffer!");
+      client_buffer[stream] = queue_entry(stream, client_in_flight[stream]);
+      if(!client_buffer[stream])
+      {
+         // Nothing in the queue except frames already sent
+         if(stream_state[stream] == STREAM_RUN || stream_state[stream] == STREAM_LOCK)
+         {
+            // Nothing more to do
+            event_unwant(s, EV_WRITE);
+            return;
          }
 
          // stream_state is _DISC, queue is empty.  Read some more from disc.
          if(disc_queue_length(stream))
          {
-            if(queue_length(STREAMS))
+            if(load_queue_from_disc(stream) || stream_q_off[stream])
             {
-               load_queue_from_disc(stream);
-               client_buffer[stream] = queue_front(stream);
+               // Loaded some, or the stream's budget is taken up by frames in flight.
+               client_buffer[stream] = queue_entry(stream, client_in_flight[stream]);
             }
             else 
             {
@@ -1118,17 +1481,22 @@ static void client_write(const int s)
                // This is a problem.  If we just leave the stream in this state, it will hog the select.
                _log(GENERAL, "Unable to load stream %d (%s) messages from disc.  No buffers available.", stream, stomp_topic_names[stream]);
                word st;
-               for(st = 0; st < STREAMS; st++)
+               for(st = 0; st < streams; st++)
                {
                   if(dump_queue_to_disc(st))
                   {
                      if(stream_state[st] == STREAM_RUN) stream_state[st] = STREAM_DISC;
                      _log(GENERAL, "client_write() dumped queue for stream %d (%s) to disc to free space.", st, stomp_topic_names[st]);
-                     st = STREAMS;
+                     st = streams;
                   }
                }
                load_queue_from_disc(stream);
-               client_buffer[stream] = queue_front(stream);
+               client_buffer[stream] = queue_entry(stream, client_in_flight[stream]);
+            }
+            if(!client_buffer[stream])
+            {
+               event_unwant(s, EV_WRITE);
+               return;
             }
          }
          else
@@ -1136,49 +1504,78 @@ static void client_write(const int s)
             // We have emptied the disc
             _log(GENERAL, "Stream %d (%s) disc queue empty.", stream, stomp_topic_names[stream]);
             stream_state[stream] = STREAM_RUN;
-            FD_CLR(s, &write_sockets);
+            event_unwant(s, EV_WRITE);
             return;
          }
       }
 
+      // Build the frame header
+      byte * header = client_header[stream];
+      client_header_length[stream] = client_header_index[stream] = 0;
+      if(client_window_announce[stream])
+      {
+         // Tell the client that sequence numbers start here.
+         ssize_t marker = -1;
+         memcpy(header, &marker, sizeof(ssize_t));
+         memcpy(header + sizeof(ssize_t), &client_seq[stream], sizeof(qword));
+         client_header_length[stream] = sizeof(ssize_t) + sizeof(qword);
+         client_window_announce[stream] = false;
+         client_windowed[stream] = true;
+      }
       client_length[stream] = strlen(client_buffer[stream]->frame) + 1; // INCLUDING the terminating \0
       _log(DEBUG, "Frame length is %ld.", client_length[stream]);
       client_index[stream] = 0;
-      l = write(s,  &client_length[stream], sizeof(ssize_t));
-      if(l != sizeof(ssize_t))
+      client_seq[stream]++;
+      memcpy(header + client_header_length[stream], &client_length[stream], sizeof(ssize_t));
+      client_header_length[stream] += sizeof(ssize_t);
+      if(client_windowed[stream])
+      {
+         memcpy(header + client_header_length[stream], &client_seq[stream], sizeof(qword));
+         client_header_length[stream] += sizeof(qword);
+      }
+      client_state[stream] = CLIENT_RUN;
+      client_in_flight[stream]++;
+   }
+
+   if(client_state[stream] == CLIENT_RUN && client_header_index[stream] < client_header_length[stream])
+   {
+      l = write(s, client_header[stream] + client_header_index[stream], client_header_length[stream] - client_header_index[stream]);
+      if(l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+         event_not_ready(s, EV_WRITE);
+         return;
+      }
+      if(l < 0)
       {
          // Handle error
          _log(MAJOR, "Error sending buffer size to client.  l = %ld, error %d %s.", l, errno, strerror(errno));
-         client_state[stream] = CLIENT_IDLE;
-         client_buffer[stream] = NULL;
-         close(s);
-         s_number[stream][CLIENT] = -1;
-         FD_CLR(s, &write_sockets);
-         FD_CLR(s, &read_sockets);
+         client_disconnect(stream);
          _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
          // Could switch to disc mode here?  Or wait until queue fills.
+         return;
       }
-      else
+      client_header_index[stream] += l;
+      if(client_header_index[stream] < client_header_length[stream])
       {
-         _log(DEBUG, "Wrote length OK");
-         client_state[stream] = CLIENT_RUN;
+         event_not_ready(s, EV_WRITE);
+         return;
       }
+      _log(DEBUG, "Wrote length OK");
    }
 
    if(client_state[stream] == CLIENT_RUN)
    {
       _log(DEBUG, "About to write %ld bytes of body.",   client_length[stream] - client_index[stream]);
       l = write(s, &client_buffer[stream]->frame[client_index[stream]], client_length[stream] - client_index[stream]);
-      if(l < 0)
+      if(l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+         event_not_ready(s, EV_WRITE);
+      }
+      else if(l < 0)
       {
          // Handle error
          _log(MAJOR, "Error writing message to client buffer.  Error %d %s", errno, strerror(errno));
-         client_state[stream] = CLIENT_IDLE;
-         client_buffer[stream] = NULL; // Buffer is still on queue
-         close(s);
-         s_number[stream][CLIENT] = -1;
-         FD_CLR(s, &write_sockets);
-         FD_CLR(s, &read_sockets);
+         client_disconnect(stream); // Buffers are still on queue
          _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
          // Could switch to disc mode here?  Or wait until queue fills.
       }
@@ -1186,13 +1583,18 @@ static void client_write(const int s)
       {
          _log(DEBUG, "client_write() sent %ld bytes of frame", l);
          client_index[stream] += l;
+         if(client_index[stream] < client_length[stream]) event_not_ready(s, EV_WRITE);
          if(client_index[stream] >= client_length[stream])
          {
-            // Finished
-            client_state[stream] = CLIENT_AWAIT_ACK;
-            FD_CLR(s, &write_sockets);
-            FD_SET(s, &read_sockets);
-            inst[BaseStartWaitClientAck + stream] = time_us();
+            // Finished.  Carry on with the next frame unless the window is full.
+            client_buffer[stream] = NULL;
+            client_state[stream] = CLIENT_IDLE;
+            if(client_in_flight[stream] >= client_window[stream])
+            {
+               client_state[stream] = CLIENT_AWAIT_ACK;
+               event_unwant(s, EV_WRITE);
+               inst[BaseStartWaitClientAck + stream] = time_us();
+            }
          }
       }
    }
@@ -1204,71 +1606,126 @@ static void client_read(const int s)
    word stream = s_stream[s];
    _log(PROC, "client_read(%d) stream %d", s, stream);
    
-   ssize_t l;
-   static char buffer[16];
+   ssize_t l, i;
+   word acks, sent;
+   struct frame_buffer * b;
 
-   if(client_state[stream] != CLIENT_AWAIT_ACK)
+   if(s != s_number[stream][CLIENT])
    {
-      _log(CRITICAL, "Unexpected client receive on socket %d stream %d", s, stream);
-      FD_CLR(s, &read_sockets);
-      l = read(s, buffer, 16);
+      // Socket has already been closed.
+      event_unwant(s, EV_READ);
+      return;
+   }
+
+   l = read(s, client_rx[stream] + client_rx_length[stream], CLIENT_RX_SIZE - client_rx_length[stream]);
+   if(l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+   {
+      event_not_ready(s, EV_READ);
       return;
    }
-   l = read(s, buffer, 16);
    if(l < 0)
    {
       _log(MAJOR, "Error reading ACK from client on stream %d (%s).  Error %d %s.", stream, stomp_topic_names[stream], errno, strerror(errno));
-      client_state[stream] = CLIENT_IDLE;
-      client_buffer[stream] = NULL;
-      close(s);
-      s_number[stream][CLIENT] = -1;
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
+      client_disconnect(stream);
       _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
       return;
    }
    else if(!l)
    {
       _log(MAJOR, "EOF reading ACK from client on stream %d (%s).", stream, stomp_topic_names[stream]);
-      client_state[stream] = CLIENT_IDLE;
-      client_buffer[stream] = NULL;
-      close(s);
-      s_number[stream][CLIENT] = -1;
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
+      client_disconnect(stream);
       _log(GENERAL, "Client disconnected from stream %d (%s).", stream, stomp_topic_names[stream]);
       return;
    }
-   FD_CLR(s, &read_sockets);
-   client_state[stream] = CLIENT_IDLE;
+   if(l < CLIENT_RX_SIZE - client_rx_length[stream]) event_not_ready(s, EV_READ);
+   client_rx_length[stream] += l;
 
-   // Log message
-   if(stomp_topic_log[stream]) log_message(stream);
+   // Number of frames completely sent and not yet acked.
+   sent = client_in_flight[stream] - ((client_state[stream] == CLIENT_RUN)?1:0);
 
-   if(inst[BaseStartWaitClientAck + stream]) inst[BaseTotalWaitClientAck + stream] += (time_us() - inst[BaseStartWaitClientAck + stream]);
-   inst[BaseStartWaitClientAck + stream] = 0LL;
-   inst[BaseCountStreamTX + stream]++;
+   acks = 0;
+   i = 0;
+   while(i < client_rx_length[stream])
+   {
+      if(client_rx[stream][i] == 'A')
+      {
+         acks++;
+         i++;
+      }
+      else if(client_rx[stream][i] == 'K')
+      {
+         qword seq, acked;
+         if(client_rx_length[stream] - i < 1 + sizeof(qword)) break;
+         memcpy(&seq, client_rx[stream] + i + 1, sizeof(qword));
+         i += 1 + sizeof(qword);
+         acked = client_seq[stream] - client_in_flight[stream] + acks;
+         if(seq > acked && seq <= client_seq[stream]) acks += seq - acked;
+         else if(seq != acked) _log(MAJOR, "Client on stream %d (%s) acked sequence number %lld, expected %lld to %lld.", stream, stomp_topic_names[stream], seq, acked, client_seq[stream]);
+      }
+      else if(client_rx[stream][i] == 'W')
+      {
+         dword window;
+         if(client_rx_length[stream] - i < 1 + sizeof(dword)) break;
+         memcpy(&window, client_rx[stream] + i + 1, sizeof(dword));
+         i += 1 + sizeof(dword);
+         if(window < 1) window = 1;
+         if(window > CLIENT_WINDOW_MAX) window = CLIENT_WINDOW_MAX;
+         client_window[stream] = window;
+         if(!client_windowed[stream]) client_window_announce[stream] = true;
+         _log(GENERAL, "Client on stream %d (%s) set window to %d frames.", stream, stomp_topic_names[stream], window);
+      }
+      else
+      {
+         _log(MAJOR, "Unrecognised byte 0x%02x received from client on stream %d (%s).", client_rx[stream][i], stream, stomp_topic_names[stream]);
+         i++;
+      }
+   }
+   client_rx_length[stream] -= i;
+   memmove(client_rx[stream], client_rx[stream] + i, client_rx_length[stream]);
 
-   if(client_buffer[stream] != dequeue(stream))
+   if(acks > sent)
    {
-      _log(CRITICAL, "Queue end mismatch detected in client_read() on stream %d (%s).  Fatal.", stream, stomp_topic_names[stream]);
-      run = false;
-      return;
+      _log(CRITICAL, "Unexpected ack from client on stream %d (%s).  %d acks received, %d frames unacknowledged.", stream, stomp_topic_names[stream], acks, sent);
+      acks = sent;
    }
-   free_buffer(client_buffer[stream]);
-   client_buffer[stream] = NULL;
-   stats[BaseStreamFrameSent + stream]++;
+
+   while(acks--)
+   {
+      b = dequeue(stream);
+      if(!b)
+      {
+         _log(CRITICAL, "Queue end mismatch detected in client_read() on stream %d (%s).  Fatal.", stream, stomp_topic_names[stream]);
+         run = false;
+         return;
+      }
+      client_in_flight[stream]--;
+
+      // Log message
+      if(stomp_topic_log[stream]) log_message(stream, b);
+
+      inst[BaseCountStreamTX + stream]++;
+      free_buffer(b);
+      stats[BaseStreamFrameSent + stream]++;
+   }
+
+   if(client_state[stream] == CLIENT_AWAIT_ACK && client_in_flight[stream] < client_window[stream])
+   {
+      if(inst[BaseStartWaitClientAck + stream]) inst[BaseTotalWaitClientAck + stream] += (time_us() - inst[BaseStartWaitClientAck + stream]);
+      inst[BaseStartWaitClientAck + stream] = 0LL;
+      client_state[stream] = CLIENT_IDLE;
+   }
+
    if(controlled_shutdown)
    {
-      dump_queue_to_disc(stream);
-      stream_state[stream] = STREAM_LOCK;
-      close(s);
-      FD_CLR(s, &write_sockets);
-      FD_CLR(s, &read_sockets);
-      s_number[stream][CLIENT] = -1;
+      if(client_state[stream] == CLIENT_IDLE && !client_in_flight[stream])
+      {
+         dump_queue_to_disc(stream);
+         stream_state[stream] = STREAM_LOCK;
+         client_disconnect(stream);
+      }
       return;
    }
-   FD_SET(s, &write_sockets);
+   if(client_state[stream] == CLIENT_IDLE) event_want(s, EV_WRITE);
    if(stream_state[stream] == STREAM_LOCK)
    {
       dump_queue_to_disc(stream);
@@ -1280,7 +1737,11 @@ static void client_accept(const int s)
    _log(PROC, "client_accept(%d)", s);
    word stream = s_stream[s];
    int new_socket = accept(s, NULL, NULL);
-   if(new_socket < 0)
+   if(new_socket < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+   {
+      event_not_ready(s, EV_READ);
+   }
+   else if(new_socket < 0)
    {
       _log(CRITICAL, "accept() on stream %d failed.  Error %d %s", stream, errno, strerror(errno));
    }
@@ -1291,31 +1752,55 @@ static void client_accept(const int s)
       {
          _log(MAJOR, "Client connect for stream %d, socket %d when socket %d already in use.", stream, new_socket, s_number[stream][CLIENT]);
          // Already open.  Close the old one.
-         close(s_number[stream][CLIENT]);
-         FD_CLR(s_number[stream][CLIENT], &write_sockets);
-         FD_CLR(s_number[stream][CLIENT], &read_sockets);
-         s_number[stream][CLIENT] = -1;
-         if(client_state[stream] != CLIENT_IDLE)
-         {
-            // Deal with an unacknowledged client write buffer.
-            // The buffer is still in the queue so in fact we don't have to do anything.
-            client_state[stream] = CLIENT_IDLE;
-         }
+         // Any unacknowledged client write buffers are still in the queue so in fact we don't have to do anything.
+         client_disconnect(stream);
       }
       // Make it non-blocking
       int oldflags = fcntl(new_socket, F_GETFL, 0);
       /* Set just the flag we want to set:  Non-blocking. */
       oldflags |= O_NONBLOCK;
       fcntl(new_socket, F_SETFL, oldflags);
+      // Frames are written as a header and a body, and acks are tiny, so Nagle would stall a windowed client.
+      int one = 1;
+      setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
       s_stream[new_socket] = stream;
       s_type[new_socket] = CLIENT;
       s_number[stream][CLIENT] = new_socket;
-      FD_SET(new_socket, &write_sockets);
+      event_add(new_socket);
+      event_want(new_socket, EV_WRITE);
+      event_want(new_socket, EV_READ);
       _log(GENERAL, "Client connected to stream %d (%s).", stream, stomp_topic_names[stream]);
    }
 }
 
+static void client_reset(const word stream)
+{
+   // Return client interface to the state for a new connection.
+   client_state[stream] = CLIENT_IDLE;
+   client_buffer[stream] = NULL;
+   client_window[stream] = 1;
+   client_in_flight[stream] = 0;
+   client_windowed[stream] = client_window_announce[stream] = false;
+   client_seq[stream] = 0;
+   client_rx_length[stream] = 0;
+   if(inst[BaseStartWaitClientAck + stream]) inst[BaseTotalWaitClientAck + stream] += (time_us() - inst[BaseStartWaitClientAck + stream]);
+   inst[BaseStartWaitClientAck + stream] = 0LL;
+}
+
+static void client_disconnect(const word stream)
+{
+   // Close the client connection.  Unacknowledged frames remain at the front of the queue and will be resent.
+   int s = s_number[stream][CLIENT];
+   if(s >= 0)
+   {
+      event_remove(s);
+      close(s);
+   }
+   s_number[stream][CLIENT] = -1;
+   client_reset(stream);
+}
+
 static void user_command(void)
 {
    _log(PROC, "user_command()");
@@ -1353,7 +1838,7 @@ static void user_command(void)
             if(!controlled_shutdown && stream_state[0] == STREAM_LOCK)
             {
                stream_state[0] = STREAM_DISC;
-               if(s_number[0][CLIENT] >= 0) FD_SET(s_number[0][CLIENT], &write_sockets);
+               if(s_number[0][CLIENT] >= 0) event_want(s_number[0][CLIENT], EV_WRITE);
             }
             break;
          case 'T':
@@ -1361,7 +1846,7 @@ static void user_command(void)
             if(!controlled_shutdown && stream_state[1] == STREAM_LOCK)
             {
                stream_state[1] = STREAM_DISC;
-               if(s_number[1][CLIENT] >= 0) FD_SET(s_number[1][CLIENT], &write_sockets);
+               if(s_number[1][CLIENT] >= 0) event_want(s_number[1][CLIENT], EV_WRITE);
             }
             break;
          case 'D':
@@ -1369,7 +1854,7 @@ static void user_command(void)
             if(!controlled_shutdown && stream_state[2] == STREAM_LOCK)
             {
                stream_state[2] = STREAM_DISC;
-               if(s_number[2][CLIENT] >= 0) FD_SET(s_number[2][CLIENT], &write_sockets);
+               if(s_number[2][CLIENT] >= 0) event_want(s_number[2][CLIENT], EV_WRITE);
             }
             break;
          case 's':
@@ -1396,7 +1881,7 @@ static void send_subscribes(void)
    int stream;
    _log(PROC, "send_subscribes()");
 
-   for(stream = 0; stream < STREAMS; stream++)
+   for(stream = 0; stream < streams; stream++)
    {
       if(stomp_topics[stream][0])
       {
@@ -1438,7 +1923,7 @@ static void handle_shutdown(word report)
       strcpy(reason, "STOMP socket open");
    }
 
-   for(stream = 0; stream < STREAMS; stream++)
+   for(stream = 0; stream < streams; stream++)
    {
       if(s_number[stream][SERVER] >= 0)
       {
@@ -1446,21 +1931,17 @@ static void handle_shutdown(word report)
          sprintf(reason, "Stream %d (%s) server socket still open", stream, stomp_topic_names[stream]);
          //close(s_number[stream][SERVER]);
          shutdown(s_number[stream][SERVER], 2);
-         FD_CLR(s_number[stream][SERVER], &read_sockets);
-         FD_CLR(s_number[stream][SERVER], &write_sockets);
+         event_remove(s_number[stream][SERVER]);
          s_number[stream][SERVER] = -1;
       }
       if(s_number[stream][CLIENT] >= 0)
       {
          complete = false;
          sprintf(reason, "Stream %d (%s) client connection still active", stream, stomp_topic_names[stream]);
-         if(client_state[stream] == CLIENT_IDLE)
+         if(client_state[stream] == CLIENT_IDLE && !client_in_flight[stream])
          {
             dump_queue_to_disc(stream);
-            close(s_number[stream][CLIENT]);
-            FD_CLR(s_number[stream][CLIENT], &read_sockets);
-            FD_CLR(s_number[stream][CLIENT], &write_sockets);
-            s_number[stream][CLIENT] = -1;
+            client_disconnect(stream);
          }
       }
       stream_state[stream] = STREAM_LOCK;
@@ -1490,8 +1971,10 @@ static void full_shutdown(void)
       close(s_stomp);
       s_stomp = -1;
    }
-   for(stream = 0; stream < STREAMS; stream++)
+   for(stream = 0; stream < streams; stream++)
    {
+      // The client connection is about to be closed, so unacknowledged frames go to disc as well.
+      client_in_flight[stream] = 0;
       dump_queue_to_disc(stream);
       for(type = 0; type < TYPES; type++)
       {
@@ -1570,6 +2053,8 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       report_rates("Connecting to STOMP server.");
 
       stomp_read_state = STOMP_IDLE;
+      stomp_rx_on = stomp_rx_off = 0;
+      stomp_rx_connected = false;
       // DO NOT stomp_read_buffer = NULL; HERE
       stomp_tx_queue_on = stomp_tx_queue_off = 0;
 
@@ -1585,9 +2070,8 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       server = gethostbyname(STOMP_HOST);
       if (server == NULL) 
       {
+         event_remove(s_stomp);
          close(s_stomp);
-         FD_CLR(s_stomp, &read_sockets);
-         FD_CLR(s_stomp, &write_sockets);
          s_stomp = -1;
          _log(CRITICAL, "Failed to resolve STOMP server hostname.");
          stomp_manager_state = SM_HOLD;
@@ -1608,9 +2092,8 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       if (connect(s_stomp, (const struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
       {
          _log(MAJOR, "Unable to connect to STOMP server.  Error %d %s.", errno, strerror(errno));
+         event_remove(s_stomp);
          close(s_stomp);
-         FD_CLR(s_stomp, &read_sockets);
-         FD_CLR(s_stomp, &write_sockets);
          s_stomp = -1;
          stomp_manager_state = SM_HOLD;
          SET_TIMER_HOLDOFF;
@@ -1621,6 +2104,7 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       int oldflags = fcntl(s_stomp, F_GETFL, 0);
       oldflags |= O_NONBLOCK;
       fcntl(s_stomp, F_SETFL, oldflags);
+      event_add(s_stomp);
 
       _log(GENERAL, "Socket connected to STOMP server.  Sending CONNECT message.");
       
@@ -1649,7 +2133,7 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
          stomp_queue_tx(headers, strlen(headers) + 1);
       }
       stomp_manager_state = SM_AWAIT_CONNECTED;
-      FD_SET(s_stomp, &read_sockets);
+      event_want(s_stomp, EV_READ);
       s_stream[s_stomp] = STOMP;
       SET_TIMER_RUNNING;
       break;
@@ -1662,9 +2146,8 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
       }
       if(s_stomp >= 0)
       {
+         event_remove(s_stomp);
          close(s_stomp);
-         FD_CLR(s_stomp, &read_sockets);
-         FD_CLR(s_stomp, &write_sockets);
          s_stomp = -1;
          _log(GENERAL, "%s in state %s.  STOMP socket disconnected.", sm_events[event], sm_states[stomp_manager_state]);
       }
@@ -1732,8 +2215,8 @@ static void stomp_manager(const enum stomp_manager_event event, const char * con
             _log(MAJOR, "CONNECT response incorrect.");
             if(s_stomp >= 0)
             {
-               FD_CLR(s_stomp, &read_sockets);
-               FD_CLR(s_stomp, &write_sockets);
+               event_unwant(s_stomp, EV_READ);
+               event_unwant(s_stomp, EV_WRITE);
             }
             // This will get an immediate action 2
             stomp_manager_state = SM_SEND_DISCO;
@@ -1767,7 +2250,7 @@ static void stomp_queue_tx(const char * const d, const ssize_t l)
    memcpy(stomp_tx_queue + stomp_tx_queue_on, d, l);
    stomp_tx_queue_on += l;
 
-   FD_SET(s_stomp, &write_sockets);
+   event_want(s_stomp, EV_WRITE);
 }
 
 static void report_stats(void)
@@ -1841,7 +2324,7 @@ static void report_alarms(void)
       strcat(report, "STOMP connection is down.\n");
    }
 
-   for(stream = 0; stream < STREAMS && !(*conf[conf_stompy_bin]); stream++)
+   for(stream = 0; stream < streams && !(*conf[conf_stompy_bin]); stream++)
    {
       if(stomp_topics[stream][0])
       {
@@ -1922,19 +2405,19 @@ static void report_rates(const char * const m)
          last_hour = broken->tm_hour;
          fprintf(rates_fp, "                   |      Number of message frames in period       | Percentage of period in each state  Count  Count  Count  |\n");
          fprintf(rates_fp, "                   ");
-         for(i=0; i < STREAMS; i++)
+         for(i=0; i < streams; i++)
          {
             fprintf(rates_fp, "|  %7s      ", stomp_topic_names[i]);
          }
          fprintf(rates_fp, "|  Idle   Await client ack.    Disc   Disc   Disc   Frames |");
          fprintf(rates_fp, "\n");
          fprintf(rates_fp, "                   ");
-         for(i=0; i < STREAMS; i++)
+         for(i=0; i < streams; i++)
          {
             fprintf(rates_fp, "|     RX    TX  ");
          }
          fprintf(rates_fp, "|        ");
-         for(i=0; i < STREAMS; i++)
+         for(i=0; i < streams; i++)
          {
             fprintf(rates_fp, "%6s ", stomp_topic_names[i]);
          }
@@ -1953,7 +2436,7 @@ static void report_rates(const char * const m)
       if(!m[0])
       {
          total = 0;
-         for(i=0; i < STREAMS; i++)
+         for(i=0; i < streams; i++)
          {
             total += inst[BaseCountStreamRX + i];
 
@@ -1963,7 +2446,7 @@ static void report_rates(const char * const m)
          // Calculate frames on disc
          inst[CountOnDisc] = inst[CountOnDisc] + inst[CountDiscWrite] - inst[CountDiscRead];
 
-         for(i=0; i < STREAMS; i++) inst[BaseCountStreamRX + i] = inst[BaseCountStreamTX + i] = 0LL;
+         for(i=0; i < streams; i++) inst[BaseCountStreamRX + i] = inst[BaseCountStreamTX + i] = 0LL;
 
          {
             word i;
@@ -1971,14 +2454,14 @@ static void report_rates(const char * const m)
             qword period_length = now - inst[StartPeriod];
             fprintf(rates_fp, "|  ");
             fprintf(rates_fp, "%5s  ", show_percent(&inst[StartIdle],       &inst[TotalIdle],       period_length, now));
-            for(i = 0; i < STREAMS;i++)
+            for(i = 0; i < streams;i++)
             {
                fprintf(rates_fp, "%5s  ", show_percent(&inst[BaseStartWaitClientAck + i], &inst[BaseTotalWaitClientAck + i], period_length, now));
             }
             fprintf(rates_fp, "%5s  %5llu  %5llu%8s ", show_percent(&inst[StartDisc], &inst[TotalDisc], period_length, now), inst[CountDiscWrite], inst[CountDiscRead], commas_q(inst[CountOnDisc]));
             inst[StartPeriod] = now;
             inst[TotalIdle] = inst[TotalDisc] = inst[CountDiscWrite] = inst[CountDiscRead] = 0LL;
-            for(i = 0; i < STREAMS;i++) inst[BaseTotalWaitClientAck + i] = 0LL;
+            for(i = 0; i < streams;i++) inst[BaseTotalWaitClientAck + i] = 0LL;
          }
          fprintf(rates_fp, "|");
          // Bodge.  Don't do flow checking unless both "busy" streams are enabled.
@@ -2055,15 +2538,16 @@ static void report_status(void)
    char * ss[] = {"Disc", "Run", "Lock"};
    char * cs[] = {"Idle", "Await ack", "Run"}; 
    _log(GENERAL, "System status:");
-   _log(GENERAL, "Frame buffers free %d.", queue_length(STREAMS));
+   _log(GENERAL, "Frame buffers:  %lld bytes in use, %lld bytes allocated.  Budget %lld bytes per stream.", pool_in_use, pool_bytes, stream_budget);
    _log(GENERAL, "STOMP:  Manager state %d, read state %d, read buffer %sowned, socket %d.", stomp_manager_state, stomp_read_state, stomp_read_buffer?"":"not ", s_stomp);
-   for(stream = 0; stream < STREAMS; stream++)
+   for(stream = 0; stream < streams; stream++)
    {
       if(stomp_topics[stream][0])
       {
          dql = disc_queue_length(stream);
-         _log(GENERAL, "Stream %d (%s): Server socket %d, client socket %d, frames in queue %d, on disc %d.", stream, stomp_topic_names[stream], s_number[stream][SERVER], s_number[stream][CLIENT], queue_length(stream), dql);
+         _log(GENERAL, "Stream %d (%s): Server socket %d, client socket %d, frames in queue %d (%lld bytes), on disc %d.", stream, stomp_topic_names[stream], s_number[stream][SERVER], s_number[stream][CLIENT], queue_length(stream), stream_bytes[stream], dql);
          _log(GENERAL, "   Stream state %d (%s), client state %d (%s), length %ld, index %ld.", stream_state[stream], ss[stream_state[stream]], client_state[stream], cs[client_state[stream]], client_length[stream], client_index[stream]);
+         _log(GENERAL, "   Client window %d%s, frames in flight %d, sequence number %lld.", client_window[stream], client_windowed[stream]?"":" (not sequenced)", client_in_flight[stream], client_seq[stream]);
          if(dql) 
          {
             qword oldest = disc_queue_oldest(stream);
@@ -2071,6 +2555,7 @@ static void report_status(void)
             oldest /= 1000;
             _log(GENERAL, "   Oldest message in disc queue is stamped %s.", time_text(oldest, true));
          }
+         _log(GENERAL, "   Journal segments %lld to %lld, cursor %lld:%ld, next sequence number %lld.", journal[stream].first_segment, journal[stream].write_segment, journal[stream].read_segment, journal[stream].read_offset, journal[stream].write_seq);
       }
    }
 }
@@ -2122,39 +2607,64 @@ static void init_buffers_queues(void)
    word s;
    _log(PROC, "init_buffers_queues()");
 
-   for(s = 0; s < BUFFERS - 1; s++)
-   {
-      buffers[s].next = &buffers[s + 1];
-   }
-   buffers[s].next = NULL;
-   empty_list = buffers;
-
    for(s = 0; s < STREAMS; s++)
    {
       stream_q_on[s] = NULL;
       stream_q_off[s] = NULL;
+      stream_bytes[s] = 0;
    }
 }
 
-static struct frame_buffer * new_buffer(void)
+static struct frame_buffer * new_buffer(const size_t length)
 {
-   _log(PROC, "new_buffer()");
-   struct frame_buffer * result = empty_list;
-   if(result) empty_list = result->next;
-   if(!result) _log(DEBUG, "new_buffer():  No buffers available.");
+   // Returns a buffer which will hold length bytes, or NULL.
+   _log(PROC, "new_buffer(%ld)", length);
+   struct frame_buffer * result;
+   word c;
+
+   for(c = 0; c < SIZE_CLASSES - 1 && size_class[c] < length; c++);
+
+   if(!empty_list[c])
+   {
+      // Carve up a new slab
+      size_t size = (sizeof(struct frame_buffer) + size_class[c] + 7) & ~7;
+      char * slab = malloc(SLAB_SIZE);
+      char * p;
+      if(!slab)
+      {
+         _log(MAJOR, "new_buffer():  Failed to allocate slab.  Error %d %s.", errno, strerror(errno));
+         return NULL;
+      }
+      pool_bytes += SLAB_SIZE;
+      for(p = slab; p + size <= slab + SLAB_SIZE; p += size)
+      {
+         result = (struct frame_buffer *) p;
+         result->size_class = c;
+         result->next = empty_list[c];
+         empty_list[c] = result;
+      }
+      _log(DEBUG, "new_buffer():  New slab of %d byte buffers.  Pool now %lld bytes.", size_class[c], pool_bytes);
+   }
+
+   result = empty_list[c];
+   empty_list[c] = result->next;
+   result->segment = 0;
+   pool_in_use += size_class[c];
    return result;
 }
 
 void free_buffer(struct frame_buffer * const b)
 {
    _log(PROC, "free_buffer(~)");
-   b->next = empty_list;
-   empty_list = b;
+   pool_in_use -= size_class[b->size_class];
+   b->next = empty_list[b->size_class];
+   empty_list[b->size_class] = b;
 }
 
 static void enqueue(const word s, struct frame_buffer * const b)
 {
    _log(PROC, "enqueue(%d, ~)", s);
+   stream_bytes[s] += size_class[b->size_class];
    if(stream_q_on[s]) stream_q_on[s]->next = b;
    stream_q_on[s] = b;
    if(!stream_q_off[s]) stream_q_off[s] = b;
@@ -2169,33 +2679,28 @@ static struct frame_buffer * dequeue(const word s)
    {
       stream_q_off[s] = result->next;
       if(stream_q_on[s] == result) stream_q_on[s] = NULL;
+      stream_bytes[s] -= size_class[result->size_class];
    }
    return result;
 }
 
-static struct frame_buffer * queue_front(const word s)
+static struct frame_buffer * queue_entry(const word s, const word n)
 {
-   // Return buffer at front of queue or NULL
+   // Return buffer n places from the front of queue or NULL
    // DO NOT Remove buffer from queue
    struct frame_buffer * result = stream_q_off[s];
-   _log(PROC, "queue_front(%d) returns %s", s, result?"a buffer":"NULL");
+   word i;
+   for(i = 0; i < n && result; i++) result = result->next;
+   _log(PROC, "queue_entry(%d, %d) returns %s", s, n, result?"a buffer":"NULL");
    return result;
 }
 
 static word queue_length(const word s)
 {
-   // Return length of queue for specified stream.  If s == STREAMS, return length of free queue
+   // Return length of queue for specified stream.
    _log(PROC, "queue_length(%d)", s);
-   struct frame_buffer * b;
+   struct frame_buffer * b = stream_q_off[s];
    word result = 0;
-   if(s < STREAMS)
-   {
-      b = stream_q_off[s];
-   }
-   else
-   {
-      b = empty_list;
-   }
    while(b && result < 999)
    {
       result++;
@@ -2206,247 +2711,610 @@ static word queue_length(const word s)
 
 static void dump_buffer_to_disc(const word s, struct frame_buffer * const b)
 {
-   char filename[256];
-
-   sprintf(filename, "%s/%lld", spool_path[s], b->stamp);
-   _log(DEBUG, "dump_buffer_to_disc():  Target filename \"%s\".", filename);
-
-   ssize_t length = strlen(b->frame);
+   _log(DEBUG, "dump_buffer_to_disc(%d, ~):  Stamp %lld.", s, b->stamp);
 
    inst[StartDisc] = time_us();
-
-   int fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-   if(fd < 0)
+   if(!journal_append(s, b))
    {
-      _log(CRITICAL, "Writing buffer to disc, failed to open \"%s\".  Error %d %s.", filename, errno, strerror(errno));
-   }
-   else
-   {
-      ssize_t l, done;
-      done = 0;
-      while (done < length)
-      {
-         l = write(fd, b->frame + done, length - done);
-         if(l < 0)
-         {
-            _log(CRITICAL, "dump_buffer_to_disc()  Failed during write to \"%s\".  Error %d %s.", filename, errno, strerror(errno));
-            done = length;
-         }
-         else
-         {
-            done += l;
-         }
-      }
-      close(fd);
       stats[DiscWrite]++;
-      inst[TotalDisc] += (time_us() - inst[StartDisc]);
-      inst[StartDisc] = 0LL;
       inst[CountDiscWrite]++;
    }
+   inst[TotalDisc] += (time_us() - inst[StartDisc]);
+   inst[StartDisc] = 0LL;
 
    free_buffer(b);   
 }
 
 static word dump_queue_to_disc(const word s)
 {
-   // Note.  If the front entry is currently being transmitted or is awaiting ack,
-   // it must not be dumped or freed, and must be left in the 
-   // queue.  It will only be freed when the client acks it.
+   // Note.  Entries at the front of the queue which are currently being transmitted or are awaiting ack
+   // must not be dumped or freed, and must be left in the 
+   // queue.  They will only be freed when the client acks them.
+   // Frames which were loaded from the journal are not written again.  Instead the journal cursor is wound back to
+   // the first of them, which keeps the journal in order.
    _log(PROC, "dump_queue_to_disc(%d)", s);
-   struct frame_buffer * b, * requeue = NULL;
+   struct frame_buffer * b, * requeue[CLIENT_WINDOW_MAX];
    word r = 0;
+   word i, keep = client_in_flight[s];
 
-   if(client_state[s] != CLIENT_IDLE) requeue = dequeue(s);
+   for(i = 0; i < keep; i++) 
+   {
+      requeue[i] = dequeue(s);
+      // An unacked frame which is not in the journal goes in now, already read, so that if the client goes away
+      // it can be wound back to without overtaking anything dumped after it.
+      if(requeue[i] && !requeue[i]->segment && journal[s].read_seq == journal[s].write_seq)
+      {
+         if(!journal_append(s, requeue[i])) journal_skip(s);
+      }
+   }
 
+   b = stream_q_off[s];
+   if(b && b->segment)
+   {
+      journal_rewind(s, b);
+   }
    while((b = dequeue(s)))
    {
-      dump_buffer_to_disc(s, b);
+      if(b->segment)
+      {
+         free_buffer(b);
+      }
+      else
+      {
+         dump_buffer_to_disc(s, b);
+      }
       r++;
    }
-   if(client_state[s] != CLIENT_IDLE && requeue) enqueue(s, requeue);
+   for(i = 0; i < keep; i++) if(requeue[i]) enqueue(s, requeue[i]);
 
    _log(DEBUG, "dump_queue_to_disc(%d) returns %d", s, r);
    return r;
 }
    
+static word load_queue_from_disc(const word s)
+{
+   // returns number loaded
+   _log(PROC, "load_queue_from_disc(%d)", s);
+   word result = 0;
+   struct frame_buffer * b;
+
+   inst[StartDisc] = time_us();
+   // Fill up to half the stream's memory budget, leaving room for new frames if the stream returns to run mode.
+   while(disc_queue_length(s) && (!stream_q_off[s] || stream_bytes[s] + journal[s].next_length < stream_budget / 2) && (b = journal_read(s)))
+   {
+      enqueue(s, b);
+      stats[DiscRead]++;
+      inst[CountDiscRead]++;
+      result++;
+   }
+   journal_checkpoint(s);
+   inst[TotalDisc] += (time_us() - inst[StartDisc]);
+   inst[StartDisc] = 0LL;
+
+   _log(DEBUG, "load_queue_from_disc() returns %d", result);
+   return result;
+}
+
+static int disc_queue_length(const word s)
+{
+   // returns number of frames in the journal which have not been read.
+   return journal[s].write_seq - journal[s].read_seq;
+}
+
+static qword disc_queue_oldest(const word s)
+{
+   // returns timestamp of oldest disc buffer.  Units are microseconds.
+   // Or 0 for none.
+   return disc_queue_length(s) ? journal[s].oldest : 0;
+}
+
+///////// Journal //////////
+static dword journal_crc(dword crc, const void * const data, const size_t length)
+{
+   // CRC-32 (IEEE), as used by zlib.  Start with crc = 0.
+   static dword table[256];
+   const byte * p = data;
+   size_t i;
+
+   if(!table[1])
+   {
+      dword c, n, k;
+      for(n = 0; n < 256; n++)
+      {
+         c = n;
+         for(k = 0; k < 8; k++) c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+         table[n] = c;
+      }
+   }
+
+   crc = ~crc;
+   for(i = 0; i < length; i++) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+   return ~crc;
+}
+
+static char * journal_segment_path(const word s, const qword segment)
+{
+   static char path[1100];
+   sprintf(path, "%s/%020lld.seg", spool_path[s], segment);
+   return path;
+}
+
+static int is_a_segment(const struct dirent *d)
+{
+   return (d->d_name[0] >= '0' && d->d_name[0] <= '9' && strstr(d->d_name, ".seg"));
+}
+
 static int is_a_buffer(const struct dirent *d)
 {
-   if(d->d_name[0] >= '0' && d->d_name[0] <= '9')
-      return 1;
-   return 0;
+   // Spool file from before the journal.
+   return (d->d_name[0] >= '0' && d->d_name[0] <= '9' && !strchr(d->d_name, '.'));
 }
 
-static void load_buffer_from_disc(struct frame_buffer * const b, const word s, const char * const name)
+static qword journal_next_segment(const word s, const qword segment)
 {
-   // NB if returned buffer has ->stamp==0 this indicates failure.
-   char filepath[256], newpath[256];
-   _log(PROC, "load_buffer_from_disc(~, %d, \"%s\")", s, name);
+   // Returns the segment following the given one, or 0 if there is none.
+   struct dirent **eps;
+   qword result = 0;
+   int n, i;
 
-   sprintf(filepath, "%s/%s", spool_path[s], name);
-   _log(DEBUG, "load_buffer_from_disc():  Target filename \"%s\".", filepath);
+   n = scandir(spool_path[s], &eps, is_a_segment, alphasort);
+   for(i = 0; i < n; i++)
+   {
+      if(!result && atoll(eps[i]->d_name) > segment) result = atoll(eps[i]->d_name);
+      free(eps[i]);
+   }
+   if(n >= 0) free(eps);
+   return result;
+}
 
-   b->frame[0] = '\0';
-   b->stamp = 0;
+static word journal_open(const word s)
+{
+   // Open the journal for stream s, creating it if necessary.  Called at startup.  Returns non-zero on failure.
+   struct dirent **eps;
+   struct journal_header h;
+   struct stat st;
+   qword cursor[2];
+   int n, i;
 
-   inst[StartDisc] = time_us();
+   journal[s].write_fd = journal[s].read_fd = journal[s].cursor_fd = -1;
+   journal[s].unsynced = 0;
 
-   int fd = open(filepath, O_RDONLY);
-   if(fd < 0)
+   n = scandir(spool_path[s], &eps, is_a_segment, alphasort);
+   if(n < 0)
    {
-      _log(CRITICAL, "Reading buffer from disc failed to open \"%s\".  Error %d %s.", filepath, errno, strerror(errno));
+      _log(CRITICAL, "Failed to open spool directory \"%s\".  Error %d %s.", spool_path[s], errno, strerror(errno));
+      return 1;
+   }
+   journal[s].first_segment = journal[s].write_segment = 1;
+   if(n > 0)
+   {
+      journal[s].first_segment = atoll(eps[0]->d_name);
+      journal[s].write_segment = atoll(eps[n - 1]->d_name);
+   }
+   for(i = 0; i < n; i++) free(eps[i]);
+   free(eps);
+
+   // Find the end of the newest segment.  Anything after the last good record was a write interrupted by a crash.
+   char * path = journal_segment_path(s, journal[s].write_segment);
+   journal[s].write_fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+   if(journal[s].write_fd < 0 || fstat(journal[s].write_fd, &st))
+   {
+      _log(CRITICAL, "Failed to open journal segment \"%s\".  Error %d %s.", path, errno, strerror(errno));
+      return 1;
+   }
+   journal[s].write_seq = journal[s].write_segment;
+   journal[s].write_offset = 0;
+   while(journal[s].write_offset + (off_t) sizeof(h) <= st.st_size)
+   {
+      if(pread(journal[s].write_fd, &h, sizeof(h), journal[s].write_offset) != sizeof(h)) break;
+      if(h.length >= FRAME_SIZE || journal[s].write_offset + (off_t) sizeof(h) + h.length > st.st_size) break;
+      if(pread(journal[s].write_fd, journal_scratch, h.length, journal[s].write_offset + sizeof(h)) != h.length) break;
+      if(journal_crc(journal_crc(0, &h.stamp, 2 * sizeof(qword)), journal_scratch, h.length) != h.crc) break;
+      journal[s].write_seq = h.seq + 1;
+      journal[s].write_offset += sizeof(h) + h.length;
+   }
+   if(journal[s].write_offset < st.st_size)
+   {
+      _log(MAJOR, "Journal segment \"%s\" truncated from %ld to %ld bytes.", path, st.st_size, journal[s].write_offset);
+      if(ftruncate(journal[s].write_fd, journal[s].write_offset))
+      {
+         _log(CRITICAL, "Failed to truncate journal segment \"%s\".  Error %d %s.", path, errno, strerror(errno));
+         return 1;
+      }
+   }
+
+   // Read cursor
+   sprintf(path, "%s/cursor", spool_path[s]);
+   journal[s].cursor_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+   if(journal[s].cursor_fd < 0)
+   {
+      _log(CRITICAL, "Failed to open journal cursor \"%s\".  Error %d %s.", path, errno, strerror(errno));
+      return 1;
+   }
+   if(pread(journal[s].cursor_fd, cursor, sizeof(cursor), 0) == sizeof(cursor) && cursor[0] >= journal[s].first_segment && cursor[0] <= journal[s].write_segment)
+   {
+      journal[s].read_segment = cursor[0];
+      journal[s].read_offset = cursor[1];
    }
    else
    {
-      ssize_t l, length;
-      length = 0;
-      l = -1;
-      while(l)
+      journal[s].read_segment = journal[s].first_segment;
+      journal[s].read_offset = 0;
+   }
+   if(journal[s].read_segment == journal[s].write_segment && journal[s].read_offset > journal[s].write_offset)
+   {
+      journal[s].read_offset = journal[s].write_offset;
+   }
+   journal[s].read_fd = open(journal_segment_path(s, journal[s].read_segment), O_RDONLY);
+   if(journal[s].read_fd < 0)
+   {
+      _log(CRITICAL, "Failed to open journal segment \"%s\".  Error %d %s.", journal_segment_path(s, journal[s].read_segment), errno, strerror(errno));
+      return 1;
+   }
+   journal_peek(s);
+
+   // Bring in any spool files left by an older version
+   n = scandir(spool_path[s], &eps, is_a_buffer, alphasort);
+   if(n > 0)
+   {
+      _log(GENERAL, "Importing %d spool files into journal for stream %d.", n, s);
+   }
+   if(n > 0)
+   {
+      struct frame_buffer * b = new_buffer(FRAME_SIZE);
+      for(i = 0; i < n; i++)
       {
-         l = read(fd, b->frame + length, FRAME_SIZE - length - 1);
-         if(l < 0)
-         {
-            _log(CRITICAL, "Error reading buffer \"%s\" from disc.  Error %d %s.", filepath, errno, strerror(errno));
-            l = 0;
-         }
-         else if(l > 0)
-         {
-            length += l;
-         }
-         else // l == 0  EOF
+         if(b)
          {
-            b->stamp = atoll(name);
-            b->frame[length] = 0; // Append the \0.
-            _log(DEBUG, "load_buffer_from_disc(): Successfully read %ld bytes with stamp %lld.", l, b->stamp);
-            stats[DiscRead]++;
+            load_buffer_from_disc(b, s, eps[i]->d_name);
+            if(b->stamp) journal_append(s, b);
          }
+         free(eps[i]);
       }
-      close(fd);
+      if(b) free_buffer(b);
+   }
+   if(n >= 0) free(eps);
+   journal_sync(s);
 
-      // Now "delete" the file
-      if(debug)
+   _log(GENERAL, "Journal for stream %d:  Segments %lld to %lld, cursor %lld:%ld, %d frames unread.", s, journal[s].first_segment, journal[s].write_segment, journal[s].read_segment, journal[s].read_offset, disc_queue_length(s));
+   return 0;
+}
+
+static void journal_close(const word s)
+{
+   _log(PROC, "journal_close(%d)", s);
+   journal_sync(s);
+   journal_checkpoint(s);
+   if(journal[s].write_fd >= 0)  close(journal[s].write_fd);
+   if(journal[s].read_fd >= 0)   close(journal[s].read_fd);
+   if(journal[s].cursor_fd >= 0) close(journal[s].cursor_fd);
+   journal[s].write_fd = journal[s].read_fd = journal[s].cursor_fd = -1;
+}
+
+static word journal_append(const word s, struct frame_buffer * const b)
+{
+   // Append frame to journal, and note where it went in the buffer.  Returns non-zero on failure.
+   struct journal_header h;
+   struct iovec iov[2];
+   ssize_t l;
+
+   if(journal[s].write_fd < 0) return 1;
+
+   h.length = strlen(b->frame);
+   h.stamp = b->stamp;
+   h.seq = journal[s].write_seq;
+   h.crc = journal_crc(journal_crc(0, &h.stamp, 2 * sizeof(qword)), b->frame, h.length);
+
+   if(journal[s].write_offset && journal[s].write_offset + (off_t) sizeof(h) + h.length > JOURNAL_SEGMENT_SIZE)
+   {
+      // Start a new segment
+      int fd = open(journal_segment_path(s, h.seq), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+      if(fd < 0)
       {
-         sprintf(newpath, "/tmp/stompy-%d-%s", s, name);
-         rename(filepath, newpath);
+         _log(CRITICAL, "Failed to create journal segment \"%s\".  Error %d %s.", journal_segment_path(s, h.seq), errno, strerror(errno));
       }
       else
       {
-         if(unlink(filepath))
-            _log(MAJOR, "Failed to delete \"%s\" from disc.  Error %d %s.", errno, strerror(errno));
+         journal_sync(s);
+         close(journal[s].write_fd);
+         journal[s].write_fd = fd;
+         journal[s].write_segment = h.seq;
+         journal[s].write_offset = 0;
+         _log(DEBUG, "Stream %d journal segment %lld started.", s, h.seq);
       }
+   }
 
-      inst[TotalDisc] += (time_us() - inst[StartDisc]);
-      inst[StartDisc] = 0LL;
-      inst[CountDiscRead]++;
+   iov[0].iov_base = &h;
+   iov[0].iov_len  = sizeof(h);
+   iov[1].iov_base = b->frame;
+   iov[1].iov_len  = h.length;
+   l = writev(journal[s].write_fd, iov, 2);
+   if(l != (ssize_t) (sizeof(h) + h.length))
+   {
+      _log(CRITICAL, "Failed to write frame to journal for stream %d.  Error %d %s.", s, errno, strerror(errno));
+      // Don't leave part of a record behind
+      if(l > 0 && ftruncate(journal[s].write_fd, journal[s].write_offset)) 
+      {
+         _log(CRITICAL, "Failed to truncate journal for stream %d.  Error %d %s.", s, errno, strerror(errno));
+      }
+      return 1;
+   }
+
+   b->segment = journal[s].write_segment;
+   b->offset = journal[s].write_offset;
+   b->seq = h.seq;
+   if(journal[s].read_seq == journal[s].write_seq) journal[s].oldest = h.stamp;
+   journal[s].write_seq++;
+   journal[s].write_offset += l;
+
+   // Sync according to policy
+   journal[s].unsynced++;
+   if(journal_sync_policy == JOURNAL_SYNC_ALWAYS || journal[s].unsynced >= JOURNAL_SYNC_FRAMES)
+   {
+      if(journal_sync_policy != JOURNAL_SYNC_NEVER) journal_sync(s);
    }
+   else if(journal_sync_policy == JOURNAL_SYNC_INTERVAL && journal_sync_due > now + journal_sync_interval)
+   {
+      journal_sync_due = now + journal_sync_interval;
+   }
+   return 0;
 }
 
-static word load_queue_from_disc(const word s)
+static word journal_peek(const word s)
 {
-   // returns number loaded
-   _log(PROC, "load_queue_from_disc(%d)", s);
-   word result = 0;
-   struct dirent **eps;
+   // Find the header of the record at the cursor, moving to the next segment if necessary.  Sets read_seq and oldest.
+   // Returns non-zero if the journal is empty.
+   struct journal_header h;
+   ssize_t l;
+   qword next;
+
+   while(true)
+   {
+      if(journal[s].read_segment == journal[s].write_segment && journal[s].read_offset >= journal[s].write_offset)
+      {
+         journal[s].read_seq = journal[s].write_seq;
+         return 1;
+      }
+
+      l = pread(journal[s].read_fd, &h, sizeof(h), journal[s].read_offset);
+      if(l == sizeof(h) && h.length < FRAME_SIZE)
+      {
+         journal[s].read_seq = h.seq;
+         journal[s].oldest = h.stamp;
+         journal[s].next_length = h.length + 1;
+         return 0;
+      }
+
+      if(l != 0)
+      {
+         _log(MAJOR, "Stream %d journal segment %lld corrupt at offset %ld.  Rest of segment skipped.", s, journal[s].read_segment, journal[s].read_offset);
+      }
+      if(journal[s].read_segment == journal[s].write_segment)
+      {
+         journal[s].read_offset = journal[s].write_offset;
+         continue;
+      }
+
+      // On to the next segment.  It's normally named after the next sequence number.
+      next = journal[s].read_seq;
+      if(next <= journal[s].read_segment || access(journal_segment_path(s, next), F_OK))
+      {
+         next = journal_next_segment(s, journal[s].read_segment);
+      }
+      if(!next)
+      {
+         _log(CRITICAL, "Stream %d journal segment after %lld missing.", s, journal[s].read_segment);
+         next = journal[s].write_segment;
+      }
+      close(journal[s].read_fd);
+      journal[s].read_segment = next;
+      journal[s].read_offset = 0;
+      journal[s].read_fd = open(journal_segment_path(s, next), O_RDONLY);
+      if(journal[s].read_fd < 0)
+      {
+         _log(CRITICAL, "Failed to open journal segment \"%s\".  Error %d %s.", journal_segment_path(s, next), errno, strerror(errno));
+         journal[s].read_segment = journal[s].write_segment;
+         journal[s].read_offset = journal[s].write_offset;
+      }
+   }
+}
+
+static struct frame_buffer * journal_read(const word s)
+{
+   // Read the frame at the cursor into a new buffer, and advance the cursor.  Returns NULL if there are none left,
+   // or no buffer is available.
+   struct journal_header h;
    struct frame_buffer * b;
 
-   // Get some file names
-   inst[StartDisc] = time_us();
-   int n = scandir (spool_path[s], &eps, is_a_buffer, alphasort);
-   inst[TotalDisc] += (time_us() - inst[StartDisc]);
-   inst[StartDisc] = 0LL;
+   while(!journal_peek(s))
+   {
+      if(!(b = new_buffer(journal[s].next_length))) return NULL;
+      if(pread(journal[s].read_fd, &h, sizeof(h), journal[s].read_offset) == sizeof(h) &&
+         pread(journal[s].read_fd, b->frame, h.length, journal[s].read_offset + sizeof(h)) == h.length &&
+         journal_crc(journal_crc(0, &h.stamp, 2 * sizeof(qword)), b->frame, h.length) == h.crc)
+      {
+         b->frame[h.length] = '\0';
+         b->stamp = h.stamp;
+         b->segment = journal[s].read_segment;
+         b->offset = journal[s].read_offset;
+         b->seq = h.seq;
+         journal[s].read_offset += sizeof(h) + h.length;
+         journal[s].read_seq = h.seq + 1;
+         journal_peek(s);
+         return b;
+      }
+      free_buffer(b);
+      _log(MAJOR, "Stream %d journal record %lld at %lld:%ld failed check.  Discarded.", s, h.seq, journal[s].read_segment, journal[s].read_offset);
+      journal[s].read_offset += sizeof(h) + h.length;
+      journal[s].read_seq = h.seq + 1;
+   }
+   return NULL;
+}
 
-   if (n >= 0)
+static void journal_skip(const word s)
+{
+   // Mark everything in the journal as read
+   if(journal[s].read_segment != journal[s].write_segment)
+   {
+      close(journal[s].read_fd);
+      journal[s].read_fd = open(journal_segment_path(s, journal[s].write_segment), O_RDONLY);
+   }
+   journal[s].read_segment = journal[s].write_segment;
+   journal[s].read_offset  = journal[s].write_offset;
+   journal[s].read_seq     = journal[s].write_seq;
+}
+
+static void journal_rewind(const word s, const struct frame_buffer * const b)
+{
+   // Move the cursor back to the frame in b, which was read from the journal.
+   _log(DEBUG, "journal_rewind(%d, ~):  Back to record %lld at %lld:%ld.", s, b->seq, b->segment, (long) b->offset);
+   if(b->segment != journal[s].read_segment)
    {
-      int cnt;
-      for (cnt = 0; cnt < n && cnt < BUFFERS / 2; cnt++)
+      close(journal[s].read_fd);
+      journal[s].read_fd = open(journal_segment_path(s, b->segment), O_RDONLY);
+      if(journal[s].read_fd < 0)
       {
-         if( (b = new_buffer()) )
+         _log(CRITICAL, "Failed to open journal segment \"%s\".  Error %d %s.", journal_segment_path(s, b->segment), errno, strerror(errno));
+      }
+   }
+   journal[s].read_segment = b->segment;
+   journal[s].read_offset  = b->offset;
+   journal[s].read_seq     = b->seq;
+   journal[s].oldest       = b->stamp;
+}
+
+static void journal_checkpoint(const word s)
+{
+   // Record the cursor on disc, and delete segments which are no longer needed.
+   // Frames loaded from the journal which are still in the queue have not been acked, so the recorded cursor
+   // is the oldest of those.  After a crash they will be sent again.
+   struct frame_buffer * b;
+   qword cursor[2];
+   struct dirent **eps;
+   int n, i;
+
+   if(journal[s].cursor_fd < 0) return;
+
+   cursor[0] = journal[s].read_segment;
+   cursor[1] = journal[s].read_offset;
+   for(b = stream_q_off[s]; b; b = b->next)
+   {
+      if(b->segment)
+      {
+         cursor[0] = b->segment;
+         cursor[1] = b->offset;
+         break;
+      }
+   }
+   if(pwrite(journal[s].cursor_fd, cursor, sizeof(cursor), 0) != sizeof(cursor))
+   {
+      _log(CRITICAL, "Failed to write journal cursor for stream %d.  Error %d %s.", s, errno, strerror(errno));
+   }
+
+   if(journal[s].first_segment < cursor[0])
+   {
+      n = scandir(spool_path[s], &eps, is_a_segment, alphasort);
+      for(i = 0; i < n; i++)
+      {
+         qword segment = atoll(eps[i]->d_name);
+         if(segment < cursor[0])
          {
-            _log(DEBUG, "Loading \"%s\".", eps[cnt]->d_name);
-            load_buffer_from_disc(b, s, eps[cnt]->d_name);
-            if(b->stamp)
+            char * path = journal_segment_path(s, segment);
+            _log(DEBUG, "Deleting journal segment \"%s\".", path);
+            if(debug)
             {
-               enqueue(s, b);
-               result++;
+               char newpath[512];
+               sprintf(newpath, "/tmp/stompy-%d-%s", s, eps[i]->d_name);
+               rename(path, newpath);
             }
-            else
+            else if(unlink(path))
             {
-               free_buffer(b);
+               _log(MAJOR, "Failed to delete \"%s\" from disc.  Error %d %s.", path, errno, strerror(errno));
             }
          }
-         free(eps[cnt]);
-      }  
-      for(;cnt < n; cnt++)
-      {
-         free(eps[cnt]);
-      }         
-      free(eps);
-   }
-   else
-   {
-      // Couldn't open the directory");
-      _log(CRITICAL, "load_queue_from_disc() failed to open directory \"%s\".  Error %d %s.  Fatal", spool_path[s], errno, strerror(errno));
-      run = false;
+         free(eps[i]);
+      }
+      if(n >= 0) free(eps);
+      journal[s].first_segment = cursor[0];
    }
-
-   _log(DEBUG, "load_queue_from_disc() returns %d", result);
-   return result;
 }
 
-static int disc_queue_length(const word s)
+static void journal_sync(const word s)
 {
-   // returns number found, or -1 for error.
-   // _log(PROC, "disc_queue_length(%d)", s);
-   struct dirent **eps;
-   int result, i;
-
-   // Get some file names
-   inst[StartDisc] = time_us();
-   result = scandir (spool_path[s], &eps, is_a_buffer, alphasort);
-   inst[TotalDisc] += (time_us() - inst[StartDisc]);
-   inst[StartDisc] = 0LL;
-   if(result >=0)
+   if(journal[s].unsynced && journal[s].write_fd >= 0)
    {
-      for(i = 0; i < result; i++)
+      if(fdatasync(journal[s].write_fd))
       {
-         free(eps[i]);
+         _log(CRITICAL, "Failed to sync journal for stream %d.  Error %d %s.", s, errno, strerror(errno));
       }
-      free(eps);
+      journal[s].unsynced = 0;
    }
+}
 
-   _log(PROC, "disc_queue_length(%d) returns %d.", s, result);
-   return result;
+static void journal_sync_all(void)
+{
+   word s;
+   for(s = 0; s < streams; s++) journal_sync(s);
+   journal_sync_due = 0x7fffffff;
 }
 
-static qword disc_queue_oldest(const word s)
+static void load_buffer_from_disc(struct frame_buffer * const b, const word s, const char * const name)
 {
-   // returns timestamp of oldest disc buffer.  Units are microseconds.
-   // Or 0 for none found or error.
-   struct dirent **eps;
-   qword result = 0;
-   int n, i;
+   // Load a spool file written by an older version, then delete it.
+   // NB if returned buffer has ->stamp==0 this indicates failure.
+   char filepath[1100], newpath[512];
+   _log(PROC, "load_buffer_from_disc(~, %d, \"%s\")", s, name);
 
-   // Get some file names
-   inst[StartDisc] = time_us();
-   n = scandir(spool_path[s], &eps, is_a_buffer, alphasort);
-   inst[TotalDisc] += (time_us() - inst[StartDisc]);
-   inst[StartDisc] = 0LL;
+   sprintf(filepath, "%s/%s", spool_path[s], name);
 
-   if(n > 0)
+   b->frame[0] = '\0';
+   b->stamp = 0;
+
+   int fd = open(filepath, O_RDONLY);
+   if(fd < 0)
    {
-      result = atoll(eps[0]->d_name);
+      _log(CRITICAL, "Reading buffer from disc failed to open \"%s\".  Error %d %s.", filepath, errno, strerror(errno));
    }
-   if(n >= 0)
+   else
    {
-      for(i = 0; i < n; i++)
+      ssize_t l, length;
+      length = 0;
+      l = -1;
+      while(l)
       {
-         free(eps[i]);
+         l = read(fd, b->frame + length, FRAME_SIZE - length - 1);
+         if(l < 0)
+         {
+            _log(CRITICAL, "Error reading buffer \"%s\" from disc.  Error %d %s.", filepath, errno, strerror(errno));
+            l = 0;
+         }
+         else if(l > 0)
+         {
+            length += l;
+         }
+         else // l == 0  EOF
+         {
+            b->stamp = atoll(name);
+            b->frame[length] = 0; // Append the \0.
+         }
+      }
+      close(fd);
+
+      // Now "delete" the file
+      if(debug)
+      {
+         sprintf(newpath, "/tmp/stompy-%d-%s", s, name);
+         rename(filepath, newpath);
+      }
+      else
+      {
+         if(unlink(filepath))
+            _log(MAJOR, "Failed to delete \"%s\" from disc.  Error %d %s.", filepath, errno, strerror(errno));
       }
-      free(eps);
    }
-   return result;
 }
 
-static void log_message(const word s)
+static void log_message(const word s, const struct frame_buffer * const b)
 {
    FILE * fp;
    
@@ -2464,7 +3332,7 @@ static void log_message(const word s)
               broken->tm_min,
               broken->tm_sec,
               stomp_topic_names[s]);
-      fprintf(fp, "%s\n", client_buffer[s]->frame);
+      fprintf(fp, "%s\n", b->frame);
       fclose(fp);
    }
 }
@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
 #include <mysql.h>
@@ -40,6 +41,7 @@
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "tdshm.h"
 #include "build.h"
 
 #define NAME  "tddb"
@@ -65,6 +67,19 @@ static void log_detail(const time_t stamp, const char * text, ...);
 static void check_timeout(void);
 static void control_mode_change(const word d, const word n);
 static void reload_describers(void);
+static word state_load(void);
+static dword state_hash(const char * const k);
+static struct state * state_find(const char * const k, const word create);
+static struct state * state_select(const word d, const char type0, const char type1, dword * const count);
+static void state_delete(struct state * const e);
+static void state_mark(struct state * const e, const byte flags);
+static word state_flush(void);
+static void state_write_behind(const word force);
+static const char * obfus_true_hc(const char * const obfus_hc);
+static void tdshm_open(void);
+static void tdshm_publish(struct state * const e, const word journal);
+static void tdshm_describer(const word d, const time_t last_timestamp);
+static void tdshm_banner(void);
 
 static word debug, run, interrupt, holdoff;
 static char zs[4096];
@@ -77,6 +92,8 @@ static jsmntok_t tokens[NUM_TOKENS];
 
 // stompy port for TD stream
 #define STOMPY_PORT 55842
+// Number of frames stompy may send ahead of our acks
+#define STOMPY_WINDOW 8
 
 // Time in hours (local) when daily statistical report is produced.
 // (Set > 23 to disable daily report.)
@@ -118,13 +135,13 @@ static time_t check_describers_flow_due;
 enum data_types {Berth, Signal};
 
 // Stats
-enum stats_categories {ConnectAttempt, GoodMessage, RelMessage, CA, CB, CC, CT, SF, SG, SH, NewDesc, NewKey, NotRecog, HandleWrap, MAXstats};
+enum stats_categories {ConnectAttempt, GoodMessage, RelMessage, CA, CB, CC, CT, SF, SG, SH, NewDesc, NewKey, NotRecog, HandleWrap, DBRoundTrip, StateFlush, MAXstats};
 static qword stats[MAXstats];
 static qword grand_stats[MAXstats];
 static const char * stats_category[MAXstats] = 
    {
       "Stompy connect attempt", "Good message", 
-      "Relevant message", "CA message", "CB message", "CC message", "CT message", "SF message", "SG message", "SH message", "New describer", "New key", "Unrecognised message", "Handle wrap",
+      "Relevant message", "CA message", "CB message", "CC message", "CT message", "SF message", "SG message", "SH message", "New describer", "New key", "Unrecognised message", "Handle wrap", "Database round trips", "State flushes",
    };
 
 // Signalling
@@ -135,6 +152,52 @@ static word signalling[DESCRIBERS][SIG_BYTES];
 #define MAX_HANDLE 0x19a000
 static dword handle;
 
+// Berth and signalling states.  These are held here, and td_states and td_updates are written behind in batches, so
+// a berth step costs no round trips.  Every key in td_states is loaded at start up, so a key not found is a new one.
+// The table is open addressed, with deleted entries left as markers until it is next grown.
+#define STATE_SLOTS 65536
+#define STATE_FLUSH_INTERVAL 2
+#define STATE_FLUSH_MAX 4096
+#define STATE_FLUSH_BACKOFF_MAX 64
+enum state_flags {StateUsed = 0x01, StateDeleted = 0x02, StateDirty = 0x04, UpdateDirty = 0x08, StateListed = 0x10};
+struct state
+{
+   char k[20], v[8];
+   byte flags;
+   dword handle;
+   time_t updated;
+   dword shm; // Index + 1 in the shared memory segment, or 0.
+};
+static struct state * states;
+static dword state_slots, state_used;
+// Entries with changes not yet written.  An entry listed is flagged StateListed, which survives its deletion and reuse, so
+// it appears at most once and the list can't outgrow the table.
+static dword * state_dirty;
+static dword state_dirty_count;
+// Set when the handle wraps and td_updates is to be emptied.
+static word state_wrapped;
+static time_t state_flushed;
+// Seconds to wait after a failed flush before trying again, or 0.
+static word state_flush_wait;
+static struct db_batch state_batch;
+
+// Obfuscated headcodes, copied from obfus_lookup, which trustdb keeps for 24 hours.
+#define OBFUS_SLOTS 4096
+#define OBFUS_REFRESH_INTERVAL 8
+#define OBFUS_LIFE 86400L
+static struct
+{
+   char obfus_hc[8], true_hc[8];
+   time_t created;
+} obfus[OBFUS_SLOTS];
+static word obfus_count;
+static time_t obfus_refreshed, obfus_latest;
+
+// Shared memory copy of the berth and signal states, for livesig.  NULL if it couldn't be set up.
+#define TDSHM_BANNER_INTERVAL 32
+static struct tdshm * shm;
+static time_t shm_banner_due;
+
 // Message count
 word message_count, message_count_rel;
 time_t last_message_count_report;
@@ -306,6 +369,10 @@ int main(int argc, char *argv[])
          _log(CRITICAL, "Failed to set up signal handler.");
          exit(1);
       }
+      // SIGUSR1 asks for the database query profile.  It is kept blocked and picked up in the main loop.
+      sigemptyset(&block_mask);
+      sigaddset(&block_mask, SIGUSR1);
+      sigprocmask(SIG_BLOCK, &block_mask, NULL);
    }
    if(!debug) signal(SIGCHLD,SIG_IGN); /* ignore child */
    if(!debug) signal(SIGTSTP,SIG_IGN); /* ignore tty signals */
@@ -361,6 +428,15 @@ static void perform(void)
 
    handle = MAX_HANDLE;
 
+   tdshm_open();
+
+   while(run && state_load())
+   {
+      _log(CRITICAL, "Failed to load berth states.  Will retry...");
+      word i;
+      for(i = 0; i < 64 && run; i++) sleep(1);
+   }
+
    {
       time_t now = time(NULL);
       struct tm * broken = localtime(&now);
@@ -392,7 +468,7 @@ static void perform(void)
    while(run)
    {   
       stats[ConnectAttempt]++;
-      int run_receive = !open_stompy(STOMPY_PORT);
+      int run_receive = !open_stompy_window(STOMPY_PORT, STOMPY_WINDOW);
       while(run_receive && run)
       {
          holdoff = 0;
@@ -404,6 +480,7 @@ static void perform(void)
                last_report_day = broken->tm_wday;
                report_stats();
             }
+            if(signal_pending(SIGUSR1)) db_report_profile(false);
             if(now - last_message_count_report > MESSAGE_COUNT_REPORT_INTERVAL)
             {
                char query[256];
@@ -451,6 +528,7 @@ static void perform(void)
                      _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
                      run_receive = false;
                   }
+                  state_write_behind(false);
                }
             }
             else
@@ -472,6 +550,7 @@ static void perform(void)
                if(!stompy_timeout) _log(MINOR, "TD message stream - Receive timeout."); 
                no_feed = NO_FEED_LOCKOUT;
                stompy_timeout = true;
+               state_write_behind(true);
             }
          }
 
@@ -493,6 +572,7 @@ static void perform(void)
       _log(CRITICAL, "Terminating due to interrupt.");
    }
 
+   if(state_flush()) _log(CRITICAL, "Failed to write %u berth state changes.", state_dirty_count);
    db_disconnect();
    report_stats();
 }
@@ -618,6 +698,7 @@ static void process_message(const word describer, const char * const body, const
        db_query(query);
        sprintf(query, "update describers set last_timestamp = %ld WHERE id = '%s'", timestamp, describers[describer].id);
        db_query(query);
+       tdshm_describer(describer, timestamp);
    }
 
    if(!strcasecmp(message_type, "CA"))
@@ -773,9 +854,9 @@ static void signalling_update(const char * const message_name, const word descri
 
 static void update_database(const word type, const word describer, const char * const b, const char * const v)
 {
-   char query[512], typec, vv[8];
-   MYSQL_RES * result;
-   MYSQL_ROW row;
+   char typec, vv[8], k[32];
+   const char * true_hc;
+   struct state * e;
    time_t now = time(NULL);
 
    _log(PROC, "update_database(%d, %d, \"%s\", \"%s\")", type, describer, b, v);
@@ -788,19 +869,10 @@ static void update_database(const word type, const word describer, const char *
    if(type == Berth) 
    {
       typec = 'b';
-      if(v[0])
+      if(v[0] && (true_hc = obfus_true_hc(v)))
       {
-         sprintf(query, "SELECT true_hc FROM obfus_lookup where obfus_hc = '%s' ORDER BY created DESC LIMIT 1", v);
-         if(!db_query(query))
-         {
-            result = db_store_result();
-            if((row = mysql_fetch_row(result))) 
-            {
-               strcpy(vv, row[0]);
-               _log(DEBUG, "De-obfuscating \"%s\" to \"%s\".", v, vv);
-            }
-            mysql_free_result(result);
-         }
+         strcpy(vv, true_hc);
+         _log(DEBUG, "De-obfuscating \"%s\" to \"%s\".", v, vv);
       }
    }
    else
@@ -813,61 +885,61 @@ static void update_database(const word type, const word describer, const char *
       if(++handle > MAX_HANDLE)
       {
          handle = 1;
-         // n.b. Do not use TRUNCATE TABLE as that cannot be rolled back.
-         db_query("delete from td_updates");
+         // The updates waiting to be written go with the rest.
+         dword i;
+         for(i = 0; i < state_dirty_count; i++) states[state_dirty[i]].flags &= ~UpdateDirty;
+         state_wrapped = true;
          stats[HandleWrap]++;
+         if(shm)
+         {
+            shm->sequence++;
+            __sync_synchronize();
+            shm->journal_first = handle;
+            __sync_synchronize();
+            shm->sequence++;
+         }
       }
-      else
-      {
-         sprintf(query, "delete from td_updates where k = '%s%c%s'", describers[describer].id, typec, b);
-         db_query(query);
-      }
-
-      sprintf(query, "INSERT INTO td_updates values(%ld, %d, '%s%c%s', '%s')", now, handle, describers[describer].id, typec, b, vv);
-      db_query(query);
+   }
+   else
+   {
+      typec++;
    }
 
-   if(describers[describer].control_mode == 2) typec++;
-
-   sprintf(query, "UPDATE td_states SET updated = %ld, v = '%s' where k = '%s%c%s'", now, vv, describers[describer].id, typec, b);
-   if(!db_query(query))
+   sprintf(k, "%s%c%s", describers[describer].id, typec, b);
+   if(!(e = state_find(k, false)))
    {
-      if(!db_affected_rows())
+      if(!(e = state_find(k, true))) return;
+      if(describers[describer].control_mode != 2)
       {
-         sprintf(query, "INSERT INTO td_states VALUES(%ld, '%s%c%s', '%s')", now, describers[describer].id, typec, b, vv);
-         db_query(query);
-         if(describers[describer].control_mode != 2)
-         {
-            char report[1024];
-            sprintf(report, "Added new %s \"%s\", value \"%s\", on describer %s (%s) to database.", ((typec == 'b')?"berth":"S address"), b, v, describers[describer].id, describers[describer].description);
-            _log(MINOR, report);
-            if(*conf[conf_tddb_report_new]) email_alert(NAME, BUILD, "New Key Alert", report);
-            stats[NewKey]++;
-         }
+         char report[1024];
+         sprintf(report, "Added new %s \"%s\", value \"%s\", on describer %s (%s) to database.", ((typec == 'b')?"berth":"S address"), b, v, describers[describer].id, describers[describer].description);
+         _log(MINOR, report);
+         if(*conf[conf_tddb_report_new]) email_alert(NAME, BUILD, "New Key Alert", report);
+         stats[NewKey]++;
       }
    }
+   strcpy(e->v, vv);
+   e->updated = now;
+   if(describers[describer].control_mode != 2)
+   {
+      e->handle = handle;
+      state_mark(e, StateDirty | UpdateDirty);
+      tdshm_publish(e, true);
+   }
+   else
+   {
+      state_mark(e, StateDirty);
+   }
 }
 
 static const char * const query_berth(const word describer, const char * const b)
 {
-   char query[512];
-   MYSQL_RES * result;
-   MYSQL_ROW row;
-   static char reply[32];
+   char k[32];
+   struct state * e;
 
-   strcpy(reply, "");
-
-   sprintf(query, "SELECT * FROM td_states where k = '%sb%s'", describers[describer].id, b);
-   if(!db_query(query))
-   {
-      result = db_store_result();
-      if((row = mysql_fetch_row(result))) 
-      {
-         strcpy(reply,row[2]);
-      }
-      mysql_free_result(result);
-   }
-   return reply;
+   sprintf(k, "%sb%s", describers[describer].id, b);
+   if((e = state_find(k, false))) return e->v;
+   return "";
 }
 
 static void create_database(void)
@@ -929,6 +1001,8 @@ static void report_stats(void)
    _log(GENERAL, zs);
    strcat(report, zs);
    strcat(report, "\n");
+   stats[DBRoundTrip] += db_round_trips;
+   db_round_trips = 0;
    for(i=0; i<MAXstats; i++)
    {
       grand_stats[i] += stats[i];
@@ -974,6 +1048,7 @@ static void report_stats(void)
 
    email_alert(NAME, BUILD, "Statistics Report", report);
    _log(GENERAL, "");
+   db_report_profile(true);
 }
 
 static const char * show_signalling_state(const word describer)
@@ -1035,6 +1110,16 @@ static void check_timeout(void)
    char report[512];
 
    time_t now = time(NULL);
+   if(shm)
+   {
+      shm->heartbeat = now;
+      if(now >= shm_banner_due)
+      {
+         shm_banner_due = now + TDSHM_BANNER_INTERVAL;
+         tdshm_banner();
+      }
+   }
+
    if(now > check_describers_flow_due)
    {   
       check_describers_flow_due = now + CHECK_DESCRIBERS_FLOW_INTERVAL;
@@ -1097,10 +1182,10 @@ static void check_timeout(void)
 
 static void control_mode_change(const word d, const word n)
 {
-   MYSQL_RES * result;
-   MYSQL_ROW row;
    char q[512];
-   char other_k[16];
+   char other_k[20];
+   struct state * list, * e;
+   dword count, i;
    word j;
 
    _log(GENERAL, "   Mode change from %d to %d on describer %s (%s).", describers[d].control_mode, n, describers[d].id,  describers[d].description);
@@ -1111,26 +1196,24 @@ static void control_mode_change(const word d, const word n)
       // 1. Set mode so that update_database points to the live records.
       describers[d].control_mode = n;
       // 2. Retrieve hidden records and make them live
-      sprintf(q, "SELECT updated, k, v FROM td_states WHERE substring(k,1,2) = '%s' AND v != '' AND (substring(k,3,1) = 'c' OR substring(k,3,1) = 't')", describers[d].id);
-      if(!db_query(q))
+      list = state_select(d, 'c', 't', &count);
+      for(i = 0; i < count; i++)
       {
-         result = db_store_result();
-         while((row = mysql_fetch_row(result))) 
+         if(list[i].v[0])
          {
-            strcpy(other_k, row[1]);
-            other_k[2]--;
-            if(other_k[2] == 'b')
+            if(list[i].k[2] == 'c')
             {
-               update_database(Berth, d, other_k+3, row[2]);
+               update_database(Berth, d, list[i].k + 3, list[i].v);
             }
-            else if(other_k[2] == 's')
+            else
             {
-               update_database(Signal, d, other_k+3, row[2]);
+               update_database(Signal, d, list[i].k + 3, list[i].v);
             }
          }
-         mysql_free_result(result);
+         // 3. Delete all hidden records
+         if((e = state_find(list[i].k, false))) state_delete(e);
       }
-      // 3. Delete all hidden records
+      free(list);
       sprintf(q, "DELETE FROM td_states WHERE (substring(k,3,1) = 'c' OR substring(k,3,1) = 't') AND substring(k,1,2) = '%s'", describers[d].id);
       db_query(q);
    }
@@ -1145,23 +1228,15 @@ static void control_mode_change(const word d, const word n)
    case 1:
       // Clear all berths
       _log(GENERAL, "      Clearing all berth data and reverting to mode 0.");
-      sprintf(q, "SELECT k FROM td_states WHERE v != '' AND substring(k,1,2) = '%s'", describers[d].id);
-      if(!db_query(q))
+      list = state_select(d, 'b', 's', &count);
+      for(i = 0; i < count; i++)
       {
-         result = db_store_result();
-         while((row = mysql_fetch_row(result))) 
+         if(list[i].v[0])
          {
-            if(row[0][2] == 'b')
-            {
-               update_database(Berth, d, row[0]+3, "");
-            }
-            else if(row[0][2] == 's')
-            {
-               update_database(Signal, d, row[0]+3, "");
-            }
+            update_database((list[i].k[2] == 'b') ? Berth : Signal, d, list[i].k + 3, "");
          }
-         mysql_free_result(result);
       }
+      free(list);
 
       // Clear locally stored signal states
       for(j = 0; j < SIG_BYTES; j++)
@@ -1179,32 +1254,32 @@ static void control_mode_change(const word d, const word n)
       // Turn on blank mode
       _log(GENERAL, "      Turning on blank mode, retaining states in database.");
       // 1. Delete all hidden records.
+      list = state_select(d, 'c', 't', &count);
+      for(i = 0; i < count; i++)
+      {
+         if((e = state_find(list[i].k, false))) state_delete(e);
+      }
+      free(list);
       sprintf(q, "DELETE FROM td_states WHERE (substring(k,3,1) = 'c' OR substring(k,3,1) = 't') AND substring(k,1,2) = '%s'", describers[d].id);
+      db_query(q);
       // 2. Copy live records to hidden and blank live ones.
-      sprintf(q, "SELECT updated, k, v FROM td_states WHERE substring(k,1,2) = '%s' AND (substring(k,3,1) = 'b' OR substring(k,3,1) = 's')", describers[d].id);
-      if(!db_query(q))
+      list = state_select(d, 'b', 's', &count);
+      for(i = 0; i < count; i++)
       {
-         result = db_store_result();
-         while((row = mysql_fetch_row(result))) 
+         strcpy(other_k, list[i].k);
+         other_k[2]++;
+         if((e = state_find(other_k, true)))
          {
-            strcpy(other_k, row[1]);
-            other_k[2]++;
-            sprintf(q, "INSERT INTO td_states (updated, k, v) VALUES(%s, '%s', '%s')", row[0], other_k, row[2]);
-            db_query(q);
-            if(row[2][0])
-            {
-               if(row[1][2] == 'b')
-               {
-                  update_database(Berth, d, row[1]+3, "");
-               }
-               else if(row[1][2] == 's')
-               {
-                  update_database(Signal, d, row[1]+3, "");
-               }
-            }
+            strcpy(e->v, list[i].v);
+            e->updated = list[i].updated;
+            state_mark(e, StateDirty);
+         }
+         if(list[i].v[0])
+         {
+            update_database((list[i].k[2] == 'b') ? Berth : Signal, d, list[i].k + 3, "");
          }
-         mysql_free_result(result);
       }
+      free(list);
       // Set mode so that future updates will go to the hidden records.
       describers[d].control_mode = 2;
       sprintf(q, "UPDATE describers SET control_mode_cmd = 2, control_mode = 2 WHERE id = '%s'", describers[d].id);
@@ -1254,12 +1329,14 @@ static void reload_describers(void)
                if(describers[new_describers].no_sig_address > SIG_BYTES) describers[new_describers].no_sig_address=SIG_BYTES;
                describers[new_describers].process_mode   = atoi(row[5]);
                strcpy(describers[new_describers].description, row[6]);
+               tdshm_describer(new_describers, atol(row[1]));
                new_describers++;
             }
          }
       }
       mysql_free_result(result);
       no_describers = new_describers;
+      if(shm) shm->describers = no_describers;
       _log(GENERAL, "   Loaded %d describers.", no_describers);
       if(list_changed)
       {
@@ -1286,3 +1363,424 @@ static void reload_describers(void)
    // Give any added describers time to get some messages before complaining
    no_feed = NO_FEED_LOCKOUT;
 }
+
+static word state_load(void)
+{
+   // Load td_states into the table.  Returns non-zero on failure.
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   struct state * e;
+
+   _log(GENERAL, "Loading berth states...");
+
+   free(states);
+   free(state_dirty);
+   state_slots = STATE_SLOTS;
+   state_used = state_dirty_count = 0;
+   state_wrapped = false;
+   states = calloc(state_slots, sizeof(struct state));
+   state_dirty = malloc(state_slots * sizeof(dword));
+   if(!states || !state_dirty)
+   {
+      _log(CRITICAL, "state_load():  Out of memory.");
+      return 1;
+   }
+
+   if(db_query("SELECT updated, k, v FROM td_states")) return 1;
+   result = db_use_result();
+   while((row = mysql_fetch_row(result)))
+   {
+      if(strlen(row[1]) >= sizeof(e->k) || strlen(row[2]) >= sizeof(e->v)) continue;
+      if(!(e = state_find(row[1], true)))
+      {
+         mysql_free_result(result);
+         return 1;
+      }
+      strcpy(e->v, row[2]);
+      e->updated = atol(row[0]);
+   }
+   mysql_free_result(result);
+
+   if(shm)
+   {
+      // Republish everything.  Readers will see the handle go backwards and ask for it all.
+      dword i;
+      shm->sequence++;
+      __sync_synchronize();
+      shm->states = 0;
+      shm->handle = 0;
+      shm->journal_first = 1;
+      __sync_synchronize();
+      shm->sequence++;
+      for(i = 0; i < state_slots; i++)
+      {
+         if(states[i].flags == StateUsed) tdshm_publish(&states[i], false);
+      }
+   }
+   // The rows came back from the database, so there's nothing to write.
+   state_dirty_count = 0;
+   state_flushed = time(NULL);
+
+   _log(GENERAL, "   Loaded %u berth states.", state_used);
+   return 0;
+}
+
+static dword state_hash(const char * const k)
+{
+   dword hash = 2166136261u;
+   const char * c;
+   for(c = k; *c; c++)
+   {
+      hash ^= (byte) *c;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+static struct state * state_find(const char * const k, const word create)
+{
+   // Find the entry for key k, adding it, blank, if create is set.  Returns NULL if not found.  Adding an entry may move
+   // the others.
+   dword i, deleted;
+
+   if(create && (state_used + 1) * 4 > state_slots * 3)
+   {
+      // Grow the table, dropping the deleted entries.
+      struct state * old = states;
+      dword old_slots = state_slots, j;
+      struct state * n = calloc(state_slots * 2, sizeof(struct state));
+      dword * nd = malloc(state_slots * 2 * sizeof(dword));
+      if(!n || !nd)
+      {
+         _log(CRITICAL, "state_find():  Out of memory.");
+         free(n); free(nd);
+         return NULL;
+      }
+      states = n;
+      free(state_dirty);
+      state_dirty = nd;
+      state_slots *= 2;
+      state_used = state_dirty_count = 0;
+      for(j = 0; j < old_slots; j++)
+      {
+         if((old[j].flags & (StateUsed | StateDeleted)) == StateUsed)
+         {
+            for(i = state_hash(old[j].k) & (state_slots - 1); states[i].flags; i = (i + 1) & (state_slots - 1));
+            states[i] = old[j];
+            state_used++;
+            states[i].flags &= ~StateListed;
+            if(states[i].flags & (StateDirty | UpdateDirty))
+            {
+               states[i].flags |= StateListed;
+               state_dirty[state_dirty_count++] = i;
+            }
+         }
+      }
+      free(old);
+      _log(GENERAL, "Berth state table grown to %u entries.", state_slots);
+   }
+
+   deleted = state_slots;
+   for(i = state_hash(k) & (state_slots - 1); states[i].flags; i = (i + 1) & (state_slots - 1))
+   {
+      if(states[i].flags & StateDeleted)
+      {
+         if(deleted == state_slots) deleted = i;
+      }
+      else if(!strcmp(states[i].k, k))
+      {
+         return &states[i];
+      }
+   }
+   if(!create) return NULL;
+
+   if(deleted < state_slots) i = deleted;
+   else state_used++;
+   byte listed = states[i].flags & StateListed;
+   memset(&states[i], 0, sizeof(struct state));
+   strcpy(states[i].k, k);
+   states[i].flags = StateUsed | listed;
+   return &states[i];
+}
+
+static struct state * state_select(const word d, const char type0, const char type1, dword * const count)
+{
+   // Copy the entries for describer d of either type into a malloc'd array.
+   struct state * list;
+   dword i;
+
+   *count = 0;
+   if(!(list = malloc(state_slots * sizeof(struct state)))) return NULL;
+   for(i = 0; i < state_slots; i++)
+   {
+      if((states[i].flags & (StateUsed | StateDeleted)) == StateUsed && !strncmp(states[i].k, describers[d].id, 2) && (states[i].k[2] == type0 || states[i].k[2] == type1))
+      {
+         list[(*count)++] = states[i];
+      }
+   }
+   return list;
+}
+
+static void state_delete(struct state * const e)
+{
+   // The row in td_states is deleted by the caller.
+   e->flags = StateUsed | StateDeleted | (e->flags & StateListed);
+}
+
+static void state_mark(struct state * const e, const byte flags)
+{
+   if(!(e->flags & StateListed)) state_dirty[state_dirty_count++] = e - states;
+   e->flags |= flags | StateListed;
+}
+
+static void state_write_behind(const word force)
+{
+   // Flush the changes if they are due, or if force is set.  A failed flush keeps its changes, so the feed carries on, and
+   // the next attempt is put off, for twice as long each time up to STATE_FLUSH_BACKOFF_MAX seconds.
+   time_t now = time(NULL);
+
+   if(now < state_flushed + state_flush_wait) return;
+   if(!force && state_dirty_count < STATE_FLUSH_MAX && now < state_flushed + STATE_FLUSH_INTERVAL) return;
+
+   if(state_flush())
+   {
+      if(!state_flush_wait) state_flush_wait = STATE_FLUSH_INTERVAL;
+      else if(state_flush_wait < STATE_FLUSH_BACKOFF_MAX) state_flush_wait *= 2;
+      _log(MAJOR, "Failed to write %u berth state changes.  Retrying in %u seconds.", state_dirty_count, state_flush_wait);
+   }
+   else if(state_flush_wait)
+   {
+      _log(MINOR, "Berth state changes written.");
+      state_flush_wait = 0;
+   }
+}
+
+static word state_flush(void)
+{
+   // Write the changes to td_states and td_updates, in one transaction.  Returns non-zero on failure, in which case the
+   // changes are kept to try again.
+   dword i;
+   char row[128], k[48], v[24];
+   word fail = false;
+
+   state_flushed = time(NULL);
+   if(!state_dirty_count && !state_wrapped) return 0;
+   _log(DEBUG, "Writing %u berth state changes.", state_dirty_count);
+
+   if(db_start_transaction()) return 1;
+   // n.b. Do not use TRUNCATE TABLE as that cannot be rolled back.
+   if(state_wrapped) fail = db_query("delete from td_updates");
+
+   db_batch_init(&state_batch, "INSERT INTO td_states (updated, k, v) VALUES", " ON DUPLICATE KEY UPDATE updated = VALUES(updated), v = VALUES(v)");
+   for(i = 0; i < state_dirty_count && !fail; i++)
+   {
+      const struct state * const e = &states[state_dirty[i]];
+      if(e->flags & StateDirty)
+      {
+         db_real_escape_string(k, e->k, strlen(e->k));
+         db_real_escape_string(v, e->v, strlen(e->v));
+         sprintf(row, "(%ld, '%s', '%s')", e->updated, k, v);
+         fail = db_batch_insert(&state_batch, row);
+      }
+   }
+   if(!fail) fail = db_batch_flush(&state_batch);
+
+   db_batch_init(&state_batch, "INSERT INTO td_updates (created, handle, k, v) VALUES", " ON DUPLICATE KEY UPDATE created = VALUES(created), handle = VALUES(handle), v = VALUES(v)");
+   for(i = 0; i < state_dirty_count && !fail; i++)
+   {
+      const struct state * const e = &states[state_dirty[i]];
+      if(e->flags & UpdateDirty)
+      {
+         db_real_escape_string(k, e->k, strlen(e->k));
+         db_real_escape_string(v, e->v, strlen(e->v));
+         sprintf(row, "(%ld, %u, '%s', '%s')", e->updated, e->handle, k, v);
+         fail = db_batch_insert(&state_batch, row);
+      }
+   }
+   if(!fail) fail = db_batch_flush(&state_batch);
+
+   if(fail || db_commit_transaction())
+   {
+      db_rollback_transaction();
+      return 1;
+   }
+
+   for(i = 0; i < state_dirty_count; i++) states[state_dirty[i]].flags &= ~(StateDirty | UpdateDirty | StateListed);
+   state_dirty_count = 0;
+   state_wrapped = false;
+   stats[StateFlush]++;
+   return 0;
+}
+
+static const char * obfus_true_hc(const char * const obfus_hc)
+{
+   // The true headcode for an obfuscated one, or NULL.  The copy of obfus_lookup is brought up to date every
+   // OBFUS_REFRESH_INTERVAL seconds.
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   char query[256];
+   word i;
+   time_t now = time(NULL);
+
+   if(now >= obfus_refreshed + OBFUS_REFRESH_INTERVAL)
+   {
+      obfus_refreshed = now;
+      if(obfus_count > OBFUS_SLOTS / 2)
+      {
+         // Start again, leaving out the expired ones.
+         memset(obfus, 0, sizeof(obfus));
+         obfus_count = 0;
+         obfus_latest = now - OBFUS_LIFE;
+      }
+      sprintf(query, "SELECT created, true_hc, obfus_hc FROM obfus_lookup WHERE created >= %ld ORDER BY created", obfus_latest);
+      if(!db_query(query))
+      {
+         result = db_store_result();
+         while((row = mysql_fetch_row(result)))
+         {
+            if(strlen(row[2]) >= sizeof(obfus[0].obfus_hc) || strlen(row[1]) >= sizeof(obfus[0].true_hc)) continue;
+            for(i = state_hash(row[2]) % OBFUS_SLOTS; obfus[i].obfus_hc[0] && strcmp(obfus[i].obfus_hc, row[2]); i = (i + 1) % OBFUS_SLOTS);
+            if(!obfus[i].obfus_hc[0])
+            {
+               if(obfus_count >= OBFUS_SLOTS - 1) break;
+               strcpy(obfus[i].obfus_hc, row[2]);
+               obfus_count++;
+            }
+            // Rows are in order, so the latest wins.
+            strcpy(obfus[i].true_hc, row[1]);
+            obfus[i].created = atol(row[0]);
+            if(obfus[i].created > obfus_latest) obfus_latest = obfus[i].created;
+         }
+         mysql_free_result(result);
+      }
+   }
+
+   for(i = state_hash(obfus_hc) % OBFUS_SLOTS; obfus[i].obfus_hc[0]; i = (i + 1) % OBFUS_SLOTS)
+   {
+      if(!strcmp(obfus[i].obfus_hc, obfus_hc))
+      {
+         if(obfus[i].created < now - OBFUS_LIFE) return NULL;
+         return obfus[i].true_hc;
+      }
+   }
+   return NULL;
+}
+
+static void tdshm_open(void)
+{
+   // Create or reuse the shared memory segment.  On failure we carry on without it and livesig uses the database.
+   int fd = shm_open(TDSHM_NAME, O_CREAT | O_RDWR, 0644);
+   if(fd < 0)
+   {
+      _log(MAJOR, "Failed to open shared memory \"%s\".  Error %d %s", TDSHM_NAME, errno, strerror(errno));
+      return;
+   }
+   if(ftruncate(fd, sizeof(struct tdshm)))
+   {
+      _log(MAJOR, "Failed to size shared memory \"%s\".  Error %d %s", TDSHM_NAME, errno, strerror(errno));
+      close(fd);
+      return;
+   }
+   shm = mmap(NULL, sizeof(struct tdshm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(shm == MAP_FAILED)
+   {
+      _log(MAJOR, "Failed to map shared memory \"%s\".  Error %d %s", TDSHM_NAME, errno, strerror(errno));
+      shm = NULL;
+      return;
+   }
+
+   // Readers ignore it until the magic is set.  Leave sequence alone, a reader may be part way through.
+   shm->magic = 0;
+   __sync_synchronize();
+   shm->sequence |= 1;
+   __sync_synchronize();
+   shm->heartbeat = time(NULL);
+   shm->handle = shm->states = 0;
+   shm->journal_first = 1;
+   shm->describers = 0;
+   shm->banner[0] = shm->banner1[0] = '\0';
+   shm->banner_expires = 0;
+   __sync_synchronize();
+   shm->sequence++;
+   shm->magic = TDSHM_MAGIC;
+   shm_banner_due = 0;
+   _log(GENERAL, "Publishing berth states in shared memory \"%s\", %s bytes.", TDSHM_NAME, commas_q(sizeof(struct tdshm)));
+}
+
+static void tdshm_publish(struct state * const e, const word journal)
+{
+   // Copy a berth or signal state to shared memory, and into the journal if journal is set.
+   if(!shm || (e->k[2] != 'b' && e->k[2] != 's') || strlen(e->k) >= sizeof(shm->state[0].k)) return;
+
+   if(!e->shm)
+   {
+      if(shm->states >= TDSHM_STATES)
+      {
+         _log(MAJOR, "Shared memory berth state table is full.  Withdrawing it.");
+         shm->magic = 0;
+         shm = NULL;
+         return;
+      }
+   }
+
+   shm->sequence++;
+   __sync_synchronize();
+   if(!e->shm)
+   {
+      e->shm = ++shm->states;
+      strcpy(shm->state[e->shm - 1].k, e->k);
+   }
+   strcpy(shm->state[e->shm - 1].v, e->v);
+   if(journal)
+   {
+      struct tdshm_update * u = &shm->journal[handle % TDSHM_JOURNAL];
+      u->handle = handle;
+      u->s = shm->state[e->shm - 1];
+      shm->handle = handle;
+   }
+   __sync_synchronize();
+   shm->sequence++;
+}
+
+static void tdshm_describer(const word d, const time_t last_timestamp)
+{
+   if(!shm || d >= TDSHM_DESCRIBERS) return;
+
+   shm->sequence++;
+   __sync_synchronize();
+   strcpy(shm->describer[d].id, describers[d].id);
+   shm->describer[d].last_timestamp = last_timestamp;
+   __sync_synchronize();
+   shm->sequence++;
+}
+
+static void tdshm_banner(void)
+{
+   // Copy the diagram banner to shared memory, so livesig doesn't have to look for it on every poll.
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   char banner[sizeof(shm->banner)], banner1[sizeof(shm->banner1)];
+   time_t expires = 0;
+
+   banner[0] = banner1[0] = '\0';
+   if(db_query("SELECT banner, banner1, expires FROM banners WHERE type = 'diagram'")) return;
+   if((result = db_store_result()))
+   {
+      if((row = mysql_fetch_row(result)))
+      {
+         snprintf(banner, sizeof(banner), "%s", row[0]);
+         snprintf(banner1, sizeof(banner1), "%s", row[1]);
+         expires = atol(row[2]);
+      }
+      mysql_free_result(result);
+   }
+
+   shm->sequence++;
+   __sync_synchronize();
+   strcpy(shm->banner, banner);
+   strcpy(shm->banner1, banner1);
+   shm->banner_expires = expires;
+   __sync_synchronize();
+   shm->sequence++;
+}
@@ -0,0 +1,210 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "misc.h"
+#include "tdshm.h"
+
+static word match(const char * const k, const char * const * const describers, const word count);
+static int compare(const void * a, const void * b);
+
+static struct tdshm_update found[TDSHM_STATES];
+
+const struct tdshm * tdshm_map(void)
+{
+   int fd = shm_open(TDSHM_NAME, O_RDONLY, 0);
+   if(fd < 0) return NULL;
+   const struct tdshm * shm = mmap(NULL, sizeof(struct tdshm), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(shm == MAP_FAILED) return NULL;
+   if(!tdshm_usable(shm))
+   {
+      tdshm_unmap(shm);
+      return NULL;
+   }
+   return shm;
+}
+
+void tdshm_unmap(const struct tdshm * const shm)
+{
+   if(shm) munmap((void *) shm, sizeof(struct tdshm));
+}
+
+word tdshm_usable(const struct tdshm * const shm)
+{
+   return shm->magic == TDSHM_MAGIC && time(NULL) - shm->heartbeat <= TDSHM_STALE;
+}
+
+size_t tdshm_reply(const struct tdshm * const shm, const dword handle, const char * const * const describers, const word count, const char * const name, const char * const build, char * const reply, const size_t size, dword * const new_handle, dword * const lines)
+{
+   static char banner[sizeof(shm->banner)], banner1[sizeof(shm->banner1)];
+   dword sequence, found_count, h, i, j;
+   time_t last_actual, banner_expires;
+   word tries, d, p, all;
+   size_t length;
+
+   for(tries = 0; ; tries++)
+   {
+      if(tries >= 64 || !tdshm_usable(shm)) return 0;
+      sequence = shm->sequence;
+      __sync_synchronize();
+      if(sequence & 1)
+      {
+         usleep(1000);
+         continue;
+      }
+
+      *new_handle = shm->handle;
+      found_count = 0;
+      all = (handle > *new_handle || handle + 1 < shm->journal_first || *new_handle - handle >= TDSHM_JOURNAL);
+      if(!all)
+      {
+         for(h = handle + 1; h <= *new_handle; h++)
+         {
+            const struct tdshm_update * u = &shm->journal[h % TDSHM_JOURNAL];
+            if(u->handle != h)
+            {
+               // A handle used without being journalled leaves its slot stale.
+               all = true;
+               found_count = 0;
+               break;
+            }
+            if(match(u->s.k, describers, count)) found[found_count++] = *u;
+         }
+      }
+      if(all)
+      {
+         dword states = shm->states;
+         if(states > TDSHM_STATES) states = TDSHM_STATES;
+         for(i = 0; i < states; i++)
+         {
+            if(match(shm->state[i].k, describers, count))
+            {
+               found[found_count].handle = 0;
+               found[found_count++].s = shm->state[i];
+            }
+         }
+      }
+
+      last_actual = 0;
+      for(d = 0; d < shm->describers && d < TDSHM_DESCRIBERS; d++)
+      {
+         for(p = 0; p < count; p++)
+         {
+            if(!strcasecmp(shm->describer[d].id, describers[p]))
+            {
+               if(!last_actual || shm->describer[d].last_timestamp < last_actual) last_actual = shm->describer[d].last_timestamp;
+               break;
+            }
+         }
+      }
+      memcpy(banner, shm->banner, sizeof(banner));
+      memcpy(banner1, shm->banner1, sizeof(banner1));
+      banner_expires = shm->banner_expires;
+
+      __sync_synchronize();
+      if(shm->sequence == sequence) break;
+   }
+   banner[sizeof(banner) - 1] = banner1[sizeof(banner1) - 1] = '\0';
+
+   if(!all)
+   {
+      // Only the latest update to each key is wanted.  Sort by key, newest first, and drop the rest.
+      qsort(found, found_count, sizeof(found[0]), compare);
+      for(i = j = 0; i < found_count; i++)
+      {
+         if(!j || strcmp(found[i].s.k, found[j - 1].s.k)) found[j++] = found[i];
+      }
+      found_count = j;
+   }
+   // Ordered so that blank ones come first, to avoid overfilling the arrays in client js.
+   for(i = 0; i < found_count; i++) found[i].handle = 0;
+   qsort(found, found_count, sizeof(found[0]), compare);
+
+   {
+      // Handle in base 36.
+      const char convert[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+      char text[16];
+      word c = 15;
+      dword v = *new_handle;
+      text[c] = '\0';
+      do
+      {
+         text[--c] = convert[v % 36];
+         v /= 36;
+      } while(v);
+      length = snprintf(reply, size, "%s\n", text + c);
+   }
+   *lines = 0;
+   for(i = 0; i < found_count && length + 64 < size; i++)
+   {
+      found[i].s.k[sizeof(found[i].s.k) - 1] = found[i].s.v[sizeof(found[i].s.v) - 1] = '\0';
+      length += sprintf(reply + length, "%s|%s\n", found[i].s.k, found[i].s.v);
+      (*lines)++;
+   }
+
+   // End the output with the data for the status line.
+   {
+      char host[256], text[32];
+      if(gethostname(host, sizeof(host))) host[0] = '\0';
+      strcpy(text, time_text(last_actual, 1));
+      text[14] = '\0'; // Chop off the seconds.
+      time_t now = time(NULL);
+      length += snprintf(reply + length, size - length, "%d|%s|%s|%s|%s", ((now - last_actual < 96)?0:1), text, name, build, host);
+      if(length < size && banner[0] && (banner_expires == 0 || banner_expires > now))
+      {
+         length += snprintf(reply + length, size - length, "|%s|%s", banner, banner1);
+      }
+      if(length < size) length += snprintf(reply + length, size - length, "\n");
+   }
+   if(length >= size) return 0;
+   return length;
+}
+
+static word match(const char * const k, const char * const * const describers, const word count)
+{
+   word p;
+   for(p = 0; p < count; p++)
+   {
+      if(!strncasecmp(k, describers[p], strlen(describers[p]))) return true;
+   }
+   return false;
+}
+
+static int compare(const void * a, const void * b)
+{
+   // With handles set, by key and then newest first.  With handles zero, by value and then key.
+   const struct tdshm_update * ua = a, * ub = b;
+   int r;
+   if(ua->handle != ub->handle)
+   {
+      if((r = strcmp(ua->s.k, ub->s.k))) return r;
+      return (ua->handle < ub->handle) ? 1 : -1;
+   }
+   if((r = strcasecmp(ua->s.v, ub->s.v))) return r;
+   return strcmp(ua->s.k, ub->s.k);
+}
@@ -0,0 +1,80 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// TD state published by tddb in POSIX shared memory, for livesig to answer polls without the database.
+//
+// tddb is the only writer.  It makes sequence odd before changing anything and even again afterwards, so a reader
+// copies what it wants and then checks that sequence was even and unchanged throughout, retrying if not.
+//
+// state[] holds every berth and signal key (the "b" and "s" ones in td_states), in the order they were first seen.
+// journal[] holds the most recent updates, the update with handle h being at journal[h % TDSHM_JOURNAL].  Updates after
+// handle h can be had from the journal if h + 1 >= journal_first and handle - h < TDSHM_JOURNAL.  Otherwise, or if
+// h > handle, or if a slot in between holds another handle, as tddb uses some handles without journalling them, the whole
+// state must be sent.
+
+#define TDSHM_NAME      "/garner-td"
+#define TDSHM_MAGIC     0x54445331
+#define TDSHM_STATES    131072
+#define TDSHM_JOURNAL   16384
+#define TDSHM_DESCRIBERS 512
+// Readers ignore the segment if tddb hasn't touched it for this many seconds.
+#define TDSHM_STALE     600
+
+struct tdshm_state
+{
+   char k[12], v[8];
+};
+
+struct tdshm_update
+{
+   dword handle;
+   struct tdshm_state s;
+};
+
+struct tdshm
+{
+   dword magic;
+   volatile dword sequence;
+   time_t heartbeat;
+   dword handle, journal_first, states;
+   word describers;
+   struct
+   {
+      char id[4];
+      time_t last_timestamp;
+   } describer[TDSHM_DESCRIBERS];
+   char banner[520], banner1[72];
+   time_t banner_expires;
+   struct tdshm_state state[TDSHM_STATES];
+   struct tdshm_update journal[TDSHM_JOURNAL];
+};
+
+// Reading.  tdshm_map() returns NULL if the segment isn't there or tddb has stopped updating it.
+extern const struct tdshm * tdshm_map(void);
+extern void tdshm_unmap(const struct tdshm * const shm);
+extern word tdshm_usable(const struct tdshm * const shm);
+
+// Room for the longest reply.
+#define TDSHM_REPLY (TDSHM_STATES * 24 + 2048)
+
+// Write the reply to an update poll from a client holding handle, in livesig's format:  The new handle, a k|v line for
+// each changed key of the describers (which match as "k LIKE 'XX%'" would), and the status line naming program.
+// Returns the length, or 0 if a consistent copy couldn't be had.  *lines is set to the number of k|v lines.
+extern size_t tdshm_reply(const struct tdshm * const shm, const dword handle, const char * const * const describers, const word count, const char * const name, const char * const build, char * const reply, const size_t size, dword * const new_handle, dword * const lines);
@@ -0,0 +1,216 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Tests of db.c's handling of a lost connection.  db.o is linked against the fake client library below instead of
+// -lmysqlclient, and time() is faked so that the connection can be made to look idle.  db.h isn't included, as the fakes
+// don't match the real client library's prototypes exactly.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "misc.h"
+
+extern word db_errored;
+extern word db_init(const char * const server, const char * const user, const char * const password, const char * const database);
+extern word db_query(const char * const query);
+extern word db_start_transaction(void);
+extern word db_rollback_transaction(void);
+extern void db_disconnect(void);
+extern word db_drop_indexes(const char * const table, char * const indexes);
+#define DB_INDEXES_SIZE 1024
+
+// Fake clock
+static time_t fake_now = 1500000000;
+time_t time(time_t * t)
+{
+   if(t) *t = fake_now;
+   return fake_now;
+}
+
+// Fake client library
+static char fake_mysql[64];
+static word ping_fail;
+static dword connects, queries, pings;
+static char last_query[2048];
+// Result rows, as SHOW INDEX returns them.  fake_result is NULL for no result.
+static char * fake_result;
+static char ** fake_rows[64];
+static word fake_row_count, fake_row_next;
+
+void * mysql_init(void * m) { return fake_mysql; }
+void * mysql_real_connect(void * m, const char * h, const char * u, const char * p, const char * d, unsigned int port, const char * s, unsigned long f) { connects++; return m; }
+int mysql_options(void * m, int o, const void * a) { return 0; }
+int mysql_ping(void * m) { pings++; return ping_fail; }
+void mysql_close(void * m) { }
+unsigned int mysql_errno(void * m) { return 2006; }
+const char * mysql_error(void * m) { return "MySQL server has gone away"; }
+int mysql_query(void * m, const char * q) { queries++; return 0; }
+int mysql_real_query(void * m, const char * q, unsigned long l) { queries++; snprintf(last_query, sizeof(last_query), "%.*s", (int) l, q); return 0; }
+void * mysql_store_result(void * m) { fake_row_next = 0; return fake_result; }
+void * mysql_use_result(void * m) { return NULL; }
+void * mysql_fetch_row(void * r) { return fake_row_next < fake_row_count ? fake_rows[fake_row_next++] : NULL; }
+void * mysql_fetch_fields(void * r) { return NULL; }
+unsigned int mysql_num_fields(void * r) { return 0; }
+unsigned long long mysql_num_rows(void * r) { return 0; }
+void mysql_free_result(void * r) { }
+unsigned long long mysql_affected_rows(void * m) { return 0; }
+unsigned long long mysql_insert_id(void * m) { return 0; }
+unsigned long mysql_real_escape_string(void * m, char * to, const char * from, unsigned long l) { memcpy(to, from, l); to[l] = '\0'; return l; }
+void * mysql_stmt_init(void * m) { return NULL; }
+int mysql_stmt_prepare(void * s, const char * q, unsigned long l) { return 1; }
+unsigned long mysql_stmt_param_count(void * s) { return 0; }
+int mysql_stmt_bind_param(void * s, void * b) { return 1; }
+int mysql_stmt_execute(void * s) { return 1; }
+int mysql_stmt_close(void * s) { return 0; }
+unsigned int mysql_stmt_errno(void * s) { return 0; }
+const char * mysql_stmt_error(void * s) { return ""; }
+unsigned long long mysql_stmt_affected_rows(void * s) { return 0; }
+
+static word failures;
+#define CHECK(a) { if(!(a)) { printf("FAIL line %d:  %s\n", __LINE__, #a); failures++; } }
+
+static void setup(void)
+{
+   static char empty[] = "";
+   word i;
+   for(i = 0; i < MAX_CONF; i++) conf[i] = empty;
+   _log_init("/dev/null", 3);
+   db_disconnect();
+   ping_fail = false;
+   CHECK(!db_init("server", "user", "password", "database"));
+   connects = queries = pings = 0;
+}
+
+static void test_ping_failure_in_transaction(void)
+{
+   // The connection drops while a transaction is idle.  The next statement must fail, not reconnect and run in autocommit.
+   setup();
+   CHECK(!db_start_transaction());
+   CHECK(!db_query("INSERT INTO t VALUES(1)"));
+   dword before = queries;
+
+   fake_now += 3600;
+   ping_fail = true;
+   CHECK(db_query("INSERT INTO t VALUES(2)"));
+   CHECK(db_errored);
+   CHECK(pings == 1);
+   CHECK(queries == before);
+   CHECK(connects == 0);
+
+   ping_fail = false;
+   db_rollback_transaction();
+}
+
+static void test_ping_failure_at_start_transaction(void)
+{
+   // The connection drops while idle between transactions.  START TRANSACTION reconnects, and the transaction's
+   // statements then run on the new connection.
+   setup();
+   fake_now += 3600;
+   ping_fail = true;
+   CHECK(!db_start_transaction());
+   CHECK(!db_errored);
+   CHECK(connects == 1);
+   CHECK(queries == 1);
+
+   // And a drop inside it is still caught.
+   fake_now += 3600;
+   CHECK(db_query("INSERT INTO t VALUES(3)"));
+   CHECK(db_errored);
+   CHECK(connects == 1);
+   CHECK(queries == 1);
+   ping_fail = false;
+   db_rollback_transaction();
+}
+
+static void test_ping_failure_outside_transaction(void)
+{
+   // Outside a transaction a dropped connection is simply reopened.
+   setup();
+   fake_now += 3600;
+   ping_fail = true;
+   CHECK(!db_query("SELECT 1"));
+   CHECK(!db_errored);
+   CHECK(connects == 1);
+   CHECK(queries == 1);
+}
+
+static void test_drop_indexes(void)
+{
+   static char * a[] = {"t", "0", "PRIMARY", "1", "id"};
+   static char * b[] = {"t", "1", "ix_ab", "1", "a"};
+   static char * c[] = {"t", "1", "ix_ab", "2", "b"};
+   static char * d[] = {"t", "0", "ux_c", "1", "c"};
+   static char * big[64][5];
+   static char names[64][80];
+   char indexes[DB_INDEXES_SIZE + 64];
+   word i;
+
+   // No result.
+   setup();
+   fake_result = NULL;
+   CHECK(db_drop_indexes("t", indexes));
+   CHECK(!indexes[0]);
+
+   // The dropped indexes are listed for rebuilding.
+   setup();
+   fake_result = "";
+   fake_rows[0] = a; fake_rows[1] = b; fake_rows[2] = c; fake_rows[3] = d;
+   fake_row_count = 4;
+   CHECK(!db_drop_indexes("t", indexes));
+   CHECK(!strcmp(indexes, "ADD INDEX `ix_ab` (`a`, `b`), ADD UNIQUE INDEX `ux_c` (`c`)"));
+   CHECK(!strcmp(last_query, "ALTER TABLE t DROP INDEX `ix_ab`, DROP INDEX `ux_c`"));
+
+   // A list too long for the buffer fails without dropping anything.
+   setup();
+   for(i = 0; i < 64; i++)
+   {
+      sprintf(names[i], "index_with_a_rather_long_name_%02d", i);
+      big[i][0] = "t"; big[i][1] = "1"; big[i][2] = names[i]; big[i][3] = "1"; big[i][4] = "column";
+      fake_rows[i] = big[i];
+   }
+   fake_row_count = 64;
+   memset(indexes, 'x', sizeof(indexes));
+   CHECK(db_drop_indexes("t", indexes));
+   CHECK(!indexes[0]);
+   CHECK(indexes[DB_INDEXES_SIZE] == 'x');
+   CHECK(queries == 1);
+
+   fake_result = NULL;
+   fake_row_count = 0;
+}
+
+int main()
+{
+   test_ping_failure_in_transaction();
+   test_ping_failure_at_start_transaction();
+   test_ping_failure_outside_transaction();
+   test_drop_indexes();
+
+   if(failures)
+   {
+      printf("db_test:  %d failures.\n", failures);
+      return 1;
+   }
+   printf("db_test:  OK.\n");
+   return 0;
+}
@@ -0,0 +1,197 @@
+/*
+    Copyright (C) 2017 Phil Wieland
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    phil@philwieland.com
+
+*/
+
+// Tests of jsmn_parse().  jsmn.c is included here built without its SSE2 string scan, under other names, and its results
+// are compared with those of jsmn.o over the sample feed messages in tests/samples, every truncation of them at every
+// alignment, randomly corrupted copies and deeply nested input.  Return code, position and every token must match.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef __SSE2__
+#define jsmn_init               jsmn_init_scalar
+#define jsmn_parse              jsmn_parse_scalar
+#define jsmn_find_name_token    jsmn_find_name_token_scalar
+#define jsmn_extract_token      jsmn_extract_token_scalar
+#define jsmn_find_extract_token jsmn_find_extract_token_scalar
+#define jsmn_extract_fields     jsmn_extract_fields_scalar
+#include "jsmn.c"
+#undef jsmn_init
+#undef jsmn_parse
+
+extern void jsmn_init(jsmn_parser *parser);
+extern jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, jsmntok_t *tokens, unsigned int num_tokens);
+
+#define SAMPLES "tests/samples"
+#define MAX_TOKENS 4096
+#define MAX_TEXT 16384
+#define CORRUPTIONS 20000
+
+static word failures;
+static dword compared;
+#define CHECK(a) { if(!(a)) { printf("FAIL line %d:  %s\n", __LINE__, #a); failures++; } }
+
+static jsmntok_t tokens_simd[MAX_TOKENS], tokens_scalar[MAX_TOKENS];
+
+static word compare(const char * const js, const unsigned int num_tokens)
+{
+   // Parse js both ways.  Returns non-zero if the results differ.
+   jsmn_parser simd, scalar;
+   jsmnerr_t r_simd, r_scalar;
+
+   memset(tokens_simd, 0xa5, sizeof(tokens_simd));
+   memset(tokens_scalar, 0xa5, sizeof(tokens_scalar));
+   jsmn_init(&simd);
+   jsmn_init_scalar(&scalar);
+   r_simd = jsmn_parse(&simd, js, tokens_simd, num_tokens);
+   r_scalar = jsmn_parse_scalar(&scalar, js, tokens_scalar, num_tokens);
+   compared++;
+
+   return r_simd != r_scalar || simd.pos != scalar.pos || simd.toknext != scalar.toknext || simd.depth != scalar.depth ||
+      memcmp(tokens_simd, tokens_scalar, sizeof(tokens_simd));
+}
+
+static word compare_at(const char * const text, const size_t length, const size_t align, const unsigned int num_tokens)
+{
+   // Parse the first length bytes of text placed align bytes into a 16 byte block.  The bytes after the terminating NUL
+   // are quotes and backslashes, which a scan running past the NUL would find.
+   static char buffer[MAX_TEXT + 64] __attribute__((aligned(16)));
+   char * js = buffer + align;
+
+   memset(buffer, '\\', sizeof(buffer));
+   memset(buffer + align + length + 1, '"', 8);
+   memcpy(js, text, length);
+   js[length] = '\0';
+   return compare(js, num_tokens);
+}
+
+static size_t load(const char * const name, char * const text)
+{
+   char path[256];
+   FILE * fp;
+   size_t length;
+
+   sprintf(path, "%s/%s", SAMPLES, name);
+   if(!(fp = fopen(path, "r")))
+   {
+      printf("FAIL:  Cannot open \"%s\".\n", path);
+      failures++;
+      return 0;
+   }
+   length = fread(text, 1, MAX_TEXT - 1, fp);
+   fclose(fp);
+   text[length] = '\0';
+   return length;
+}
+
+static void test_sample(const char * const name)
+{
+   static char text[MAX_TEXT], copy[MAX_TEXT];
+   static const char specials[] = "{}[]\":,\\ \t0aZ";
+   static dword seed = 12345;
+   size_t length, l, a;
+   dword i, n;
+
+   if(!(length = load(name, text))) return;
+
+   // Whole.
+   CHECK(!compare_at(text, length, 0, MAX_TOKENS));
+   jsmn_parser parser;
+   jsmn_init(&parser);
+   CHECK(jsmn_parse(&parser, text, tokens_simd, MAX_TOKENS) == JSMN_SUCCESS);
+
+   // Too few tokens.
+   CHECK(!compare_at(text, length, 0, 16));
+
+   // Every truncation at every alignment.
+   for(a = 0; a < 16; a++)
+   {
+      for(l = 0; l <= length; l++)
+      {
+         if(compare_at(text, l, a, MAX_TOKENS))
+         {
+            printf("FAIL:  %s truncated to %zu bytes at alignment %zu.\n", name, l, a);
+            failures++;
+            a = 16;
+            break;
+         }
+      }
+   }
+
+   // Random corruption.
+   for(i = 0; i < CORRUPTIONS; i++)
+   {
+      memcpy(copy, text, length + 1);
+      for(n = 0; n < 1 + i % 4; n++)
+      {
+         seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+         l = seed % length;
+         copy[l] = (seed >> 16) & 1 ? specials[(seed >> 8) % (sizeof(specials) - 1)] : (char) (seed >> 8);
+      }
+      if(compare_at(copy, strlen(copy), i % 16, MAX_TOKENS))
+      {
+         printf("FAIL:  %s corrupted copy %u.\n", name, i);
+         failures++;
+         break;
+      }
+   }
+}
+
+static void test_nesting(void)
+{
+   // Deeper than JSMN_STACK, where the parser falls back to searching back for the open container.
+   char text[1024];
+   word depth, i;
+
+   for(depth = JSMN_STACK - 2; depth < JSMN_STACK + 4; depth++)
+   {
+      text[0] = '\0';
+      for(i = 0; i < depth; i++) strcat(text, i & 1 ? "{\"k\":" : "[");
+      strcat(text, "\"v\\\"\"");
+      for(i = depth; i--; ) strcat(text, i & 1 ? "}" : "]");
+      CHECK(!compare_at(text, strlen(text), depth % 16, MAX_TOKENS));
+      jsmn_parser parser;
+      jsmn_init(&parser);
+      CHECK(jsmn_parse(&parser, text, tokens_simd, MAX_TOKENS) == JSMN_SUCCESS);
+      // Unbalanced.
+      CHECK(!compare_at(text, strlen(text) - 1, 0, MAX_TOKENS));
+      strcat(text, "]");
+      CHECK(!compare_at(text, strlen(text), 0, MAX_TOKENS));
+   }
+}
+
+int main()
+{
+   _log_init("/dev/null", 3);
+
+   test_sample("trust.json");
+   test_sample("vstp.json");
+   test_sample("td.json");
+   test_nesting();
+
+   if(failures)
+   {
+      printf("jsmn_test:  %d failures.\n", failures);
+      return 1;
+   }
+   printf("jsmn_test:  OK, %u parses compared.\n", compared);
+   return 0;
+}
@@ -51,6 +51,7 @@
 #endif
 
 static void perform(void);
+static word process_batch(void);
 static void process_frame(const char * const body);
 static void process_trust_0001(const char * const string, const jsmntok_t * const tokens, const int index);
 static void process_trust_0002(const char * const string, const jsmntok_t * const tokens, const int index);
@@ -68,18 +69,35 @@ static void defer_activation(const char * const uid, const time_t schedule_start
 static void process_deferred_activations(void);
 static word count_deferred_activations(void);
 static void check_timeout(void);
+static void load_activation_index(void);
+static void index_activation(const time_t created, const char * const trust_id, const dword cif_schedule_id, const word deduced);
+static word count_activations(const char * const trust_id, const time_t since, const word scheduled, word * const count);
+static word latest_activation(const char * const trust_id, const time_t since, dword * const cif_schedule_id);
+static void load_timetable_index(void);
+static void check_timetable_index(void);
+#define TIMETABLE_CANDIDATES 48
+static word timetable_candidates(const char * const tiploc, const char * const planned, const char event, const word day, const time_t when, char * const candidates);
 
 static word debug, run, interrupt, holdoff;
 static char zs[4096];
 
 #define FRAME_SIZE 64000
-static char body[FRAME_SIZE];
 
 #define NUM_TOKENS 8192
 static jsmntok_t tokens[NUM_TOKENS];
 
 // stompy port for trust stream
 #define STOMPY_PORT 55841
+// Number of frames stompy may send ahead of our acks
+#define STOMPY_WINDOW 64
+
+// Group commit.  Up to BATCH_FRAMES frames are processed in one transaction, which is committed when it is full, when
+// its first frame has waited BATCH_MS milliseconds, or as soon as no more frames are waiting.  Frames are acked after
+// the commit.
+#define BATCH_FRAMES 32
+#define BATCH_MS 500
+static char batch[BATCH_FRAMES][FRAME_SIZE];
+static word batch_count;
 
 // Time in hours (local) when daily statistical report is produced.
 // (Set > 23 to disable daily report.)
@@ -96,7 +114,7 @@ static time_t status_last_trust_processed, status_last_trust_actual;
 enum stats_categories {ConnectAttempt, GoodMessage, // Don't insert any here
                        Mess1, Mess2, Mess3, Mess4, Mess5, Mess6, Mess7, Mess8,
                        NotMessage, NotRecog, Mess1Miss, Mess1MissHit, Mess1Cape, MovtNoAct, DeducedAct, 
-                       DeducedHC, DeducedHCReplaced, MAXstats};
+                       DeducedHC, DeducedHCReplaced, DBRoundTrip, MAXstats};
 static qword stats[MAXstats];
 static qword grand_stats[MAXstats];
 static const char * stats_category[MAXstats] = 
@@ -104,7 +122,7 @@ static const char * stats_category[MAXstats] =
       "Stompy connect attempt", "Good message", 
       "Message type 1","Message type 2","Message type 3","Message type 4","Message type 5","Message type 6","Message type 7","Message type 8",
       "Not a message", "Invalid or not recognised", "Activation no schedule", "Found by second search", "Act. cancelled schedule", "Movement without act.", "Deduced activation",
-      "Deduced headcode", "Changed deduced headcode",
+      "Deduced headcode", "Changed deduced headcode", "Database round trips",
    };
 
 // Message count
@@ -283,6 +301,10 @@ int main(int argc, char *argv[])
          _log(CRITICAL, "Failed to set up signal handler.");
          exit(1);
       }
+      // SIGUSR1 asks for the database query profile.  It is kept blocked and picked up in the main loop.
+      sigemptyset(&block_mask);
+      sigaddset(&block_mask, SIGUSR1);
+      sigprocmask(SIG_BLOCK, &block_mask, NULL);
    }
    if(!debug) signal(SIGCHLD,SIG_IGN); /* ignore child */
    if(!debug) signal(SIGTSTP,SIG_IGN); /* ignore tty signals */
@@ -347,16 +369,35 @@ static void perform(void)
    // Status
    status_last_trust_processed = status_last_trust_actual = 0;
 
+   load_activation_index();
+   load_timetable_index();
+
    while(run)
    {   
       stats[ConnectAttempt]++;
-      int run_receive = !open_stompy(STOMPY_PORT);
+      int run_receive = !open_stompy_window(STOMPY_PORT, STOMPY_WINDOW);
+      qword batch_start = 0;
+      batch_count = 0;
       while(run && run_receive)
       {
          holdoff = 0;
-         check_timeout();
 
-         int r = read_stompy(body, FRAME_SIZE, 128);
+         if(batch_count)
+         {
+            // Add any frames already waiting to the group, otherwise process it.
+            if(batch_count >= BATCH_FRAMES || time_ms() - batch_start >= BATCH_MS || !stompy_pending(0))
+            {
+               if(process_batch()) run_receive = false;
+               batch_count = 0;
+               continue;
+            }
+         }
+         else
+         {
+            check_timeout();
+         }
+
+         int r = read_stompy(batch[batch_count], FRAME_SIZE, 128);
          _log(DEBUG, "read_stompy() returned %d.", r);
          if(!r && run && run_receive)
          {
@@ -365,36 +406,8 @@ static void perform(void)
                _log(MINOR, "TRUST message stream - Receive OK.");
                stompy_timeout = false;
             }
-            if(db_start_transaction())
-            {
-               run_receive = false;
-            }
-            if(run_receive) process_deferred_activations();
-            if(run_receive && !db_errored) process_frame(body);
-
-            if(!db_errored)
-            {
-               if(db_commit_transaction())
-               {
-                  db_rollback_transaction();
-                  run_receive = false;
-               }
-               else
-               {
-                  // Send ACK
-                  if(ack_stompy())
-                  {
-                     _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
-                     run_receive = false;
-                  }
-               }
-            }
-            else
-            {
-               // DB error occurred during processing of frame.
-               db_rollback_transaction();
-               run_receive = false;
-            }
+            if(!batch_count) batch_start = time_ms();
+            batch_count++;
          }
          else if(run && run_receive)
          {
@@ -431,6 +444,40 @@ static void perform(void)
    report_stats();
 }
 
+static word process_batch(void)
+{
+   // Process the frames in the group in one transaction, then ack them.  If the transaction fails it is rolled back
+   // and the group is replayed once.  Returns non-zero if that fails too, in which case the frames are left unacked
+   // and stompy will send them again.
+   word attempt, i;
+
+   for(attempt = 0; attempt < 2 && run; attempt++)
+   {
+      if(attempt) _log(MAJOR, "Replaying group of %d frame%s.", batch_count, (batch_count == 1)?"":"s");
+      if(!db_start_transaction())
+      {
+         process_deferred_activations();
+         for(i = 0; i < batch_count && !db_errored; i++) process_frame(batch[i]);
+         if(!db_errored && !db_commit_transaction())
+         {
+            _log(DEBUG, "Committed group of %d frame%s.", batch_count, (batch_count == 1)?"":"s");
+            // Send ACK
+            if(ack_stompy())
+            {
+               _log(CRITICAL, "Failed to write message ack.  Error %d %s", errno, strerror(errno));
+               return 1;
+            }
+            return 0;
+         }
+      }
+      // DB error occurred during processing of group.
+      db_rollback_transaction();
+      // The activation index may now hold activations which were rolled back.
+      load_activation_index();
+   }
+   return 1;
+}
+
 static void process_frame(const char * const body)
 {
    jsmn_parser parser;
@@ -525,42 +572,56 @@ static void process_frame(const char * const body)
 
 static void process_trust_0001(const char * const string, const jsmntok_t * const tokens, const int index)
 {
-   char zs[128], zs1[128], report[1024];
-   char train_id[64], train_uid[64];
+   char zs1[128], report[1024];
    char query[4096];
    dword cif_schedule_id = 0;
    MYSQL_RES * result0;
    MYSQL_ROW row0;
+
+   struct activation
+   {
+      char train_id[64], schedule_start_date[128], schedule_end_date[128], train_uid[64], schedule_source[128], schedule_wtt_id[128];
+      char train_file_address[128], tp_origin_timestamp[128], creation_timestamp[128], tp_origin_stanox[128], origin_dep_timestamp[128];
+      char train_service_code[128], toc_id[128], d1266_record_number[128], train_call_type[128], train_call_mode[128];
+      char schedule_type[128], sched_origin_stanox[128];
+   } a;
+   static const jsmnfield_t activation_fields[] =
+   {
+      JSMN_FIELD(struct activation, train_id), JSMN_FIELD(struct activation, schedule_start_date), JSMN_FIELD(struct activation, schedule_end_date),
+      JSMN_FIELD(struct activation, train_uid), JSMN_FIELD(struct activation, schedule_source), JSMN_FIELD(struct activation, schedule_wtt_id),
+      JSMN_FIELD(struct activation, train_file_address), JSMN_FIELD(struct activation, tp_origin_timestamp), JSMN_FIELD(struct activation, creation_timestamp),
+      JSMN_FIELD(struct activation, tp_origin_stanox), JSMN_FIELD(struct activation, origin_dep_timestamp), JSMN_FIELD(struct activation, train_service_code),
+      JSMN_FIELD(struct activation, toc_id), JSMN_FIELD(struct activation, d1266_record_number), JSMN_FIELD(struct activation, train_call_type),
+      JSMN_FIELD(struct activation, train_call_mode), JSMN_FIELD(struct activation, schedule_type), JSMN_FIELD(struct activation, sched_origin_stanox),
+   };
    
    time_t now = time(NULL);
    status_last_trust_processed = now;
 
+   jsmn_extract_fields(string, tokens, index, activation_fields, JSMN_FIELDS(activation_fields), &a);
+   char * const train_id = a.train_id;
+   char * const train_uid = a.train_uid;
+
    sprintf(report, "Activation message:");
 
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
    sprintf(zs1, " train_id=\"%s\"", train_id);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "schedule_start_date", zs, sizeof(zs));
-   time_t schedule_start_date_stamp = parse_datestamp(zs);
-   sprintf(zs1, " schedule_start_date=%s", zs);
+   time_t schedule_start_date_stamp = parse_datestamp(a.schedule_start_date);
+   sprintf(zs1, " schedule_start_date=%s", a.schedule_start_date);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "schedule_end_date", zs, sizeof(zs));
-   time_t schedule_end_date_stamp   = parse_datestamp(zs);
-   sprintf(zs1, " schedule_end_date=%s", zs);
+   time_t schedule_end_date_stamp   = parse_datestamp(a.schedule_end_date);
+   sprintf(zs1, " schedule_end_date=%s", a.schedule_end_date);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "train_uid", train_uid, sizeof(train_uid));
    sprintf(zs1, " train_uid=\"%s\"", train_uid);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "schedule_source", zs, sizeof(zs));
-   sprintf(zs1, " schedule_source=\"%s\"", zs);
+   sprintf(zs1, " schedule_source=\"%s\"", a.schedule_source);
    strcat(report, zs1);
 
-   jsmn_find_extract_token(string, tokens, index, "schedule_wtt_id", zs, sizeof(zs));
-   sprintf(zs1, " schedule_wtt_id=\"%s\"", zs);
+   sprintf(zs1, " schedule_wtt_id=\"%s\"", a.schedule_wtt_id);
    strcat(report, zs1);
 
    sprintf(query, "select id, CIF_stp_indicator from cif_schedules where cif_train_uid = '%s' AND schedule_start_date = %ld AND schedule_end_date = %ld AND deleted > %ld ORDER BY LOCATE(CIF_stp_indicator, 'ONPC')", train_uid, schedule_start_date_stamp, schedule_end_date_stamp, now);
@@ -590,86 +651,17 @@ static void process_trust_0001(const char * const string, const jsmntok_t * cons
             cancelled = true;
          }
          sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %u, 0)", now, train_id, cif_schedule_id);
-         db_query(query);
+         if(!db_query(query)) index_activation(now, train_id, cif_schedule_id, false);
          mysql_free_result(result0);
 
          // Process "extra" data
-         sprintf(query, "INSERT INTO trust_activation_extra VALUES(%ld, '%s', '", now, train_id);
-
-         jsmn_find_extract_token(string, tokens, index, "schedule_source", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-         
-         jsmn_find_extract_token(string, tokens, index, "train_file_address", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', ");
-             
-         jsmn_find_extract_token(string, tokens, index, "schedule_end_date", zs, sizeof(zs));
-         sprintf(zs1, "%lu", parse_datestamp(zs));
-         strcat(query, zs1);
-         strcat(query, ", ");
-                             
-         jsmn_find_extract_token(string, tokens, index, "tp_origin_timestamp", zs, sizeof(zs));
-         sprintf(zs1, "%lu", parse_datestamp(zs));
-         strcat(query, zs1);
-         strcat(query, ", ");
-              
-         jsmn_find_extract_token(string, tokens, index, "creation_timestamp", zs, sizeof(zs));
-         zs[10] = '\0';
-         sprintf(zs1, "%lu", correct_trust_timestamp(atol(zs)));
-         strcat(query, zs1);
-         strcat(query, ", '");
-               
-         jsmn_find_extract_token(string, tokens, index, "tp_origin_stanox", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', ");
-                 
-         jsmn_find_extract_token(string, tokens, index, "origin_dep_timestamp", zs, sizeof(zs));
-         zs[10] = '\0';
-         sprintf(zs1, "%lu", correct_trust_timestamp(atol(zs)));
-         strcat(query, zs1);
-         strcat(query, ", '");
-             
-         jsmn_find_extract_token(string, tokens, index, "train_service_code", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-               
-         jsmn_find_extract_token(string, tokens, index, "toc_id", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-                           
-         jsmn_find_extract_token(string, tokens, index, "d1266_record_number", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-              
-         jsmn_find_extract_token(string, tokens, index, "train_call_type", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-                  
-         jsmn_find_extract_token(string, tokens, index, "train_uid", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-                        
-         jsmn_find_extract_token(string, tokens, index, "train_call_mode", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-                  
-         jsmn_find_extract_token(string, tokens, index, "schedule_type", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-                    
-         jsmn_find_extract_token(string, tokens, index, "sched_origin_stanox", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', '");
-              
-         jsmn_find_extract_token(string, tokens, index, "schedule_wtt_id", zs, sizeof(zs));
-         strcat(query, zs);
-         strcat(query, "', ");
-                  
-         jsmn_find_extract_token(string, tokens, index, "schedule_start_date", zs, sizeof(zs));
-         sprintf(zs1, "%lu", parse_datestamp(zs));
-         strcat(query, zs1);
-         strcat(query, ")");
+         a.creation_timestamp[10] = '\0';
+         a.origin_dep_timestamp[10] = '\0';
+         sprintf(query, "INSERT INTO trust_activation_extra VALUES(%ld, '%s', '%s', '%s', %lu, %lu, %lu, '%s', %lu, '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', '%s', %lu)",
+                 now, train_id, a.schedule_source, a.train_file_address, parse_datestamp(a.schedule_end_date), parse_datestamp(a.tp_origin_timestamp),
+                 correct_trust_timestamp(atol(a.creation_timestamp)), a.tp_origin_stanox, correct_trust_timestamp(atol(a.origin_dep_timestamp)),
+                 a.train_service_code, a.toc_id, a.d1266_record_number, a.train_call_type, a.train_uid, a.train_call_mode, a.schedule_type,
+                 a.sched_origin_stanox, a.schedule_wtt_id, parse_datestamp(a.schedule_start_date));
               
          db_query(query);
       }
@@ -799,92 +791,79 @@ static void process_trust_0002(const char * string, const jsmntok_t * tokens, co
 
 static void process_trust_0003(const char * string, const jsmntok_t * tokens, const int index)
 {
-  char query[1024], zs[32], zs1[32], train_id[16], loc_stanox[16], event_type[16];
+   char query[1024];
    word flags;
   
    time_t planned_timestamp, actual_timestamp, timestamp;
 
+   struct movement
+   {
+      char train_id[16], event_type[16], planned_event_type[32], platform[32], loc_stanox[16], actual_timestamp[32], gbtt_timestamp[32];
+      char planned_timestamp[32], timetable_variation[32], event_source[32], offroute_ind[32], train_terminated[32];
+      char variation_status[32], next_report_stanox[32], next_report_run_time[32], correction_ind[32];
+   } m;
+   static const jsmnfield_t movement_fields[] =
+   {
+      JSMN_FIELD(struct movement, train_id), JSMN_FIELD(struct movement, event_type), JSMN_FIELD(struct movement, planned_event_type),
+      JSMN_FIELD(struct movement, platform), JSMN_FIELD(struct movement, loc_stanox), JSMN_FIELD(struct movement, actual_timestamp),
+      JSMN_FIELD(struct movement, gbtt_timestamp), JSMN_FIELD(struct movement, planned_timestamp), JSMN_FIELD(struct movement, timetable_variation),
+      JSMN_FIELD(struct movement, event_source), JSMN_FIELD(struct movement, offroute_ind), JSMN_FIELD(struct movement, train_terminated),
+      JSMN_FIELD(struct movement, variation_status), JSMN_FIELD(struct movement, next_report_stanox), JSMN_FIELD(struct movement, next_report_run_time),
+      JSMN_FIELD(struct movement, correction_ind),
+   };
    time_t now = time(NULL);
    status_last_trust_processed = now;
    flags = 0;
    
-   sprintf(query, "INSERT INTO trust_movement VALUES(%ld, '", now);
-   jsmn_find_extract_token(string, tokens, index, "train_id", train_id, sizeof(train_id));
-   strcat(query, train_id);
-   strcat(query, "', '");
-   jsmn_find_extract_token(string, tokens, index, "event_type", event_type, sizeof(event_type));
-   jsmn_find_extract_token(string, tokens, index, "planned_event_type", zs, sizeof(zs));
-   if     (event_type[0] == 'D' && zs[0] == 'D') flags = 0x0001;
-   else if(event_type[0] == 'A' && zs[0] == 'A') flags = 0x0002;
-   else if(event_type[0] == 'A' && zs[0] == 'D') flags = 0x0003; // ARRIVAL, DESTINATION
-   else _log(MAJOR, "TRUST movement:  Unexpected fields event_type \"%s\", planned_event_type \"%s\".", event_type, zs);
-   jsmn_find_extract_token(string, tokens, index, "platform", zs, sizeof(zs));
-   strcat(query, zs);
-   strcat(query, "', '");
-   jsmn_find_extract_token(string, tokens, index, "loc_stanox", loc_stanox, sizeof(loc_stanox));
-   strcat(query, loc_stanox);
-   strcat(query, "', ");
-   jsmn_find_extract_token(string, tokens, index, "actual_timestamp", zs, sizeof(zs));
-   zs[10] = '\0';
-   actual_timestamp = correct_trust_timestamp(atol(zs));
-   sprintf(zs, "%ld", actual_timestamp);
-   strcat(query, zs);
-   strcat(query, ", ");
+   static word movement_statement;
+   if(!movement_statement) movement_statement = db_prepare("INSERT INTO trust_movement VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+
+   jsmn_extract_fields(string, tokens, index, movement_fields, JSMN_FIELDS(movement_fields), &m);
+
+   db_bind_integer(movement_statement, 0, now);
+   db_bind_string(movement_statement, 1, m.train_id);
+   if     (m.event_type[0] == 'D' && m.planned_event_type[0] == 'D') flags = 0x0001;
+   else if(m.event_type[0] == 'A' && m.planned_event_type[0] == 'A') flags = 0x0002;
+   else if(m.event_type[0] == 'A' && m.planned_event_type[0] == 'D') flags = 0x0003; // ARRIVAL, DESTINATION
+   else _log(MAJOR, "TRUST movement:  Unexpected fields event_type \"%s\", planned_event_type \"%s\".", m.event_type, m.planned_event_type);
+   db_bind_string(movement_statement, 2, m.platform);
+   db_bind_string(movement_statement, 3, m.loc_stanox);
+   m.actual_timestamp[10] = '\0';
+   actual_timestamp = correct_trust_timestamp(atol(m.actual_timestamp));
+   db_bind_integer(movement_statement, 4, actual_timestamp);
    //if(actual_timestamp > status_last_trust_actual)
    //{
    //   status_last_trust_actual = actual_timestamp;
    //}
-   jsmn_find_extract_token(string, tokens, index, "gbtt_timestamp", zs, sizeof(zs));
-   zs[10] = '\0';
-   timestamp = correct_trust_timestamp(atol(zs));
-   sprintf(zs, "%ld", timestamp);
-   strcat(query, zs);
-   strcat(query, ", ");
-   jsmn_find_extract_token(string, tokens, index, "planned_timestamp", zs, sizeof(zs));
-   zs[10] = '\0';
-   planned_timestamp = correct_trust_timestamp(atol(zs));
-   sprintf(zs, "%ld", planned_timestamp);
-   strcat(query, zs);
-   strcat(query, ", ");
-   jsmn_find_extract_token(string, tokens, index, "timetable_variation", zs, sizeof(zs));
-   strcat(query, zs);
-   strcat(query, ", '");
-   jsmn_find_extract_token(string, tokens, index, "event_source", zs, sizeof(zs));
-   switch(zs[0])
+   m.gbtt_timestamp[10] = '\0';
+   timestamp = correct_trust_timestamp(atol(m.gbtt_timestamp));
+   db_bind_integer(movement_statement, 5, timestamp);
+   m.planned_timestamp[10] = '\0';
+   planned_timestamp = correct_trust_timestamp(atol(m.planned_timestamp));
+   db_bind_integer(movement_statement, 6, planned_timestamp);
+   db_bind_integer(movement_statement, 7, atoi(m.timetable_variation));
+   switch(m.event_source[0])
       {
       case 'A': break;
       case 'M': flags += 0x0004; break;
-      default: _log(MAJOR, "TRUST movement:  Unexpected event_source field \"%s\".", zs); break;
+      default: _log(MAJOR, "TRUST movement:  Unexpected event_source field \"%s\".", m.event_source); break;
       }
-   jsmn_find_extract_token(string, tokens, index, "offroute_ind", zs, sizeof(zs));
-   if(zs[0] == 't') flags += 0x0020;
-   jsmn_find_extract_token(string, tokens, index, "train_terminated", zs, sizeof(zs));
-   if(zs[0] == 't') flags += 0x0040;
-   jsmn_find_extract_token(string, tokens, index, "variation_status", zs, sizeof(zs));
-   switch(zs[2])
+   if(m.offroute_ind[0] == 't') flags += 0x0020;
+   if(m.train_terminated[0] == 't') flags += 0x0040;
+   switch(m.variation_status[2])
       {
       case 'R': break; // EARLY
       case ' ': flags += 0x0008; break; // ON TIME
       case 'T': flags += 0x0010; break; // LATE
       case 'F': flags += 0x0018; break; // OFF ROUTE
-      default: _log(MAJOR, "TRUST movement:  Unexpected variation_status field \"%s\".", zs); break;
+      default: _log(MAJOR, "TRUST movement:  Unexpected variation_status field \"%s\".", m.variation_status); break;
       }
-   jsmn_find_extract_token(string, tokens, index, "next_report_stanox", zs, sizeof(zs));
-   strcat(query, zs);
-   strcat(query, "', ");
-   jsmn_find_extract_token(string, tokens, index, "next_report_run_time", zs, sizeof(zs));
-   sprintf(zs1, "%d", atoi(zs));
-   strcat(query, zs1);
-   strcat(query, ", ");
-   jsmn_find_extract_token(string, tokens, index, "correction_ind", zs, sizeof(zs));
-   if(zs[0] == 't') flags += 0x0080;
-
-   sprintf(zs1, "%d", flags);
-   strcat(query, zs1);
-   
-   strcat(query, ")");
+   db_bind_string(movement_statement, 8, m.next_report_stanox);
+   db_bind_integer(movement_statement, 9, atoi(m.next_report_run_time));
+   if(m.correction_ind[0] == 't') flags += 0x0080;
+   db_bind_integer(movement_statement, 10, flags);
 
-   db_query(query);
+   db_execute(movement_statement);
 
    // Old one?
    if(planned_timestamp && now - actual_timestamp > 12*60*60)
@@ -895,22 +874,19 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
    // NB Don't accept cif_schedule_id==0 ones here as the schedule may have arrived after the activation!
    // This can happen due to a VSTP race, hopefully fixed V505
    // OR due to the service being activated before the daily timetable download.
-   sprintf(query, "SELECT * from trust_activation where trust_id = '%s' and created > %ld and cif_schedule_id > 0", train_id, actual_timestamp - (4*24*60*60));
-   if(!(*conf[conf_trustdb_no_deduce_act]) && !db_query(query))
+   word num_rows;
+   if(!(*conf[conf_trustdb_no_deduce_act]) && !count_activations(m.train_id, actual_timestamp - (4*24*60*60), true, &num_rows))
    {
-      MYSQL_RES * result0 = db_store_result();
-
-      word num_rows = mysql_num_rows(result0);
-      mysql_free_result(result0);
       if(num_rows > 1)
       {
          // This is not actually invalid, if there's some cancellations as well
-         // sprintf(query, "Movement message received with %d matching activations, train_id = \"%s\".", num_rows, train_id);
+         // sprintf(query, "Movement message received with %d matching activations, train_id = \"%s\".", num_rows, m.train_id);
          // _log(MAJOR, query);
       }
       else if(num_rows < 1)
       {
          // Movement no activation.  Attempt to create the missing activation.
+         MYSQL_RES * result0;
          MYSQL_ROW row0;
          char tiploc[128], reason[128];
          time_t now = time(NULL);
@@ -921,19 +897,11 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
          strcpy(planned, "-----");
          tiploc[0] = '\0';
 
-         _log(MINOR, "Movement message received with no matching activations, TRUST id = \"%s\".", train_id);
+         _log(MINOR, "Movement message received with no matching activations, TRUST id = \"%s\".", m.train_id);
 
-         sprintf(query, "SELECT * from trust_activation where trust_id = '%s' and created > %ld AND cif_schedule_id = 0", train_id, actual_timestamp - (4*24*60*60));
-         if(!db_query(query))
+         if(!count_activations(m.train_id, actual_timestamp - (4*24*60*60), false, &num_rows) && num_rows > 0)
          {
-            MYSQL_RES * result0 = db_store_result();
-
-            word num_rows = mysql_num_rows(result0);
-            mysql_free_result(result0);
-            if(num_rows > 0)
-            {
-               _log(MINOR, "   A matching activation with no schedule exists.");
-            }
+            _log(MINOR, "   A matching activation with no schedule exists.");
          }
          stats[MovtNoAct]++;
 
@@ -956,7 +924,7 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
 
          if(!reason[0])
          {
-            sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s AND tiploc != ''", loc_stanox);
+            sprintf(query, "SELECT tiploc FROM corpus WHERE stanox = %s AND tiploc != ''", m.loc_stanox);
             if(!db_query(query))
             {
                result0 = db_store_result();
@@ -988,30 +956,43 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
             broken->tm_sec = 0;
             time_t when = timegm(broken);
 
-            // TODO It is this query which takes ages.  Can we accelerate it?
-            sprintf(query, "SELECT cif_schedules.id, cif_schedules.CIF_train_uid, signalling_id, CIF_stp_indicator FROM cif_schedules INNER JOIN cif_schedule_locations AS l ON cif_schedules.id = l.cif_schedule_id WHERE l.tiploc_code = '%s'",
-                    tiploc);
-
-            if(event_type[0] == 'A')
-               sprintf(query1, " AND (l.arrival = '%s' OR l.pass = '%s')", planned, planned);
-            else if(event_type[0] == 'D')
-               sprintf(query1, " AND (l.departure = '%s' OR l.pass = '%s')", planned, planned);
-            else
+            char candidates[TIMETABLE_CANDIDATES * 12];
+            if(!timetable_candidates(tiploc, planned, m.event_type[0], day, when, candidates))
             {
-               sprintf(query1, " AND 0");
-               strcpy(reason, "Unrecognised event type");
+               // Candidates from the timetable index, check them against the rest of the criteria.
+               if(candidates[0])
+                  sprintf(query, "SELECT id, CIF_train_uid, signalling_id, CIF_stp_indicator FROM cif_schedules WHERE id IN (%s)", candidates);
+               else
+                  strcpy(query, "SELECT id, CIF_train_uid, signalling_id, CIF_stp_indicator FROM cif_schedules WHERE 0");
+               strcat(query, " AND (CIF_stp_indicator = 'N' OR CIF_stp_indicator = 'P' OR CIF_stp_indicator = 'O')");
             }
-            strcat(query, query1);
+            else
+            {
+               // Index can't help, do it the slow way.
+               sprintf(query, "SELECT cif_schedules.id, cif_schedules.CIF_train_uid, signalling_id, CIF_stp_indicator FROM cif_schedules INNER JOIN cif_schedule_locations AS l ON cif_schedules.id = l.cif_schedule_id WHERE l.tiploc_code = '%s'",
+                       tiploc);
+
+               if(m.event_type[0] == 'A')
+                  sprintf(query1, " AND (l.arrival = '%s' OR l.pass = '%s')", planned, planned);
+               else if(m.event_type[0] == 'D')
+                  sprintf(query1, " AND (l.departure = '%s' OR l.pass = '%s')", planned, planned);
+               else
+               {
+                  sprintf(query1, " AND 0");
+                  strcpy(reason, "Unrecognised event type");
+               }
+               strcat(query, query1);
 
-            strcat(query, " AND (cif_schedules.CIF_stp_indicator = 'N' OR cif_schedules.CIF_stp_indicator = 'P' OR cif_schedules.CIF_stp_indicator = 'O')");
+               strcat(query, " AND (cif_schedules.CIF_stp_indicator = 'N' OR cif_schedules.CIF_stp_indicator = 'P' OR cif_schedules.CIF_stp_indicator = 'O')");
 
-            static const char * days_runs[8] = {"runs_su", "runs_mo", "runs_tu", "runs_we", "runs_th", "runs_fr", "runs_sa", "runs_su"};
+               static const char * days_runs[8] = {"runs_su", "runs_mo", "runs_tu", "runs_we", "runs_th", "runs_fr", "runs_sa", "runs_su"};
 
-            //
-            sprintf(query1, " AND (((%s) AND (schedule_start_date <= %ld) AND (schedule_end_date >= %ld) AND (NOT next_day))",   days_runs[day],  when + 12*60*60, when - 12*60*60);
-            strcat(query, query1);
-            sprintf(query1, " OR   ((%s) AND (schedule_start_date <= %ld) AND (schedule_end_date >= %ld) AND (    next_day)))",  days_runs[yest], when - 12*60*60, when - 36*60*60);
-            strcat(query, query1);
+               //
+               sprintf(query1, " AND (((%s) AND (schedule_start_date <= %ld) AND (schedule_end_date >= %ld) AND (NOT next_day))",   days_runs[day],  when + 12*60*60, when - 12*60*60);
+               strcat(query, query1);
+               sprintf(query1, " OR   ((%s) AND (schedule_start_date <= %ld) AND (schedule_end_date >= %ld) AND (    next_day)))",  days_runs[yest], when - 12*60*60, when - 36*60*60);
+               strcat(query, query1);
+            }
 
             //                                      Exclude buses . . . . . . . . . . . . . . .
             sprintf(query1, " AND deleted > %ld AND train_status != 'B' AND train_status != '5' ORDER BY LOCATE(CIF_stp_indicator, 'NPO')", planned_timestamp);
@@ -1031,7 +1012,7 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
                   strcpy(reason, "No schedules found");
                }
                headcode_match = false;
-               strcpy(target_head, train_id + 2);
+               strcpy(target_head, m.train_id + 2);
                target_head[4] = '\0';
                for(row_count = 0; row_count < ROWS && (rows[row_count] = mysql_fetch_row(result0)); row_count++)
                {
@@ -1074,19 +1055,19 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
                }
                if(!reason[0])
                {
-                  sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %u, 1)", now, train_id, cif_schedule_id);
-                  db_query(query);
+                  sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %u, 1)", now, m.train_id, cif_schedule_id);
+                  if(!db_query(query)) index_activation(now, m.train_id, cif_schedule_id, true);
                   elapsed = time_ms() - elapsed;
                   _log(MINOR, "   Successfully deduced schedule %u.  Elapsed time %s ms.", cif_schedule_id, commas_q(elapsed));
 
-                  if(train_id[2] >= '0' && train_id[2] <= '9' &&
-                     (train_id[3] < 'A' || train_id[3] > 'Z'  ||
-                      train_id[4] < '0' || train_id[4] > '9'  ||
-                      train_id[5] < '0' || train_id[5] > '9'))
+                  if(m.train_id[2] >= '0' && m.train_id[2] <= '9' &&
+                     (m.train_id[3] < 'A' || m.train_id[3] > 'Z'  ||
+                      m.train_id[4] < '0' || m.train_id[4] > '9'  ||
+                      m.train_id[5] < '0' || m.train_id[5] > '9'))
                   {
                      // This has an obfuscated headcode.  Do we know the real one?
                      char obfus_hc[16], true_hc[8];
-                     strcpy(obfus_hc, train_id + 2);
+                     strcpy(obfus_hc, m.train_id + 2);
                      obfus_hc[4] = '\0';
                      sprintf(query, "SELECT signalling_id, deduced_headcode, deduced_headcode_status from cif_schedules where id = %u", cif_schedule_id);
                      if(!db_query(query))
@@ -1111,13 +1092,13 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
                            {
                               sprintf(query, "INSERT INTO obfus_lookup VALUES(%ld, '%s', '%s')", now, true_hc, obfus_hc);
                               db_query(query);
-                              _log(DEBUG, "   Added obfuscated \"%s\", true \"%s\" (%s) to headcode obfuscation table.  TRUST id \"%s\", garner schedule id %u.  [Deduced activation]", obfus_hc, true_hc, status, train_id, cif_schedule_id);
+                              _log(DEBUG, "   Added obfuscated \"%s\", true \"%s\" (%s) to headcode obfuscation table.  TRUST id \"%s\", garner schedule id %u.  [Deduced activation]", obfus_hc, true_hc, status, m.train_id, cif_schedule_id);
                               sprintf(query, "DELETE FROM obfus_lookup WHERE created < %ld", now - 86400L); // 24 hours.
                               db_query(query);
                            }
                            else if(true_hc[0])
                            {
-                              _log(MINOR, "Discarded obfuscated headcode \"%s\", true headcode \"%s\" (%s) as class does not match.  TRUST id \"%s\", garner schedule id %u.",obfus_hc, true_hc, status, train_id, cif_schedule_id);
+                              _log(MINOR, "Discarded obfuscated headcode \"%s\", true headcode \"%s\" (%s) as class does not match.  TRUST id \"%s\", garner schedule id %u.",obfus_hc, true_hc, status, m.train_id, cif_schedule_id);
                            }
                         }
                         mysql_free_result(result0);
@@ -1135,7 +1116,7 @@ static void process_trust_0003(const char * string, const jsmntok_t * tokens, co
          {
             elapsed = time_ms() - elapsed;
             _log(MINOR, "   Failed to deduce an activation.  Reason:  %s.   Elapsed time %s ms.", reason, commas_q(elapsed));
-            _log(MINOR, "      stanox = %s, tiploc = \"%s\", planned_timestamp \"%s\"", loc_stanox, tiploc, planned);
+            _log(MINOR, "      stanox = %s, tiploc = \"%s\", planned_timestamp \"%s\"", m.loc_stanox, tiploc, planned);
             _log(MINOR, "      actual_timestamp %s.", time_text(actual_timestamp, true));
          }
       }
@@ -1195,17 +1176,7 @@ static void process_trust_0007(const char * const string, const jsmntok_t * cons
    sprintf(query, "INSERT INTO trust_changeid VALUES(%ld, '%s', '%s')", now, train_id, new_id);
    db_query(query);
    
-   sprintf(query, "SELECT cif_schedule_id FROM trust_activation WHERE created > %lu AND trust_id = '%s' ORDER BY created DESC",
-           now - 20*24*60*60, train_id);
-   if(!db_query(query))
-   {
-      result = db_store_result();
-      if((row = mysql_fetch_row(result)))
-      {
-         cif_schedule_id = atol(row[0]);
-      }
-      mysql_free_result(result);
-   }
+   latest_activation(train_id, now - 20*24*60*60, &cif_schedule_id);
 
    if(cif_schedule_id && 
       new_id[2] >= '0' && new_id[2] <= '9' &&
@@ -1324,6 +1295,8 @@ static void report_stats(void)
    _log(GENERAL, zs);
    strcat(report, zs);
    strcat(report, "\n");
+   stats[DBRoundTrip] += db_round_trips;
+   db_round_trips = 0;
    for(i=0; i<MAXstats; i++)
    {
       grand_stats[i] += stats[i];
@@ -1335,6 +1308,7 @@ static void report_stats(void)
       stats[i] = 0;
    }
    email_alert(NAME, BUILD, "Statistics Report", report);
+   db_report_profile(true);
 }
 
 static time_t correct_trust_timestamp(const time_t in)
@@ -1413,7 +1387,7 @@ static void process_deferred_activations(void)
                _log(MINOR, "No schedules found for deferred activation \"%s\".  Activation recorded without schedule.", deferred_activations[i].trust_id);
 
                sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %ld, 0)", now, deferred_activations[i].trust_id, 0L);
-               db_query(query);
+               if(!db_query(query)) index_activation(now, deferred_activations[i].trust_id, 0, false);
             }
             else
             {
@@ -1422,7 +1396,7 @@ static void process_deferred_activations(void)
                _log(MINOR, "Found schedule %ld for deferred activation \"%s\".", cif_schedule_id, deferred_activations[i].trust_id);
                stats[Mess1MissHit]++;
                sprintf(query, "INSERT INTO trust_activation VALUES(%ld, '%s', %u, 0)", now, deferred_activations[i].trust_id, cif_schedule_id);
-               db_query(query);
+               if(!db_query(query)) index_activation(now, deferred_activations[i].trust_id, cif_schedule_id, false);
                // TODO:  We should do the 'deduced headcode' processing here.
             }
             mysql_free_result(db_result);
@@ -1447,6 +1421,8 @@ static word count_deferred_activations(void)
 
 static void check_timeout(void)
 {
+   if(signal_pending(SIGUSR1)) db_report_profile(false);
+
    // Daily report
    time_t now = time(NULL);
    struct tm * broken = localtime(&now);
@@ -1459,7 +1435,14 @@ static void check_timeout(void)
          sprintf(query, "DELETE FROM message_count WHERE time < %ld", now - (24*60*60));
          db_query(query);
       }
+      // Rebuild the activation index, dropping old ones and any archived by archdb.
+      load_activation_index();
+      // Rebuild the timetable index to move its date window on.
+      load_timetable_index();
    }
+
+   // Rebuild the timetable index after a timetable update.
+   check_timetable_index();
    
    // Message counts
    if(now > message_count_report_due)
@@ -1493,3 +1476,436 @@ static void check_timeout(void)
       latency_check_due = now + LATENCY_CHECK_INTERVAL;
    } 
 }
+
+// Activation index
+// Recent activations are held in memory, keyed by TRUST id, so that movement and change of id messages
+// can be matched without a query.  If the index can't be loaded, the lookups fall back to the database.
+#define ACTIVATION_HASH_BITS 18
+#define ACTIVATION_DAYS 20
+#define ACTIVATION_GROW 65536
+static struct activation_entry
+{
+   time_t created;
+   dword cif_schedule_id;
+   dword next;             // Index + 1 of next entry in chain, newest first.  0 = end of chain.
+   char trust_id[12];
+   byte deduced;
+}
+   * activations;
+static dword activation_hash[1 << ACTIVATION_HASH_BITS];
+static dword activation_count, activation_size;
+static word activation_index_ok;
+
+static dword activation_hash_key(const char * const trust_id)
+{
+   // FNV-1a
+   dword h = 2166136261u;
+   const char * c;
+   for(c = trust_id; *c; c++)
+   {
+      h ^= (byte) *c;
+      h *= 16777619u;
+   }
+   return h & ((1 << ACTIVATION_HASH_BITS) - 1);
+}
+
+static void load_activation_index(void)
+{
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   char query[256];
+   qword elapsed = time_ms();
+
+   activation_index_ok = false;
+   activation_count = 0;
+   memset(activation_hash, 0, sizeof(activation_hash));
+
+   sprintf(query, "SELECT created, trust_id, cif_schedule_id, deduced FROM trust_activation WHERE created > %ld ORDER BY created", time(NULL) - ACTIVATION_DAYS*24*60*60);
+   if(db_query(query))
+   {
+      _log(MAJOR, "Failed to load activation index.  Activations will be looked up in the database.");
+      return;
+   }
+
+   activation_index_ok = true;
+   result = db_use_result();
+   while((row = mysql_fetch_row(result)))
+   {
+      index_activation(atol(row[0]), row[1], atol(row[2]), atoi(row[3]));
+   }
+   mysql_free_result(result);
+
+   if(!activation_index_ok)
+   {
+      _log(MAJOR, "Failed to load activation index.  Activations will be looked up in the database.");
+      return;
+   }
+   _log(GENERAL, "Loaded %s activations into index.  Elapsed time %s ms.", commas(activation_count), commas_q(time_ms() - elapsed));
+}
+
+static void index_activation(const time_t created, const char * const trust_id, const dword cif_schedule_id, const word deduced)
+{
+   if(!activation_index_ok) return;
+
+   if(strlen(trust_id) >= sizeof(activations->trust_id))
+   {
+      // Can't index this one, so the index can't be trusted to be complete.
+      _log(MAJOR, "Overlong TRUST id \"%s\" in activation.  Activation index disabled.", trust_id);
+      activation_index_ok = false;
+      return;
+   }
+
+   if(activation_count >= activation_size)
+   {
+      struct activation_entry * new = realloc(activations, (activation_size + ACTIVATION_GROW) * sizeof(struct activation_entry));
+      if(!new)
+      {
+         _log(CRITICAL, "Failed to grow activation index.  Activation index disabled.");
+         activation_index_ok = false;
+         return;
+      }
+      activations = new;
+      activation_size += ACTIVATION_GROW;
+   }
+
+   dword key = activation_hash_key(trust_id);
+   struct activation_entry * a = &activations[activation_count];
+   a->created = created;
+   a->cif_schedule_id = cif_schedule_id;
+   a->deduced = deduced;
+   strcpy(a->trust_id, trust_id);
+   a->next = activation_hash[key];
+   activation_hash[key] = ++activation_count;
+}
+
+static word count_activations(const char * const trust_id, const time_t since, const word scheduled, word * const count)
+{
+   // Count activations of trust_id created after since, either with a schedule or without.  Returns non-zero on failure.
+   *count = 0;
+   if(activation_index_ok)
+   {
+      dword i;
+      for(i = activation_hash[activation_hash_key(trust_id)]; i; i = activations[i - 1].next)
+      {
+         const struct activation_entry * a = &activations[i - 1];
+         if(a->created > since && (scheduled ? (a->cif_schedule_id > 0) : (a->cif_schedule_id == 0)) && !strcmp(a->trust_id, trust_id))
+         {
+            (*count)++;
+         }
+      }
+      return 0;
+   }
+
+   char query[256];
+   sprintf(query, "SELECT COUNT(*) FROM trust_activation WHERE trust_id = '%s' AND created > %ld AND cif_schedule_id %s 0", trust_id, since, scheduled ? ">" : "=");
+   if(db_query(query)) return 1;
+   MYSQL_RES * result = db_store_result();
+   MYSQL_ROW row;
+   if((row = mysql_fetch_row(result))) *count = atoi(row[0]);
+   mysql_free_result(result);
+   return 0;
+}
+
+static word latest_activation(const char * const trust_id, const time_t since, dword * const cif_schedule_id)
+{
+   // Find the schedule of the newest activation of trust_id created after since.  Returns non-zero if none found.
+   if(activation_index_ok)
+   {
+      dword i;
+      for(i = activation_hash[activation_hash_key(trust_id)]; i; i = activations[i - 1].next)
+      {
+         const struct activation_entry * a = &activations[i - 1];
+         if(a->created > since && !strcmp(a->trust_id, trust_id))
+         {
+            *cif_schedule_id = a->cif_schedule_id;
+            return 0;
+         }
+      }
+      return 1;
+   }
+
+   char query[256];
+   word rc = 1;
+   sprintf(query, "SELECT cif_schedule_id FROM trust_activation WHERE created > %lu AND trust_id = '%s' ORDER BY created DESC LIMIT 1", since, trust_id);
+   if(!db_query(query))
+   {
+      MYSQL_RES * result = db_store_result();
+      MYSQL_ROW row;
+      if((row = mysql_fetch_row(result)))
+      {
+         *cif_schedule_id = atol(row[0]);
+         rc = 0;
+      }
+      mysql_free_result(result);
+   }
+   return rc;
+}
+
+// Timetable index
+// The timed locations of current schedules, keyed by TIPLOC and time, so that a movement with no activation can be matched
+// to candidate schedules without the join of cif_schedules and cif_schedule_locations.  It is rebuilt daily and after each
+// cifdb update, and topped up with any newer (VSTP) schedules before each lookup.  Deletions are caught by checking the
+// candidates against cif_schedules.
+#define TIMETABLE_HASH_BITS 20
+#define TIMETABLE_GROW_SCHEDULES 16384
+#define TIMETABLE_GROW_LOCATIONS 262144
+#define TIMETABLE_CHECK_INTERVAL 300
+#define TIMETABLE_ARRIVAL   0x01
+#define TIMETABLE_DEPARTURE 0x02
+#define TIMETABLE_PASS      0x04
+#define TIMETABLE_NEXT_DAY  0x08
+static struct timetable_schedule
+{
+   time_t schedule_start_date, schedule_end_date;
+   dword id;
+   byte runs;              // Bit per day, bit 0 = Sunday, as tm_wday.
+}
+   * timetable_schedules;
+static struct timetable_location
+{
+   dword next;             // Index + 1 of next location in chain.  0 = end of chain.
+   dword schedule;         // Index into timetable_schedules.
+   char tiploc[8];
+   word when;              // Half minutes since midnight.
+   byte flags;
+}
+   * timetable_locations;
+static dword timetable_hash[1 << TIMETABLE_HASH_BITS];
+static dword timetable_schedule_count, timetable_schedule_size, timetable_location_count, timetable_location_size;
+static dword timetable_max_id, timetable_update_id;
+static word timetable_index_ok;
+static time_t timetable_check_due;
+
+static dword timetable_hash_key(const char * const tiploc, const word when)
+{
+   // FNV-1a
+   dword h = 2166136261u;
+   const char * c;
+   for(c = tiploc; *c; c++)
+   {
+      h ^= (byte) *c;
+      h *= 16777619u;
+   }
+   h ^= when;
+   h *= 16777619u;
+   return h & ((1 << TIMETABLE_HASH_BITS) - 1);
+}
+
+static word timetable_when(const char * const t)
+{
+   // Convert "HHMM" or "HHMMH" to half minutes.  Returns 0xffff if not a time.
+   if(t[0] < '0' || t[0] > '9' || t[1] < '0' || t[1] > '9' || t[2] < '0' || t[2] > '9' || t[3] < '0' || t[3] > '9') return 0xffff;
+   return (((t[0] - '0') * 10 + t[1] - '0') * 60 + (t[2] - '0') * 10 + t[3] - '0') * 2 + (t[4] == 'H');
+}
+
+static word timetable_add_location(const dword schedule, const char * const tiploc, const char * const time, const byte flags)
+{
+   word when = timetable_when(time);
+   if(when == 0xffff) return 0;
+
+   if(timetable_location_count >= timetable_location_size)
+   {
+      struct timetable_location * new = realloc(timetable_locations, (timetable_location_size + TIMETABLE_GROW_LOCATIONS) * sizeof(struct timetable_location));
+      if(!new) return 1;
+      timetable_locations = new;
+      timetable_location_size += TIMETABLE_GROW_LOCATIONS;
+   }
+
+   dword key = timetable_hash_key(tiploc, when);
+   struct timetable_location * l = &timetable_locations[timetable_location_count];
+   l->schedule = schedule;
+   strncpy(l->tiploc, tiploc, sizeof(l->tiploc) - 1);
+   l->tiploc[sizeof(l->tiploc) - 1] = '\0';
+   l->when = when;
+   l->flags = flags;
+   l->next = timetable_hash[key];
+   timetable_hash[key] = ++timetable_location_count;
+   return 0;
+}
+
+static word load_timetable(const char * const where)
+{
+   // Add the schedules selected by where, and their locations, to the index.  Returns non-zero on failure.
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   char query[1024];
+   dword first = timetable_schedule_count;
+   word fail = false;
+
+   sprintf(query, "SELECT id, schedule_start_date, schedule_end_date, runs_su, runs_mo, runs_tu, runs_we, runs_th, runs_fr, runs_sa FROM cif_schedules WHERE %s ORDER BY id", where);
+   if(db_query(query)) return 1;
+   result = db_use_result();
+   while((row = mysql_fetch_row(result)))
+   {
+      if(fail) continue;
+      if(timetable_schedule_count >= timetable_schedule_size)
+      {
+         struct timetable_schedule * new = realloc(timetable_schedules, (timetable_schedule_size + TIMETABLE_GROW_SCHEDULES) * sizeof(struct timetable_schedule));
+         if(!new)
+         {
+            fail = true;
+            continue;
+         }
+         timetable_schedules = new;
+         timetable_schedule_size += TIMETABLE_GROW_SCHEDULES;
+      }
+      struct timetable_schedule * s = &timetable_schedules[timetable_schedule_count++];
+      s->id = atol(row[0]);
+      s->schedule_start_date = atol(row[1]);
+      s->schedule_end_date = atol(row[2]);
+      word d;
+      s->runs = 0;
+      for(d = 0; d < 7; d++) if(atoi(row[d + 3])) s->runs |= 1 << d;
+   }
+   mysql_free_result(result);
+   if(fail) return 1;
+
+   if(timetable_schedule_count == first) return 0;
+
+   sprintf(query, "SELECT l.cif_schedule_id, l.tiploc_code, l.arrival, l.departure, l.pass, l.next_day FROM cif_schedule_locations AS l INNER JOIN cif_schedules ON l.cif_schedule_id = cif_schedules.id WHERE %s AND cif_schedules.id >= %u AND cif_schedules.id <= %u",
+           where, timetable_schedules[first].id, timetable_schedules[timetable_schedule_count - 1].id);
+   if(db_query(query)) return 1;
+   result = db_use_result();
+   while((row = mysql_fetch_row(result)))
+   {
+      if(fail) continue;
+      // Find the schedule.  They are in id order.
+      dword id = atol(row[0]);
+      dword lo = first, hi = timetable_schedule_count;
+      while(lo < hi)
+      {
+         dword mid = (lo + hi) / 2;
+         if(timetable_schedules[mid].id < id) lo = mid + 1;
+         else hi = mid;
+      }
+      // A schedule which arrived between the two queries is skipped here, and picked up by the next top up.
+      if(lo >= timetable_schedule_count || timetable_schedules[lo].id != id) continue;
+      byte next_day = atoi(row[5]) ? TIMETABLE_NEXT_DAY : 0;
+      if(timetable_add_location(lo, row[1], row[2], TIMETABLE_ARRIVAL | next_day) ||
+         timetable_add_location(lo, row[1], row[3], TIMETABLE_DEPARTURE | next_day) ||
+         timetable_add_location(lo, row[1], row[4], TIMETABLE_PASS | next_day))
+      {
+         fail = true;
+      }
+   }
+   mysql_free_result(result);
+   if(fail) return 1;
+
+   timetable_max_id = timetable_schedules[timetable_schedule_count - 1].id;
+   return 0;
+}
+
+static void timetable_where(char * const where, const dword after)
+{
+   // Schedules which may run in the next day or so, as of a planned timestamp up to a day old.  Excludes buses.
+   time_t now = time(NULL);
+   sprintf(where, "cif_schedules.id > %u AND deleted > %ld AND schedule_end_date >= %ld AND schedule_start_date <= %ld"
+           " AND (CIF_stp_indicator = 'N' OR CIF_stp_indicator = 'P' OR CIF_stp_indicator = 'O') AND train_status != 'B' AND train_status != '5'",
+           after, now - 24*60*60, now - 3*24*60*60, now + 2*24*60*60);
+}
+
+static void load_timetable_index(void)
+{
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+   char where[512];
+   qword elapsed = time_ms();
+
+   timetable_index_ok = false;
+   timetable_check_due = time(NULL) + TIMETABLE_CHECK_INTERVAL;
+   timetable_schedule_count = timetable_location_count = timetable_max_id = 0;
+   memset(timetable_hash, 0, sizeof(timetable_hash));
+
+   // Note the latest timetable update, so we can tell when there's another.
+   if(db_query("SELECT MAX(id) FROM updates_processed")) return;
+   result = db_store_result();
+   timetable_update_id = ((row = mysql_fetch_row(result)) && row[0]) ? atol(row[0]) : 0;
+   mysql_free_result(result);
+
+   timetable_where(where, 0);
+   if(load_timetable(where))
+   {
+      _log(MAJOR, "Failed to load timetable index.  Activations will be deduced from the database.");
+      return;
+   }
+   timetable_index_ok = true;
+   _log(GENERAL, "Loaded %s schedules into timetable index.  Elapsed time %s ms.", commas(timetable_schedule_count), commas_q(time_ms() - elapsed));
+}
+
+static void check_timetable_index(void)
+{
+   MYSQL_RES * result;
+   MYSQL_ROW row;
+
+   if(time(NULL) < timetable_check_due) return;
+   timetable_check_due = time(NULL) + TIMETABLE_CHECK_INTERVAL;
+
+   if(timetable_index_ok)
+   {
+      if(db_query("SELECT MAX(id) FROM updates_processed")) return;
+      result = db_store_result();
+      dword update_id = ((row = mysql_fetch_row(result)) && row[0]) ? atol(row[0]) : 0;
+      mysql_free_result(result);
+      if(update_id == timetable_update_id) return;
+      _log(GENERAL, "Timetable update detected.");
+   }
+   load_timetable_index();
+}
+
+static word timetable_candidates(const char * const tiploc, const char * const planned, const char event, const word day, const time_t when, char * const candidates)
+{
+   // Build a list of the ids of schedules which call at tiploc at the planned time, on the day of the movement.  when is
+   // midday on the day.  Returns non-zero if the index can't answer, in which case the caller should use the database.
+   dword ids[TIMETABLE_CANDIDATES];
+   word count = 0;
+   byte want;
+
+   if(!timetable_index_ok) return 1;
+   if(event == 'A') want = TIMETABLE_ARRIVAL | TIMETABLE_PASS;
+   else if(event == 'D') want = TIMETABLE_DEPARTURE | TIMETABLE_PASS;
+   else return 1;
+   word planned_when = timetable_when(planned);
+   if(planned_when == 0xffff) return 1;
+
+   // Top up with any newer schedules.
+   {
+      char where[512];
+      timetable_where(where, timetable_max_id);
+      if(load_timetable(where))
+      {
+         _log(MAJOR, "Failed to update timetable index.  Activations will be deduced from the database.");
+         timetable_index_ok = false;
+         return 1;
+      }
+   }
+
+   word yest = (day + 6) % 7;
+   dword i;
+   for(i = timetable_hash[timetable_hash_key(tiploc, planned_when)]; i; i = timetable_locations[i - 1].next)
+   {
+      const struct timetable_location * l = &timetable_locations[i - 1];
+      if(l->when != planned_when || !(l->flags & want) || strcmp(l->tiploc, tiploc)) continue;
+      const struct timetable_schedule * s = &timetable_schedules[l->schedule];
+      if(l->flags & TIMETABLE_NEXT_DAY)
+      {
+         if(!(s->runs & (1 << yest)) || s->schedule_start_date > when - 12*60*60 || s->schedule_end_date < when - 36*60*60) continue;
+      }
+      else
+      {
+         if(!(s->runs & (1 << day))  || s->schedule_start_date > when + 12*60*60 || s->schedule_end_date < when - 12*60*60) continue;
+      }
+      word j;
+      for(j = 0; j < count && ids[j] != s->id; j++);
+      if(j < count) continue;
+      if(count >= TIMETABLE_CANDIDATES) return 1;
+      ids[count++] = s->id;
+   }
+
+   candidates[0] = '\0';
+   word j;
+   for(j = 0; j < count; j++)
+   {
+      sprintf(candidates + strlen(candidates), "%s%u", j ? "," : "", ids[j]);
+   }
+   return 0;
+}
@@ -41,6 +41,7 @@
 #include "misc.h"
 #include "db.h"
 #include "database.h"
+#include "corpus.h"
 #include "build.h"
 
 #define NAME  "vstpdb"
@@ -88,14 +89,14 @@ static jsmntok_t tokens[NUM_TOKENS];
 static time_t start_time;
 enum stats_categories {ConnectAttempt, GoodMessage, DeleteHit, DeleteMiss, DeleteMulti, Create, 
                        UpdateCreate, UpdateDeleteMiss, UpdateDeleteMulti, HeadcodeDeduced,
-                       NotMessage, NotVSTP, NotTransaction, MAXstats};
+                       NotMessage, NotVSTP, NotTransaction, DBRoundTrip, MAXstats};
 static qword stats[MAXstats];
 static qword grand_stats[MAXstats];
 static const char * stats_category[MAXstats] = 
    {
       "Stompy Connect Attempt", "Good Message", "Delete Hit", "Delete Miss", "Delete Multiple Hit", "Create",
       "Update", "Update Delete Miss", "Update Delete Mult. Hit", "Deduced Schedule Headcode",
-      "Not a message", "Invalid or Not VSTP", "Unknown Transaction",
+      "Not a message", "Invalid or Not VSTP", "Unknown Transaction", "Database round trips",
    };
 
 // Signal handling
@@ -261,6 +262,10 @@ int main(int argc, char *argv[])
          _log(CRITICAL, "Failed to set up signal handler.");
          exit(1);
       }
+      // SIGUSR1 asks for the database query profile.  It is kept blocked and picked up in the main loop.
+      sigemptyset(&block_mask);
+      sigaddset(&block_mask, SIGUSR1);
+      sigprocmask(SIG_BLOCK, &block_mask, NULL);
    }
 
    if(!debug) signal(SIGCHLD,SIG_IGN); /* ignore child */
@@ -333,6 +338,7 @@ static void perform(void)
                last_report_day = broken->tm_wday;
                report_stats();
             }
+            if(signal_pending(SIGUSR1)) db_report_profile(false);
          }
 
          word r = read_stompy(body, FRAME_SIZE, 64);
@@ -454,7 +460,12 @@ static void process_vstp(const char * string, const jsmntok_t * tokens)
          _log(MAJOR, "process_schedule():  Unrecognised transaction type \"%s\".", zs);
          jsmn_dump_tokens(body, tokens, 0);
          stats[NotTransaction]++;
+         return;
       }
+
+      // liverail's day plans for the locations this train calls at are now out of date.
+      jsmn_find_extract_token(string, tokens, 0, "CIF_train_uid", zs, sizeof(zs));
+      if(zs[0]) day_plans_invalidate(zs);
    }
    else
    {
@@ -553,70 +564,85 @@ static void process_create_schedule(const char * string, const jsmntok_t * token
 {
    // update true indicates this is as the result of a VSTP update.
    char zs[1024], zs1[1024];
-   char query[2048];
+   char query[4096];
    word i;
-   char uid[16], stp_indicator[2];
-   char signalling_id[8];
+
+   struct schedule
+   {
+      char CIF_bank_holiday_running[128], CIF_stp_indicator[2], CIF_train_uid[16], applicable_timetable[128], atoc_code[128];
+      char uic_code[128], schedule_days_runs[128], schedule_end_date[128], signalling_id[8], CIF_train_category[128];
+      char CIF_headcode[128], CIF_train_service_code[128], CIF_business_sector[128], CIF_power_type[128], CIF_timing_load[128];
+      char CIF_speed[128], CIF_operating_characteristics[128], CIF_train_class[128], CIF_sleepers[128], CIF_reservations[128];
+      char CIF_connection_indicator[128], CIF_catering_code[128], CIF_service_branding[128], schedule_start_date[128], train_status[128];
+   } sc;
+   static const jsmnfield_t schedule_fields[] =
+   {
+      JSMN_FIELD(struct schedule, CIF_bank_holiday_running), JSMN_FIELD(struct schedule, CIF_stp_indicator), JSMN_FIELD(struct schedule, CIF_train_uid),
+      JSMN_FIELD(struct schedule, applicable_timetable), JSMN_FIELD(struct schedule, atoc_code), JSMN_FIELD(struct schedule, uic_code),
+      JSMN_FIELD(struct schedule, schedule_days_runs), JSMN_FIELD(struct schedule, schedule_end_date), JSMN_FIELD(struct schedule, signalling_id),
+      JSMN_FIELD(struct schedule, CIF_train_category), JSMN_FIELD(struct schedule, CIF_headcode), JSMN_FIELD(struct schedule, CIF_train_service_code),
+      JSMN_FIELD(struct schedule, CIF_business_sector), JSMN_FIELD(struct schedule, CIF_power_type), JSMN_FIELD(struct schedule, CIF_timing_load),
+      JSMN_FIELD(struct schedule, CIF_speed), JSMN_FIELD(struct schedule, CIF_operating_characteristics), JSMN_FIELD(struct schedule, CIF_train_class),
+      JSMN_FIELD(struct schedule, CIF_sleepers), JSMN_FIELD(struct schedule, CIF_reservations), JSMN_FIELD(struct schedule, CIF_connection_indicator),
+      JSMN_FIELD(struct schedule, CIF_catering_code), JSMN_FIELD(struct schedule, CIF_service_branding), JSMN_FIELD(struct schedule, schedule_start_date),
+      JSMN_FIELD(struct schedule, train_status),
+   };
+#define APPEND_SQL(a) { sprintf(zs1, ", \"%s\"", a); strcat(query, zs1); }
 
    if(debug) jsmn_dump_tokens(string, tokens, 0);
 
+   jsmn_extract_fields(string, tokens, 0, schedule_fields, JSMN_FIELDS(schedule_fields), &sc);
+
    time_t now = time(NULL);
    sprintf(query, "INSERT INTO cif_schedules VALUES(0, %ld, %lu", now, NOT_DELETED); // update_id == 0 => VSTP
 
-   EXTRACT_APPEND_SQL("CIF_bank_holiday_running");
+   APPEND_SQL(sc.CIF_bank_holiday_running);
 
-   //EXTRACT_APPEND_SQL("CIF_stp_indicator");
-   EXTRACT("CIF_stp_indicator", stp_indicator);
-   sprintf(zs1, ", '%s'", stp_indicator); strcat(query, zs1); 
+   sprintf(zs1, ", '%s'", sc.CIF_stp_indicator); strcat(query, zs1); 
 
-   //EXTRACT_APPEND_SQL("CIF_train_uid");
-   EXTRACT("CIF_train_uid", uid);
-   sprintf(zs1, ", '%s'", uid); strcat(query, zs1); 
+   sprintf(zs1, ", '%s'", sc.CIF_train_uid); strcat(query, zs1); 
 
-   EXTRACT_APPEND_SQL("applicable_timetable");
+   APPEND_SQL(sc.applicable_timetable);
 
-   EXTRACT_APPEND_SQL("atoc_code");
-   // EXTRACT_APPEND_SQL("traction_class");
-   EXTRACT_APPEND_SQL("uic_code");
-   EXTRACT("schedule_days_runs", zs);
+   APPEND_SQL(sc.atoc_code);
+   // APPEND_SQL(sc.traction_class);
+   APPEND_SQL(sc.uic_code);
    for(i=0; i<7; i++)
    {
       strcat(query, ", ");
-      strcat(query, (zs[i]=='1')?"1":"0");
+      strcat(query, (sc.schedule_days_runs[i]=='1')?"1":"0");
    }
 
-   EXTRACT("schedule_end_date", zs);
-   time_t z = parse_datestamp(zs);
+   time_t z = parse_datestamp(sc.schedule_end_date);
    sprintf(zs1, ", %ld", z);
    strcat(query, zs1);
 
-   EXTRACT("signalling_id", signalling_id);
-   sprintf(zs1, ", '%s'", signalling_id); strcat(query, zs1);
-
-   EXTRACT_APPEND_SQL("CIF_train_category");
-   EXTRACT_APPEND_SQL("CIF_headcode");
-   //EXTRACT_APPEND_SQL("CIF_course_indicator");
-   EXTRACT_APPEND_SQL("CIF_train_service_code");
-   EXTRACT_APPEND_SQL("CIF_business_sector");
-   EXTRACT_APPEND_SQL("CIF_power_type");
-   EXTRACT_APPEND_SQL("CIF_timing_load");
-   EXTRACT_APPEND_SQL("CIF_speed");
-   EXTRACT_APPEND_SQL("CIF_operating_characteristics");
-   EXTRACT_APPEND_SQL("CIF_train_class");
-
-   EXTRACT_APPEND_SQL("CIF_sleepers");
-
-   EXTRACT_APPEND_SQL("CIF_reservations");
-   EXTRACT_APPEND_SQL("CIF_connection_indicator");
-   EXTRACT_APPEND_SQL("CIF_catering_code");
-   EXTRACT_APPEND_SQL("CIF_service_branding");
+   sprintf(zs1, ", '%s'", sc.signalling_id); strcat(query, zs1);
+
+   APPEND_SQL(sc.CIF_train_category);
+   APPEND_SQL(sc.CIF_headcode);
+   //APPEND_SQL(sc.CIF_course_indicator);
+   APPEND_SQL(sc.CIF_train_service_code);
+   APPEND_SQL(sc.CIF_business_sector);
+   APPEND_SQL(sc.CIF_power_type);
+   APPEND_SQL(sc.CIF_timing_load);
+   APPEND_SQL(sc.CIF_speed);
+   APPEND_SQL(sc.CIF_operating_characteristics);
+   APPEND_SQL(sc.CIF_train_class);
+
+   APPEND_SQL(sc.CIF_sleepers);
+
+   APPEND_SQL(sc.CIF_reservations);
+   APPEND_SQL(sc.CIF_connection_indicator);
+   APPEND_SQL(sc.CIF_catering_code);
+   APPEND_SQL(sc.CIF_service_branding);
    
-   EXTRACT("schedule_start_date", zs);
-   z = parse_datestamp(zs);
+   z = parse_datestamp(sc.schedule_start_date);
    sprintf(zs1, ", %ld", z);
    strcat(query, zs1);
 
-   EXTRACT_APPEND_SQL("train_status");
+   APPEND_SQL(sc.train_status);
+#undef APPEND_SQL
 
    strcat(query, ", 0, '', '')"); // id filled by MySQL
 
@@ -637,13 +663,13 @@ static void process_create_schedule(const char * string, const jsmntok_t * token
       index = process_create_schedule_location(string, tokens, index, id);
    }
 
-   if(stp_indicator[0] == 'O' && (signalling_id[0] == '\0' || signalling_id[0] == ' '))
+   if(sc.CIF_stp_indicator[0] == 'O' && (sc.signalling_id[0] == '\0' || sc.signalling_id[0] == ' '))
    {
       // Search db for schedules with a deduced headcode, and add it to this one, status = D
       // Bug:  Really this should also look for schedules with a signalling_id
       MYSQL_RES * result;
       MYSQL_ROW row;
-      sprintf(query, "SELECT deduced_headcode FROM cif_schedules WHERE CIF_train_uid = '%s' AND deduced_headcode != '' AND schedule_end_date > %ld ORDER BY created DESC", uid, now - (64L * 24L * 60L * 60L));
+      sprintf(query, "SELECT deduced_headcode FROM cif_schedules WHERE CIF_train_uid = '%s' AND deduced_headcode != '' AND schedule_end_date > %ld ORDER BY created DESC", sc.CIF_train_uid, now - (64L * 24L * 60L * 60L));
       if(!db_query(query))
       {
          result = db_store_result();
@@ -651,12 +677,12 @@ static void process_create_schedule(const char * string, const jsmntok_t * token
          {
             sprintf(query, "UPDATE cif_schedules SET deduced_headcode = '%s', deduced_headcode_status = 'D' WHERE id = %u", row[0], id);
             db_query(query);
-            _log(DEBUG, "Deduced headcode \"%s\" applied to overlay schedule %u, uid \"%s\".", row[0], id, uid);
+            _log(DEBUG, "Deduced headcode \"%s\" applied to overlay schedule %u, uid \"%s\".", row[0], id, sc.CIF_train_uid);
             stats[HeadcodeDeduced]++;
          }
          else
          {
-            _log(DEBUG, "Deduced headcode not found for overlay schedule %u, uid \"%s\".", id, uid);
+            _log(DEBUG, "Deduced headcode not found for overlay schedule %u, uid \"%s\".", id, sc.CIF_train_uid);
          }
          mysql_free_result(result);
       }
@@ -675,16 +701,11 @@ static void process_create_schedule(const char * string, const jsmntok_t * token
       char title[64], message[512];
       MYSQL_RES * result0;
       MYSQL_ROW row0;
-      char stp[4];
       sprintf(title, "Huyton Schedule Created.");
       sprintf(message, "Created schedule which passes Huyton.");
       if(update) strcat(message, "  Due to a VSTP Update transaction.");
       strcat(message, "\n\n");
-      EXTRACT("CIF_train_uid", zs1);
-      EXTRACT("CIF_stp_indicator", stp);
-      sprintf(zs, "%u (%s %s) ", id, zs1, stp);
-      EXTRACT("signalling_id", zs1);
-      strcat(zs, zs1);
+      sprintf(zs, "%u (%s %s) %s", id, sc.CIF_train_uid, sc.CIF_stp_indicator, sc.signalling_id);
       sprintf(query, "SELECT tiploc_code, departure FROM cif_schedule_locations WHERE record_identity = 'LO' AND cif_schedule_id = %u", id);
       if(!db_query(query))
       {
@@ -766,63 +787,62 @@ static void process_create_schedule(const char * string, const jsmntok_t * token
 
 static word process_create_schedule_location(const char * string, const jsmntok_t * tokens, const int index, const unsigned long schedule_id)
 {
-   char query[2048], zs[1024], zs1[1024];
+   char zs[1024];
 
    word sort_arrive, sort_depart, sort_pass, sort_time;
    static word origin_sort_time;
+   static word location_statement;
 
    byte type_LO;
 
    sprintf(zs, "process_create_schedule_location(%d, %ld)", index, schedule_id);
    _log(PROC, zs);
 
-   sprintf(query, "INSERT INTO cif_schedule_locations VALUES(%ld, %ld",
-           0L, schedule_id);
+   if(!location_statement) location_statement = db_prepare("INSERT INTO cif_schedule_locations VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+
+#define EXTRACT_BIND_OBJECT(a, p) { EXTRACT_OBJECT(a, zs); db_bind_string(location_statement, p, zs); }
+   db_bind_integer(location_statement, 0, 0);
+   db_bind_integer(location_statement, 1, schedule_id);
 
-   EXTRACT_APPEND_SQL_OBJECT("CIF_activity");
+   EXTRACT_BIND_OBJECT("CIF_activity", 2);
    //EXTRACT_APPEND_SQL_OBJECT("record_identity");
    type_LO = false;
    if(strstr(zs, "TB"))
    {
       type_LO = true;
-      strcat(query, ", 'LO'");
+      db_bind_string(location_statement, 3, "LO");
    }
    else if(strstr(zs, "TF"))
    {
-      strcat(query, ", 'LT'");
+      db_bind_string(location_statement, 3, "LT");
    }
    else
    {
-      strcat(query, ", 'LI'");
+      db_bind_string(location_statement, 3, "LI");
    }
-   EXTRACT_APPEND_SQL_OBJECT("tiploc_id");
+   EXTRACT_BIND_OBJECT("tiploc_id", 4);
    if(*conf[conf_huyton_alerts] && ((!strcmp(zs, "HUYTON")) || (!strcmp(zs, "HUYTJUN"))))
    {
       huyton_flag = true;
    }
 
    // EXTRACT_APPEND_SQL_OBJECT("tiploc_instance");// Missing from VSTPDB
-   strcat(query, ", ''");
+   db_bind_string(location_statement, 5, "");
 
    // Times
    EXTRACT_OBJECT("scheduled_arrival_time", zs);
    sort_arrive = get_sort_time_vstp(zs);
-   sprintf(zs1, ", '%s'", vstp_to_CIF_time(zs));
-   strcat(query, zs1);
+   db_bind_string(location_statement, 6, vstp_to_CIF_time(zs));
    EXTRACT_OBJECT("scheduled_departure_time", zs);
    sort_depart = get_sort_time_vstp(zs) + 1;
-   sprintf(zs1, ", '%s'", vstp_to_CIF_time(zs));
-   strcat(query, zs1);
+   db_bind_string(location_statement, 7, vstp_to_CIF_time(zs));
    EXTRACT_OBJECT("scheduled_pass_time", zs);
    sort_pass = get_sort_time_vstp(zs) + 1;
-   sprintf(zs1, ", '%s'", vstp_to_CIF_time(zs));
-   strcat(query, zs1);
+   db_bind_string(location_statement, 8, vstp_to_CIF_time(zs));
    EXTRACT_OBJECT("public_arrival_time", zs);
-   sprintf(zs1, ", '%s'", vstp_to_CIF_time(zs));
-   strcat(query, zs1);
+   db_bind_string(location_statement, 9, vstp_to_CIF_time(zs));
    EXTRACT_OBJECT("public_departure_time", zs);
-   sprintf(zs1, ", '%s'", vstp_to_CIF_time(zs));
-   strcat(query, zs1);
+   db_bind_string(location_statement, 10, vstp_to_CIF_time(zs));
 
    // Evaluate the sort_time and next_day fields
    if(sort_arrive < INVALID_SORT_TIME) sort_time = sort_arrive;
@@ -830,17 +850,16 @@ static word process_create_schedule_location(const char * string, const jsmntok_
    else sort_time = sort_pass;
    if(type_LO) origin_sort_time = sort_time;
    // N.B. Calculation of next_day field assumes that the LO record will be processed before the others.  Can we assume this?
-   sprintf(zs, ", %d, %d", sort_time, (sort_time < origin_sort_time)?1:0);
-   strcat(query, zs);
-   EXTRACT_APPEND_SQL_OBJECT("CIF_platform");
-   EXTRACT_APPEND_SQL_OBJECT("CIF_line");
-   EXTRACT_APPEND_SQL_OBJECT("CIF_path");
-   EXTRACT_APPEND_SQL_OBJECT("CIF_engineering_allowance");
-   EXTRACT_APPEND_SQL_OBJECT("CIF_pathing_allowance");
-   EXTRACT_APPEND_SQL_OBJECT("CIF_performance_allowance");
-   strcat(query, ")");
-
-   (void) db_query(query); 
+   db_bind_integer(location_statement, 11, sort_time);
+   db_bind_integer(location_statement, 12, (sort_time < origin_sort_time)?1:0);
+   EXTRACT_BIND_OBJECT("CIF_platform", 13);
+   EXTRACT_BIND_OBJECT("CIF_line", 14);
+   EXTRACT_BIND_OBJECT("CIF_path", 15);
+   EXTRACT_BIND_OBJECT("CIF_engineering_allowance", 16);
+   EXTRACT_BIND_OBJECT("CIF_pathing_allowance", 17);
+   EXTRACT_BIND_OBJECT("CIF_performance_allowance", 18);
+
+   (void) db_execute(location_statement); 
 
    return (index + tokens[index].size + 5);
 }
@@ -939,6 +958,8 @@ static void report_stats(void)
    _log(GENERAL, zs);
    strcat(report, zs);
    strcat(report, "\n");
+   stats[DBRoundTrip] += db_round_trips;
+   db_round_trips = 0;
    for(i=0; i<MAXstats; i++)
    {
       grand_stats[i] += stats[i];
@@ -950,6 +971,7 @@ static void report_stats(void)
       stats[i] = 0;
    }
    email_alert(NAME, BUILD, "Statistics Report", report);
+   db_report_profile(true);
 }
 
 static word get_sort_time_vstp(const char const * buffer)
@@ -1006,6 +1028,21 @@ static char * tiploc_name(const char * const tiploc)
    MYSQL_ROW row0;
    static char result[128];
 
+   if(corpus_available())
+   {
+      const char * fn = corpus_tiploc_name(tiploc);
+      if(fn)
+      {
+         strncpy(result, fn, 127);
+         result[127] = '\0';
+      }
+      else
+      {
+         strcpy(result, tiploc);
+      }
+      return result;
+   }
+
    sprintf(query, "select fn from corpus where tiploc = '%s'", tiploc);
    db_query(query);
    result0 = db_store_result();